@@ -0,0 +1,580 @@
+/** @file agent/keyagent.cpp
+ * @brief Caches master keys between runs so the password KDF only runs once per session.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "keyagent.hpp"
+#include "../fs/ioexception.hpp"
+#include "../lnthrow.hpp"
+#include "../logger.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using CloudSync::fs::IOException;
+using namespace CloudSync::Crypto;
+
+namespace CloudSync::Agent {
+
+/**
+ * @brief The requests a client can make. Each connection carries exactly one.
+ *
+ * Every request starts with the op and a u16 id length followed by the id. PUT follows that with the KDF parameters, u32 TTL in seconds, and the key.
+ * Every reply starts with a Status. A GET that finds its key follows that with the KDF parameters and the key.
+ * KDF parameters are u8 KDFType, u8 HashType, u32 cost, u16 block size, u16 parallelism, and a u8 salt length followed by the salt.
+ * Integers are little-endian.
+ */
+enum class Op : uint8_t {
+	GET = 1,
+	PUT = 2,
+	FORGET = 3,
+};
+
+enum class Status : uint8_t {
+	OK = 0,
+	NOT_FOUND = 1,
+	BAD_REQUEST = 2,
+};
+
+/**
+ * @brief A client that stalls for longer than this is disconnected, so it cannot block the agent.
+ */
+constexpr int IO_TIMEOUT_MS = 1000;
+
+/**
+ * @brief The longest key id accepted.
+ */
+constexpr size_t MAX_ID_LEN = 4096;
+
+static void setTimeouts(int fd) {
+	struct timeval tv;
+	tv.tv_sec = IO_TIMEOUT_MS / 1000;
+	tv.tv_usec = (IO_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * @brief Reads exactly len bytes, returning false on EOF, timeout, or error.
+ */
+static bool readAll(int fd, void* buf, size_t len) {
+	unsigned char* ptr = static_cast<unsigned char*>(buf);
+	while (len > 0) {
+		const ssize_t n = read(fd, ptr, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool writeAll(int fd, const void* buf, size_t len) {
+	const unsigned char* ptr = static_cast<const unsigned char*>(buf);
+	while (len > 0) {
+		const ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return true;
+}
+
+template <typename T>
+static unsigned char* putLE(unsigned char* buf, T val) {
+	for (size_t i = 0; i < sizeof(T); ++i) {
+		*buf++ = static_cast<unsigned char>(val >> (8 * i));
+	}
+	return buf;
+}
+
+template <typename T>
+static T getLE(const unsigned char* buf) {
+	T val = 0;
+	for (size_t i = 0; i < sizeof(T); ++i) {
+		val |= static_cast<T>(buf[i]) << (8 * i);
+	}
+	return val;
+}
+
+/**
+ * @brief The length of serialized KDF parameters up to and including the salt length.
+ */
+constexpr size_t PARAMS_LEN = 1 + 1 + 4 + 2 + 2 + 1;
+
+/**
+ * @brief Returns the length of params when serialized, which includes the salt.
+ */
+static size_t paramsSize(const KdfParams& params) {
+	if (params.salt.size() > UINT8_MAX) {
+		lnthrow(std::logic_error, "The salt cannot be longer than " + std::to_string(UINT8_MAX) + " bytes");
+	}
+	return PARAMS_LEN + params.salt.size();
+}
+
+static unsigned char* putParams(unsigned char* buf, const KdfParams& params) {
+	*buf++ = static_cast<unsigned char>(params.kt);
+	*buf++ = static_cast<unsigned char>(params.ht);
+	buf = putLE(buf, params.cost);
+	buf = putLE(buf, params.blockSize);
+	buf = putLE(buf, params.parallelism);
+	*buf++ = params.salt.size();
+	std::memcpy(buf, params.salt.data(), params.salt.size());
+	return buf + params.salt.size();
+}
+
+/**
+ * @brief Reads serialized KDF parameters, returning false on EOF, timeout, or error.
+ */
+static bool readParams(int fd, KdfParams& params) {
+	unsigned char buf[PARAMS_LEN];
+	if (!readAll(fd, buf, sizeof(buf))) {
+		return false;
+	}
+	params.kt = static_cast<KDFType>(buf[0]);
+	params.ht = static_cast<HashType>(buf[1]);
+	params.cost = getLE<uint32_t>(buf + 2);
+	params.blockSize = getLE<uint16_t>(buf + 6);
+	params.parallelism = getLE<uint16_t>(buf + 8);
+	params.salt.resize(buf[10]);
+	return readAll(fd, params.salt.data(), params.salt.size());
+}
+
+/**
+ * @brief Builds the address of a socket path, checking that the path fits in a sockaddr_un.
+ */
+static sockaddr_un makeAddress(const std::string& path) {
+	sockaddr_un addr = {};
+	if (path.size() >= sizeof(addr.sun_path)) {
+		lnthrow(IOException, "The socket path \"" + path + "\" is too long");
+	}
+	addr.sun_family = AF_UNIX;
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+
+static std::string parentDir(const std::string& path) {
+	const size_t slash = path.rfind('/');
+	if (slash == std::string::npos) {
+		return ".";
+	}
+	return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+/**
+ * @brief Throws unless st is owned by this user and cannot be accessed by anyone else.
+ */
+static void checkPrivate(const struct stat& st, const std::string& path, const char* what) {
+	if (st.st_uid != geteuid()) {
+		lnthrow(IOException, std::string("The agent's ") + what + " \"" + path + "\" is owned by another user");
+	}
+	if (st.st_mode & (S_IRWXG | S_IRWXO)) {
+		lnthrow(IOException, std::string("The agent's ") + what + " \"" + path + "\" is accessible to other users");
+	}
+}
+
+std::string defaultSocketPath() {
+	const char* runtimeDir = std::getenv("XDG_RUNTIME_DIR");
+	if (runtimeDir && runtimeDir[0] != '\0') {
+		return std::string(runtimeDir) + "/cloudsync-agent.sock";
+	}
+	return "/tmp/cloudsync-agent-" + std::to_string(geteuid()) + "/agent.sock";
+}
+
+void hardenProcess() {
+	prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		LOG(LEVEL_WARNING) << "Failed to lock the agent's memory (" << std::strerror(errno) << "). Cached keys may be swapped to disk. Raise RLIMIT_MEMLOCK (ulimit -l) to fix this.";
+	}
+}
+
+struct KeyAgent::KeyAgentImpl {
+	struct Entry {
+		MasterKey key;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	std::string socketPath;
+	std::chrono::seconds maxTtl;
+	int listenFd = -1;
+	/**
+	 * @brief stop() writes to wakeFds[1] to interrupt poll().
+	 */
+	int wakeFds[2] = {-1, -1};
+	std::unordered_map<std::string, Entry> keys;
+
+	/**
+	 * @brief Wipes every key, removes the socket if it was bound, and closes whatever descriptors were opened, so a constructor that throws partway through leaves nothing behind.
+	 */
+	~KeyAgentImpl() {
+		this->keys.clear();
+		if (!this->socketPath.empty()) {
+			unlink(this->socketPath.c_str());
+		}
+		for (int fd : {this->listenFd, this->wakeFds[0], this->wakeFds[1]}) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+	}
+
+	/**
+	 * @brief Wipes expired keys and returns how long poll() can sleep before the next one expires, or -1 if none are cached.
+	 */
+	int purge() {
+		const auto now = std::chrono::steady_clock::now();
+		auto next = std::chrono::steady_clock::time_point::max();
+
+		for (auto it = keys.begin(); it != keys.end();) {
+			if (it->second.expires <= now) {
+				it = keys.erase(it);
+				continue;
+			}
+			next = std::min(next, it->second.expires);
+			++it;
+		}
+
+		if (keys.empty()) {
+			return -1;
+		}
+		const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1;
+		return static_cast<int>(std::min<long long>(ms, INT32_MAX));
+	}
+
+	/**
+	 * @brief Answers one connection. Errors only drop that connection.
+	 */
+	void serve(int fd) {
+		struct ucred cred = {};
+		socklen_t credLen = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0 || cred.uid != geteuid()) {
+			LOG(LEVEL_WARNING) << "Refused a connection from uid " << cred.uid;
+			return;
+		}
+		setTimeouts(fd);
+
+		unsigned char head[3];
+		if (!readAll(fd, head, sizeof(head))) {
+			return;
+		}
+		const Op op = static_cast<Op>(head[0]);
+		const uint16_t idLen = getLE<uint16_t>(head + 1);
+		if (idLen > MAX_ID_LEN) {
+			reply(fd, Status::BAD_REQUEST);
+			return;
+		}
+		std::string id(idLen, '\0');
+		if (!readAll(fd, &id[0], idLen)) {
+			return;
+		}
+
+		switch (op) {
+		case Op::GET: {
+			auto it = keys.find(id);
+			if (it == keys.end() || it->second.expires <= std::chrono::steady_clock::now()) {
+				reply(fd, Status::NOT_FOUND);
+				return;
+			}
+			// the reply is built in a SecBytes so the key is never copied into unwiped memory
+			SecBytes out(1 + paramsSize(it->second.key.params()) + MasterKey::LENGTH);
+			out[0] = static_cast<unsigned char>(Status::OK);
+			unsigned char* ptr = putParams(out.data() + 1, it->second.key.params());
+			std::memcpy(ptr, it->second.key.bytes().data(), MasterKey::LENGTH);
+			writeAll(fd, out.data(), out.size());
+			return;
+		}
+		case Op::PUT: {
+			KdfParams params;
+			unsigned char ttlBuf[4];
+			SecBytes key(MasterKey::LENGTH);
+			if (!readParams(fd, params) || !readAll(fd, ttlBuf, sizeof(ttlBuf)) || !readAll(fd, key.data(), key.size())) {
+				return;
+			}
+			std::chrono::seconds ttl(getLE<uint32_t>(ttlBuf));
+			if (ttl.count() == 0 || ttl > maxTtl) {
+				ttl = maxTtl;
+			}
+			MasterKey mk = MasterKey::fromBytes(key, params);
+			keys.insert_or_assign(id, Entry{std::move(mk), std::chrono::steady_clock::now() + ttl});
+			reply(fd, Status::OK);
+			return;
+		}
+		case Op::FORGET:
+			reply(fd, keys.erase(id) > 0 ? Status::OK : Status::NOT_FOUND);
+			return;
+		default:
+			reply(fd, Status::BAD_REQUEST);
+			return;
+		}
+	}
+
+	static void reply(int fd, Status status) {
+		const unsigned char c = static_cast<unsigned char>(status);
+		writeAll(fd, &c, 1);
+	}
+};
+
+KeyAgent::KeyAgent(const char* socketPath, std::chrono::seconds maxTtl): impl(std::make_unique<KeyAgentImpl>()) {
+	const std::string path = socketPath;
+	const std::string dir = parentDir(path);
+	const sockaddr_un addr = makeAddress(path);
+	struct stat st;
+
+	this->impl->maxTtl = maxTtl;
+
+	if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+		lnthrow(IOException, "Failed to create \"" + dir + "\" (" + std::strerror(errno) + ")");
+	}
+	if (stat(dir.c_str(), &st) != 0) {
+		lnthrow(IOException, "Failed to stat \"" + dir + "\" (" + std::strerror(errno) + ")");
+	}
+	// XDG_RUNTIME_DIR is always 0700, and anything else the socket is put in must be too
+	checkPrivate(st, dir, "directory");
+
+	this->impl->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (this->impl->listenFd < 0) {
+		lnthrow(IOException, std::string("Failed to create a socket (") + std::strerror(errno) + ")");
+	}
+
+	if (lstat(path.c_str(), &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			lnthrow(IOException, "\"" + path + "\" exists and is not a socket");
+		}
+		if (connect(this->impl->listenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) {
+			lnthrow(IOException, "Another agent is already listening on \"" + path + "\"");
+		}
+		// a socket nobody is listening on was left behind by an agent that was killed
+		unlink(path.c_str());
+		close(this->impl->listenFd);
+		this->impl->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (this->impl->listenFd < 0) {
+			lnthrow(IOException, std::string("Failed to create a socket (") + std::strerror(errno) + ")");
+		}
+	}
+
+	const mode_t oldMask = umask(0177);
+	const int bindRet = bind(this->impl->listenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+	const int bindErr = errno;
+	umask(oldMask);
+	if (bindRet != 0) {
+		lnthrow(IOException, "Failed to bind \"" + path + "\" (" + std::strerror(bindErr) + ")");
+	}
+	this->impl->socketPath = path;
+
+	if (listen(this->impl->listenFd, SOMAXCONN) != 0) {
+		lnthrow(IOException, "Failed to listen on \"" + path + "\" (" + std::strerror(errno) + ")");
+	}
+	if (pipe2(this->impl->wakeFds, O_CLOEXEC | O_NONBLOCK) != 0) {
+		lnthrow(IOException, std::string("Failed to create a pipe (") + std::strerror(errno) + ")");
+	}
+}
+
+KeyAgent::~KeyAgent() = default;
+
+void KeyAgent::run() {
+	for (;;) {
+		struct pollfd fds[2] = {
+			{this->impl->listenFd, POLLIN, 0},
+			{this->impl->wakeFds[0], POLLIN, 0},
+		};
+		const int timeout = this->impl->purge();
+
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			lnthrow(IOException, std::string("poll() failed (") + std::strerror(errno) + ")");
+		}
+		if (fds[1].revents) {
+			// a stop() from before run() was called counts too, so the wakeup is only drained here
+			unsigned char drain[64];
+			while (read(this->impl->wakeFds[0], drain, sizeof(drain)) > 0) {}
+			return;
+		}
+		if (!(fds[0].revents & POLLIN)) {
+			continue;
+		}
+
+		const int fd = accept4(this->impl->listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		this->impl->purge();
+		this->impl->serve(fd);
+		close(fd);
+	}
+}
+
+void KeyAgent::stop() noexcept {
+	const unsigned char c = 0;
+	// the pipe is non-blocking, and a full pipe already means run() will wake up
+	ssize_t ret = write(this->impl->wakeFds[1], &c, 1);
+	(void)ret;
+}
+
+size_t KeyAgent::size() const {
+	return this->impl->keys.size();
+}
+
+AgentClient::AgentClient(const char* socketPath): socketPath(socketPath ? socketPath : defaultSocketPath()) {}
+
+/**
+ * @brief Connects to the agent after checking that its socket and directory belong to this user alone.
+ *
+ * @return The connection, or -1 if the agent is not running.
+ */
+static int connectAgent(const std::string& path) {
+	const sockaddr_un addr = makeAddress(path);
+	const std::string dir = parentDir(path);
+	struct stat st;
+
+	if (lstat(path.c_str(), &st) != 0) {
+		return -1;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		lnthrow(IOException, "\"" + path + "\" is not a socket");
+	}
+	checkPrivate(st, path, "socket");
+	if (stat(dir.c_str(), &st) != 0) {
+		return -1;
+	}
+	checkPrivate(st, dir, "directory");
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		lnthrow(IOException, std::string("Failed to create a socket (") + std::strerror(errno) + ")");
+	}
+	if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	struct ucred cred = {};
+	socklen_t credLen = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != 0 || cred.uid != geteuid()) {
+		close(fd);
+		lnthrow(IOException, "The process listening on \"" + path + "\" belongs to another user");
+	}
+	setTimeouts(fd);
+	return fd;
+}
+
+/**
+ * @brief Sends a request and reads the status of the reply, closing fd on failure.
+ */
+static Status request(int fd, Op op, const std::string& id, const unsigned char* extra = nullptr, size_t extraLen = 0) {
+	if (id.size() > MAX_ID_LEN) {
+		close(fd);
+		lnthrow(std::logic_error, "Key ids cannot be longer than " + std::to_string(MAX_ID_LEN) + " bytes");
+	}
+
+	unsigned char head[3];
+	head[0] = static_cast<unsigned char>(op);
+	putLE(head + 1, static_cast<uint16_t>(id.size()));
+
+	unsigned char status;
+	if (!writeAll(fd, head, sizeof(head)) || !writeAll(fd, id.data(), id.size()) || (extraLen > 0 && !writeAll(fd, extra, extraLen)) || !readAll(fd, &status, 1)) {
+		close(fd);
+		lnthrow(IOException, "The agent closed the connection before replying");
+	}
+	if (status > static_cast<unsigned char>(Status::BAD_REQUEST)) {
+		close(fd);
+		lnthrow(IOException, "The agent sent an unknown status " + std::to_string(status));
+	}
+	return static_cast<Status>(status);
+}
+
+std::optional<MasterKey> AgentClient::get(const std::string& id) const {
+	const int fd = connectAgent(this->socketPath);
+	if (fd < 0) {
+		return std::nullopt;
+	}
+
+	if (request(fd, Op::GET, id) != Status::OK) {
+		close(fd);
+		return std::nullopt;
+	}
+
+	KdfParams params;
+	SecBytes key(MasterKey::LENGTH);
+	const bool ok = readParams(fd, params) && readAll(fd, key.data(), key.size());
+	close(fd);
+	if (!ok) {
+		lnthrow(IOException, "The agent's reply was truncated");
+	}
+	return MasterKey::fromBytes(key, params);
+}
+
+bool AgentClient::put(const std::string& id, const MasterKey& key, std::chrono::seconds ttl) const {
+	const int fd = connectAgent(this->socketPath);
+	if (fd < 0) {
+		return false;
+	}
+
+	SecBytes extra(paramsSize(key.params()) + 4 + MasterKey::LENGTH);
+	unsigned char* ptr = putParams(extra.data(), key.params());
+	ptr = putLE(ptr, static_cast<uint32_t>(std::clamp<long long>(ttl.count(), 0, UINT32_MAX)));
+	std::memcpy(ptr, key.bytes().data(), MasterKey::LENGTH);
+
+	const Status status = request(fd, Op::PUT, id, extra.data(), extra.size());
+	close(fd);
+	return status == Status::OK;
+}
+
+bool AgentClient::forget(const std::string& id) const {
+	const int fd = connectAgent(this->socketPath);
+	if (fd < 0) {
+		return false;
+	}
+
+	const Status status = request(fd, Op::FORGET, id);
+	close(fd);
+	return status == Status::OK;
+}
+
+MasterKey unlockMasterKey(const std::string& id, const char* prompt, const KdfParams& params, bool* derived, const char* socketPath) {
+	const AgentClient client(socketPath);
+
+	std::optional<MasterKey> cached = client.get(id);
+	if (cached && cached->params() == params) {
+		if (derived) {
+			*derived = false;
+		}
+		return std::move(*cached);
+	}
+
+	std::optional<SecBytes> password = StdinPassword(prompt, nullptr);
+	if (!password || password->size() == 0) {
+		lnthrow(std::runtime_error, "The password cannot be empty");
+	}
+	if (derived) {
+		*derived = true;
+	}
+	return MasterKey(*password, params);
+}
+
+}
@@ -0,0 +1,149 @@
+/** @file agent/keyagent.hpp
+ * @brief Caches master keys between runs so the password KDF only runs once per session.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_AGENT_KEYAGENT_HPP
+#define __CS_AGENT_KEYAGENT_HPP
+
+#include "../crypto/masterkey.hpp"
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace CloudSync::Agent {
+
+/**
+ * @brief How long a key is cached if neither the agent nor the client asks for less.
+ */
+constexpr std::chrono::seconds DEFAULT_TTL(15 * 60);
+
+/**
+ * @brief Returns where the agent listens by default.
+ * This is $XDG_RUNTIME_DIR/cloudsync-agent.sock if XDG_RUNTIME_DIR is set, and /tmp/cloudsync-agent-$UID/agent.sock otherwise.
+ */
+std::string defaultSocketPath();
+
+/**
+ * @brief Locks all of this process's memory into RAM and stops it from being dumped or traced.
+ * cloudsync-agent calls this before it holds any keys. Failing to lock memory is logged and is not fatal.
+ */
+void hardenProcess();
+
+/**
+ * @brief Holds master keys in memory and serves them to cloudsync runs by the same user over a Unix socket.
+ *
+ * Only processes with the agent's effective uid are answered, which is checked with SO_PEERCRED on every connection.
+ * The socket is created with mode 0600 in a directory with mode 0700, and clients refuse to talk to a socket that does not look like that.
+ * Every key expires after its TTL, at which point it is wiped. Nothing is ever written to disk.
+ */
+class KeyAgent {
+public:
+	/**
+	 * @brief Creates the socket. Keys are not served until run() is called.
+	 *
+	 * @param socketPath Where to listen. Its directory is created with mode 0700 if it does not exist.
+	 * @param maxTtl The longest a key is kept. A client can ask for a shorter TTL, but not a longer one.
+	 *
+	 * @exception IOException The socket could not be created, its directory is accessible to other users, or another agent is already listening there.
+	 */
+	KeyAgent(const char* socketPath, std::chrono::seconds maxTtl = DEFAULT_TTL);
+
+	/**
+	 * @brief Wipes every key and removes the socket.
+	 */
+	~KeyAgent();
+
+	/**
+	 * @brief Serves requests until stop() is called.
+	 */
+	void run();
+
+	/**
+	 * @brief Makes run() return, or makes the next call to it return immediately if it is not running. This is async-signal-safe, so it can be called from a SIGTERM handler.
+	 */
+	void stop() noexcept;
+
+	/**
+	 * @brief Returns the number of keys currently cached.
+	 */
+	size_t size() const;
+
+private:
+	struct KeyAgentImpl;
+	std::unique_ptr<KeyAgentImpl> impl;
+};
+
+/**
+ * @brief Talks to a KeyAgent.
+ * Every request opens its own connection, so an AgentClient is cheap and can be used from any thread.
+ * A missing agent is not an error: get() returns std::nullopt and put() returns false, so callers fall back to asking for the password.
+ */
+class AgentClient {
+public:
+	/**
+	 * @brief Creates a client. Nothing is connected until a request is made.
+	 *
+	 * @param socketPath The agent's socket, or nullptr for defaultSocketPath().
+	 */
+	AgentClient(const char* socketPath = nullptr);
+
+	/**
+	 * @brief Fetches a cached key.
+	 *
+	 * @param id The name the key was stored under, such as the name of a backup.
+	 *
+	 * @return The key, or std::nullopt if the agent is not running or does not have it.
+	 *
+	 * @exception IOException The socket is owned by another user or is accessible to other users, or the agent sent a malformed reply.
+	 */
+	std::optional<Crypto::MasterKey> get(const std::string& id) const;
+
+	/**
+	 * @brief Caches a key.
+	 *
+	 * @param id The name to store the key under.
+	 * @param key The key.
+	 * @param ttl How long to keep the key. This is capped at the agent's own TTL, and 0 means the agent's TTL.
+	 *
+	 * @return True if the agent stored the key, or false if it is not running.
+	 *
+	 * @exception IOException The socket is owned by another user or is accessible to other users, or the agent sent a malformed reply.
+	 */
+	bool put(const std::string& id, const Crypto::MasterKey& key, std::chrono::seconds ttl = std::chrono::seconds(0)) const;
+
+	/**
+	 * @brief Wipes a cached key before its TTL runs out.
+	 *
+	 * @return True if the agent had the key.
+	 *
+	 * @exception IOException The socket is owned by another user or is accessible to other users, or the agent sent a malformed reply.
+	 */
+	bool forget(const std::string& id) const;
+
+private:
+	std::string socketPath;
+};
+
+/**
+ * @brief Returns the master key for id from the agent, or asks for the password and derives it if the agent does not have it.
+ * A freshly derived key is not handed to the agent, since nothing has checked the password yet. Callers cache it with AgentClient::put() once it has opened a container, so a mistyped password is not served until its TTL runs out.
+ *
+ * @param id The name of the key, such as the name of a backup.
+ * @param prompt The password prompt.
+ * @param params The KDF parameters, such as ones from CalibrateKdf(). A cached key derived with different parameters is not used.
+ * @param derived Set to true if the key was derived from a password, or false if it came from the agent. This can be nullptr.
+ * @param socketPath The agent's socket, or nullptr for defaultSocketPath().
+ *
+ * @exception IOException The agent's socket is insecure.
+ * @exception std::runtime_error The password is empty.
+ */
+Crypto::MasterKey unlockMasterKey(const std::string& id, const char* prompt, const Crypto::KdfParams& params, bool* derived = nullptr, const char* socketPath = nullptr);
+
+}
+
+#endif
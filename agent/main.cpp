@@ -0,0 +1,74 @@
+/** @file agent/main.cpp
+ * @brief cloudsync-agent, which caches master keys for later cloudsync runs.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "keyagent.hpp"
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+
+using namespace CloudSync::Agent;
+
+static KeyAgent* agent = nullptr;
+
+static void onSignal(int) {
+	if (agent) {
+		agent->stop();
+	}
+}
+
+static void usage(const char* argv0) {
+	std::cerr << "Usage: " << argv0 << " [--socket PATH] [--ttl SECONDS]" << std::endl;
+	std::cerr << "Caches master keys in locked memory and serves them to " << PROG_NAME << " runs by the same user." << std::endl;
+	std::cerr << "  --socket PATH   Where to listen. Defaults to " << defaultSocketPath() << "." << std::endl;
+	std::cerr << "  --ttl SECONDS   The longest a key is kept. Defaults to " << DEFAULT_TTL.count() << "." << std::endl;
+}
+
+int main(int argc, char** argv) {
+	std::string socketPath = defaultSocketPath();
+	std::chrono::seconds ttl = DEFAULT_TTL;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!std::strcmp(argv[i], "--socket") && i + 1 < argc) {
+			socketPath = argv[++i];
+		}
+		else if (!std::strcmp(argv[i], "--ttl") && i + 1 < argc) {
+			char* end;
+			const long long n = std::strtoll(argv[++i], &end, 10);
+			if (*end != '\0' || n <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			ttl = std::chrono::seconds(n);
+		}
+		else {
+			usage(argv[0]);
+			return !std::strcmp(argv[i], "--help") ? 0 : 1;
+		}
+	}
+
+	hardenProcess();
+	try {
+		KeyAgent ka(socketPath.c_str(), ttl);
+		agent = &ka;
+		std::signal(SIGINT, onSignal);
+		std::signal(SIGTERM, onSignal);
+		std::signal(SIGHUP, onSignal);
+
+		std::cout << "Listening on " << socketPath << std::endl;
+		ka.run();
+		agent = nullptr;
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
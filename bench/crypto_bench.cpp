@@ -0,0 +1,261 @@
+/** @file bench/crypto_bench.cpp
+ * @brief Measures the throughput of every cipher and mode, and the cost of every KDF.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Every result has bytes_per_second, and a cycles_per_byte counter on x86, where it is measured with the timestamp counter.
+ * `make bench` writes the results to bench/crypto_bench.json as well as the console, so releases can be compared with Google Benchmark's tools/compare.py.
+ */
+
+#include "../crypto/engine.hpp"
+#include "../crypto/password.hpp"
+#include "../crypto/secbytes.hpp"
+#include "../crypto/symmetric.hpp"
+#include "../fs/file.hpp"
+#include <benchmark/benchmark.h>
+#include <cryptopp/sha.h>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using namespace CloudSync::Crypto;
+
+constexpr BlockCipher ALL_CIPHERS[] = {BlockCipher::AES, BlockCipher::BLOWFISH, BlockCipher::CAMELLIA, BlockCipher::CAST6};
+constexpr CipherMode ALL_MODES[] = {CipherMode::CCM, CipherMode::CBC, CipherMode::CFB, CipherMode::CTR, CipherMode::EAX, CipherMode::GCM};
+constexpr KDFType ALL_KDFS[] = {HKDF, PBKDF2, SCRYPT};
+constexpr HashType ALL_HASHES[] = {RIPEMD256, SHA1, SHA256, SHA512};
+constexpr const char* HASH_NAMES[] = {"RIPEMD256", "SHA1", "SHA256", "SHA512"};
+constexpr const char* KDF_NAMES[] = {"", "HKDF", "PBKDF2", "SCRYPT"};
+
+/**
+ * @brief The size of the file encrypted by BM_EncryptFile.
+ */
+constexpr size_t FILE_BENCH_SIZE = 64 << 20;
+
+/**
+ * @brief The number of files encrypted by BM_EncryptSmallFiles.
+ */
+constexpr size_t SMALL_BENCH_COUNT = 1000;
+
+constexpr const char* FILE_BENCH_IN = "bench_plain.bin";
+constexpr const char* FILE_BENCH_OUT = "bench_enc.bin";
+
+/**
+ * @brief Returns the timestamp counter, or 0 where there is none.
+ */
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void setRates(benchmark::State& state, uint64_t bytes, uint64_t cyc) {
+	state.SetBytesProcessed(bytes);
+	if (cyc > 0 && bytes > 0) {
+		state.counters["cycles_per_byte"] = benchmark::Counter(static_cast<double>(cyc) / bytes, benchmark::Counter::kAvgThreads);
+	}
+}
+
+/**
+ * @brief Encrypts one message of state.range(0) bytes per iteration, the way chunked mode encrypts a segment.
+ * Each benchmark thread has its own engine, so the multi-threaded runs show how throughput scales across cores.
+ */
+static void BM_Cipher(benchmark::State& state, BlockCipher bc, CipherMode cm) {
+	std::unique_ptr<CipherEngine> engine = makeEngine(bc, cm);
+	const size_t ivLen = engine->tagSize() > 0 ? 12 : engine->blockSize();
+	std::vector<unsigned char> buf(state.range(0));
+	std::vector<unsigned char> iv(ivLen);
+	unsigned char tag[16];
+	engine->setKey(SecBytes(32), iv.data(), iv.size());
+
+	const uint64_t start = cycles();
+	for (auto _ : state) {
+		engine->encryptMessage(iv.data(), iv.size(), buf.data(), buf.size(), buf.data(), tag);
+		benchmark::DoNotOptimize(tag);
+	}
+	setRates(state, state.iterations() * buf.size(), cycles() - start);
+}
+
+/**
+ * @brief Encrypts a file through Symmetric in chunked mode with state.range(0) threads.
+ */
+static void BM_EncryptFile(benchmark::State& state) {
+	Symmetric sym("hunter2");
+	sym.setThreads(state.range(0));
+
+	if (!CloudSync::fs::exists(FILE_BENCH_IN)) {
+		std::vector<char> buf(FILE_BENCH_SIZE, 'a');
+		std::ofstream(FILE_BENCH_IN, std::ios_base::binary).write(buf.data(), buf.size());
+	}
+
+	const uint64_t start = cycles();
+	for (auto _ : state) {
+		sym.encryptFile(FILE_BENCH_IN, FILE_BENCH_OUT);
+	}
+	setRates(state, state.iterations() * FILE_BENCH_SIZE, cycles() - start);
+
+	CloudSync::fs::remove(FILE_BENCH_OUT);
+}
+
+/**
+ * @brief Hashes and encrypts a file, in one pass with encryptFileHashed() if state.range(0) is 1, or as a SHA-256 pass over the file followed by encryptFile() if it is 0.
+ */
+static void BM_HashAndEncryptFile(benchmark::State& state) {
+	Symmetric sym("hunter2");
+
+	if (!CloudSync::fs::exists(FILE_BENCH_IN)) {
+		std::vector<char> buf(FILE_BENCH_SIZE, 'a');
+		std::ofstream(FILE_BENCH_IN, std::ios_base::binary).write(buf.data(), buf.size());
+	}
+
+	const uint64_t start = cycles();
+	for (auto _ : state) {
+		if (state.range(0)) {
+			benchmark::DoNotOptimize(sym.encryptFileHashed(FILE_BENCH_IN, FILE_BENCH_OUT));
+			continue;
+		}
+		std::ifstream ifs(FILE_BENCH_IN, std::ios_base::binary);
+		std::vector<unsigned char> buf(1 << 20);
+		CryptoPP::SHA256 hash;
+		ContentDigest digest;
+		while (ifs.read(reinterpret_cast<char*>(buf.data()), buf.size()) || ifs.gcount() > 0) {
+			hash.Update(buf.data(), ifs.gcount());
+		}
+		hash.Final(digest.data());
+		benchmark::DoNotOptimize(digest);
+		sym.encryptFile(FILE_BENCH_IN, FILE_BENCH_OUT);
+	}
+	setRates(state, state.iterations() * FILE_BENCH_SIZE, cycles() - start);
+
+	CloudSync::fs::remove(FILE_BENCH_OUT);
+}
+
+/**
+ * @brief Encrypts SMALL_BENCH_COUNT files of state.range(1) bytes each, one encryptFile() at a time if state.range(0) is 0, or with one encryptFiles() call otherwise.
+ */
+static void BM_EncryptSmallFiles(benchmark::State& state) {
+	Symmetric sym("hunter2");
+	const size_t len = state.range(1);
+	std::vector<std::pair<std::string, std::string>> files;
+	std::vector<char> buf(len, 'a');
+
+	for (size_t i = 0; i < SMALL_BENCH_COUNT; ++i) {
+		const std::string name = "bench_small_" + std::to_string(i);
+		std::ofstream(name, std::ios_base::binary).write(buf.data(), buf.size());
+		files.emplace_back(name, name + ".enc");
+	}
+
+	const uint64_t start = cycles();
+	for (auto _ : state) {
+		if (state.range(0)) {
+			sym.encryptFiles(files);
+		}
+		else {
+			for (const std::pair<std::string, std::string>& f : files) {
+				sym.encryptFile(f.first.c_str(), f.second.c_str());
+			}
+		}
+	}
+	setRates(state, state.iterations() * SMALL_BENCH_COUNT * len, cycles() - start);
+	state.counters["files_per_second"] = benchmark::Counter(state.iterations() * SMALL_BENCH_COUNT, benchmark::Counter::kIsRate);
+
+	for (const std::pair<std::string, std::string>& f : files) {
+		CloudSync::fs::remove(f.first.c_str());
+		CloudSync::fs::remove(f.second.c_str());
+	}
+}
+
+/**
+ * @brief Derives a 256-bit key and a 128-bit IV from a password.
+ */
+static void BM_DeriveKeypair(benchmark::State& state, KDFType kt, HashType ht) {
+	const SecBytes password("correct horse battery staple");
+
+	for (auto _ : state) {
+		std::pair<SecBytes, SecBytes> kp = DeriveKeypair(password, 32, 16, kt, ht);
+		benchmark::DoNotOptimize(kp.first.data());
+	}
+}
+
+static void registerAll() {
+	const int hwThreads = std::thread::hardware_concurrency();
+	std::vector<int> threadCounts = {1};
+	if (hwThreads > 1) {
+		threadCounts.push_back(hwThreads);
+	}
+
+	std::vector<std::pair<BlockCipher, CipherMode>> ciphers;
+	for (BlockCipher bc : ALL_CIPHERS) {
+		// CCM and GCM are only defined for 128-bit blocks, so they are skipped for ciphers like Blowfish
+		const bool wideBlock = makeEngine(bc, CipherMode::CTR)->blockSize() == 16;
+		for (CipherMode cm : ALL_MODES) {
+			if (!wideBlock && (cm == CipherMode::CCM || cm == CipherMode::GCM)) {
+				continue;
+			}
+			ciphers.emplace_back(bc, cm);
+		}
+	}
+	// ChaCha20 only pairs with Poly1305
+	ciphers.emplace_back(BlockCipher::CHACHA20, CipherMode::POLY1305);
+
+	for (const std::pair<BlockCipher, CipherMode>& c : ciphers) {
+		const std::string name = std::string("BM_Cipher/") + bcToString(c.first) + "/" + cmToString(c.second);
+		benchmark::internal::Benchmark* b = benchmark::RegisterBenchmark(name.c_str(), BM_Cipher, c.first, c.second);
+		b->RangeMultiplier(4)->Range(64, 16 << 20)->UseRealTime();
+		for (int n : threadCounts) {
+			b->Threads(n);
+		}
+	}
+
+	benchmark::internal::Benchmark* b = benchmark::RegisterBenchmark("BM_EncryptFile", BM_EncryptFile);
+	b->Unit(benchmark::kMillisecond)->UseRealTime();
+	for (int n : threadCounts) {
+		b->Arg(n);
+	}
+
+	benchmark::RegisterBenchmark("BM_HashAndEncryptFile", BM_HashAndEncryptFile)->Unit(benchmark::kMillisecond)->UseRealTime()->ArgName("fused")->Arg(0)->Arg(1);
+
+	b = benchmark::RegisterBenchmark("BM_EncryptSmallFiles", BM_EncryptSmallFiles);
+	b->Unit(benchmark::kMillisecond)->UseRealTime()->ArgNames({"batch", "size"});
+	for (int batch : {0, 1}) {
+		for (int size : {512, 8 << 10}) {
+			b->Args({batch, size});
+		}
+	}
+
+	for (KDFType kt : ALL_KDFS) {
+		if (kt == SCRYPT) {
+			// scrypt does not take a hash function
+			benchmark::RegisterBenchmark("BM_DeriveKeypair/SCRYPT", BM_DeriveKeypair, kt, SHA256)->Unit(benchmark::kMicrosecond);
+			continue;
+		}
+		for (HashType ht : ALL_HASHES) {
+			const std::string name = std::string("BM_DeriveKeypair/") + KDF_NAMES[kt] + "/" + HASH_NAMES[ht];
+			benchmark::RegisterBenchmark(name.c_str(), BM_DeriveKeypair, kt, ht)->Unit(benchmark::kMicrosecond);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	registerAll();
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+		return 1;
+	}
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	CloudSync::fs::remove(FILE_BENCH_IN);
+	return 0;
+}
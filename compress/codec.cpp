@@ -0,0 +1,255 @@
+/** @file compress/codec.cpp
+ * @brief Compresses segments before they are encrypted.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "codec.hpp"
+#include "../lnthrow.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef CS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef CS_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+namespace CloudSync::Compress {
+
+/**
+ * @brief Data with more entropy than this is not worth compressing.
+ */
+constexpr double INCOMPRESSIBLE_ENTROPY = 7.5;
+
+/**
+ * @brief estimateEntropy() samples data longer than this.
+ */
+constexpr size_t ENTROPY_SAMPLE_LEN = 64 << 10;
+
+constexpr size_t ENTROPY_WINDOWS = 16;
+
+const char* codecToString(Codec codec) {
+	switch (codec) {
+	case Codec::NONE:
+		return "None";
+	case Codec::ZSTD:
+		return "zstd";
+	case Codec::LZ4:
+		return "LZ4";
+	default:
+		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
+	}
+}
+
+bool codecAvailable(Codec codec) noexcept {
+	switch (codec) {
+	case Codec::NONE:
+		return true;
+#ifdef CS_HAVE_ZSTD
+	case Codec::ZSTD:
+		return true;
+#endif
+#ifdef CS_HAVE_LZ4
+	case Codec::LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool validLevel(Codec codec, int level) noexcept {
+	switch (codec) {
+#ifdef CS_HAVE_ZSTD
+	case Codec::ZSTD:
+		return level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel();
+#endif
+#ifdef CS_HAVE_LZ4
+	case Codec::LZ4:
+		return level <= LZ4HC_CLEVEL_MAX;
+#endif
+	default:
+		return level == 0;
+	}
+}
+
+double estimateEntropy(const unsigned char* data, size_t len) noexcept {
+	uint32_t counts[256] = {};
+	size_t total = 0;
+
+	if (len <= ENTROPY_SAMPLE_LEN) {
+		for (size_t i = 0; i < len; ++i) {
+			counts[data[i]]++;
+		}
+		total = len;
+	}
+	else {
+		const size_t window = ENTROPY_SAMPLE_LEN / ENTROPY_WINDOWS;
+		const size_t stride = (len - window) / (ENTROPY_WINDOWS - 1);
+		for (size_t w = 0; w < ENTROPY_WINDOWS; ++w) {
+			const unsigned char* ptr = data + w * stride;
+			for (size_t i = 0; i < window; ++i) {
+				counts[ptr[i]]++;
+			}
+		}
+		total = window * ENTROPY_WINDOWS;
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	double entropy = 0;
+	for (uint32_t c : counts) {
+		if (c > 0) {
+			const double p = static_cast<double>(c) / total;
+			entropy -= p * std::log2(p);
+		}
+	}
+	return entropy;
+}
+
+bool worthCompressing(const unsigned char* data, size_t len) noexcept {
+	return estimateEntropy(data, len) <= INCOMPRESSIBLE_ENTROPY;
+}
+
+struct Compressor::CompressorImpl {
+	Codec codec;
+	int level;
+#ifdef CS_HAVE_ZSTD
+	ZSTD_CCtx* cctx = nullptr;
+	ZSTD_DCtx* dctx = nullptr;
+#endif
+	/**
+	 * @brief LZ4's compression state, which is reused between calls instead of being allocated for each one.
+	 */
+	std::vector<char> lz4State;
+
+	~CompressorImpl() {
+#ifdef CS_HAVE_ZSTD
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+#endif
+	}
+};
+
+Compressor::Compressor(Codec codec, int level): impl(std::make_unique<CompressorImpl>()) {
+	if (codec == Codec::NONE) {
+		lnthrow(std::logic_error, "A Compressor needs a codec other than Codec::NONE");
+	}
+	if (!codecAvailable(codec)) {
+		lnthrow(std::logic_error, std::string("This build does not support ") + codecToString(codec) + " compression");
+	}
+	if (!validLevel(codec, level)) {
+		lnthrow(std::logic_error, std::to_string(level) + " is not a valid level for " + codecToString(codec));
+	}
+	this->impl->codec = codec;
+	this->impl->level = level;
+
+#ifdef CS_HAVE_ZSTD
+	if (codec == Codec::ZSTD) {
+		this->impl->cctx = ZSTD_createCCtx();
+		this->impl->dctx = ZSTD_createDCtx();
+		if (!this->impl->cctx || !this->impl->dctx) {
+			throw std::bad_alloc();
+		}
+	}
+#endif
+#ifdef CS_HAVE_LZ4
+	if (codec == Codec::LZ4) {
+		this->impl->lz4State.resize(level > 0 ? LZ4_sizeofStateHC() : LZ4_sizeofState());
+	}
+#endif
+}
+
+Compressor::Compressor(Compressor&& other) noexcept = default;
+
+Compressor& Compressor::operator=(Compressor&& other) noexcept = default;
+
+Compressor::~Compressor() = default;
+
+size_t Compressor::compress(const unsigned char* in, size_t len, unsigned char* out, size_t outLen) {
+	switch (this->impl->codec) {
+#ifdef CS_HAVE_ZSTD
+	case Codec::ZSTD: {
+		const size_t ret = ZSTD_compressCCtx(this->impl->cctx, out, outLen, in, len, this->impl->level);
+		return ZSTD_isError(ret) ? 0 : ret;
+	}
+#endif
+#ifdef CS_HAVE_LZ4
+	case Codec::LZ4: {
+		if (len > INT_MAX || outLen == 0) {
+			return 0;
+		}
+		const int cap = std::min<size_t>(outLen, INT_MAX);
+		const char* src = reinterpret_cast<const char*>(in);
+		char* dst = reinterpret_cast<char*>(out);
+		const int ret = this->impl->level > 0 ?
+			LZ4_compress_HC_extStateHC(this->impl->lz4State.data(), src, dst, len, cap, this->impl->level) :
+			LZ4_compress_fast_extState(this->impl->lz4State.data(), src, dst, len, cap, 1 - this->impl->level);
+		return ret > 0 ? ret : 0;
+	}
+#endif
+	default:
+		// the constructor rejects codecs this build does not have
+		(void)in;
+		(void)len;
+		(void)out;
+		(void)outLen;
+		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
+	}
+}
+
+size_t Compressor::decompress(const unsigned char* in, size_t len, unsigned char* out, size_t outLen) {
+	switch (this->impl->codec) {
+#ifdef CS_HAVE_ZSTD
+	case Codec::ZSTD: {
+		const size_t ret = ZSTD_decompressDCtx(this->impl->dctx, out, outLen, in, len);
+		if (ZSTD_isError(ret)) {
+			lnthrow(std::runtime_error, std::string("zstd: ") + ZSTD_getErrorName(ret));
+		}
+		return ret;
+	}
+#endif
+#ifdef CS_HAVE_LZ4
+	case Codec::LZ4: {
+		if (len > INT_MAX) {
+			lnthrow(std::runtime_error, "LZ4: the compressed data is too long");
+		}
+		const int ret = LZ4_decompress_safe(reinterpret_cast<const char*>(in), reinterpret_cast<char*>(out), len, std::min<size_t>(outLen, INT_MAX));
+		if (ret < 0) {
+			lnthrow(std::runtime_error, "LZ4: the compressed data is corrupt");
+		}
+		return ret;
+	}
+#endif
+	default:
+		// the constructor rejects codecs this build does not have
+		(void)in;
+		(void)len;
+		(void)out;
+		(void)outLen;
+		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
+	}
+}
+
+Codec Compressor::codec() const noexcept {
+	return this->impl->codec;
+}
+
+int Compressor::level() const noexcept {
+	return this->impl->level;
+}
+
+}
@@ -0,0 +1,127 @@
+/** @file compress/codec.hpp
+ * @brief Compresses segments before they are encrypted.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_COMPRESS_CODEC_HPP
+#define __CS_COMPRESS_CODEC_HPP
+
+#include <cstddef>
+#include <memory>
+
+namespace CloudSync::Compress {
+
+/**
+ * @brief A compression codec.
+ * The values are recorded in container headers, so they must never change.
+ */
+enum class Codec {
+	NONE = 0,
+	/**
+	 * @brief Zstandard. Levels run from ZSTD_minCLevel() (fastest, negative) to 22, and 0 is the library default of 3.
+	 */
+	ZSTD = 1,
+	/**
+	 * @brief LZ4. Level 0 is the default fast compressor, negative levels trade ratio for speed, and levels 1 to 12 use LZ4HC.
+	 */
+	LZ4 = 2,
+};
+
+/**
+ * @brief Returns the name of a codec.
+ */
+const char* codecToString(Codec codec);
+
+/**
+ * @brief Returns true if this build can compress and decompress with a codec.
+ * zstd and LZ4 are optional dependencies. Codec::NONE is always available.
+ */
+bool codecAvailable(Codec codec) noexcept;
+
+/**
+ * @brief Returns true if level is a valid level for codec.
+ */
+bool validLevel(Codec codec, int level) noexcept;
+
+/**
+ * @brief Estimates the Shannon entropy of data in bits per byte, from 0 to 8.
+ * Data longer than 64KiB is sampled in 16 evenly spaced 4KiB windows, so this costs the same for any chunk size.
+ *
+ * @param data The data.
+ * @param len The length of the data.
+ */
+double estimateEntropy(const unsigned char* data, size_t len) noexcept;
+
+/**
+ * @brief Returns false if data looks like it is already compressed or encrypted, such as JPEG, zip, or video.
+ * This is the case when estimateEntropy() is above 7.5 bits per byte. Text and logs are usually between 4 and 6.
+ */
+bool worthCompressing(const unsigned char* data, size_t len) noexcept;
+
+/**
+ * @brief A compression context for one codec and level.
+ * Contexts are reused between calls, so a Compressor is not thread-safe. Give each thread its own.
+ */
+class Compressor {
+public:
+	/**
+	 * @brief Creates a compressor.
+	 *
+	 * @param codec The codec. This cannot be Codec::NONE.
+	 * @param level The level to compress at. The level does not matter for decompression.
+	 *
+	 * @exception std::logic_error The codec is not available in this build, or the level is invalid.
+	 */
+	Compressor(Codec codec, int level = 0);
+
+	Compressor(Compressor&& other) noexcept;
+	Compressor& operator=(Compressor&& other) noexcept;
+	~Compressor();
+
+	/**
+	 * @brief Compresses a buffer.
+	 *
+	 * @param in The data to compress.
+	 * @param len The length of the data.
+	 * @param out Where to write the compressed data.
+	 * @param outLen The length of out.
+	 *
+	 * @return The length of the compressed data, or 0 if it does not fit in outLen bytes.
+	 */
+	size_t compress(const unsigned char* in, size_t len, unsigned char* out, size_t outLen);
+
+	/**
+	 * @brief Decompresses a buffer.
+	 *
+	 * @param in The compressed data.
+	 * @param len The length of the compressed data.
+	 * @param out Where to write the data.
+	 * @param outLen The length of out.
+	 *
+	 * @return The length of the decompressed data.
+	 *
+	 * @exception std::runtime_error The data is corrupt or decompresses to more than outLen bytes.
+	 */
+	size_t decompress(const unsigned char* in, size_t len, unsigned char* out, size_t outLen);
+
+	/**
+	 * @brief Returns this compressor's codec.
+	 */
+	Codec codec() const noexcept;
+
+	/**
+	 * @brief Returns this compressor's level.
+	 */
+	int level() const noexcept;
+
+private:
+	struct CompressorImpl;
+	std::unique_ptr<CompressorImpl> impl;
+};
+
+}
+
+#endif
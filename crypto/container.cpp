@@ -0,0 +1,265 @@
+/** @file crypto/container.cpp
+ * @brief Reads and writes the encrypted container format.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "container.hpp"
+#include "integrityexception.hpp"
+#include "../fs/ioexception.hpp"
+#include "../lnthrow.hpp"
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+
+namespace CloudSync::Crypto {
+
+constexpr const char CONTAINER_MAGIC[] = "CSE\n";
+constexpr const char FOOTER_MAGIC[] = "CSEI";
+constexpr size_t MAGIC_LEN = 4;
+
+/**
+ * @brief The size of the fixed part of a header, which is everything up to and including the KDF salt length.
+ */
+constexpr size_t HEADER_FIXED_SIZE = MAGIC_LEN + 6 + 2 + 4 + 1 + 8 + 1;
+
+/**
+ * @brief The size of an index entry without its tag, which is the offset and the length.
+ */
+constexpr size_t ENTRY_FIXED_SIZE = 8 + 4;
+
+/**
+ * @brief Writes an unsigned integer to a buffer in little-endian order.
+ */
+template <typename T>
+static unsigned char* putLE(unsigned char* buf, T val) {
+	for (size_t i = 0; i < sizeof(T); ++i) {
+		buf[i] = (val >> (8 * i)) & 0xFF;
+	}
+	return buf + sizeof(T);
+}
+
+/**
+ * @brief Reads an unsigned integer from a buffer in little-endian order.
+ */
+template <typename T>
+static const unsigned char* getLE(const unsigned char* buf, T& val) {
+	val = 0;
+	for (size_t i = 0; i < sizeof(T); ++i) {
+		val |= static_cast<T>(buf[i]) << (8 * i);
+	}
+	return buf + sizeof(T);
+}
+
+static void readExact(std::istream& is, void* buf, size_t len, const char* what) {
+	is.read(reinterpret_cast<char*>(buf), len);
+	if (is.bad()) {
+		lnthrow(fs::IOException, std::string("I/O error reading the container ") + what + " (" + std::strerror(errno) + ")");
+	}
+	if (static_cast<size_t>(is.gcount()) != len) {
+		lnthrow(IntegrityException, std::string("The container ") + what + " is truncated");
+	}
+}
+
+size_t ContainerHeader::size() const noexcept {
+	return HEADER_FIXED_SIZE + kdf.salt.size() + 1 + wrappedKey.size() + 1 + 1 + keySalt.size();
+}
+
+uint64_t indexSize(uint64_t count, size_t tagLen) noexcept {
+	return count * (ENTRY_FIXED_SIZE + tagLen) + CONTAINER_FOOTER_SIZE;
+}
+
+size_t serializeHeader(const ContainerHeader& header, unsigned char* out) {
+	unsigned char* ptr = out;
+	size_t keyOffset;
+
+	if (header.version != CONTAINER_VERSION) {
+		lnthrow(std::logic_error, "Only version " + std::to_string(CONTAINER_VERSION) + " containers can be written");
+	}
+	if (header.kdf.salt.size() > UINT8_MAX) {
+		lnthrow(std::logic_error, "The salt cannot be longer than " + std::to_string(UINT8_MAX) + " bytes");
+	}
+	if (header.wrappedKey.size() > UINT8_MAX) {
+		lnthrow(std::logic_error, "The wrapped key cannot be longer than " + std::to_string(UINT8_MAX) + " bytes");
+	}
+	if (header.keySalt.size() > UINT8_MAX) {
+		lnthrow(std::logic_error, "The key salt cannot be longer than " + std::to_string(UINT8_MAX) + " bytes");
+	}
+
+	std::memcpy(ptr, CONTAINER_MAGIC, MAGIC_LEN);
+	ptr += MAGIC_LEN;
+	*ptr++ = header.version;
+	*ptr++ = static_cast<uint8_t>(header.bc);
+	*ptr++ = static_cast<uint8_t>(header.cm);
+	*ptr++ = static_cast<uint8_t>(header.kdf.kt);
+	*ptr++ = static_cast<uint8_t>(header.kdf.ht);
+	*ptr++ = header.tagLen;
+	ptr = putLE(ptr, header.keyLen);
+	ptr = putLE(ptr, header.chunkSize);
+	*ptr++ = static_cast<uint8_t>(header.codec);
+	ptr = putLE(ptr, header.kdf.cost);
+	ptr = putLE(ptr, header.kdf.blockSize);
+	ptr = putLE(ptr, header.kdf.parallelism);
+	*ptr++ = header.kdf.salt.size();
+	ptr = std::copy(header.kdf.salt.begin(), header.kdf.salt.end(), ptr);
+	*ptr++ = header.wrappedKey.size();
+	keyOffset = ptr - out;
+	ptr = std::copy(header.wrappedKey.begin(), header.wrappedKey.end(), ptr);
+	*ptr++ = header.flags;
+	*ptr++ = header.keySalt.size();
+	if (header.wrappedKey.empty()) {
+		keyOffset = ptr - out;
+	}
+	std::copy(header.keySalt.begin(), header.keySalt.end(), ptr);
+	return keyOffset;
+}
+
+void writeHeader(std::ostream& os, const ContainerHeader& header) {
+	std::vector<unsigned char> buf(header.size());
+
+	serializeHeader(header, buf.data());
+	os.write(reinterpret_cast<char*>(buf.data()), buf.size());
+	if (!os) {
+		lnthrow(fs::IOException, std::string("Failed to write the container header (") + std::strerror(errno) + ")");
+	}
+}
+
+ContainerHeader readHeader(std::istream& is) {
+	unsigned char buf[HEADER_FIXED_SIZE];
+	const unsigned char* ptr = buf;
+	ContainerHeader header;
+
+	readExact(is, buf, MAGIC_LEN + 1, "header");
+	if (std::memcmp(ptr, CONTAINER_MAGIC, MAGIC_LEN) != 0) {
+		lnthrow(IntegrityException, "This is not an encrypted container");
+	}
+	ptr += MAGIC_LEN;
+	header.version = *ptr++;
+	if (header.version != CONTAINER_VERSION) {
+		lnthrow(IntegrityException, "Unsupported container version " + std::to_string(header.version));
+	}
+	readExact(is, buf + MAGIC_LEN + 1, HEADER_FIXED_SIZE - MAGIC_LEN - 1, "header");
+	header.bc = static_cast<BlockCipher>(*ptr++);
+	header.cm = static_cast<CipherMode>(*ptr++);
+	header.kdf.kt = static_cast<KDFType>(*ptr++);
+	header.kdf.ht = static_cast<HashType>(*ptr++);
+	header.tagLen = *ptr++;
+	ptr = getLE(ptr, header.keyLen);
+	ptr = getLE(ptr, header.chunkSize);
+	header.codec = static_cast<Compress::Codec>(*ptr++);
+	ptr = getLE(ptr, header.kdf.cost);
+	ptr = getLE(ptr, header.kdf.blockSize);
+	ptr = getLE(ptr, header.kdf.parallelism);
+	header.kdf.salt.resize(*ptr++);
+	readExact(is, header.kdf.salt.data(), header.kdf.salt.size(), "salt");
+
+	unsigned char len;
+	readExact(is, &len, 1, "wrapped key");
+	header.wrappedKey.resize(len);
+	readExact(is, header.wrappedKey.data(), header.wrappedKey.size(), "wrapped key");
+	readExact(is, &header.flags, 1, "flags");
+	readExact(is, &len, 1, "key salt");
+	header.keySalt.resize(len);
+	readExact(is, header.keySalt.data(), header.keySalt.size(), "key salt");
+
+	if (header.chunkSize == 0) {
+		lnthrow(IntegrityException, "The container has a chunk size of 0");
+	}
+	if (header.codec != Compress::Codec::NONE && header.codec != Compress::Codec::ZSTD && header.codec != Compress::Codec::LZ4) {
+		lnthrow(IntegrityException, "The container has an unknown codec");
+	}
+	if (header.flags & ~CONTAINER_FLAG_CONVERGENT) {
+		lnthrow(IntegrityException, "The container has unknown flags");
+	}
+	if (header.wrappedKey.empty() == header.keySalt.empty()) {
+		lnthrow(IntegrityException, "The container must have either a wrapped key or a key salt");
+	}
+	return header;
+}
+
+void serializeIndex(const ChunkIndex& index, uint64_t indexOffset, unsigned char* out) noexcept {
+	unsigned char* ptr = out;
+
+	for (size_t i = 0; i < index.count(); ++i) {
+		ptr = putLE(ptr, index.offsets[i]);
+		ptr = putLE(ptr, index.lengths[i]);
+		std::memcpy(ptr, index.tags.data() + i * index.tagLen, index.tagLen);
+		ptr += index.tagLen;
+	}
+	ptr = putLE(ptr, indexOffset);
+	ptr = putLE(ptr, static_cast<uint64_t>(index.count()));
+	std::memcpy(ptr, FOOTER_MAGIC, MAGIC_LEN);
+}
+
+void writeIndex(std::ostream& os, const ChunkIndex& index, uint64_t indexOffset) {
+	std::vector<unsigned char> buf(indexSize(index.count(), index.tagLen));
+
+	serializeIndex(index, indexOffset, buf.data());
+	os.write(reinterpret_cast<char*>(buf.data()), buf.size());
+	if (!os) {
+		lnthrow(fs::IOException, std::string("Failed to write the container index (") + std::strerror(errno) + ")");
+	}
+}
+
+ContainerFooter readFooter(std::istream& is, const ContainerHeader& header) {
+	const uint64_t entryLen = ENTRY_FIXED_SIZE + header.tagLen;
+	unsigned char buf[CONTAINER_FOOTER_SIZE];
+	ContainerFooter footer;
+
+	is.clear();
+	is.seekg(-static_cast<std::streamoff>(CONTAINER_FOOTER_SIZE), std::ios_base::end);
+	if (!is) {
+		lnthrow(IntegrityException, "The container is too short to have a footer");
+	}
+	const uint64_t footerOffset = static_cast<uint64_t>(is.tellg());
+	readExact(is, buf, sizeof(buf), "footer");
+	if (std::memcmp(buf + 16, FOOTER_MAGIC, MAGIC_LEN) != 0) {
+		lnthrow(IntegrityException, "The container footer is missing. The file may be truncated.");
+	}
+	getLE(getLE(buf, footer.indexOffset), footer.count);
+	if (footer.count == 0) {
+		lnthrow(IntegrityException, "The container has no chunks");
+	}
+
+	// a corrupt count must not size the index, so the index has to fit exactly between the header and the footer
+	if (footer.indexOffset < header.size() || footer.indexOffset > footerOffset || footer.count > (footerOffset - footer.indexOffset) / entryLen || footer.count * entryLen != footerOffset - footer.indexOffset) {
+		lnthrow(IntegrityException, "The container's index does not fit between its header and its footer. The file may be truncated or corrupt.");
+	}
+	return footer;
+}
+
+ChunkIndex readIndex(std::istream& is, const ContainerHeader& header, const ContainerFooter& footer, uint64_t first, uint64_t n) {
+	const size_t entryLen = ENTRY_FIXED_SIZE + header.tagLen;
+	std::vector<unsigned char> buf;
+	const unsigned char* ptr;
+	ChunkIndex index;
+
+	if (first > footer.count || n > footer.count - first) {
+		lnthrow(IntegrityException, "Chunks " + std::to_string(first) + "-" + std::to_string(first + n) + " are out of range of the index (" + std::to_string(footer.count) + " chunks)");
+	}
+
+	buf.resize(n * entryLen);
+	index.tagLen = header.tagLen;
+	index.offsets.resize(n);
+	index.lengths.resize(n);
+	index.tags.resize(n * header.tagLen);
+
+	is.clear();
+	is.seekg(footer.indexOffset + first * entryLen);
+	readExact(is, buf.data(), buf.size(), "index");
+
+	ptr = buf.data();
+	for (size_t i = 0; i < n; ++i) {
+		ptr = getLE(ptr, index.offsets[i]);
+		ptr = getLE(ptr, index.lengths[i]);
+		std::memcpy(index.tag(i), ptr, header.tagLen);
+		ptr += header.tagLen;
+	}
+	return index;
+}
+
+}
@@ -0,0 +1,235 @@
+/** @file crypto/container.hpp
+ * @brief Reads and writes the encrypted container format.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_CRYPTO_CONTAINER_HPP
+#define __CS_CRYPTO_CONTAINER_HPP
+
+#include "password.hpp"
+#include "symmetric.hpp"
+#include "../compress/codec.hpp"
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+namespace CloudSync::Crypto {
+
+/**
+ * @brief The version of the container format written by this build, which is the only one it reads.
+ *
+ * A container has the following format. All integers are little-endian.
+ * ```
+ * Header:
+ *     "CSE\n"                     magic
+ *     u8  version
+ *     u8  BlockCipher
+ *     u8  CipherMode
+ *     u8  KDFType
+ *     u8  HashType
+ *     u8  tag length
+ *     u16 key length in bits
+ *     u32 chunk size
+ *     u8  Codec
+ *     u32 KDF cost
+ *     u16 KDF block size
+ *     u16 KDF parallelism
+ *     u8  KDF salt length,        0 for keys derived without a salt
+ *         followed by the KDF salt
+ *     u8  wrapped key length,     0 if the container has a key salt
+ *         followed by the wrapped key
+ *     u8  flags
+ *     u8  key salt length,        0 if the container has a wrapped key
+ *         followed by the key salt
+ * Data:
+ *     the ciphertext of every chunk, back to back
+ * Index:
+ *     per chunk: u64 offset of the ciphertext in the file, u32 length of the ciphertext, tag
+ * Footer:
+ *     u64 offset of the index
+ *     u64 number of chunks
+ *     "CSEI"                      magic
+ * ```
+ * Chunk i holds plaintext bytes [i * chunkSize, (i + 1) * chunkSize), so the chunks covering any plaintext range can be found without reading the rest of the file.
+ * If the codec is not Codec::NONE, each chunk's plaintext is compressed on its own before it is encrypted, and the encrypted payload starts with a byte that is 1 if the rest is compressed or 0 if it is stored as is, which it is when compressing would not make it smaller.
+ * If the wrapped key is empty, the chunks are encrypted with a key of the container's own, HMAC-SHA256(password's key, "CloudSync container key v1" || key salt) cut to the key length, where the key salt is random.
+ * Otherwise the chunks are encrypted with a random data key of its own, and the wrapped key is that data key sealed with AES-GCM under the password's key: a 12-byte nonce, the encrypted data key, and a 16-byte tag.
+ * Either way, no two containers written under the same password share a key, so their nonces can start with zeros.
+ * Changing the password then only means rewrapping the data key, which rewrites the header and nothing else.
+ * If CONTAINER_FLAG_CONVERGENT is set, every chunk is encrypted with a key of its own derived from its plaintext, under a nonce of zeros.
+ * Each index entry's tag is then the chunk's tag, followed by the chunk's key sealed under the container's key with the chunk's usual nonce, followed by that seal's tag.
+ * The header and index are not encrypted, but tampering with either makes the affected chunks fail authentication.
+ */
+constexpr uint8_t CONTAINER_VERSION = 1;
+
+/**
+ * @brief Set in a container's flags if its chunks are encrypted convergently. See Symmetric::setConvergent().
+ */
+constexpr uint8_t CONTAINER_FLAG_CONVERGENT = 1;
+
+/**
+ * @brief The size of the footer at the end of a container.
+ */
+constexpr size_t CONTAINER_FOOTER_SIZE = 20;
+
+/**
+ * @brief Everything needed to decrypt a container besides the password.
+ */
+struct ContainerHeader {
+	uint8_t version = CONTAINER_VERSION;
+	BlockCipher bc = BlockCipher::AES;
+	CipherMode cm = CipherMode::GCM;
+	/**
+	 * @brief The KDF the key was derived with, its cost, and its salt, so another host can derive the same key from the password.
+	 */
+	KdfParams kdf;
+	uint8_t tagLen = 0;
+	uint16_t keyLen = 256;
+	uint32_t chunkSize = DEFAULT_CHUNK_SIZE;
+	/**
+	 * @brief The codec every chunk was compressed with.
+	 */
+	Compress::Codec codec = Compress::Codec::NONE;
+	/**
+	 * @brief The container's data key sealed under the password's key, or empty if the container's key is derived from its key salt instead.
+	 */
+	std::vector<unsigned char> wrappedKey;
+	/**
+	 * @brief The container's flags, which are CONTAINER_FLAG_ values.
+	 */
+	uint8_t flags = 0;
+	/**
+	 * @brief The random salt the container's key is derived from, or empty if it has a wrapped key.
+	 */
+	std::vector<unsigned char> keySalt;
+
+	/**
+	 * @brief Returns the size of this header when serialized.
+	 */
+	size_t size() const noexcept;
+};
+
+/**
+ * @brief The chunk index of a container, stored as parallel arrays so tags do not each need their own allocation.
+ */
+struct ChunkIndex {
+	std::vector<uint64_t> offsets;
+	std::vector<uint32_t> lengths;
+	/**
+	 * @brief Every chunk's tag back to back, tagLen bytes each.
+	 */
+	std::vector<unsigned char> tags;
+	size_t tagLen = 0;
+
+	/**
+	 * @brief Returns the number of chunks in this index.
+	 */
+	size_t count() const noexcept {
+		return offsets.size();
+	}
+
+	/**
+	 * @brief Returns a pointer to the i'th chunk's tag.
+	 */
+	unsigned char* tag(size_t i) {
+		return tags.data() + i * tagLen;
+	}
+};
+
+/**
+ * @brief The footer at the end of a container.
+ */
+struct ContainerFooter {
+	uint64_t indexOffset;
+	uint64_t count;
+};
+
+/**
+ * @brief Returns the size of a serialized chunk index plus the footer.
+ *
+ * @param count The number of chunks.
+ * @param tagLen The length of each tag.
+ */
+uint64_t indexSize(uint64_t count, size_t tagLen) noexcept;
+
+/**
+ * @brief Serializes a container header into a buffer, for callers that write the container themselves.
+ *
+ * @param header The header.
+ * @param out Where to write it. This must be header.size() bytes long.
+ *
+ * @return The offset in out of the container's key material, which is the wrapped key if there is one and the key salt otherwise, so callers can fill it in after serializing.
+ *
+ * @exception std::logic_error The header's version is not CONTAINER_VERSION, or its KDF salt, wrapped key, or key salt is too long.
+ */
+size_t serializeHeader(const ContainerHeader& header, unsigned char* out);
+
+/**
+ * @brief Writes a container header.
+ *
+ * @exception IOException I/O error.
+ * @exception std::logic_error The header cannot be serialized.
+ */
+void writeHeader(std::ostream& os, const ContainerHeader& header);
+
+/**
+ * @brief Reads a container header from the current position of a stream.
+ *
+ * @exception IntegrityException The stream does not start with a container header, its version is not CONTAINER_VERSION, or it does not have exactly one of a wrapped key and a key salt.
+ * @exception IOException I/O error.
+ */
+ContainerHeader readHeader(std::istream& is);
+
+/**
+ * @brief Serializes a chunk index followed by the footer into a buffer, for callers that write the container themselves.
+ *
+ * @param index The index to serialize.
+ * @param indexOffset The offset in the file of the index.
+ * @param out Where to write it. This must be indexSize(index.count(), index.tagLen) bytes long.
+ */
+void serializeIndex(const ChunkIndex& index, uint64_t indexOffset, unsigned char* out) noexcept;
+
+/**
+ * @brief Writes a chunk index followed by the footer.
+ *
+ * @param os The stream to write to. Its current position must be where the index starts.
+ * @param index The index to write.
+ * @param indexOffset The offset in the file of the index.
+ *
+ * @exception IOException I/O error.
+ */
+void writeIndex(std::ostream& os, const ChunkIndex& index, uint64_t indexOffset);
+
+/**
+ * @brief Reads the footer at the end of a container, and checks that the index it points to fills the space between the header and the footer exactly.
+ * This seeks the stream.
+ *
+ * @param is The stream to read from.
+ * @param header The container's header, which gives the size of the header and of each index entry.
+ *
+ * @exception IntegrityException The footer is missing, or its index offset or chunk count does not match the size of the container.
+ * @exception IOException I/O error.
+ */
+ContainerFooter readFooter(std::istream& is, const ContainerHeader& header);
+
+/**
+ * @brief Reads a contiguous run of index entries.
+ * This seeks the stream.
+ *
+ * @param is The stream to read from.
+ * @param header The container's header.
+ * @param footer The container's footer.
+ * @param first The first chunk whose entry should be read.
+ * @param n The number of entries to read.
+ *
+ * @exception IntegrityException The requested entries are out of range or malformed.
+ * @exception IOException I/O error.
+ */
+ChunkIndex readIndex(std::istream& is, const ContainerHeader& header, const ContainerFooter& footer, uint64_t first, uint64_t n);
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+/** @file crypto/engine.cpp
+ * @brief Cipher engines specialized at compile time for each block cipher and mode.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "engine.hpp"
+#include "../lnthrow.hpp"
+#include <cryptopp/aes.h>
+#include <cryptopp/blowfish.h>
+#include <cryptopp/camellia.h>
+#include <cryptopp/cast.h>
+#include <cryptopp/cpu.h>
+#include <stdexcept>
+#include <string>
+
+namespace CloudSync::Crypto {
+
+template <class Cipher>
+static std::unique_ptr<CipherEngine> makeEngine(CipherMode cm) {
+	switch (cm) {
+	case CipherMode::CCM:
+		return std::make_unique<SymmetricEngine<Cipher, CipherMode::CCM>>();
+	case CipherMode::CBC:
+		return std::make_unique<SymmetricEngine<Cipher, CipherMode::CBC>>();
+	case CipherMode::CFB:
+		return std::make_unique<SymmetricEngine<Cipher, CipherMode::CFB>>();
+	case CipherMode::CTR:
+		return std::make_unique<SymmetricEngine<Cipher, CipherMode::CTR>>();
+	case CipherMode::EAX:
+		return std::make_unique<SymmetricEngine<Cipher, CipherMode::EAX>>();
+	case CipherMode::GCM:
+		return std::make_unique<SymmetricEngine<Cipher, CipherMode::GCM>>();
+	case CipherMode::POLY1305:
+		lnthrow(std::logic_error, "Poly1305 can only be used with ChaCha20");
+	default:
+		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
+	}
+}
+
+bool hasAesAcceleration() noexcept {
+	static const bool accelerated = []() {
+#if defined(__x86_64__) || defined(__i386__)
+		return CryptoPP::HasAESNI() && CryptoPP::HasCLMUL();
+#elif defined(__aarch64__) || defined(__arm__)
+		return CryptoPP::HasAES() && CryptoPP::HasPMULL();
+#else
+		return false;
+#endif
+	}();
+	return accelerated;
+}
+
+std::pair<BlockCipher, CipherMode> autoSelectCipher() noexcept {
+	if (hasAesAcceleration()) {
+		return {BlockCipher::AES, CipherMode::GCM};
+	}
+	return {BlockCipher::CHACHA20, CipherMode::POLY1305};
+}
+
+std::unique_ptr<CipherEngine> makeEngine(BlockCipher bc, CipherMode cm) {
+	switch (bc) {
+	case BlockCipher::AES:
+		return makeEngine<CryptoPP::AES>(cm);
+	case BlockCipher::BLOWFISH:
+		return makeEngine<CryptoPP::Blowfish>(cm);
+	case BlockCipher::CAMELLIA:
+		return makeEngine<CryptoPP::Camellia>(cm);
+	case BlockCipher::CAST6:
+		return makeEngine<CryptoPP::CAST256>(cm);
+	case BlockCipher::CHACHA20:
+		if (cm != CipherMode::POLY1305) {
+			lnthrow(std::logic_error, std::string("ChaCha20 can only be used with Poly1305, not ") + cmToString(cm));
+		}
+		return std::make_unique<SymmetricEngine<ChaCha20, CipherMode::POLY1305>>();
+	default:
+		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
+	}
+}
+
+}
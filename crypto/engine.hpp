@@ -0,0 +1,285 @@
+/** @file crypto/engine.hpp
+ * @brief Cipher engines specialized at compile time for each block cipher and mode.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_CRYPTO_ENGINE_HPP
+#define __CS_CRYPTO_ENGINE_HPP
+
+#include "secbytes.hpp"
+#include "symmetric.hpp"
+#include "../attribute.hpp"
+#include <cryptopp/ccm.h>
+#include <cryptopp/chachapoly.h>
+#include <cryptopp/eax.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/modes.h>
+#include <cstddef>
+#include <memory>
+
+namespace CloudSync::Crypto {
+
+/**
+ * @brief Maps a CipherMode to its Crypto++ types.
+ */
+template <CipherMode Mode>
+struct ModeTraits;
+
+template <>
+struct ModeTraits<CipherMode::CCM> {
+	template <class Cipher> using Encryption = typename CryptoPP::CCM<Cipher>::Encryption;
+	template <class Cipher> using Decryption = typename CryptoPP::CCM<Cipher>::Decryption;
+	static constexpr bool authenticated = true;
+};
+
+template <>
+struct ModeTraits<CipherMode::CBC> {
+	template <class Cipher> using Encryption = typename CryptoPP::CBC_Mode<Cipher>::Encryption;
+	template <class Cipher> using Decryption = typename CryptoPP::CBC_Mode<Cipher>::Decryption;
+	static constexpr bool authenticated = false;
+};
+
+template <>
+struct ModeTraits<CipherMode::CFB> {
+	template <class Cipher> using Encryption = typename CryptoPP::CFB_Mode<Cipher>::Encryption;
+	template <class Cipher> using Decryption = typename CryptoPP::CFB_Mode<Cipher>::Decryption;
+	static constexpr bool authenticated = false;
+};
+
+template <>
+struct ModeTraits<CipherMode::CTR> {
+	template <class Cipher> using Encryption = typename CryptoPP::CTR_Mode<Cipher>::Encryption;
+	template <class Cipher> using Decryption = typename CryptoPP::CTR_Mode<Cipher>::Decryption;
+	static constexpr bool authenticated = false;
+};
+
+template <>
+struct ModeTraits<CipherMode::EAX> {
+	template <class Cipher> using Encryption = typename CryptoPP::EAX<Cipher>::Encryption;
+	template <class Cipher> using Decryption = typename CryptoPP::EAX<Cipher>::Decryption;
+	static constexpr bool authenticated = true;
+};
+
+template <>
+struct ModeTraits<CipherMode::GCM> {
+	template <class Cipher> using Encryption = typename CryptoPP::GCM<Cipher>::Encryption;
+	template <class Cipher> using Decryption = typename CryptoPP::GCM<Cipher>::Decryption;
+	static constexpr bool authenticated = true;
+};
+
+template <>
+struct ModeTraits<CipherMode::POLY1305> {
+	// ChaCha20-Poly1305 is a single construction, so the cipher parameter is ignored
+	template <class Cipher> using Encryption = CryptoPP::ChaCha20Poly1305::Encryption;
+	template <class Cipher> using Decryption = CryptoPP::ChaCha20Poly1305::Decryption;
+	static constexpr bool authenticated = true;
+};
+
+/**
+ * @brief Stands in for the cipher in SymmetricEngine<ChaCha20, CipherMode::POLY1305>.
+ * The block size is that of the ChaCha20 keystream.
+ */
+struct ChaCha20 {
+	static constexpr size_t BLOCKSIZE = 64;
+};
+
+/**
+ * @brief An encryption and decryption context for one block cipher and mode.
+ *
+ * Every operation works on a whole buffer or message, so callers pay for one virtual call per operation, and everything below it is dispatched statically by SymmetricEngine.
+ * An engine is keyed once with setKey(). Afterwards, each message only resynchronizes the IV, which skips the key schedule.
+ */
+class CipherEngine {
+public:
+	virtual ~CipherEngine() = default;
+
+	/**
+	 * @brief Keys both directions.
+	 *
+	 * @param key The key.
+	 * @param iv The IV to start both directions with.
+	 * @param ivLen The length of the IV.
+	 */
+	virtual void setKey(SecSpan key, const unsigned char* iv, size_t ivLen) = 0;
+
+	/**
+	 * @brief Restarts encryption with a new IV, keeping the key.
+	 */
+	virtual void restartEncryption(const unsigned char* iv, size_t ivLen) = 0;
+
+	/**
+	 * @brief Restarts decryption with a new IV, keeping the key.
+	 */
+	virtual void restartDecryption(const unsigned char* iv, size_t ivLen) = 0;
+
+	/**
+	 * @brief Encrypts the next part of the current message.
+	 * out may equal in.
+	 */
+	virtual void encrypt(unsigned char* out, const unsigned char* in, size_t len) = 0;
+
+	/**
+	 * @brief Decrypts the next part of the current message.
+	 * out may equal in.
+	 */
+	virtual void decrypt(unsigned char* out, const unsigned char* in, size_t len) = 0;
+
+	/**
+	 * @brief Finishes the current encrypted message and writes its tag.
+	 * This does nothing for unauthenticated modes.
+	 *
+	 * @param tag Where to write the tag. This must be tagSize() bytes long.
+	 */
+	virtual void encryptFinal(unsigned char* tag) = 0;
+
+	/**
+	 * @brief Finishes the current decrypted message and checks its tag.
+	 *
+	 * @return True if the tag matches or the mode is unauthenticated.
+	 */
+	virtual bool decryptVerify(const unsigned char* tag) = 0;
+
+	/**
+	 * @brief Encrypts a whole message under a new IV.
+	 *
+	 * @param iv The message's IV.
+	 * @param ivLen The length of the IV.
+	 * @param in The plaintext.
+	 * @param len The length of the plaintext.
+	 * @param out Where to write the ciphertext. This must be len bytes long, and may equal in.
+	 * @param tag Where to write the tag. This must be tagSize() bytes long.
+	 */
+	virtual void encryptMessage(const unsigned char* iv, size_t ivLen, const unsigned char* in, size_t len, unsigned char* out, unsigned char* tag) = 0;
+
+	/**
+	 * @brief Decrypts a whole message under a new IV and checks its tag.
+	 *
+	 * @return True if the tag matches or the mode is unauthenticated.
+	 */
+	virtual bool decryptMessage(const unsigned char* iv, size_t ivLen, const unsigned char* in, size_t len, unsigned char* out, const unsigned char* tag) = 0;
+
+	/**
+	 * @brief Returns the length of the tag, or 0 for unauthenticated modes.
+	 */
+	virtual size_t tagSize() const noexcept = 0;
+
+	/**
+	 * @brief Returns the block size of the cipher.
+	 */
+	virtual size_t blockSize() const noexcept = 0;
+
+	/**
+	 * @brief Returns the multiple of which every encrypt() and decrypt() call's length must be.
+	 * This is the block size for CBC, and 1 for every mode that can stop in the middle of a block.
+	 */
+	virtual size_t mandatoryBlockSize() const noexcept = 0;
+};
+
+/**
+ * @brief A CipherEngine for one Crypto++ block cipher and CipherMode.
+ *
+ * The Crypto++ objects are held by value, so the compiler knows their exact types and calls them directly instead of through their vtables.
+ * Code that knows Cipher and Mode at compile time can use this class directly, and nothing it calls is virtual.
+ *
+ * @tparam Cipher The Crypto++ block cipher, such as CryptoPP::AES.
+ * @tparam Mode The mode.
+ */
+template <class Cipher, CipherMode Mode>
+class SymmetricEngine final : public CipherEngine {
+public:
+	static constexpr bool authenticated = ModeTraits<Mode>::authenticated;
+
+	void setKey(SecSpan key, const unsigned char* iv, size_t ivLen) override {
+		enc.SetKeyWithIV(key.data(), key.size(), iv, ivLen);
+		dec.SetKeyWithIV(key.data(), key.size(), iv, ivLen);
+	}
+
+	void restartEncryption(const unsigned char* iv, size_t ivLen) override {
+		enc.Resynchronize(iv, ivLen);
+	}
+
+	void restartDecryption(const unsigned char* iv, size_t ivLen) override {
+		dec.Resynchronize(iv, ivLen);
+	}
+
+	CS_HOT void encrypt(unsigned char* out, const unsigned char* in, size_t len) override {
+		enc.ProcessData(out, in, len);
+	}
+
+	CS_HOT void decrypt(unsigned char* out, const unsigned char* in, size_t len) override {
+		dec.ProcessData(out, in, len);
+	}
+
+	void encryptFinal(unsigned char* tag) override {
+		if constexpr (authenticated) {
+			enc.TruncatedFinal(tag, enc.DigestSize());
+		}
+		else {
+			(void)tag;
+		}
+	}
+
+	bool decryptVerify(const unsigned char* tag) override {
+		if constexpr (authenticated) {
+			return dec.TruncatedVerify(tag, dec.DigestSize());
+		}
+		else {
+			(void)tag;
+			return true;
+		}
+	}
+
+	CS_HOT void encryptMessage(const unsigned char* iv, size_t ivLen, const unsigned char* in, size_t len, unsigned char* out, unsigned char* tag) override {
+		enc.Resynchronize(iv, ivLen);
+		if constexpr (Mode == CipherMode::CCM) {
+			enc.SpecifyDataLengths(0, len, 0);
+		}
+		enc.ProcessData(out, in, len);
+		encryptFinal(tag);
+	}
+
+	CS_HOT bool decryptMessage(const unsigned char* iv, size_t ivLen, const unsigned char* in, size_t len, unsigned char* out, const unsigned char* tag) override {
+		dec.Resynchronize(iv, ivLen);
+		if constexpr (Mode == CipherMode::CCM) {
+			dec.SpecifyDataLengths(0, len, 0);
+		}
+		dec.ProcessData(out, in, len);
+		return decryptVerify(tag);
+	}
+
+	size_t tagSize() const noexcept override {
+		if constexpr (authenticated) {
+			return enc.DigestSize();
+		}
+		else {
+			return 0;
+		}
+	}
+
+	size_t blockSize() const noexcept override {
+		return Cipher::BLOCKSIZE;
+	}
+
+	size_t mandatoryBlockSize() const noexcept override {
+		return enc.MandatoryBlockSize();
+	}
+
+private:
+	typename ModeTraits<Mode>::template Encryption<Cipher> enc;
+	typename ModeTraits<Mode>::template Decryption<Cipher> dec;
+};
+
+/**
+ * @brief Creates the SymmetricEngine for a block cipher and mode.
+ * This is the only place the choice is made at runtime. The engine is unkeyed.
+ *
+ * @exception std::logic_error ChaCha20 was paired with a mode other than POLY1305, or the other way around.
+ */
+std::unique_ptr<CipherEngine> makeEngine(BlockCipher bc, CipherMode cm);
+
+}
+
+#endif
@@ -0,0 +1,23 @@
+/** @file crypto/integrityexception.hpp
+ * @brief Thrown when ciphertext fails authentication.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_CRYPTO_INTEGRITYEXCEPTION_HPP
+#define __CS_CRYPTO_INTEGRITYEXCEPTION_HPP
+
+#include <stdexcept>
+
+namespace CloudSync::Crypto {
+
+class IntegrityException : public std::runtime_error {
+public:
+	IntegrityException(std::string msg) : std::runtime_error(msg) {}
+};
+
+}
+
+#endif
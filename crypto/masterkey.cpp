@@ -0,0 +1,111 @@
+/** @file crypto/masterkey.cpp
+ * @brief Derives per-file keys from one password-derived master key.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "masterkey.hpp"
+#include "../lnthrow.hpp"
+#include <cryptopp/hmac.h>
+#include <cryptopp/sha.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace CloudSync::Crypto {
+
+/**
+ * @brief The length of the master secret, which is the output length of SHA256 so HKDF-Expand can use it as its PRK directly.
+ */
+constexpr size_t MASTER_KEY_LEN = CryptoPP::SHA256::DIGESTSIZE;
+static_assert(MASTER_KEY_LEN == MasterKey::LENGTH, "MasterKey::LENGTH must match the HKDF-Expand PRK length");
+
+/**
+ * @brief Prefixed to every file ID in HKDF's info, so keys derived for another purpose from the same master key can never collide with file keys.
+ */
+constexpr const char FILE_KEY_LABEL[] = "CloudSync file key v1";
+
+struct MasterKey::MasterKeyImpl {
+	SecBytes prk;
+	KdfParams params;
+};
+
+MasterKey::MasterKey(SecSpan password, KDFType kt, HashType ht): MasterKey(password, KdfParams{kt, ht}) {}
+
+MasterKey::MasterKey(SecSpan password, const KdfParams& params): impl(std::make_unique<MasterKeyImpl>()) {
+	this->impl->prk.resize(MASTER_KEY_LEN);
+	DeriveKey(password, this->impl->prk.data(), MASTER_KEY_LEN, params);
+	this->impl->params = params;
+}
+
+MasterKey::MasterKey(): impl(std::make_unique<MasterKeyImpl>()) {}
+
+MasterKey MasterKey::fromBytes(SecSpan prk, const KdfParams& params) {
+	if (prk.size() != MASTER_KEY_LEN) {
+		lnthrow(std::logic_error, "A master key must be " + std::to_string(MASTER_KEY_LEN) + " bytes, not " + std::to_string(prk.size()));
+	}
+	MasterKey ret;
+	ret.impl->prk = SecBytes(prk.data(), prk.size());
+	ret.impl->params = params;
+	return ret;
+}
+
+MasterKey::MasterKey(MasterKey&& other) noexcept = default;
+
+MasterKey& MasterKey::operator=(MasterKey&& other) noexcept = default;
+
+MasterKey::~MasterKey() = default;
+
+FileKey MasterKey::fileKey(const unsigned char* fileId, size_t fileIdLen, size_t keyLen, size_t ivLen) const {
+	constexpr size_t hashLen = CryptoPP::SHA256::DIGESTSIZE;
+	const size_t outLen = keyLen + ivLen;
+	CryptoPP::HMAC<CryptoPP::SHA256> hmac(this->impl->prk.data(), this->impl->prk.size());
+	SecBytes t(hashLen);
+	FileKey ret;
+
+	if (outLen > 255 * hashLen) {
+		lnthrow(std::logic_error, "Cannot derive more than " + std::to_string(255 * hashLen) + " bytes of key material per file");
+	}
+	ret.key.resize(keyLen);
+	ret.iv.resize(ivLen);
+
+	// HKDF-Expand: T(i) = HMAC(PRK, T(i - 1) || info || i), where info = label || 0x00 || fileId
+	for (size_t i = 1, pos = 0; pos < outLen; ++i) {
+		const unsigned char sep = 0;
+		const unsigned char counter = i;
+
+		if (i > 1) {
+			hmac.Update(t.data(), hashLen);
+		}
+		hmac.Update(reinterpret_cast<const unsigned char*>(FILE_KEY_LABEL), sizeof(FILE_KEY_LABEL) - 1);
+		hmac.Update(&sep, 1);
+		hmac.Update(fileId, fileIdLen);
+		hmac.Update(&counter, 1);
+		hmac.Final(t.data());
+
+		// T(i) is split between the end of the key and the start of the IV
+		const size_t n = std::min(hashLen, outLen - pos);
+		for (size_t j = 0; j < n; ++j, ++pos) {
+			(pos < keyLen ? ret.key[pos] : ret.iv[pos - keyLen]) = t[j];
+		}
+	}
+
+	ret.kdf = this->impl->params;
+	return ret;
+}
+
+FileKey MasterKey::fileKey(const std::string& fileId, size_t keyLen, size_t ivLen) const {
+	return fileKey(reinterpret_cast<const unsigned char*>(fileId.data()), fileId.size(), keyLen, ivLen);
+}
+
+SecSpan MasterKey::bytes() const noexcept {
+	return SecSpan(this->impl->prk);
+}
+
+const KdfParams& MasterKey::params() const noexcept {
+	return this->impl->params;
+}
+
+}
@@ -0,0 +1,121 @@
+/** @file crypto/masterkey.hpp
+ * @brief Derives per-file keys from one password-derived master key.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_CRYPTO_MASTERKEY_HPP
+#define __CS_CRYPTO_MASTERKEY_HPP
+
+#include "password.hpp"
+#include "secbytes.hpp"
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace CloudSync::Crypto {
+
+/**
+ * @brief A key and IV for a single file, produced by MasterKey::fileKey().
+ */
+struct FileKey {
+	SecBytes key;
+	SecBytes iv;
+	/**
+	 * @brief The KDF the master key was derived with and its cost, which are recorded in containers encrypted with this key.
+	 */
+	KdfParams kdf;
+};
+
+/**
+ * @brief A key derived once from a password, from which any number of per-file keys can be derived cheaply.
+ *
+ * Running the password KDF for every file is slow, and sharing one key/IV pair between files reuses nonces, which is catastrophic for GCM.
+ * A MasterKey runs the KDF once. fileKey() then runs HKDF-Expand (RFC 5869) with HMAC-SHA256 over the file's ID, which costs a few hash compressions.
+ * Every file ID gets an unrelated key, so files never share a key and nonce even though each one's nonces start from the same place.
+ *
+ * The same file ID must be given to decrypt a file as was given to encrypt it. A path relative to the root of a backup works well.
+ */
+class MasterKey {
+public:
+	/**
+	 * @brief Derives a master key from a password.
+	 * This is the only expensive step.
+	 *
+	 * @param password The password. It is not copied.
+	 * @param kt The KDF to use. By default this is HKDF.
+	 * @param ht The hash function to use while deriving. By default this is SHA256.
+	 */
+	MasterKey(SecSpan password, KDFType kt = HKDF, HashType ht = SHA256);
+
+	/**
+	 * @brief Derives a master key from a password with a chosen KDF cost, such as one picked by CalibrateKdf().
+	 *
+	 * @exception std::logic_error The parameters are invalid.
+	 */
+	MasterKey(SecSpan password, const KdfParams& params);
+
+	/**
+	 * @brief Rebuilds a master key from the secret returned by bytes(), without running the KDF.
+	 * This is how keys cached by cloudsync-agent are handed back.
+	 *
+	 * @param prk The secret. It must be exactly MasterKey::LENGTH bytes.
+	 * @param params The KDF parameters the secret was derived with.
+	 *
+	 * @exception std::logic_error prk has the wrong length.
+	 */
+	static MasterKey fromBytes(SecSpan prk, const KdfParams& params);
+
+	/**
+	 * @brief The length of the secret returned by bytes().
+	 */
+	static constexpr size_t LENGTH = 32;
+
+	MasterKey(MasterKey&& other) noexcept;
+	MasterKey& operator=(MasterKey&& other) noexcept;
+	~MasterKey();
+
+	/**
+	 * @brief Derives the key and IV for a file.
+	 * This is thread-safe, and the key and IV are written straight into the returned FileKey, which holds them inline without allocating.
+	 *
+	 * @param fileId The file's ID.
+	 * @param fileIdLen The length of the ID.
+	 * @param keyLen The length of the key in bytes.
+	 * @param ivLen The length of the IV in bytes.
+	 *
+	 * @exception std::logic_error keyLen + ivLen is more than 8160 bytes, which is the most HKDF-SHA256 can produce.
+	 */
+	FileKey fileKey(const unsigned char* fileId, size_t fileIdLen, size_t keyLen = 32, size_t ivLen = 16) const;
+
+	/**
+	 * @brief Derives the key and IV for a file.
+	 *
+	 * @param fileId The file's ID.
+	 * @param keyLen The length of the key in bytes.
+	 * @param ivLen The length of the IV in bytes.
+	 */
+	FileKey fileKey(const std::string& fileId, size_t keyLen = 32, size_t ivLen = 16) const;
+
+	/**
+	 * @brief Returns the secret every file key is derived from. Anyone holding it can decrypt every file, so it should only ever be stored in SecBytes.
+	 */
+	SecSpan bytes() const noexcept;
+
+	/**
+	 * @brief Returns the KDF parameters this key was derived with.
+	 */
+	const KdfParams& params() const noexcept;
+
+private:
+	MasterKey();
+
+	struct MasterKeyImpl;
+	std::unique_ptr<MasterKeyImpl> impl;
+};
+
+}
+
+#endif
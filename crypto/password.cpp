@@ -7,101 +7,377 @@
  */
 
 #include "password.hpp"
+#include "../lnthrow.hpp"
 #include "../terminal.hpp"
+#include "../threadpool.hpp"
 // the following import does not work unless this one is present
 #include <cryptopp/algparam.h>
 #include <cryptopp/hkdf.h>
+#include <cryptopp/osrng.h>
 #include <cryptopp/pwdbased.h>
 #include <cryptopp/ripemd.h>
+#include <cryptopp/salsa.h>
 #include <cryptopp/scrypt.h>
 #include <cryptopp/sha.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 namespace CloudSync::Crypto {
 
-static std::unique_ptr<CryptoPP::KeyDerivationFunction> getKdf(KDFType kt, HashType ht) {
-	switch (kt) {
-	case HKDF:
-		switch (ht) {
+/**
+ * @brief Runs a KDF that lives on the stack, so deriving a key does not allocate one.
+ */
+template <class KDF>
+static void derive(SecSpan password, unsigned char* out, size_t outLen) {
+	KDF kdf;
+	kdf.DeriveKey(out, outLen, password.data(), password.size());
+}
+
+template <template <class> class KDF>
+static void deriveWithHash(HashType ht, SecSpan password, unsigned char* out, size_t outLen) {
+	switch (ht) {
+	case RIPEMD256:
+		return derive<KDF<CryptoPP::RIPEMD256>>(password, out, outLen);
+	case SHA1:
+		return derive<KDF<CryptoPP::SHA1>>(password, out, outLen);
+	case SHA256:
+		return derive<KDF<CryptoPP::SHA256>>(password, out, outLen);
+	case SHA512:
+		return derive<KDF<CryptoPP::SHA512>>(password, out, outLen);
+	default:
+		throw std::runtime_error("Switch statement fell through when all enum cases were covered.");
+	}
+}
+
+/**
+ * @brief Runs PBKDF2 with a chosen iteration count. Crypto++'s default is a single iteration.
+ */
+template <class Hash>
+static void derivePbkdf2(SecSpan password, const unsigned char* salt, size_t saltLen, unsigned char* out, size_t outLen, uint32_t iterations) {
+	CryptoPP::PKCS5_PBKDF2_HMAC<Hash> kdf;
+	kdf.DeriveKey(out, outLen, 0, password.data(), password.size(), salt, saltLen, iterations);
+}
+
+/**
+ * @brief The default scrypt block size, as recommended by RFC 7914.
+ */
+constexpr uint32_t SCRYPT_DEFAULT_R = 8;
+
+/**
+ * @brief scrypt's BlockMix with Salsa20/8 (RFC 7914 section 4), in place.
+ *
+ * @param b 2 * r 64-byte blocks, as 32 * r words.
+ * @param y Scratch space the same size as b.
+ */
+static void blockMix(uint32_t* b, uint32_t* y, size_t r) {
+	uint32_t x[16];
+
+	std::memcpy(x, b + (2 * r - 1) * 16, sizeof(x));
+	for (size_t i = 0; i < 2 * r; ++i) {
+		for (size_t j = 0; j < 16; ++j) {
+			x[j] ^= b[i * 16 + j];
+		}
+		CryptoPP::Salsa20_Core(x, 8);
+		// even blocks go to the first half of the output and odd blocks to the second
+		std::memcpy(y + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+	}
+	std::memcpy(b, y, 128 * r);
+}
+
+/**
+ * @brief scrypt's ROMix (RFC 7914 section 5) on one lane, in place.
+ *
+ * @param lane The lane's 128 * r bytes.
+ * @param v Scratch space of 128 * r * n bytes, which is the memory-hard part.
+ */
+static void roMix(unsigned char* lane, size_t r, uint32_t n, uint32_t* v) {
+	const size_t words = 32 * r;
+	// X holds the lane's state between rounds, so it is locked and wiped like v
+	SecBytes xy(2 * words * sizeof(uint32_t));
+	uint32_t* x = reinterpret_cast<uint32_t*>(xy.data());
+	uint32_t* y = x + words;
+
+	for (size_t i = 0; i < words; ++i) {
+		x[i] = static_cast<uint32_t>(lane[4 * i]) | static_cast<uint32_t>(lane[4 * i + 1]) << 8 | static_cast<uint32_t>(lane[4 * i + 2]) << 16 | static_cast<uint32_t>(lane[4 * i + 3]) << 24;
+	}
+	for (uint32_t i = 0; i < n; ++i) {
+		std::memcpy(v + i * words, x, words * sizeof(uint32_t));
+		blockMix(x, y, r);
+	}
+	for (uint32_t i = 0; i < n; ++i) {
+		// Integerify: the first word of the last block, mod n, which is a power of two
+		const uint32_t j = x[(2 * r - 1) * 16] & (n - 1);
+		for (size_t k = 0; k < words; ++k) {
+			x[k] ^= v[j * words + k];
+		}
+		blockMix(x, y, r);
+	}
+	for (size_t i = 0; i < words; ++i) {
+		for (size_t k = 0; k < 4; ++k) {
+			lane[4 * i + k] = x[i] >> (8 * k);
+		}
+	}
+}
+
+/**
+ * @brief Runs scrypt (RFC 7914) with its lanes spread over a thread pool.
+ * Crypto++'s Scrypt only runs lanes in parallel if it was built with OpenMP, which distribution packages usually are not.
+ */
+static void deriveScrypt(SecSpan password, const std::vector<unsigned char>& salt, unsigned char* out, size_t outLen, uint32_t n, uint32_t r, uint32_t p) {
+	const size_t laneLen = 128 * r;
+	const unsigned nThreads = std::min<unsigned>(p, std::max(1u, std::thread::hardware_concurrency()));
+	SecBytes b(laneLen * p);
+
+	derivePbkdf2<CryptoPP::SHA256>(password, salt.data(), salt.size(), b.data(), b.size(), 1);
+
+	std::vector<SecBytes> scratch(nThreads);
+	const auto lane = [&](size_t i, unsigned worker) {
+		if (scratch[worker].size() == 0) {
+			scratch[worker].resize(laneLen * n);
+		}
+		roMix(b.data() + i * laneLen, r, n, reinterpret_cast<uint32_t*>(scratch[worker].data()));
+	};
+	if (nThreads == 1) {
+		for (size_t i = 0; i < p; ++i) {
+			lane(i, 0);
+		}
+	}
+	else {
+		ThreadPool pool(nThreads);
+		pool.parallelFor(p, lane);
+	}
+
+	derivePbkdf2<CryptoPP::SHA256>(password, b.data(), b.size(), out, outLen, 1);
+}
+
+size_t KdfParams::memory() const noexcept {
+	if (kt != SCRYPT || cost == 0) {
+		return 0;
+	}
+	return static_cast<size_t>(128) * (blockSize ? blockSize : SCRYPT_DEFAULT_R) * cost * (parallelism ? parallelism : 1);
+}
+
+bool KdfParams::operator==(const KdfParams& other) const noexcept {
+	return kt == other.kt && ht == other.ht && cost == other.cost && blockSize == other.blockSize && parallelism == other.parallelism && salt == other.salt;
+}
+
+bool KdfParams::operator!=(const KdfParams& other) const noexcept {
+	return !(*this == other);
+}
+
+/**
+ * @brief Runs HKDF with a salt. Crypto++'s default is no salt, which RFC 5869 treats as a salt of zeros.
+ */
+template <class Hash>
+static void deriveHkdf(SecSpan password, const std::vector<unsigned char>& salt, unsigned char* out, size_t outLen) {
+	CryptoPP::HKDF<Hash> kdf;
+	kdf.DeriveKey(out, outLen, password.data(), password.size(), salt.data(), salt.size(), nullptr, 0);
+}
+
+void DeriveKey(SecSpan password, unsigned char* out, size_t outLen, const KdfParams& params) {
+	if (params.kt == HKDF && !params.salt.empty()) {
+		switch (params.ht) {
 		case RIPEMD256:
-			return std::make_unique<CryptoPP::HKDF<CryptoPP::RIPEMD256>>(CryptoPP::HKDF<CryptoPP::RIPEMD256>());
+			return deriveHkdf<CryptoPP::RIPEMD256>(password, params.salt, out, outLen);
 		case SHA1:
-			return std::make_unique<CryptoPP::HKDF<CryptoPP::SHA1>>(CryptoPP::HKDF<CryptoPP::SHA1>());
+			return deriveHkdf<CryptoPP::SHA1>(password, params.salt, out, outLen);
 		case SHA256:
-			return std::make_unique<CryptoPP::HKDF<CryptoPP::SHA256>>(CryptoPP::HKDF<CryptoPP::SHA256>());
+			return deriveHkdf<CryptoPP::SHA256>(password, params.salt, out, outLen);
 		case SHA512:
-			return std::make_unique<CryptoPP::HKDF<CryptoPP::SHA512>>(CryptoPP::HKDF<CryptoPP::SHA512>());
-		default:
-			throw std::runtime_error("Switch statement fell through when all enum cases were covered.");
+			return deriveHkdf<CryptoPP::SHA512>(password, params.salt, out, outLen);
+		}
+	}
+	if (params.cost == 0) {
+		if (!params.salt.empty() && params.kt != HKDF) {
+			lnthrow(std::logic_error, "A salt can only be used with PBKDF2 or scrypt if their cost is set");
 		}
+		return DeriveKey(password, out, outLen, params.kt, params.ht);
+	}
+
+	switch (params.kt) {
+	case HKDF:
+		return DeriveKey(password, out, outLen, params.kt, params.ht);
 	case PBKDF2:
-		switch (ht) {
+		switch (params.ht) {
 		case RIPEMD256:
-			return std::make_unique<CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::RIPEMD256>>(CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::RIPEMD256>());
+			return derivePbkdf2<CryptoPP::RIPEMD256>(password, params.salt.data(), params.salt.size(), out, outLen, params.cost);
 		case SHA1:
-			return std::make_unique<CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA1>>(CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA1>());
+			return derivePbkdf2<CryptoPP::SHA1>(password, params.salt.data(), params.salt.size(), out, outLen, params.cost);
 		case SHA256:
-			return std::make_unique<CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA256>>(CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA256>());
+			return derivePbkdf2<CryptoPP::SHA256>(password, params.salt.data(), params.salt.size(), out, outLen, params.cost);
 		case SHA512:
-			return std::make_unique<CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA512>>(CryptoPP::PKCS5_PBKDF2_HMAC<CryptoPP::SHA512>());
-		default:
-			throw std::runtime_error("Switch statement fell through when all enum cases were covered.");
+			return derivePbkdf2<CryptoPP::SHA512>(password, params.salt.data(), params.salt.size(), out, outLen, params.cost);
+		}
+		break;
+	case SCRYPT: {
+		const uint32_t r = params.blockSize ? params.blockSize : SCRYPT_DEFAULT_R;
+		const uint32_t p = params.parallelism ? params.parallelism : 1;
+		if (params.cost < 2 || (params.cost & (params.cost - 1)) != 0) {
+			lnthrow(std::logic_error, "The scrypt cost must be a power of two of at least 2, not " + std::to_string(params.cost));
+		}
+		if (static_cast<uint64_t>(r) * p >= (1u << 30) || static_cast<uint64_t>(128) * r * params.cost > SIZE_MAX / 2) {
+			lnthrow(std::logic_error, "The scrypt parameters are too large");
+		}
+		return deriveScrypt(password, params.salt, out, outLen, params.cost, r, p);
+	}
+	}
+	throw std::runtime_error("Switch statement fell through when all enum cases were covered.");
+}
+
+std::vector<unsigned char> NewSalt() {
+	std::vector<unsigned char> salt(KDF_SALT_LEN);
+	CryptoPP::OS_GenerateRandomBlock(false, salt.data(), salt.size());
+	return salt;
+}
+
+/**
+ * @brief Returns how long deriving a key with params takes.
+ */
+static std::chrono::steady_clock::duration timeKdf(const KdfParams& params) {
+	unsigned char out[32];
+	const auto start = std::chrono::steady_clock::now();
+	DeriveKey("CloudSync calibration", out, sizeof(out), params);
+	return std::chrono::steady_clock::now() - start;
+}
+
+KdfParams CalibrateKdf(KDFType kt, std::chrono::milliseconds targetTime, size_t maxMemory, HashType ht, uint16_t lanes) {
+	KdfParams params;
+	params.kt = kt;
+	params.ht = ht;
+	params.salt = NewSalt();
+
+	switch (kt) {
+	case HKDF:
+		lnthrow(std::logic_error, "HKDF is not a password hash, so it has no cost to calibrate");
+	case PBKDF2: {
+		if (targetTime.count() <= 0) {
+			lnthrow(std::logic_error, "PBKDF2 can only be calibrated to a time");
+		}
+		// double the trial until it is long enough to time accurately, then scale it to the target
+		params.cost = 1024;
+		std::chrono::steady_clock::duration elapsed = timeKdf(params);
+		while (elapsed < targetTime / 8 && params.cost < (1u << 30)) {
+			params.cost *= 2;
+			elapsed = timeKdf(params);
+		}
+		const double scale = std::chrono::duration<double>(targetTime) / std::chrono::duration<double>(elapsed);
+		params.cost = static_cast<uint32_t>(std::clamp(params.cost * scale, 1024.0, static_cast<double>(UINT32_MAX)));
+		return params;
+	}
+	case SCRYPT: {
+		if (targetTime.count() <= 0 && maxMemory == 0) {
+			lnthrow(std::logic_error, "scrypt needs a time or memory budget to calibrate to");
+		}
+		if (lanes == 0 || lanes > SCRYPT_MAX_LANES) {
+			lnthrow(std::logic_error, "scrypt needs between 1 and " + std::to_string(SCRYPT_MAX_LANES) + " lanes, not " + std::to_string(lanes));
 		}
+		params.blockSize = SCRYPT_DEFAULT_R;
+		params.parallelism = lanes;
+
+		// the largest N that fits the memory budget
+		uint32_t maxCost = 1u << 30;
+		if (maxMemory > 0) {
+			const size_t perUnit = static_cast<size_t>(128) * params.blockSize * params.parallelism;
+			while (maxCost >= 2 && static_cast<size_t>(maxCost) * perUnit > maxMemory) {
+				maxCost >>= 1;
+			}
+			if (maxCost < 2) {
+				lnthrow(std::logic_error, std::to_string(maxMemory) + " bytes is too little memory for scrypt with " + std::to_string(params.parallelism) + " lanes");
+			}
+		}
+		if (targetTime.count() <= 0) {
+			params.cost = maxCost;
+			return params;
+		}
+
+		// scrypt's time is linear in N, so N doubles until the next doubling would overshoot
+		params.cost = std::min<uint32_t>(1u << 10, maxCost);
+		while (params.cost < maxCost && 2 * timeKdf(params) <= targetTime) {
+			params.cost *= 2;
+		}
+		return params;
+	}
+	}
+	throw std::runtime_error("Switch statement fell through when all enum cases were covered.");
+}
+
+void DeriveKey(SecSpan password, unsigned char* out, size_t outLen, KDFType kt, HashType ht) {
+	switch (kt) {
+	case HKDF:
+		return deriveWithHash<CryptoPP::HKDF>(ht, password, out, outLen);
+	case PBKDF2:
+		return deriveWithHash<CryptoPP::PKCS5_PBKDF2_HMAC>(ht, password, out, outLen);
 	case SCRYPT:
-		return std::make_unique<CryptoPP::Scrypt>(CryptoPP::Scrypt());
+		return derive<CryptoPP::Scrypt>(password, out, outLen);
 	}
 	throw std::runtime_error("Switch statement fell through when all enum cases were covered.");
 }
 
-std::pair<SecBytes, SecBytes> DeriveKeypair(SecBytes password, size_t keyLen, size_t ivLen, KDFType kt, HashType ht) {
-	std::unique_ptr<CryptoPP::KeyDerivationFunction> kdf = getKdf(kt, ht);
-	SecBytes buf(keyLen + ivLen);
-	SecBytes key;
-	SecBytes iv;
+std::pair<SecBytes, SecBytes> DeriveKeypair(SecSpan password, size_t keyLen, size_t ivLen, KDFType kt, HashType ht) {
+	std::pair<SecBytes, SecBytes> ret(SecBytes(keyLen + ivLen), SecBytes(ivLen));
+
+	// the KDF writes key || iv into the key's storage, then the IV is moved out and wiped from the key
+	DeriveKey(password, ret.first.data(), keyLen + ivLen, kt, ht);
+	std::memcpy(ret.second.data(), ret.first.data() + keyLen, ivLen);
+	ret.first.resize(keyLen);
+	return ret;
+}
+
+std::pair<SecBytes, SecBytes> DeriveKeypair(SecSpan password, size_t keyLen, size_t ivLen, const KdfParams& params) {
+	std::pair<SecBytes, SecBytes> ret(SecBytes(keyLen + ivLen), SecBytes(ivLen));
 
-	kdf->DeriveKey(buf.data(), keyLen + ivLen, password.data(), password.size());
-	key = SecBytes(buf.data(), keyLen);
-	iv = SecBytes(buf.data() + keyLen, ivLen);
-	return std::make_pair(key, iv);
+	DeriveKey(password, ret.first.data(), keyLen + ivLen, params);
+	std::memcpy(ret.second.data(), ret.first.data() + keyLen, ivLen);
+	ret.first.resize(keyLen);
+	return ret;
 }
 
-std::optional<std::pair<SecBytes, SecBytes>> StdinKeypair(const char* prompt, const char* verify_prompt, size_t keyLen, size_t ivLen, KDFType kt, HashType ht) {
+/**
+ * @brief Reads a line from stdin with echo off, without the newline.
+ */
+static SecBytes readPassword(const char* prompt) {
 	constexpr size_t bufLen = 256;
 	SecBytes input;
 	SecBytes buf;
-	std::pair<SecBytes, SecBytes> ret;
 
 	Terminal::echo(false);
 	std::cout << prompt;
 	do {
 		buf.resize(bufLen);
-		fgets(reinterpret_cast<char*>(buf.data()), bufLen, stdin);
+		if (!fgets(reinterpret_cast<char*>(buf.data()), bufLen, stdin)) {
+			buf.resize(0);
+			break;
+		}
 		buf.resize(std::strlen(reinterpret_cast<char*>(buf.data())));
 		input += buf;
-	} while (buf.size() == bufLen - 1);
+	} while (buf.size() == bufLen - 1 && buf[bufLen - 2] != '\n');
 	Terminal::echo(true);
+	std::cout << std::endl;
 
-	ret = DeriveKeypair(input, keyLen, ivLen, kt, ht);
-	if (!verify_prompt) {
-		return ret;
+	if (input.size() > 0 && input[input.size() - 1] == '\n') {
+		input.resize(input.size() - 1);
 	}
-	input.resize(0);
+	return input;
+}
 
-	Terminal::echo(false);
-	std::cout << prompt;
-	do {
-		buf.resize(bufLen);
-		fgets(reinterpret_cast<char*>(buf.data()), bufLen, stdin);
-		buf.resize(std::strlen(reinterpret_cast<char*>(buf.data())));
-		input += buf;
-	} while (buf.size() == bufLen - 1);
-	Terminal::echo(true);
+std::optional<SecBytes> StdinPassword(const char* prompt, const char* verify_prompt) {
+	SecBytes password = readPassword(prompt);
+	if (verify_prompt && readPassword(verify_prompt) != password) {
+		return std::nullopt;
+	}
+	return password;
+}
 
-	std::pair<SecBytes, SecBytes> tmp = DeriveKeypair(input, keyLen, ivLen, kt, ht);
-	if (ret.first != tmp.first || ret.second != tmp.second) {
+std::optional<std::pair<SecBytes, SecBytes>> StdinKeypair(const char* prompt, const char* verify_prompt, size_t keyLen, size_t ivLen, KDFType kt, HashType ht) {
+	std::optional<SecBytes> password = StdinPassword(prompt, verify_prompt);
+	if (!password) {
 		return std::nullopt;
 	}
-	return ret;
+	return DeriveKeypair(*password, keyLen, ivLen, kt, ht);
 }
 
 }
@@ -11,9 +11,12 @@
 
 #include "../attribute.hpp"
 #include "secbytes.hpp"
+#include <chrono>
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <utility>
+#include <vector>
 
 namespace CloudSync::Crypto {
 
@@ -37,9 +40,112 @@ enum HashType {
 };
 
 /**
- * @brief Derives a key/iv pair from a password.
+ * @brief The length of the salt CalibrateKdf() and NewSalt() generate.
+ */
+constexpr size_t KDF_SALT_LEN = 16;
+
+/**
+ * @brief A KDF, its cost parameters, and its salt, which are recorded in containers so any host can derive the same key.
+ * A cost of 0 means Crypto++'s defaults, which is what every key was derived with before the cost could be chosen.
+ */
+struct KdfParams {
+	KDFType kt = HKDF;
+	/**
+	 * @brief The hash function. scrypt always uses SHA256.
+	 */
+	HashType ht = SHA256;
+	/**
+	 * @brief PBKDF2's iteration count, or scrypt's N, which must be a power of two. HKDF has no cost and ignores this.
+	 */
+	uint32_t cost = 0;
+	/**
+	 * @brief scrypt's r, which sets the size of each memory block to 128 * r bytes. 0 means 8.
+	 */
+	uint16_t blockSize = 0;
+	/**
+	 * @brief scrypt's p, the number of independent lanes. Lanes are run on separate threads, so on a machine with p cores this costs no more time than 1 lane. 0 means 1.
+	 */
+	uint16_t parallelism = 0;
+	/**
+	 * @brief The salt, so two users with the same password do not get the same key and one precomputed table cannot attack every key.
+	 * Empty means no salt, which is how every key was derived before salts were recorded. PBKDF2 and scrypt need a cost to use a salt.
+	 */
+	std::vector<unsigned char> salt = {};
+
+	/**
+	 * @brief Returns how many bytes deriving a key with these parameters needs, which is 128 * r * N per lane for scrypt and negligible otherwise.
+	 */
+	size_t memory() const noexcept;
+
+	bool operator==(const KdfParams& other) const noexcept;
+	bool operator!=(const KdfParams& other) const noexcept;
+};
+
+/**
+ * @brief Derives key material from a password straight into a buffer, with a KDF's cost chosen by the caller.
+ *
+ * @param password The password to derive from.
+ * @param out Where to write the key material.
+ * @param outLen The number of bytes to derive.
+ * @param params The KDF and its cost.
+ *
+ * @exception std::logic_error The parameters are invalid, such as an scrypt cost that is not a power of two, or a salt with PBKDF2 or scrypt's default cost.
+ */
+void DeriveKey(SecSpan password, unsigned char* out, size_t outLen, const KdfParams& params);
+
+/**
+ * @brief Returns KDF_SALT_LEN random bytes for KdfParams::salt.
+ * Every new key should get a salt of its own, such as when a password is changed.
+ */
+std::vector<unsigned char> NewSalt();
+
+/**
+ * @brief The number of scrypt lanes CalibrateKdf() uses by default.
+ * This is low enough that any host a backup is restored on runs them in about the calibrated time, and high enough that a quad-core machine spends all its cores on them.
+ */
+constexpr uint16_t SCRYPT_DEFAULT_LANES = 4;
+
+/**
+ * @brief The most scrypt lanes CalibrateKdf() accepts.
+ */
+constexpr uint16_t SCRYPT_MAX_LANES = 16;
+
+/**
+ * @brief Times a KDF on this machine and returns parameters that take about targetTime to derive a key.
+ *
+ * For scrypt, r is 8, p is the lanes argument, and N is the largest power of two that fits both budgets with p lanes running on this machine.
+ * p is fixed rather than taken from this machine's core count, because every host that derives the key has to run all p lanes: a p picked on a 64-core server would take 32 times the target time on a laptop with 2 cores.
+ * For PBKDF2, the iteration count is scaled from a short trial run.
+ * The returned parameters have a fresh salt from NewSalt().
+ * Calibration takes around twice targetTime.
+ *
+ * @param kt The KDF. This must be PBKDF2 or SCRYPT, since HKDF is not meant for passwords and has no cost to tune.
+ * @param targetTime How long deriving a key should take, or 0 to only use maxMemory.
+ * @param maxMemory The most memory scrypt may use in bytes, or 0 for no limit. This is ignored for PBKDF2.
+ * @param ht The hash function for PBKDF2.
+ * @param lanes scrypt's p. This is ignored for PBKDF2.
+ *
+ * @exception std::logic_error kt is HKDF, both budgets are 0, lanes is 0 or more than SCRYPT_MAX_LANES, or maxMemory is too small for scrypt to run at all.
+ */
+KdfParams CalibrateKdf(KDFType kt, std::chrono::milliseconds targetTime, size_t maxMemory = 0, HashType ht = SHA256, uint16_t lanes = SCRYPT_DEFAULT_LANES);
+
+/**
+ * @brief Derives key material from a password straight into a buffer.
+ * Nothing is allocated on the heap besides what the KDF itself needs.
  *
  * @param password The password to derive from.
+ * @param out Where to write the key material.
+ * @param outLen The number of bytes to derive.
+ * @param kt The Key Derivation Function to use. By default this is HKDF.
+ * @param ht The hash function to use while deriving. By default this is SHA256.
+ */
+void DeriveKey(SecSpan password, unsigned char* out, size_t outLen, KDFType kt = HKDF, HashType ht = SHA256);
+
+/**
+ * @brief Derives a key/iv pair from a password.
+ * The key is derived in place in the returned SecBytes, and the pair should be moved rather than copied into wherever it is kept.
+ *
+ * @param password The password to derive from. It is not copied.
  * @param keyLen The length of the key that should be returned.
  * @param ivLen The length of the IV that should be returned.
  * @param kt The Key Derivation Function to use. By default this is HKDF.
@@ -47,10 +153,28 @@ enum HashType {
  *
  * @return A pair containing the Key (first) and IV (second).
  */
-std::pair<SecBytes, SecBytes> CS_PURE DeriveKeypair(SecBytes password, size_t keyLen, size_t ivLen, KDFType kt = HKDF, HashType ht = SHA256);
+std::pair<SecBytes, SecBytes> CS_PURE DeriveKeypair(SecSpan password, size_t keyLen, size_t ivLen, KDFType kt = HKDF, HashType ht = SHA256);
+
+/**
+ * @brief Derives a key/iv pair from a password with a KDF's cost chosen by the caller, such as by CalibrateKdf().
+ *
+ * @exception std::logic_error The parameters are invalid.
+ */
+std::pair<SecBytes, SecBytes> DeriveKeypair(SecSpan password, size_t keyLen, size_t ivLen, const KdfParams& params);
+
+/**
+ * @brief Asks the user for a password without echoing it.
+ *
+ * @param prompt The prompt to display to the user.
+ * @param verify_prompt The prompt that asks for the password again. This can be nullptr if verification is not necessary.
+ *
+ * @return The password, or std::nullopt if the second password does not match the first.
+ */
+std::optional<SecBytes> StdinPassword(const char* prompt, const char* verify_prompt);
 
 /**
  * @brief Asks the user for a password and derives a key/iv pair from it.
+ * The passwords are compared before anything is derived, so the KDF only runs once.
  *
  * @param prompt The prompt to display to the user.
  * @param verify_prompt The prompt that verifies the password. This can be nullptr if verification is not necessary.
@@ -7,57 +7,288 @@
  */
 
 #include "secbytes.hpp"
-#include <cryptopp/secblock.h>
+#include "../logger.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <unistd.h>
 
-struct SecBytes::SecBytesImpl {
-	CryptoPP::SecByteBlock s;
+namespace CloudSync::Crypto {
+
+namespace {
+
+/**
+ * @brief Zeroes memory in a way the compiler cannot optimize out, even if the memory is about to be freed.
+ */
+void wipe(void* ptr, size_t len) noexcept {
+	std::memset(ptr, 0, len);
+	__asm__ __volatile__("" : : "r"(ptr) : "memory");
+}
+
+/**
+ * @brief The smallest pooled block, which fits a 256-bit key.
+ */
+constexpr size_t MIN_BLOCK = 32;
+
+/**
+ * @brief The largest pooled block. Larger secrets get their own locked mapping, which is unmapped when they are released.
+ */
+constexpr size_t MAX_BLOCK = 64 << 10;
+
+/**
+ * @brief The number of size classes, which are the powers of two from MIN_BLOCK to MAX_BLOCK.
+ */
+constexpr size_t N_CLASSES = 12;
+
+/**
+ * @brief The least memory mapped at once to refill a size class.
+ */
+constexpr size_t MIN_SLAB = 64 << 10;
+
+/**
+ * @brief A process-wide pool of locked memory for every secret.
+ *
+ * Blocks come in power-of-two size classes. Each class has a free list, which is refilled by mapping a slab of locked pages and splitting it into blocks.
+ * Released blocks are wiped and kept on their free list, so the pool only grows to the largest number of secrets alive at once and never returns memory to the OS.
+ */
+class SecureArena {
+public:
+	/**
+	 * @brief Returns the pool.
+	 * It is never destroyed, since SecBytes with static storage duration may be released after it would have been.
+	 */
+	static SecureArena& instance() {
+		static SecureArena* arena = new SecureArena();
+		return *arena;
+	}
+
+	/**
+	 * @brief Takes a block of at least len bytes from the pool.
+	 *
+	 * @param len The number of bytes needed. This must not be 0.
+	 * @param cap Set to the size of the block.
+	 *
+	 * @exception std::bad_alloc Out of memory.
+	 */
+	unsigned char* allocate(size_t len, size_t& cap) {
+		if (len > MAX_BLOCK) {
+			cap = (len + pageSize - 1) / pageSize * pageSize;
+			return mapLocked(cap);
+		}
+
+		const size_t cls = classOf(len);
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (!freeLists[cls]) {
+			refill(cls);
+		}
+		FreeBlock* block = freeLists[cls];
+		freeLists[cls] = block->next;
+		block->next = nullptr;
+
+		cap = MIN_BLOCK << cls;
+		return reinterpret_cast<unsigned char*>(block);
+	}
+
+	/**
+	 * @brief Wipes a block and returns it to the pool.
+	 *
+	 * @param ptr The block.
+	 * @param cap The size of the block, as returned by allocate().
+	 */
+	void release(unsigned char* ptr, size_t cap) noexcept {
+		wipe(ptr, cap);
+		if (cap > MAX_BLOCK) {
+			munlock(ptr, cap);
+			munmap(ptr, cap);
+			return;
+		}
+
+		const size_t cls = classOf(cap);
+		FreeBlock* block = reinterpret_cast<FreeBlock*>(ptr);
+		std::lock_guard<std::mutex> lock(mutex);
+		block->next = freeLists[cls];
+		freeLists[cls] = block;
+	}
+
+private:
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+	SecureArena(): pageSize(sysconf(_SC_PAGESIZE)) {}
+
+	static size_t classOf(size_t len) noexcept {
+		size_t cls = 0;
+		while ((MIN_BLOCK << cls) < len) {
+			++cls;
+		}
+		return cls;
+	}
+
+	/**
+	 * @brief Maps a slab of locked memory and splits it into blocks for a size class.
+	 */
+	void refill(size_t cls) {
+		const size_t blockLen = MIN_BLOCK << cls;
+		const size_t slabLen = std::max(MIN_SLAB, 4 * blockLen);
+		unsigned char* slab = mapLocked(slabLen);
+
+		for (size_t off = slabLen; off > 0; off -= blockLen) {
+			FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + off - blockLen);
+			block->next = freeLists[cls];
+			freeLists[cls] = block;
+		}
+	}
+
+	/**
+	 * @brief Maps zeroed memory that is locked into RAM and left out of core dumps.
+	 * If the memory cannot be locked, usually because RLIMIT_MEMLOCK is too low, it is used anyway and a warning is logged once.
+	 */
+	unsigned char* mapLocked(size_t len) {
+		void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+#ifdef MADV_DONTDUMP
+		madvise(ptr, len, MADV_DONTDUMP);
+#endif
+		if (mlock(ptr, len) != 0) {
+			std::call_once(warnOnce, [](int err) {
+				LOG(LEVEL_WARNING) << "Failed to lock secure memory (" << std::strerror(err) << "). Secrets may be swapped to disk. Raise RLIMIT_MEMLOCK (ulimit -l) to fix this.";
+			}, errno);
+		}
+		return reinterpret_cast<unsigned char*>(ptr);
+	}
+
+	const size_t pageSize;
+	std::mutex mutex;
+	FreeBlock* freeLists[N_CLASSES] = {};
+	std::once_flag warnOnce;
 };
 
-SecBytes::SecBytes(): impl(std::make_unique<SecBytesImpl>()) {}
+/**
+ * @brief What an empty SecBytes points to, so data() is never nullptr. Nothing is ever written to it.
+ */
+alignas(16) unsigned char emptyBlock[16];
 
-SecBytes::SecBytes(size_t capacity): impl(std::make_unique<SecBytesImpl>()) {
-	this->impl->s.resize(capacity);
+/**
+ * @brief Returns a block for len bytes, which is emptyBlock with a capacity of 0 if len is 0.
+ */
+unsigned char* acquire(size_t len, size_t& cap) {
+	if (len == 0) {
+		cap = 0;
+		return emptyBlock;
+	}
+	return SecureArena::instance().allocate(len, cap);
 }
 
-SecBytes::SecBytes(const void* data, size_t data_len): impl(std::make_unique<SecBytesImpl>()) {
-	std::memcpy(&(this->impl->s[0]), data, data_len);
 }
 
-SecBytes::SecBytes(const char* str): impl(std::make_unique<SecBytesImpl>()) {
-	std::memcpy(&(this->impl->s[0]), str, std::strlen(str));
 }
 
-SecBytes::SecBytes(SecBytes&& other) {
-	this->impl = std::move(other.impl);
+using CloudSync::Crypto::SecureArena;
+using CloudSync::Crypto::acquire;
+using CloudSync::Crypto::emptyBlock;
+using CloudSync::Crypto::wipe;
+
+SecBytes::SecBytes(): ptr(emptyBlock), len(0), cap(0) {}
+
+SecBytes::SecBytes(size_t capacity): len(capacity) {
+	this->ptr = acquire(capacity, this->cap);
 }
 
-SecBytes::SecBytes(const SecBytes& other): impl(std::make_unique<SecBytesImpl>()) {
-	this->impl->s = other.impl->s;
+SecBytes::SecBytes(const void* data, size_t data_len): SecBytes(data_len) {
+	if (data_len > 0) {
+		std::memcpy(this->ptr, data, data_len);
+	}
 }
 
-SecBytes::~SecBytes() = default;
+SecBytes::SecBytes(const char* str): SecBytes(str, std::strlen(str)) {}
+
+SecBytes::SecBytes(SecBytes&& other) noexcept: ptr(emptyBlock), len(0), cap(0) {
+	*this = std::move(other);
+}
+
+SecBytes::SecBytes(const SecBytes& other): SecBytes(other.ptr, other.len) {}
+
+SecBytes::~SecBytes() {
+	this->clear();
+}
+
+void SecBytes::clear() noexcept {
+	if (this->cap != 0) {
+		SecureArena::instance().release(this->ptr, this->cap);
+	}
+	this->ptr = emptyBlock;
+	this->len = 0;
+	this->cap = 0;
+}
 
 unsigned char* SecBytes::data() const {
-	return &(this->impl->s[0]);
+	return this->ptr;
 }
 
 size_t SecBytes::size() const {
-	return this->impl->s.size();
+	return this->len;
+}
+
+size_t SecBytes::capacity() const {
+	return this->cap;
 }
 
 void SecBytes::resize(size_t capacity) {
-	this->impl->s.resize(capacity);
+	if (capacity <= this->cap) {
+		if (capacity < this->len) {
+			wipe(this->ptr + capacity, this->len - capacity);
+		}
+		this->len = capacity;
+		return;
+	}
+
+	size_t newCap;
+	unsigned char* newPtr = acquire(capacity, newCap);
+	std::memcpy(newPtr, this->ptr, this->len);
+	this->clear();
+	this->ptr = newPtr;
+	this->cap = newCap;
+	this->len = capacity;
 }
 
-SecBytes& SecBytes::operator=(SecBytes&& other) {
-	this->impl = std::move(other.impl);
+SecBytes& SecBytes::operator=(SecBytes&& other) noexcept {
+	if (this == &other) {
+		return *this;
+	}
+
+	this->clear();
+	this->ptr = other.ptr;
+	this->len = other.len;
+	this->cap = other.cap;
+	other.ptr = emptyBlock;
+	other.len = 0;
+	other.cap = 0;
 	return *this;
 }
 
 SecBytes& SecBytes::operator=(const SecBytes& other) {
-	this->impl->s = other.impl->s;
+	if (this == &other) {
+		return *this;
+	}
+
+	if (other.len > this->cap) {
+		this->clear();
+		this->ptr = acquire(other.len, this->cap);
+	}
+	else if (this->len > other.len) {
+		wipe(this->ptr + other.len, this->len - other.len);
+	}
+	std::memcpy(this->ptr, other.ptr, other.len);
+	this->len = other.len;
 	return *this;
 }
 
@@ -65,24 +296,47 @@ unsigned char& SecBytes::operator[](size_t index) const {
 	if (index >= this->size()) {
 		throw std::out_of_range(std::string("Size = ") + std::to_string(this->size()) + ". Index = " + std::to_string(index) + ".");
 	}
-	return this->impl->s[index];
+	return this->ptr[index];
 }
 
 SecBytes SecBytes::operator+(const SecBytes& other) const {
-	SecBytes ret(*this);
-	ret += other;
+	SecBytes ret(this->len + other.len);
+	std::memcpy(ret.ptr, this->ptr, this->len);
+	std::memcpy(ret.ptr + this->len, other.ptr, other.len);
 	return ret;
 }
 
 SecBytes& SecBytes::operator+=(const SecBytes& other) {
-	this->impl->s += other.impl->s;
+	const size_t oldLen = this->len;
+	const size_t otherLen = other.len;
+
+	// other may be this, so other.ptr is only read after the resize
+	this->resize(oldLen + otherLen);
+	std::memcpy(this->ptr + oldLen, other.ptr, otherLen);
 	return *this;
 }
 
 bool SecBytes::operator==(const SecBytes& other) const {
-	return this->impl->s == other.impl->s;
+	unsigned char diff = 0;
+
+	if (this->len != other.len) {
+		return false;
+	}
+	for (size_t i = 0; i < this->len; ++i) {
+		diff |= this->ptr[i] ^ other.ptr[i];
+	}
+	return diff == 0;
 }
 
 bool SecBytes::operator!=(const SecBytes& other) const {
-	return this->impl->s != other.impl->s;
+	return !(*this == other);
+}
+
+SecSpan::SecSpan(const char* str) noexcept: ptr(reinterpret_cast<const unsigned char*>(str)), len(std::strlen(str)) {}
+
+SecSpan SecSpan::subspan(size_t offset, size_t count) const {
+	if (offset > this->len || count > this->len - offset) {
+		throw std::out_of_range(std::string("Size = ") + std::to_string(this->len) + ". Range = [" + std::to_string(offset) + ", " + std::to_string(offset + count) + ").");
+	}
+	return SecSpan(this->ptr + offset, count);
 }
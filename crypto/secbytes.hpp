@@ -10,11 +10,14 @@
 #define __CS_CRYPTO_SECBYTES_HPP
 
 #include <cstddef>
-#include <memory>
 
 /**
  * @brief A secure byte container class.
  * When this class is destructed, its contents are wiped.
+ *
+ * Every secret, down to a single key or IV, is taken from a process-wide pool of pages that are locked with mlock() so they are never swapped, and excluded from core dumps.
+ * Secrets are never stored inside the object itself, which would put them on the stack or wherever else the object lives, where they could not be locked.
+ * Blocks are wiped before they go back to the pool, and the pool keeps them for reuse, so steady-state key handling does not call malloc() or mmap() at all, and moving a SecBytes only hands its block over.
  */
 class SecBytes {
 public:
@@ -47,8 +50,9 @@ public:
 
 	/**
 	 * @brief Move constructor.
+	 * The block changes owner without being copied, and other is left empty.
 	 */
-	SecBytes(SecBytes&& other);
+	SecBytes(SecBytes&& other) noexcept;
 
 	/**
 	 * @brief Copy constructor.
@@ -56,12 +60,13 @@ public:
 	SecBytes(const SecBytes& other);
 
 	/**
-	 * @brief Destructor. Needed so the unique_ptr can work with an incomplete type.
+	 * @brief Destructor. Wipes the contents and returns any pooled block to the pool.
 	 */
 	~SecBytes();
 
 	/**
-	 * @brief Returns a pointer to the first element of this SecBytes, or nullptr if it's empty.
+	 * @brief Returns a pointer to the first element of this SecBytes.
+	 * This is never nullptr, even if the SecBytes is empty.
 	 */
 	unsigned char* data() const;
 
@@ -70,16 +75,21 @@ public:
 	 */
 	size_t size() const;
 
+	/**
+	 * @brief Returns the number of bytes this SecBytes can hold without moving to a larger block.
+	 */
+	size_t capacity() const;
+
 	/**
 	 * @brief Resizes the SecBytes block.
-	 * Any new data allocated is not initialized.
+	 * Existing contents are kept, and any new data allocated is not initialized. Bytes cut off by shrinking are wiped.
 	 */
 	void resize(size_t capacity);
 
 	/**
 	 * @brief Move assignment operator.
 	 */
-	SecBytes& operator=(SecBytes&& other);
+	SecBytes& operator=(SecBytes&& other) noexcept;
 
 	/**
 	 * @brief Copy assignment operator.
@@ -106,6 +116,7 @@ public:
 
 	/**
 	 * @brief Returns true if two SecBytes classes have the same contents, false if not.
+	 * This takes the same time wherever the contents differ.
 	 */
 	bool operator==(const SecBytes& other) const;
 
@@ -115,8 +126,69 @@ public:
 	bool operator!=(const SecBytes& other) const;
 
 private:
-	struct SecBytesImpl;
-	std::unique_ptr<SecBytesImpl> impl;
+	/**
+	 * @brief Wipes the contents and returns the block to the pool, leaving this empty.
+	 */
+	void clear() noexcept;
+
+	/**
+	 * @brief Points to a block from the pool, or to a shared empty block if cap is 0.
+	 */
+	unsigned char* ptr;
+	size_t len;
+	size_t cap;
+};
+
+/**
+ * @brief A non-owning view of secret bytes, such as a SecBytes, a password string, or part of a larger buffer.
+ * Passing one copies nothing, so it must not outlive the bytes it points to.
+ */
+class SecSpan {
+public:
+	/**
+	 * @brief Constructs an empty SecSpan.
+	 */
+	constexpr SecSpan() noexcept: ptr(nullptr), len(0) {}
+
+	/**
+	 * @brief Constructs a SecSpan over len bytes starting at data.
+	 */
+	constexpr SecSpan(const unsigned char* data, size_t len) noexcept: ptr(data), len(len) {}
+
+	/**
+	 * @brief Constructs a SecSpan over the contents of a SecBytes.
+	 */
+	SecSpan(const SecBytes& bytes) noexcept: ptr(bytes.data()), len(bytes.size()) {}
+
+	/**
+	 * @brief Constructs a SecSpan over a string, not including its null terminator.
+	 */
+	SecSpan(const char* str) noexcept;
+
+	/**
+	 * @brief Returns a pointer to the first byte.
+	 */
+	constexpr const unsigned char* data() const noexcept {
+		return ptr;
+	}
+
+	/**
+	 * @brief Returns the number of bytes in view.
+	 */
+	constexpr size_t size() const noexcept {
+		return len;
+	}
+
+	/**
+	 * @brief Returns a view of count bytes starting at offset.
+	 *
+	 * @exception std::out_of_range The range goes past the end of this view.
+	 */
+	SecSpan subspan(size_t offset, size_t count) const;
+
+private:
+	const unsigned char* ptr;
+	size_t len;
 };
 
 #endif
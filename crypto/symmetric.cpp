@@ -7,22 +7,37 @@
  */
 
 #include "symmetric.hpp"
+#include "../fs/chunkpipeline.hpp"
 #include "../fs/file.hpp"
+#include "../fs/io.hpp"
+#include "../fs/mappedfile.hpp"
 #include "../fs/ioexception.hpp"
 #include "../lnthrow.hpp"
+#include "../threadpool.hpp"
+#include "container.hpp"
+#include "engine.hpp"
+#include "integrityexception.hpp"
+#include "masterkey.hpp"
 #include "password.hpp"
 #include <cryptopp/aes.h>
 #include <cryptopp/blowfish.h>
 #include <cryptopp/camellia.h>
 #include <cryptopp/cast.h>
-#include <cryptopp/ccm.h>
-#include <cryptopp/eax.h>
-#include <cryptopp/gcm.h>
-#include <cryptopp/cryptlib.h>
-#include <cryptopp/modes.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/osrng.h>
+#include <cryptopp/sha.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <memory>
-#include <variant>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
 namespace CloudSync::Crypto {
 
@@ -36,6 +51,10 @@ const char* bcToString(BlockCipher bc) {
 		return "Camellia";
 	case BlockCipher::CAST6:
 		return "CAST6";
+	case BlockCipher::CHACHA20:
+		return "ChaCha20";
+	case BlockCipher::AUTO:
+		return "Auto";
 	default:
 		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug."); // shut up gcc
 	}
@@ -55,156 +74,10 @@ const char* cmToString(CipherMode cm) {
 		return "EAX";
 	case CipherMode::GCM:
 		return "GCM";
-	default:
-		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-	}
-}
-
-std::variant<std::unique_ptr<CryptoPP::CipherModeBase>, std::unique_ptr<CryptoPP::AuthenticatedSymmetricCipherBase>> getEncCipher(enum BlockCipher bc, enum CipherMode cm) {
-	switch (bc) {
-	case BlockCipher::AES:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::AES>::Encryption>(CryptoPP::CCM<CryptoPP::AES>::Encryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption>(CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption>(CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption>(CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::AES>::Encryption>(CryptoPP::EAX<CryptoPP::AES>::Encryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::AES>::Encryption>(CryptoPP::GCM<CryptoPP::AES>::Encryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	case BlockCipher::BLOWFISH:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::Blowfish>::Encryption>(CryptoPP::CCM<CryptoPP::Blowfish>::Encryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::Blowfish>::Encryption>(CryptoPP::CBC_Mode<CryptoPP::Blowfish>::Encryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::Blowfish>::Encryption>(CryptoPP::CFB_Mode<CryptoPP::Blowfish>::Encryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::Blowfish>::Encryption>(CryptoPP::CTR_Mode<CryptoPP::Blowfish>::Encryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::Blowfish>::Encryption>(CryptoPP::EAX<CryptoPP::Blowfish>::Encryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::Blowfish>::Encryption>(CryptoPP::GCM<CryptoPP::Blowfish>::Encryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	case BlockCipher::CAMELLIA:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::Camellia>::Encryption>(CryptoPP::CCM<CryptoPP::Camellia>::Encryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::Camellia>::Encryption>(CryptoPP::CBC_Mode<CryptoPP::Camellia>::Encryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::Camellia>::Encryption>(CryptoPP::CFB_Mode<CryptoPP::Camellia>::Encryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::Camellia>::Encryption>(CryptoPP::CTR_Mode<CryptoPP::Camellia>::Encryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::Camellia>::Encryption>(CryptoPP::EAX<CryptoPP::Camellia>::Encryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::Camellia>::Encryption>(CryptoPP::GCM<CryptoPP::Camellia>::Encryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	case BlockCipher::CAST6:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::CAST256>::Encryption>(CryptoPP::CCM<CryptoPP::CAST256>::Encryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::CAST256>::Encryption>(CryptoPP::CBC_Mode<CryptoPP::CAST256>::Encryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::CAST256>::Encryption>(CryptoPP::CFB_Mode<CryptoPP::CAST256>::Encryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::CAST256>::Encryption>(CryptoPP::CTR_Mode<CryptoPP::CAST256>::Encryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::CAST256>::Encryption>(CryptoPP::EAX<CryptoPP::CAST256>::Encryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::CAST256>::Encryption>(CryptoPP::GCM<CryptoPP::CAST256>::Encryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	default:
-		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-	}
-}
-
-std::variant<std::unique_ptr<CryptoPP::CipherModeBase>, std::unique_ptr<CryptoPP::AuthenticatedSymmetricCipherBase>> getDecCipher(enum BlockCipher bc, enum CipherMode cm) {
-	switch (bc) {
-	case BlockCipher::AES:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::AES>::Decryption>(CryptoPP::CCM<CryptoPP::AES>::Decryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption>(CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::AES>::Decryption>(CryptoPP::CFB_Mode<CryptoPP::AES>::Decryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption>(CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::AES>::Decryption>(CryptoPP::EAX<CryptoPP::AES>::Decryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::AES>::Decryption>(CryptoPP::GCM<CryptoPP::AES>::Decryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	case BlockCipher::BLOWFISH:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::Blowfish>::Decryption>(CryptoPP::CCM<CryptoPP::Blowfish>::Decryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::Blowfish>::Decryption>(CryptoPP::CBC_Mode<CryptoPP::Blowfish>::Decryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::Blowfish>::Decryption>(CryptoPP::CFB_Mode<CryptoPP::Blowfish>::Decryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::Blowfish>::Decryption>(CryptoPP::CTR_Mode<CryptoPP::Blowfish>::Decryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::Blowfish>::Decryption>(CryptoPP::EAX<CryptoPP::Blowfish>::Decryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::Blowfish>::Decryption>(CryptoPP::GCM<CryptoPP::Blowfish>::Decryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	case BlockCipher::CAMELLIA:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::Camellia>::Decryption>(CryptoPP::CCM<CryptoPP::Camellia>::Decryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::Camellia>::Decryption>(CryptoPP::CBC_Mode<CryptoPP::Camellia>::Decryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::Camellia>::Decryption>(CryptoPP::CFB_Mode<CryptoPP::Camellia>::Decryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::Camellia>::Decryption>(CryptoPP::CTR_Mode<CryptoPP::Camellia>::Decryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::Camellia>::Decryption>(CryptoPP::EAX<CryptoPP::Camellia>::Decryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::Camellia>::Decryption>(CryptoPP::GCM<CryptoPP::Camellia>::Decryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
-	case BlockCipher::CAST6:
-		switch (cm) {
-		case CipherMode::CCM:
-			return std::make_unique<CryptoPP::CCM<CryptoPP::CAST256>::Decryption>(CryptoPP::CCM<CryptoPP::CAST256>::Decryption());
-		case CipherMode::CBC:
-			return std::make_unique<CryptoPP::CBC_Mode<CryptoPP::CAST256>::Decryption>(CryptoPP::CBC_Mode<CryptoPP::CAST256>::Decryption());
-		case CipherMode::CFB:
-			return std::make_unique<CryptoPP::CFB_Mode<CryptoPP::CAST256>::Decryption>(CryptoPP::CFB_Mode<CryptoPP::CAST256>::Decryption());
-		case CipherMode::CTR:
-			return std::make_unique<CryptoPP::CTR_Mode<CryptoPP::CAST256>::Decryption>(CryptoPP::CTR_Mode<CryptoPP::CAST256>::Decryption());
-		case CipherMode::EAX:
-			return std::make_unique<CryptoPP::EAX<CryptoPP::CAST256>::Decryption>(CryptoPP::EAX<CryptoPP::CAST256>::Decryption());
-		case CipherMode::GCM:
-			return std::make_unique<CryptoPP::GCM<CryptoPP::CAST256>::Decryption>(CryptoPP::GCM<CryptoPP::CAST256>::Decryption());
-		default:
-			lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
-		}
+	case CipherMode::POLY1305:
+		return "Poly1305";
+	case CipherMode::AUTO:
+		return "Auto";
 	default:
 		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
 	}
@@ -220,105 +93,2089 @@ int getBlockSize(BlockCipher bc) {
 		return CryptoPP::Camellia::BLOCKSIZE;
 	case BlockCipher::CAST6:
 		return CryptoPP::CAST256::BLOCKSIZE;
+	case BlockCipher::CHACHA20:
+		return ChaCha20::BLOCKSIZE;
 	default:
 		lnthrow(std::runtime_error, "Switch case covered all enums but still fell through. This is a major bug.");
 	}
 }
 
-struct Symmetric::SymmetricImpl {
-	SecBytes key;
-	SecBytes iv;
-	std::variant<std::unique_ptr<CryptoPP::CipherModeBase>, std::unique_ptr<CryptoPP::AuthenticatedSymmetricCipherBase>> mode;
-};
+/**
+ * @brief The length of the nonce given to each segment in chunked mode.
+ * Following the STREAM construction, it is made of a 7-byte prefix, a 4-byte big-endian segment counter, and a 1-byte flag that is 1 for the final segment and 0 otherwise.
+ * The prefix is zeros, since every container has a key of its own.
+ */
+constexpr size_t STREAM_NONCE_LEN = 12;
 
-bool validateKeyLen(int keyLen, BlockCipher bc) {
-	(void)bc;
-	return keyLen == 128 || keyLen == 192 || keyLen == 256;
+/**
+ * @brief The length of the prefix in a STREAM nonce.
+ */
+constexpr size_t STREAM_PREFIX_LEN = 7;
+
+/**
+ * @brief The length of the random nonce a data key is wrapped under, and of the tag after it.
+ * Wrapping uses AES-GCM, so a wrapped key is WRAP_NONCE_LEN + the key length + WRAP_TAG_LEN bytes.
+ */
+constexpr size_t WRAP_NONCE_LEN = 12;
+constexpr size_t WRAP_TAG_LEN = 16;
+
+/**
+ * @brief The length of the random salt a container's own key is derived from when it has no wrapped key.
+ * At 16 bytes, two containers under one password only get the same key once about 2^64 have been written.
+ */
+constexpr size_t KEY_SALT_LEN = 16;
+
+/**
+ * @brief Prefixed to the salt in the HMAC that derives a container's key, so those keys can never collide with keys derived from the password's key for another purpose.
+ */
+constexpr const char CONTAINER_KEY_LABEL[] = "CloudSync container key v1";
+
+/**
+ * @brief Prefixed to every segment in the HMAC that derives its convergent key, so those keys can never collide with keys derived from the same secret for another purpose.
+ */
+constexpr const char CONVERGENT_KEY_LABEL[] = "CloudSync convergent key v1";
+
+/**
+ * @brief The shortest secret setConvergent() accepts.
+ */
+constexpr size_t MIN_CONVERGENCE_SECRET_LEN = 16;
+
+static bool isAuthenticated(CipherMode cm) {
+	return cm == CipherMode::CCM || cm == CipherMode::EAX || cm == CipherMode::GCM || cm == CipherMode::POLY1305;
 }
 
-Symmetric::Symmetric(const char* password, BlockCipher bc, int keyLen, CipherMode cb): impl(std::make_unique<SymmetricImpl>()) {
-	std::pair<SecBytes, SecBytes> keyPair = DeriveKeypair(password, keyLen, getBlockSize(bc));
-	if (!validateKeyLen(keyLen, bc)) {
-		lnthrow(std::logic_error, "Key length " + std::to_string(keyLen) + " cannot be used with block cipher " + bcToString(bc));
+/**
+ * @brief Returns the length of the IV a mode should be keyed with.
+ * CCM only accepts nonces between 7 and 13 bytes, and ChaCha20-Poly1305 only accepts 12-byte nonces, so both get a 12-byte nonce. Everything else takes a full block.
+ */
+static size_t getIvLen(BlockCipher bc, CipherMode cm) {
+	return cm == CipherMode::CCM || cm == CipherMode::POLY1305 ? STREAM_NONCE_LEN : getBlockSize(bc);
+}
+
+/**
+ * @brief Returns the length of the IV derived from a password.
+ * This is capped at 16 bytes so that BlockCipher::AUTO derives the same IV whichever cipher it picks.
+ */
+static size_t getDerivedIvLen(BlockCipher bc) {
+	return std::min<size_t>(getBlockSize(bc), 16);
+}
+
+/**
+ * @brief Replaces BlockCipher::AUTO and CipherMode::AUTO with the cipher and mode they stand for.
+ */
+static std::pair<BlockCipher, CipherMode> resolveCipher(BlockCipher bc, CipherMode cm) {
+	if (bc == BlockCipher::AUTO) {
+		if (cm == CipherMode::AUTO) {
+			return autoSelectCipher();
+		}
+		bc = cm == CipherMode::POLY1305 ? BlockCipher::CHACHA20 : BlockCipher::AES;
+	}
+	if (cm == CipherMode::AUTO) {
+		cm = bc == BlockCipher::CHACHA20 ? CipherMode::POLY1305 : CipherMode::GCM;
 	}
-	this->impl->key = keyPair.first;
-	this->impl->iv = keyPair.second;
-	this->impl->mode = getEncCipher(bc, cb);
+	return {bc, cm};
 }
 
-void Symmetric::encryptData(const unsigned char* in, size_t inLen, unsigned char* out, size_t outLen) const {
-	const auto processCipherModeBase = [this](const unsigned char* in, size_t inLen, unsigned char* out) {
-		std::get<std::unique_ptr<CryptoPP::CipherModeBase>>(this->impl->mode)->ProcessData(out, in, inLen);
-	};
+/**
+ * @brief With IoBackend::AUTO, files at least this large are encrypted and decrypted through io_uring or memory maps instead of streams.
+ * Below this, setting up and tearing down the rings or mappings costs more than the copies it saves.
+ */
+constexpr uint64_t MMAP_THRESHOLD = 8 << 20;
 
-	const auto processAuthenticatedSymmetricCipherBase = [this](const unsigned char* in, size_t inLen, unsigned char* out) {
-		std::get<std::unique_ptr<CryptoPP::AuthenticatedSymmetricCipherBase>>(this->impl->mode)->ProcessData(out, in, inLen);
-	};
+/**
+ * @brief When a content digest is wanted, a segment is hashed and encrypted this many bytes at a time, so each slice is still in L1 when the cipher reads it after the hash.
+ */
+constexpr size_t FUSED_SLICE_LEN = 16 << 10;
 
-	if (inLen != outLen) {
-		lnthrow(std::logic_error, "inLen (" + std::to_string(inLen) + ") does not equal outLen (" + std::to_string(outLen) + ")");
+/**
+ * @brief The length of a SHA-256 digest, which is what each segment's digest and the content digest are.
+ */
+constexpr size_t SEGMENT_DIGEST_LEN = CryptoPP::SHA256::DIGESTSIZE;
+
+/**
+ * @brief Closes a file descriptor when it goes out of scope.
+ */
+struct ScopedFd {
+	int fd;
+
+	ScopedFd(const char* path, int flags) {
+		fd = open(path, flags | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			lnthrow(fs::IOException, std::string("Failed to open \"") + path + "\" (" + std::strerror(errno) + ")");
+		}
 	}
+	ScopedFd(const ScopedFd&) = delete;
+	ScopedFd& operator=(const ScopedFd&) = delete;
 
-	if (std::holds_alternative<std::unique_ptr<CryptoPP::CipherModeBase>>(this->impl->mode)) {
-		processCipherModeBase(in, inLen, out);
+	~ScopedFd() {
+		close(fd);
 	}
-	else {
-		processAuthenticatedSymmetricCipherBase(in, inLen, out);
+};
+
+/**
+ * @brief Reads from a file until len bytes have been read or it ends, retrying short reads.
+ *
+ * @return The number of bytes read.
+ *
+ * @exception IOException I/O error.
+ */
+static size_t readUpTo(int fd, const char* filename, unsigned char* buf, size_t len) {
+	size_t total = 0;
+	while (total < len) {
+		const ssize_t res = read(fd, buf + total, len - total);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			lnthrow(fs::IOException, std::string("Failed to read \"") + filename + "\" (" + std::strerror(errno) + ")");
+		}
+		if (res == 0) {
+			break;
+		}
+		total += res;
 	}
+	return total;
 }
 
-static void __encryptFile(std::ifstream& fsIn, std::ofstream& fsOut, const Symmetric* sym) {
-	size_t len;
-	do {
-		unsigned char buf[65536];
-		len = fsIn.readsome(reinterpret_cast<char*>(buf), sizeof(buf));
-		sym->encryptData(buf, len, buf, len);
-		fsOut.write(reinterpret_cast<char*>(buf), len);
-	} while (len > 0);
+/**
+ * @brief Runs a streaming transform over a list of input buffers into a list of output buffers, as if each list were contiguous.
+ * Runs that both buffers have room for are transformed in place, in multiples of blockLen.
+ * When fewer than blockLen bytes are left before a boundary, one block is gathered into a stack buffer, transformed, and scattered back out.
+ *
+ * @param blockLen The granularity the transform must be called with. This is at most MAX_BLOCK_LEN.
+ * @param transform Called as transform(out, in, len).
+ *
+ * @exception std::logic_error The input and output lengths differ.
+ */
+template <typename F>
+static void transformv(const iovec* in, size_t inCount, const iovec* out, size_t outCount, size_t blockLen, F transform) {
+	constexpr size_t MAX_BLOCK_LEN = 64;
+	unsigned char block[MAX_BLOCK_LEN];
+	size_t remaining = 0;
+	size_t outTotal = 0;
+	size_t ii = 0, io = 0;
+	size_t oi = 0, oo = 0;
+
+	for (size_t i = 0; i < inCount; ++i) {
+		remaining += in[i].iov_len;
+	}
+	for (size_t i = 0; i < outCount; ++i) {
+		outTotal += out[i].iov_len;
+	}
+	if (remaining != outTotal) {
+		lnthrow(std::logic_error, "The input buffers hold " + std::to_string(remaining) + " bytes, but the output buffers hold " + std::to_string(outTotal));
+	}
+	if (blockLen == 0 || blockLen > MAX_BLOCK_LEN) {
+		lnthrow(std::logic_error, "Block length " + std::to_string(blockLen) + " is not supported");
+	}
+
+	while (remaining > 0) {
+		while (io == in[ii].iov_len) {
+			ii++;
+			io = 0;
+		}
+		while (oo == out[oi].iov_len) {
+			oi++;
+			oo = 0;
+		}
+
+		const size_t run = std::min(in[ii].iov_len - io, out[oi].iov_len - oo);
+		const size_t aligned = run - run % blockLen;
+		if (aligned > 0) {
+			transform(static_cast<unsigned char*>(out[oi].iov_base) + oo, static_cast<const unsigned char*>(in[ii].iov_base) + io, aligned);
+			io += aligned;
+			oo += aligned;
+			remaining -= aligned;
+			continue;
+		}
+
+		// a block straddles a boundary, or this is a trailing partial block the transform will reject on its own
+		const size_t len = std::min(blockLen, remaining);
+		for (size_t k = 0; k < len; ++k) {
+			while (io == in[ii].iov_len) {
+				ii++;
+				io = 0;
+			}
+			block[k] = static_cast<const unsigned char*>(in[ii].iov_base)[io++];
+		}
+		transform(block, block, len);
+		for (size_t k = 0; k < len; ++k) {
+			while (oo == out[oi].iov_len) {
+				oi++;
+				oo = 0;
+			}
+			static_cast<unsigned char*>(out[oi].iov_base)[oo++] = block[k];
+		}
+		remaining -= len;
+	}
 }
 
-void Symmetric::encryptFile(const char* filenameIn, const char* filenameOut) const {
+/**
+ * @brief Opens two files as streams and runs them through an encryption or decryption function.
+ */
+template <typename F>
+static void withStreams(const char* filenameIn, const char* filenameOut, F func) {
 	std::ifstream ifs;
 	std::ofstream ofs;
 
-	ifs.open(filenameIn);
+	ifs.open(filenameIn, std::ios_base::in | std::ios_base::binary);
 	if (!ifs) {
 		lnthrow(fs::IOException, std::string("Failed to open input file \"") + filenameIn + "\" (" + std::strerror(errno) + ")");
 	}
-	ofs.open(filenameOut);
+	ofs.open(filenameOut, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
 	if (!ofs) {
 		lnthrow(fs::IOException, std::string("Failed to open output file \"") + filenameOut + "\" (" + std::strerror(errno) + ")");
 	}
 
-	__encryptFile(ifs, ofs, this);
+	func(ifs, ofs);
 
-	if (!ifs) {
+	if (ifs.bad()) {
 		lnthrow(fs::IOException, std::string("Input file I/O error: ") + std::strerror(errno));
 	}
+	ofs.close();
 	if (!ofs) {
 		lnthrow(fs::IOException, std::string("Output file I/O error: ") + std::strerror(errno));
 	}
 }
 
-void Symmetric::encryptFile(const char* filenameInOut) const {
-	if (!fs::isDirectory(filenameInOut)) {
-		lnthrow(std::runtime_error, std::string("\"") + filenameInOut + "\" is not a file");
+/**
+ * @brief Runs a file through func(filenameIn, filenameOut).
+ * If func throws, the partially written output is removed.
+ */
+template <typename F>
+static void processFile(const char* filenameIn, const char* filenameOut, F func) {
+	try {
+		func(filenameIn, filenameOut);
 	}
+	catch (...) {
+		fs::remove(filenameOut);
+		throw;
+	}
+}
 
-	std::ifstream ifs;
-	std::pair<std::string, std::ofstream> tmpFile = fs::makeTemp(fs::parentDir(filenameInOut).c_str());
+/**
+ * @brief Runs a file through func(filenameIn, filenameOut) in place.
+ * The output goes to a temporary file in the same directory, which replaces the original only once func succeeds.
+ */
+template <typename F>
+static void processFile(const char* filenameInOut, F func) {
+	if (!fs::isFile(filenameInOut)) {
+		lnthrow(std::runtime_error, std::string("\"") + filenameInOut + "\" is not a file");
+	}
 
-	__encryptFile(ifs, tmpFile.second, this);
-	tmpFile.second.close();
+	std::string tmpFile = fs::makeTemp(fs::parentDir(filenameInOut).c_str()).first;
+	processFile(filenameInOut, tmpFile.c_str(), func);
 
 	fs::remove(filenameInOut);
 	try {
-		fs::move(tmpFile.first.c_str(), filenameInOut);
+		fs::move(tmpFile.c_str(), filenameInOut);
 	}
 	catch (fs::IOException& e) {
-		lnthrow(fs::IOException, std::string("Failed to move temporary file \"") + tmpFile.first + "\" to output \"" + filenameInOut + "\"", e);
+		lnthrow(fs::IOException, std::string("Failed to move temporary file \"") + tmpFile + "\" to output \"" + filenameInOut + "\"", e);
 	}
 }
 
-}
+/**
+ * @brief The buffers for one batch of segments in chunked mode.
+ * Segment i of the batch reads from in(i), writes to out(i), and has its tag at tag(i), so workers never share a buffer.
+ */
+struct ChunkBatch {
+	ChunkBatch(size_t capacity, size_t inRecordLen, size_t outRecordLen, size_t tagLen):
+		capacity(capacity), inRecordLen(inRecordLen), outRecordLen(outRecordLen), tagLen(tagLen),
+		inBuf(capacity * inRecordLen), outBuf(capacity * outRecordLen), tags(capacity * tagLen), digests(capacity * SEGMENT_DIGEST_LEN), inLens(capacity), outLens(capacity) {}
+
+	unsigned char* in(size_t i) {
+		return inBuf.data() + i * inRecordLen;
+	}
+
+	unsigned char* out(size_t i) {
+		return outBuf.data() + i * outRecordLen;
+	}
+
+	unsigned char* tag(size_t i) {
+		return tags.data() + i * tagLen;
+	}
+
+	unsigned char* digest(size_t i) {
+		return digests.data() + i * SEGMENT_DIGEST_LEN;
+	}
+
+	const size_t capacity;
+	const size_t inRecordLen;
+	const size_t outRecordLen;
+	const size_t tagLen;
+	size_t count = 0;
+	std::vector<unsigned char> inBuf;
+	std::vector<unsigned char> outBuf;
+	std::vector<unsigned char> tags;
+	/**
+	 * @brief Each segment's plaintext digest, if a content digest is wanted.
+	 */
+	std::vector<unsigned char> digests;
+	std::vector<size_t> inLens;
+	std::vector<size_t> outLens;
+};
+
+/**
+ * @brief A worker's buffers for encryptFiles(), which are reused from one file to the next.
+ */
+struct SmallFileSlot {
+	/**
+	 * @brief The plaintext. This is one byte longer than a segment, so a file that grew past one segment since it was checked is noticed.
+	 */
+	std::vector<unsigned char> in;
+	/**
+	 * @brief The whole container: header, the one segment, and the index.
+	 */
+	std::vector<unsigned char> out;
+	/**
+	 * @brief A one-entry index, so no file needs its own.
+	 */
+	ChunkIndex index;
+};
+
+/**
+ * @brief A worker's buffers for verifying containers, which are reused from one segment or file to the next.
+ */
+struct VerifySlot {
+	std::vector<unsigned char> in;
+	/**
+	 * @brief Where compressed segments are decompressed to. Uncompressed segments are decrypted in place.
+	 */
+	std::vector<unsigned char> out;
+	/**
+	 * @brief The decompressor for the container being verified, if it is compressed.
+	 */
+	std::unique_ptr<Compress::Compressor> compressor;
+};
+
+struct Symmetric::SymmetricImpl {
+	SecBytes key;
+	SecBytes iv;
+	BlockCipher bc;
+	CipherMode cm;
+	uint16_t keyLen;
+	/**
+	 * @brief The KDF the key was derived with, which is recorded in containers.
+	 */
+	KdfParams kdf;
+	/**
+	 * @brief True if the cipher was picked with BlockCipher::AUTO, in which case decryption switches to whatever cipher a container's header names.
+	 */
+	bool autoCipher = false;
+	/**
+	 * @brief The cipher and mode BlockCipher::AUTO resolved to, which encryption always goes back to.
+	 */
+	std::pair<BlockCipher, CipherMode> autoChoice;
+	/**
+	 * @brief False if this was made from a MasterKey, which holds the key the password derives but not the IV. iv is then zeros and must not be used.
+	 */
+	bool ivKnown = true;
+	/**
+	 * @brief The engine used by encryptData(), decryptData() and the single-stream path.
+	 */
+	std::unique_ptr<CipherEngine> engine;
+
+	/**
+	 * @brief The segment size used by encryptFile(), or 0 if chunked mode is off.
+	 */
+	size_t chunkSize = DEFAULT_CHUNK_SIZE;
+
+	/**
+	 * @brief The number of threads to start the pool with, or 0 for one per hardware thread.
+	 */
+	unsigned nThreads = 0;
+
+	IoBackend backend = IoBackend::AUTO;
+
+	/**
+	 * @brief The codec encryptFile() compresses with in chunked mode, and its level.
+	 */
+	Compress::Codec codec = Compress::Codec::NONE;
+	int level = 0;
+
+	/**
+	 * @brief The worker pool used in chunked mode.
+	 * It is created the first time it is needed so that Symmetric's that never encrypt a file do not start any threads.
+	 */
+	std::unique_ptr<ThreadPool> pool;
+
+	/**
+	 * @brief One keyed engine per pool worker, so each worker can resynchronize its own engine for every segment without locking.
+	 */
+	std::vector<std::unique_ptr<CipherEngine>> engines;
+
+	/**
+	 * @brief One compressor per pool worker, for the codec of the container being processed.
+	 */
+	std::vector<std::unique_ptr<Compress::Compressor>> compressors;
+
+	/**
+	 * @brief True if every container gets a random data key of its own, wrapped with key. See setEnvelope().
+	 */
+	bool envelope = false;
+
+	/**
+	 * @brief The secret convergent segment keys are derived under, or empty if convergent encryption is off. See setConvergent().
+	 */
+	SecBytes convergenceSecret;
+
+	/**
+	 * @brief One engine per pool worker for segments of convergent containers, which is rekeyed with every segment's own key.
+	 */
+	std::vector<std::unique_ptr<CipherEngine>> segmentEngines;
+
+	/**
+	 * @brief Keys the single-stream engine with key and iv, which must already be set.
+	 * Nothing changes if the cipher cannot be used with the mode.
+	 */
+	void init(BlockCipher bc, uint16_t keyLen, CipherMode cm) {
+		std::unique_ptr<CipherEngine> e = makeEngine(bc, cm);
+		e->setKey(key, iv.data(), getIvLen(bc, cm));
+		engine = std::move(e);
+		this->bc = bc;
+		this->cm = cm;
+		this->keyLen = keyLen;
+	}
+
+	ThreadPool& getPool() {
+		if (!pool) {
+			pool = std::make_unique<ThreadPool>(nThreads);
+		}
+		return *pool;
+	}
+
+	size_t tagSize() const {
+		return engine->tagSize();
+	}
+
+	bool convergent() const {
+		return convergenceSecret.size() != 0;
+	}
+
+	/**
+	 * @brief Returns the length of each index entry's tag in a container written by this Symmetric.
+	 * In a convergent container, the segment's tag is followed by its sealed key and that seal's tag.
+	 */
+	size_t entryTagLen(bool convergent) const {
+		return convergent ? 2 * tagSize() + keyLen / 8 : tagSize();
+	}
+
+	void validateChunked() const {
+		validateChunked(bc, cm);
+	}
+
+	/**
+	 * @brief Throws if a cipher and mode cannot be used in chunked mode.
+	 */
+	static void validateChunked(BlockCipher bc, CipherMode cm) {
+		if (cm == CipherMode::CBC) {
+			lnthrow(std::logic_error, "CBC cannot be used in chunked mode, as it would need padding on every segment. Use CTR or an authenticated mode instead.");
+		}
+		if (getBlockSize(bc) < 16) {
+			lnthrow(std::logic_error, std::string("64-bit block ciphers such as ") + bcToString(bc) + " cannot be used in chunked mode.");
+		}
+	}
+
+	/**
+	 * @brief Makes the IV for a segment in chunked mode.
+	 * Authenticated modes use the 12-byte STREAM nonce as is.
+	 * CTR and CFB need a full block, so the nonce is followed by zeros, which leaves the low 4 bytes free for CTR's block counter.
+	 *
+	 * @param index The index of the segment.
+	 * @param last True if this is the final segment.
+	 * @param out Where to write the IV. This must be at least getBlockSize(bc) bytes long.
+	 *
+	 * @return The length of the IV.
+	 */
+	size_t makeNonce(uint64_t index, bool last, unsigned char* out) const {
+		const size_t len = isAuthenticated(cm) ? STREAM_NONCE_LEN : getBlockSize(bc);
+
+		if (index > UINT32_MAX) {
+			lnthrow(std::runtime_error, "Too many segments. Use a larger chunk size.");
+		}
+
+		std::memset(out, 0, len);
+		out[STREAM_PREFIX_LEN + 0] = (index >> 24) & 0xFF;
+		out[STREAM_PREFIX_LEN + 1] = (index >> 16) & 0xFF;
+		out[STREAM_PREFIX_LEN + 2] = (index >> 8) & 0xFF;
+		out[STREAM_PREFIX_LEN + 3] = index & 0xFF;
+		out[STREAM_PREFIX_LEN + 4] = last ? 1 : 0;
+		return len;
+	}
+
+	/**
+	 * @brief Derives a segment's convergent key, which is HMAC-SHA256(convergenceSecret, CONVERGENT_KEY_LABEL || cipher || mode || segment) cut to the key length.
+	 * The cipher and mode are included so that the same segment never gets the same key under two modes whose keystreams could overlap.
+	 */
+	SecBytes convergentKey(const unsigned char* in, size_t len) const {
+		CryptoPP::HMAC<CryptoPP::SHA256> hmac(convergenceSecret.data(), convergenceSecret.size());
+		const unsigned char cipher[2] = {static_cast<unsigned char>(bc), static_cast<unsigned char>(cm)};
+		SecBytes mac(CryptoPP::SHA256::DIGESTSIZE);
+
+		hmac.Update(reinterpret_cast<const unsigned char*>(CONVERGENT_KEY_LABEL), sizeof(CONVERGENT_KEY_LABEL) - 1);
+		hmac.Update(cipher, sizeof(cipher));
+		hmac.Update(in, len);
+		hmac.Final(mac.data());
+		mac.resize(keyLen / 8);
+		return mac;
+	}
+
+	/**
+	 * @brief Encrypts one segment in chunked mode.
+	 * In convergent mode, the segment is encrypted under its convergent key and a nonce of zeros, and that key is sealed after the tag under the worker's key and the segment's usual nonce.
+	 *
+	 * @param worker The worker. Its engine is resynchronized for this segment.
+	 * @param index The index of the segment.
+	 * @param last True if this is the final segment.
+	 * @param in The plaintext.
+	 * @param len The length of the plaintext.
+	 * @param out Where to write the ciphertext. This must be len bytes long.
+	 * @param tag Where to write the tag. This must be entryTagLen(convergent()) bytes long.
+	 * @param digest Where to write the SHA-256 of the plaintext, or nullptr to skip hashing.
+	 * Each slice of FUSED_SLICE_LEN bytes is hashed and then encrypted before moving on to the next, so the plaintext is only pulled into cache once.
+	 *
+	 * @return The number of bytes written to out.
+	 */
+	size_t encryptChunk(unsigned worker, uint64_t index, bool last, const unsigned char* in, size_t len, unsigned char* out, unsigned char* tag, unsigned char* digest = nullptr) const {
+		CipherEngine* chunkEngine = engines[worker].get();
+		unsigned char nonce[16];
+		size_t nonceLen = makeNonce(index, last, nonce);
+
+		if (convergent()) {
+			const SecBytes segmentKey = convergentKey(in, len);
+			unsigned char* sealed = tag + tagSize();
+
+			chunkEngine->encryptMessage(nonce, nonceLen, segmentKey.data(), segmentKey.size(), sealed, sealed + segmentKey.size());
+			std::memset(nonce, 0, nonceLen);
+			chunkEngine = segmentEngines[worker].get();
+			chunkEngine->setKey(segmentKey, nonce, nonceLen);
+		}
+		CipherEngine& engine = *chunkEngine;
+
+		if (!digest) {
+			engine.encryptMessage(nonce, nonceLen, in, len, out, tag);
+			return len;
+		}
+
+		CryptoPP::SHA256 hash;
+		// CCM needs the message length before any data, which only encryptMessage() passes on
+		if (cm == CipherMode::CCM) {
+			hash.CalculateDigest(digest, in, len);
+			engine.encryptMessage(nonce, nonceLen, in, len, out, tag);
+			return len;
+		}
+
+		engine.restartEncryption(nonce, nonceLen);
+		for (size_t pos = 0; pos < len; pos += FUSED_SLICE_LEN) {
+			const size_t n = std::min(FUSED_SLICE_LEN, len - pos);
+			hash.Update(in + pos, n);
+			engine.encrypt(out + pos, in + pos, n);
+		}
+		engine.encryptFinal(tag);
+		hash.Final(digest);
+		return len;
+	}
+
+	/**
+	 * @brief Decrypts and authenticates one segment in chunked mode.
+	 *
+	 * @param worker The worker. Its engine is resynchronized for this segment.
+	 * @param convergent True if the container is convergent, in which case the segment's key is unsealed from after its tag first.
+	 * @param index The index of the segment.
+	 * @param last True if this is the final segment.
+	 * @param in The ciphertext.
+	 * @param len The length of the ciphertext.
+	 * @param out Where to write the plaintext. This must be len bytes long.
+	 * @param tag The segment's tag from the chunk index.
+	 *
+	 * @return The number of bytes written to out.
+	 *
+	 * @exception IntegrityException The segment's tag, or that of its sealed key, does not match.
+	 */
+	size_t decryptChunk(unsigned worker, bool convergent, uint64_t index, bool last, const unsigned char* in, size_t len, unsigned char* out, const unsigned char* tag) const {
+		CipherEngine* engine = engines[worker].get();
+		unsigned char nonce[16];
+		size_t nonceLen = makeNonce(index, last, nonce);
+
+		if (convergent) {
+			SecBytes segmentKey(keyLen / 8);
+			const unsigned char* sealed = tag + tagSize();
+
+			if (!engine->decryptMessage(nonce, nonceLen, sealed, segmentKey.size(), segmentKey.data(), sealed + segmentKey.size())) {
+				lnthrow(IntegrityException, "The key of segment " + std::to_string(index) + " failed authentication");
+			}
+			std::memset(nonce, 0, nonceLen);
+			engine = segmentEngines[worker].get();
+			engine->setKey(segmentKey, nonce, nonceLen);
+		}
+		if (!engine->decryptMessage(nonce, nonceLen, in, len, out, tag)) {
+			lnthrow(IntegrityException, "Segment " + std::to_string(index) + " failed authentication");
+		}
+		return len;
+	}
+
+	/**
+	 * @brief Compresses and encrypts one segment with a worker's engine and compressor.
+	 * With Codec::NONE this is encryptChunk(). Otherwise the segment is compressed into out after a one-byte flag, or copied there as is if it does not get smaller, and then encrypted in place.
+	 *
+	 * @param out Where to write the ciphertext. This must be len + 1 bytes long.
+	 * @param digest Where to write the SHA-256 of the plaintext, or nullptr to skip hashing.
+	 * A compressed segment is hashed just before it is compressed, while it is still in cache.
+	 *
+	 * @return The number of bytes written to out.
+	 */
+	size_t sealChunk(unsigned worker, Compress::Codec codec, uint64_t index, bool last, const unsigned char* in, size_t len, unsigned char* out, unsigned char* tag, unsigned char* digest = nullptr) const {
+		if (codec == Compress::Codec::NONE) {
+			return encryptChunk(worker, index, last, in, len, out, tag, digest);
+		}
+		if (digest) {
+			CryptoPP::SHA256().CalculateDigest(digest, in, len);
+		}
+
+		size_t n = len > 1 ? compressors[worker]->compress(in, len, out + 1, len - 1) : 0;
+		if (n > 0) {
+			out[0] = 1;
+		}
+		else {
+			out[0] = 0;
+			std::memcpy(out + 1, in, len);
+			n = len;
+		}
+		return encryptChunk(worker, index, last, out, n + 1, out, tag);
+	}
+
+	/**
+	 * @brief Decrypts and decompresses one segment with a worker's engine and compressor.
+	 * With Codec::NONE this is decryptChunk(). Otherwise the segment is decrypted in place, then decompressed into out.
+	 *
+	 * @param in The ciphertext. This is overwritten with the compressed plaintext.
+	 * @param out Where to write the plaintext. This must be header.chunkSize bytes long.
+	 *
+	 * @return The number of bytes written to out.
+	 *
+	 * @exception IntegrityException The segment's tag does not match, or it does not decompress to a full segment.
+	 */
+	size_t openChunk(unsigned worker, const ContainerHeader& header, uint64_t index, bool last, unsigned char* in, size_t len, unsigned char* out, const unsigned char* tag) const {
+		return openChunk(worker, header.codec == Compress::Codec::NONE ? nullptr : compressors[worker].get(), header, index, last, in, len, out, tag);
+	}
+
+	/**
+	 * @brief Decrypts and decompresses one segment with a worker's engine and a given decompressor.
+	 *
+	 * @param compressor A decompressor for header.codec. This is only used if the container is compressed.
+	 */
+	size_t openChunk(unsigned worker, Compress::Compressor* compressor, const ContainerHeader& header, uint64_t index, bool last, unsigned char* in, size_t len, unsigned char* out, const unsigned char* tag) const {
+		if (header.codec == Compress::Codec::NONE) {
+			return decryptChunk(worker, header.flags & CONTAINER_FLAG_CONVERGENT, index, last, in, len, out, tag);
+		}
+
+		size_t n;
+		decryptChunk(worker, header.flags & CONTAINER_FLAG_CONVERGENT, index, last, in, len, in, tag);
+		if (len == 0 || in[0] > 1) {
+			lnthrow(IntegrityException, "Segment " + std::to_string(index) + " has an invalid compression flag");
+		}
+		if (in[0] == 0) {
+			n = len - 1;
+			std::memcpy(out, in + 1, n);
+		}
+		else {
+			try {
+				n = compressor->decompress(in + 1, len - 1, out, header.chunkSize);
+			}
+			catch (std::runtime_error& e) {
+				lnthrow(IntegrityException, "Segment " + std::to_string(index) + " failed to decompress (" + e.what() + ")");
+			}
+		}
+		if (n > header.chunkSize || (!last && n != header.chunkSize)) {
+			lnthrow(IntegrityException, "Segment " + std::to_string(index) + " decompressed to the wrong length");
+		}
+		return n;
+	}
+
+	/**
+	 * @brief Encrypts a stream as a single message on the calling thread.
+	 * Authenticated modes write their tag after the ciphertext.
+	 *
+	 * @param digests If not nullptr, the SHA-256 of the whole plaintext is appended to this, as the digest of its one segment.
+	 */
+	void encryptStream(std::istream& in, std::ostream& out, std::vector<unsigned char>* digests = nullptr) {
+		unsigned char buf[65536];
+		CryptoPP::SHA256 hash;
+		size_t len;
+
+		requireExplicitCipher("Single-stream mode");
+		if (cm == CipherMode::CCM) {
+			lnthrow(std::logic_error, "CCM needs the message length up front, so it can only encrypt files in chunked mode.");
+		}
+		if (envelope) {
+			lnthrow(std::logic_error, "Envelope encryption needs chunked mode, as a single stream has no header to keep the wrapped key in.");
+		}
+		if (convergent()) {
+			lnthrow(std::logic_error, "Convergent encryption needs chunked mode, as a single stream has no index to keep the segment keys in.");
+		}
+
+		engine->restartEncryption(iv.data(), getIvLen(bc, cm));
+		do {
+			in.read(reinterpret_cast<char*>(buf), sizeof(buf));
+			len = in.gcount();
+			if (digests) {
+				hash.Update(buf, len);
+			}
+			engine->encrypt(buf, buf, len);
+			out.write(reinterpret_cast<char*>(buf), len);
+		} while (len > 0);
+
+		if (isAuthenticated(cm)) {
+			engine->encryptFinal(buf);
+			out.write(reinterpret_cast<char*>(buf), tagSize());
+		}
+		if (digests) {
+			digests->resize(digests->size() + SEGMENT_DIGEST_LEN);
+			hash.Final(digests->data() + digests->size() - SEGMENT_DIGEST_LEN);
+		}
+	}
+
+	/**
+	 * @brief Decrypts a stream written by encryptStream() on the calling thread.
+	 * The last tagSize() bytes of the stream are held back as the tag, which is verified once the stream ends.
+	 * Since the whole message shares one tag, the plaintext has already been written by the time a bad tag is found.
+	 *
+	 * @exception IntegrityException The tag does not match.
+	 */
+	void decryptStream(std::istream& in, std::ostream& out) {
+		const size_t tagLen = tagSize();
+		std::vector<unsigned char> buf(65536 + tagLen);
+		size_t have = 0;
+		size_t len;
+
+		requireExplicitCipher("Single-stream mode");
+		if (cm == CipherMode::CCM) {
+			lnthrow(std::logic_error, "CCM needs the message length up front, so it can only decrypt files in chunked mode.");
+		}
+
+		engine->restartDecryption(iv.data(), getIvLen(bc, cm));
+		do {
+			in.read(reinterpret_cast<char*>(&buf[have]), buf.size() - have);
+			len = in.gcount();
+			have += len;
+			if (have > tagLen) {
+				engine->decrypt(&buf[0], &buf[0], have - tagLen);
+				out.write(reinterpret_cast<char*>(&buf[0]), have - tagLen);
+				std::memmove(&buf[0], &buf[have - tagLen], tagLen);
+				have = tagLen;
+			}
+		} while (len > 0);
+
+		if (isAuthenticated(cm)) {
+			if (have < tagLen) {
+				lnthrow(IntegrityException, "Ciphertext is too short to contain a tag");
+			}
+			if (!engine->decryptVerify(&buf[0])) {
+				lnthrow(IntegrityException, "Ciphertext failed authentication");
+			}
+		}
+	}
+
+	ContainerHeader makeHeader() const {
+		ContainerHeader header;
+		header.bc = bc;
+		header.cm = cm;
+		header.kdf = kdf;
+		header.tagLen = entryTagLen(convergent());
+		header.keyLen = keyLen;
+		header.chunkSize = chunkSize;
+		header.flags = convergent() ? CONTAINER_FLAG_CONVERGENT : 0;
+		return header;
+	}
+
+	/**
+	 * @brief Checks that a container was written with the same parameters as this Symmetric.
+	 *
+	 * @exception std::runtime_error The parameters differ.
+	 * @exception std::logic_error This Symmetric uses BlockCipher::AUTO and the container names a cipher and mode that chunked mode cannot use.
+	 */
+	void checkHeader(const ContainerHeader& header) {
+		if (!Compress::codecAvailable(header.codec)) {
+			lnthrow(std::runtime_error, std::string("The container was compressed with ") + Compress::codecToString(header.codec) + ", which this build does not support");
+		}
+		if (autoCipher && header.keyLen == keyLen) {
+			// a container naming a pairing chunked mode cannot use must not leave this Symmetric switched to it
+			validateChunked(header.bc, header.cm);
+			adoptCipher(header.bc, header.cm);
+		}
+		if (header.bc != bc || header.cm != cm || header.keyLen != keyLen || header.tagLen != entryTagLen(header.flags & CONTAINER_FLAG_CONVERGENT)) {
+			lnthrow(std::runtime_error, std::string("The container was encrypted with ") + bcToString(header.bc) + "-" + std::to_string(header.keyLen) + "/" + cmToString(header.cm) + ", but this Symmetric uses " + bcToString(bc) + "-" + std::to_string(keyLen) + "/" + cmToString(cm));
+		}
+		if (header.kdf != kdf) {
+			lnthrow(std::runtime_error, "The container's key was derived with different KDF parameters than this Symmetric's. Read them with Symmetric::kdfParams() and derive the key with those");
+		}
+	}
+
+	/**
+	 * @brief Rekeys this Symmetric for another cipher and mode, keeping the key and IV.
+	 * The worker engines are replaced in place, so references to the vector stay valid.
+	 *
+	 * @exception std::logic_error The cipher cannot be used with the mode.
+	 */
+	void adoptCipher(BlockCipher bc, CipherMode cm) {
+		if (bc == this->bc && cm == this->cm) {
+			return;
+		}
+
+		const bool workersKeyed = !engines.empty();
+
+		init(bc, keyLen, cm);
+		engines.clear();
+		segmentEngines.clear();
+		if (workersKeyed) {
+			workerEngines();
+		}
+	}
+
+	/**
+	 * @brief Throws the configuration errors that would fail every file of a batch alike, so encryptFiles() and verifyFiles() can throw them before the first file and record anything else per file.
+	 * With BlockCipher::AUTO in chunked mode, each container's cipher is checked as it is opened instead.
+	 *
+	 * @exception std::logic_error This Symmetric cannot process files as it is set up.
+	 */
+	void validateBatch() const {
+		if (chunkSize == 0) {
+			requireExplicitCipher("Single-stream mode");
+		}
+		else if (!autoCipher) {
+			validateChunked();
+		}
+	}
+
+	/**
+	 * @brief Throws if the cipher was picked with BlockCipher::AUTO, since outside of a container there is nowhere to record the choice, or if the IV is not known.
+	 */
+	void requireExplicitCipher(const char* what) const {
+		if (autoCipher) {
+			lnthrow(std::logic_error, std::string(what) + " cannot be used with BlockCipher::AUTO, since nothing records which cipher was picked. Use chunked mode instead.");
+		}
+		requireIv(what);
+	}
+
+	/**
+	 * @brief Throws if this was made from a MasterKey, which does not have the IV the password derives.
+	 */
+	void requireIv(const char* what) const {
+		if (!ivKnown) {
+			lnthrow(std::logic_error, std::string(what) + " needs the IV derived from the password, which a master key does not include. Use the password instead.");
+		}
+	}
+
+	/**
+	 * @brief Rounds up the engines so there is one per pool worker.
+	 * Each is keyed with key here, and rekeyed by keyWorker() with the key of every container it works on.
+	 */
+	std::vector<std::unique_ptr<CipherEngine>>& workerEngines() {
+		while (engines.size() < getPool().size()) {
+			engines.push_back(makeEngine(bc, cm));
+			engines.back()->setKey(key, iv.data(), getIvLen(bc, cm));
+			segmentEngines.push_back(makeEngine(bc, cm));
+		}
+		return engines;
+	}
+
+	/**
+	 * @brief Keys a worker's engine with a container's own key, which is a random data key or one derived from a random salt.
+	 * The key is used for that container only, so its segments' nonces can start with zeros. For data keys, that also keeps the data independent of the password, which is what lets rewrap() change it by rewriting the header alone.
+	 * Only that worker's engine is touched, so workers can rekey side by side.
+	 */
+	void keyWorker(unsigned worker, SecSpan dataKey) {
+		engines[worker]->setKey(dataKey, iv.data(), getIvLen(bc, cm));
+	}
 
+	/**
+	 * @brief Keys every worker's engine with a container's own key.
+	 */
+	void keyWorkers(SecSpan dataKey) {
+		workerEngines();
+		for (unsigned i = 0; i < engines.size(); ++i) {
+			keyWorker(i, dataKey);
+		}
+	}
+
+	/**
+	 * @brief Returns the length of a data key wrapped by wrapKey().
+	 */
+	size_t wrappedKeySize() const {
+		return WRAP_NONCE_LEN + keyLen / 8 + WRAP_TAG_LEN;
+	}
+
+	/**
+	 * @brief Generates a random data key for a new container.
+	 */
+	SecBytes newDataKey() const {
+		SecBytes dataKey(keyLen / 8);
+		CryptoPP::OS_GenerateRandomBlock(false, dataKey.data(), dataKey.size());
+		return dataKey;
+	}
+
+	/**
+	 * @brief Seals a data key with AES-GCM under key and a random nonce.
+	 * A fresh engine is keyed for every call, so this is safe to call from several workers at once.
+	 *
+	 * @param out Where to write the nonce, the encrypted data key and the tag. This must be wrappedKeySize() bytes long.
+	 */
+	void wrapKey(SecSpan dataKey, unsigned char* out) const {
+		std::unique_ptr<CipherEngine> kek = makeEngine(BlockCipher::AES, CipherMode::GCM);
+
+		CryptoPP::OS_GenerateRandomBlock(false, out, WRAP_NONCE_LEN);
+		kek->setKey(key, out, WRAP_NONCE_LEN);
+		kek->encryptMessage(out, WRAP_NONCE_LEN, dataKey.data(), dataKey.size(), out + WRAP_NONCE_LEN, out + WRAP_NONCE_LEN + dataKey.size());
+	}
+
+	/**
+	 * @brief Recovers the data key sealed in a container's header.
+	 *
+	 * @exception IntegrityException The wrapped key has the wrong length, or fails authentication because the password is wrong or the header was modified.
+	 */
+	SecBytes unwrapKey(const std::vector<unsigned char>& wrapped) const {
+		if (wrapped.size() != wrappedKeySize()) {
+			lnthrow(IntegrityException, "The container's wrapped key has the wrong length");
+		}
+
+		std::unique_ptr<CipherEngine> kek = makeEngine(BlockCipher::AES, CipherMode::GCM);
+		SecBytes dataKey(keyLen / 8);
+
+		kek->setKey(key, wrapped.data(), WRAP_NONCE_LEN);
+		if (!kek->decryptMessage(wrapped.data(), WRAP_NONCE_LEN, wrapped.data() + WRAP_NONCE_LEN, dataKey.size(), dataKey.data(), wrapped.data() + WRAP_NONCE_LEN + dataKey.size())) {
+			lnthrow(IntegrityException, "The container's data key failed to unwrap. The password is wrong or the header was modified");
+		}
+		return dataKey;
+	}
+
+	/**
+	 * @brief Generates a random key salt for a new container.
+	 */
+	static std::vector<unsigned char> newKeySalt() {
+		std::vector<unsigned char> salt(KEY_SALT_LEN);
+		CryptoPP::OS_GenerateRandomBlock(false, salt.data(), salt.size());
+		return salt;
+	}
+
+	/**
+	 * @brief Derives a container's key from its key salt, which is HMAC-SHA256(key, CONTAINER_KEY_LABEL || salt) cut to the key length.
+	 * A fresh HMAC is keyed for every call, so this is safe to call from several workers at once.
+	 */
+	SecBytes saltedKey(const unsigned char* salt, size_t saltLen) const {
+		CryptoPP::HMAC<CryptoPP::SHA256> hmac(key.data(), key.size());
+		SecBytes mac(CryptoPP::SHA256::DIGESTSIZE);
+
+		hmac.Update(reinterpret_cast<const unsigned char*>(CONTAINER_KEY_LABEL), sizeof(CONTAINER_KEY_LABEL) - 1);
+		hmac.Update(salt, saltLen);
+		hmac.Final(mac.data());
+		mac.resize(keyLen / 8);
+		return mac;
+	}
+
+	/**
+	 * @brief Returns the key a container's chunks are encrypted with, which is its unwrapped data key, or the key derived from its key salt if it has none.
+	 *
+	 * @exception IntegrityException The container's wrapped key fails to unwrap.
+	 */
+	SecBytes containerKey(const ContainerHeader& header) const {
+		if (!header.wrappedKey.empty()) {
+			return unwrapKey(header.wrappedKey);
+		}
+		return saltedKey(header.keySalt.data(), header.keySalt.size());
+	}
+
+	/**
+	 * @brief Keys the worker engines for a container that has just passed checkHeader().
+	 */
+	void openContainer(const ContainerHeader& header) {
+		keyWorkers(containerKey(header));
+	}
+
+	/**
+	 * @brief Returns the header for a new container and keys the worker engines for it.
+	 * The container gets a fresh key salt, or in envelope mode a fresh data key, which the header carries wrapped.
+	 */
+	ContainerHeader beginContainer() {
+		ContainerHeader header = makeHeader();
+
+		if (!envelope) {
+			header.keySalt = newKeySalt();
+			keyWorkers(saltedKey(header.keySalt.data(), header.keySalt.size()));
+			return header;
+		}
+		const SecBytes dataKey = newDataKey();
+		header.wrappedKey.resize(wrappedKeySize());
+		wrapKey(dataKey, header.wrappedKey.data());
+		keyWorkers(dataKey);
+		return header;
+	}
+
+	/**
+	 * @brief Rounds up the compressors so there is one per pool worker.
+	 * They are recreated if the codec changes. Decompression does not care about the level, so containers in this Symmetric's own codec reuse its compressors.
+	 */
+	std::vector<std::unique_ptr<Compress::Compressor>>& workerCompressors(Compress::Codec c) {
+		const int lvl = c == codec ? level : 0;
+		if (!compressors.empty() && (compressors[0]->codec() != c || compressors[0]->level() != lvl)) {
+			compressors.clear();
+		}
+		while (compressors.size() < getPool().size()) {
+			compressors.push_back(std::make_unique<Compress::Compressor>(c, lvl));
+		}
+		return compressors;
+	}
+
+	/**
+	 * @brief Encrypts a stream into a container.
+	 * Segments are read in batches of two per worker, encrypted in parallel, then written in order, with their offsets and tags collected into the trailing index.
+	 * An empty stream is still one (empty) final segment, so truncation to zero length is detected.
+	 * If compression is on, the header is only written once the first segment's entropy shows whether it is worth compressing.
+	 *
+	 * @param digests If not nullptr, each segment's plaintext digest is appended to this in order.
+	 */
+	void encryptChunked(std::istream& in, std::ostream& out, std::vector<unsigned char>* digests = nullptr) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		ContainerHeader header = beginContainer();
+		ChunkBatch b(tp.size() * 2, chunkSize, chunkSize + (codec != Compress::Codec::NONE ? 1 : 0), header.tagLen);
+		ChunkIndex index;
+		uint64_t pos = header.size();
+		bool last = false;
+
+		index.tagLen = header.tagLen;
+
+		while (!last) {
+			const uint64_t first = index.count();
+
+			for (b.count = 0; b.count < b.capacity && !last; ++b.count) {
+				in.read(reinterpret_cast<char*>(b.in(b.count)), chunkSize);
+				b.inLens[b.count] = in.gcount();
+				last = in.peek() == std::char_traits<char>::eof();
+			}
+
+			if (first == 0) {
+				if (codec != Compress::Codec::NONE && Compress::worthCompressing(b.in(0), b.inLens[0])) {
+					header.codec = codec;
+					workerCompressors(codec);
+				}
+				writeHeader(out, header);
+			}
+
+			tp.parallelFor(b.count, [&](size_t i, unsigned worker) {
+				b.outLens[i] = sealChunk(worker, header.codec, first + i, last && i == b.count - 1, b.in(i), b.inLens[i], b.out(i), b.tag(i), digests ? b.digest(i) : nullptr);
+			});
+			if (digests) {
+				digests->insert(digests->end(), b.digest(0), b.digest(b.count));
+			}
+
+			for (size_t i = 0; i < b.count; ++i) {
+				out.write(reinterpret_cast<char*>(b.out(i)), b.outLens[i]);
+				index.offsets.push_back(pos);
+				index.lengths.push_back(b.outLens[i]);
+				index.tags.insert(index.tags.end(), b.tag(i), b.tag(i) + index.tagLen);
+				pos += b.outLens[i];
+			}
+		}
+
+		writeIndex(out, index, pos);
+	}
+
+	/**
+	 * @brief Reads the ciphertext of segments [first, first + b.count) into a batch, along with their tags.
+	 *
+	 * @param in The container.
+	 * @param index The index entries starting at segment indexBase.
+	 * @param indexBase The segment the first entry of index refers to.
+	 * @param first The first segment to read.
+	 * @param total The number of segments in the container.
+	 * @param header The container's header.
+	 */
+	void readBatch(std::istream& in, ChunkIndex& index, uint64_t indexBase, uint64_t first, uint64_t total, const ContainerHeader& header, ChunkBatch& b) const {
+		for (size_t i = 0; i < b.count; ++i) {
+			const size_t entry = first - indexBase + i;
+
+			checkEntry(index, entry, first + i, total, header);
+			if (static_cast<uint64_t>(in.tellg()) != index.offsets[entry]) {
+				in.seekg(index.offsets[entry]);
+			}
+			in.read(reinterpret_cast<char*>(b.in(i)), index.lengths[entry]);
+			if (in.bad()) {
+				lnthrow(fs::IOException, std::string("I/O error reading the container (") + std::strerror(errno) + ")");
+			}
+			if (static_cast<size_t>(in.gcount()) != index.lengths[entry]) {
+				lnthrow(IntegrityException, "Segment " + std::to_string(first + i) + " is truncated");
+			}
+			b.inLens[i] = index.lengths[entry];
+			std::memcpy(b.tag(i), index.tag(entry), index.tagLen);
+		}
+	}
+
+	/**
+	 * @brief Decrypts a container, checking every segment's tag before writing its plaintext.
+	 */
+	void decryptChunked(std::istream& in, std::ostream& out) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		const ContainerHeader header = readHeader(in);
+		checkHeader(header);
+		openContainer(header);
+		const ContainerFooter footer = readFooter(in, header);
+		ChunkIndex index = readIndex(in, header, footer, 0, footer.count);
+		ChunkBatch b(tp.size() * 2, recordLen(header), header.chunkSize, header.tagLen);
+
+		if (header.codec != Compress::Codec::NONE) {
+			workerCompressors(header.codec);
+		}
+
+		in.clear();
+		in.seekg(header.size());
+		for (uint64_t first = 0; first < footer.count; first += b.count) {
+			b.count = std::min<uint64_t>(b.capacity, footer.count - first);
+			readBatch(in, index, 0, first, footer.count, header, b);
+
+			tp.parallelFor(b.count, [&](size_t i, unsigned worker) {
+				b.outLens[i] = openChunk(worker, header, first + i, first + i == footer.count - 1, b.in(i), b.inLens[i], b.out(i), b.tag(i));
+			});
+
+			for (size_t i = 0; i < b.count; ++i) {
+				out.write(reinterpret_cast<char*>(b.out(i)), b.outLens[i]);
+			}
+		}
+	}
+
+	/**
+	 * @brief Decrypts only the segments of a container that overlap [offset, offset + len).
+	 *
+	 * @return The number of bytes written to out, which is less than len if the range goes past the end of the plaintext.
+	 */
+	size_t decryptRange(std::istream& in, uint64_t offset, unsigned char* out, size_t len) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		const ContainerHeader header = readHeader(in);
+		checkHeader(header);
+		openContainer(header);
+		const ContainerFooter footer = readFooter(in, header);
+		const uint64_t cs = header.chunkSize;
+		size_t written = 0;
+
+		if (len == 0 || offset / cs >= footer.count) {
+			return 0;
+		}
+
+		const uint64_t firstSeg = offset / cs;
+		const uint64_t lastSeg = std::min((offset + len - 1) / cs, footer.count - 1);
+		ChunkIndex index = readIndex(in, header, footer, firstSeg, lastSeg - firstSeg + 1);
+		ChunkBatch b(std::min<uint64_t>(tp.size() * 2, lastSeg - firstSeg + 1), recordLen(header), cs, header.tagLen);
+
+		if (header.codec != Compress::Codec::NONE) {
+			workerCompressors(header.codec);
+		}
+
+		for (uint64_t first = firstSeg; first <= lastSeg; first += b.count) {
+			b.count = std::min<uint64_t>(b.capacity, lastSeg - first + 1);
+			readBatch(in, index, firstSeg, first, footer.count, header, b);
+
+			if (b.count == 1) {
+				b.outLens[0] = openChunk(0, header, first, first == footer.count - 1, b.in(0), b.inLens[0], b.out(0), b.tag(0));
+			}
+			else {
+				tp.parallelFor(b.count, [&](size_t i, unsigned worker) {
+					b.outLens[i] = openChunk(worker, header, first + i, first + i == footer.count - 1, b.in(i), b.inLens[i], b.out(i), b.tag(i));
+				});
+			}
+
+			for (size_t i = 0; i < b.count; ++i) {
+				const uint64_t segStart = (first + i) * cs;
+				const uint64_t from = std::max(offset, segStart);
+				const uint64_t to = std::min(offset + len, segStart + b.outLens[i]);
+				if (from < to) {
+					std::memcpy(out + (from - offset), b.out(i) + (from - segStart), to - from);
+					written += to - from;
+				}
+			}
+		}
+
+		return written;
+	}
+
+	void encrypt(std::istream& in, std::ostream& out, std::vector<unsigned char>* digests = nullptr) {
+		if (chunkSize == 0) {
+			encryptStream(in, out, digests);
+		}
+		else {
+			encryptChunked(in, out, digests);
+		}
+	}
+
+	void decrypt(std::istream& in, std::ostream& out) {
+		if (chunkSize == 0) {
+			decryptStream(in, out);
+		}
+		else {
+			decryptChunked(in, out);
+		}
+	}
+	/**
+	 * @brief Checks an index entry before its segment is read.
+	 *
+	 * @param index The index.
+	 * @param entry The entry to check.
+	 * @param segment The segment the entry refers to.
+	 * @param total The number of segments in the container.
+	 * @param header The container's header.
+	 *
+	 * @exception IntegrityException Only the final segment may be shorter than the chunk size, and none may be longer. Compressed segments may have any length up to recordLen(), but must hold at least their flag.
+	 */
+	static void checkEntry(const ChunkIndex& index, size_t entry, uint64_t segment, uint64_t total, const ContainerHeader& header) {
+		const bool last = segment == total - 1;
+		const uint32_t len = index.lengths[entry];
+		const bool valid = header.codec == Compress::Codec::NONE ?
+			len <= header.chunkSize && (last || len == header.chunkSize) :
+			len >= 1 && len <= recordLen(header);
+		if (!valid) {
+			lnthrow(IntegrityException, "Segment " + std::to_string(segment) + " has an invalid length in the index");
+		}
+	}
+
+	/**
+	 * @brief Returns the longest a segment's ciphertext can be in a container, which is one more than the chunk size if it is compressed to make room for the flag.
+	 */
+	static size_t recordLen(const ContainerHeader& header) {
+		return static_cast<size_t>(header.chunkSize) + (header.codec != Compress::Codec::NONE ? 1 : 0);
+	}
+
+	/**
+	 * @brief Picks the backend for a file, resolving IoBackend::AUTO.
+	 */
+	IoBackend chooseBackend(const char* filenameIn) const {
+		if (chunkSize == 0 || !fs::isFile(filenameIn)) {
+			return IoBackend::STREAM;
+		}
+		if (backend != IoBackend::AUTO) {
+			return backend;
+		}
+		if (fs::size(filenameIn) < MMAP_THRESHOLD) {
+			return IoBackend::STREAM;
+		}
+		return fs::asyncIoAvailable() ? IoBackend::ASYNC : IoBackend::MAPPED;
+	}
+
+	/**
+	 * @brief Returns the index of a layout with every segment at the offset it would have if the container were written in one pass.
+	 *
+	 * @param plainSize The size of the plaintext.
+	 * @param headerSize The size of the container header.
+	 */
+	ChunkIndex makeIndex(uint64_t plainSize, size_t headerSize) const {
+		const uint64_t count = std::max<uint64_t>((plainSize + chunkSize - 1) / chunkSize, 1);
+		ChunkIndex index;
+
+		index.tagLen = entryTagLen(convergent());
+		index.offsets.resize(count);
+		index.lengths.resize(count);
+		index.tags.resize(count * index.tagLen);
+		for (uint64_t i = 0; i < count; ++i) {
+			index.offsets[i] = headerSize + i * chunkSize;
+			index.lengths[i] = std::min<uint64_t>(chunkSize, plainSize - i * chunkSize);
+		}
+		return index;
+	}
+
+	/**
+	 * @brief Reads a container's header and full index, and checks that every segment lies inside its data.
+	 * Checking every offset first is what lets the mapped and async backends trust the index.
+	 * The worker engines are keyed for the container.
+	 */
+	ChunkIndex loadIndex(const char* filenameIn, ContainerHeader& header, ContainerFooter& footer) {
+		std::ifstream ifs(filenameIn, std::ios_base::in | std::ios_base::binary);
+		if (!ifs) {
+			lnthrow(fs::IOException, std::string("Failed to open input file \"") + filenameIn + "\" (" + std::strerror(errno) + ")");
+		}
+		header = readHeader(ifs);
+		checkHeader(header);
+		openContainer(header);
+		footer = readFooter(ifs, header);
+		return readCheckedIndex(ifs, fs::size(filenameIn), header, footer);
+	}
+
+	/**
+	 * @brief Reads a container's full index once its header and footer have been read, and checks that every segment lies inside its data.
+	 *
+	 * @param size The size of the container.
+	 */
+	static ChunkIndex readCheckedIndex(std::istream& ifs, uint64_t size, const ContainerHeader& header, const ContainerFooter& footer) {
+		ChunkIndex index = readIndex(ifs, header, footer, 0, footer.count);
+
+		for (uint64_t i = 0; i < footer.count; ++i) {
+			checkEntry(index, i, i, footer.count, header);
+			if (index.offsets[i] > footer.indexOffset || index.lengths[i] > footer.indexOffset - index.offsets[i] || footer.indexOffset > size) {
+				lnthrow(IntegrityException, "Segment " + std::to_string(i) + " lies outside of the container's data");
+			}
+		}
+		return index;
+	}
+
+	/**
+	 * @brief Encrypts a file into a container through memory maps.
+	 * The output's space is allocated up front, so every worker encrypts straight from the input's pages to its own region of the output's pages with no intermediate buffers.
+	 */
+	void encryptMapped(const char* filenameIn, const char* filenameOut, std::vector<unsigned char>* digests = nullptr) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		const ContainerHeader header = beginContainer();
+		const fs::MappedFile src(filenameIn);
+		ChunkIndex index = makeIndex(src.size(), header.size());
+		const uint64_t count = index.count();
+		const uint64_t indexOffset = header.size() + src.size();
+		std::ostringstream headerBuf;
+		std::ostringstream indexBuf;
+
+		const fs::MappedFile dst(filenameOut, indexOffset + indexSize(count, index.tagLen));
+		writeHeader(headerBuf, header);
+		std::memcpy(dst.data(), headerBuf.str().data(), header.size());
+
+		if (digests) {
+			digests->resize(count * SEGMENT_DIGEST_LEN);
+		}
+		tp.parallelFor(count, [&](size_t i, unsigned worker) {
+			encryptChunk(worker, i, i == count - 1, src.data() + i * chunkSize, index.lengths[i], dst.data() + index.offsets[i], index.tag(i), digests ? digests->data() + i * SEGMENT_DIGEST_LEN : nullptr);
+		});
+
+		writeIndex(indexBuf, index, indexOffset);
+		std::memcpy(dst.data() + indexOffset, indexBuf.str().data(), indexSize(count, index.tagLen));
+	}
+
+	/**
+	 * @brief Decrypts a container through memory maps.
+	 */
+	void decryptMapped(const char* filenameIn, const char* filenameOut) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		ContainerHeader header;
+		ContainerFooter footer;
+		ChunkIndex index = loadIndex(filenameIn, header, footer);
+
+		const fs::MappedFile src(filenameIn);
+		const uint64_t plainSize = (footer.count - 1) * header.chunkSize + index.lengths[footer.count - 1];
+		const fs::MappedFile dst(filenameOut, plainSize);
+
+		tp.parallelFor(footer.count, [&](size_t i, unsigned worker) {
+			decryptChunk(worker, header.flags & CONTAINER_FLAG_CONVERGENT, i, i == footer.count - 1, src.data() + index.offsets[i], index.lengths[i], dst.data() + i * header.chunkSize, index.tag(i));
+		});
+	}
+
+	/**
+	 * @brief Encrypts a file into a container with reads, encryption and writes of different segments overlapped.
+	 * Every segment's place in the output is known before it is read, so the workers never wait on each other.
+	 */
+	void encryptAsync(const char* filenameIn, const char* filenameOut, std::vector<unsigned char>* digests = nullptr) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		const ContainerHeader header = beginContainer();
+		const uint64_t plainSize = fs::size(filenameIn);
+		ChunkIndex index = makeIndex(plainSize, header.size());
+		const uint64_t count = index.count();
+		const uint64_t indexOffset = header.size() + plainSize;
+		std::ostringstream headerBuf;
+		std::ostringstream indexBuf;
+
+		const ScopedFd src(filenameIn, O_RDONLY);
+		const ScopedFd dst(filenameOut, O_WRONLY | O_CREAT | O_TRUNC);
+		fs::allocateAll(dst.fd, indexOffset + indexSize(count, index.tagLen));
+
+		writeHeader(headerBuf, header);
+		fs::pwriteAll(dst.fd, headerBuf.str().data(), header.size(), 0);
+
+		if (digests) {
+			digests->resize(count * SEGMENT_DIGEST_LEN);
+		}
+		fs::pipelineChunks(src.fd, dst.fd, tp, count, chunkSize, [&](uint64_t i) {
+			return fs::ChunkRange{i * chunkSize, index.offsets[i], index.lengths[i]};
+		}, [&](uint64_t i, unsigned worker, unsigned char* buf, size_t len) {
+			encryptChunk(worker, i, i == count - 1, buf, len, buf, index.tag(i), digests ? digests->data() + i * SEGMENT_DIGEST_LEN : nullptr);
+		});
+
+		writeIndex(indexBuf, index, indexOffset);
+		fs::pwriteAll(dst.fd, indexBuf.str().data(), indexSize(count, index.tagLen), indexOffset);
+	}
+
+	/**
+	 * @brief Decrypts a container with reads, decryption and writes of different segments overlapped.
+	 * A segment is only written once its tag has been verified.
+	 */
+	void decryptAsync(const char* filenameIn, const char* filenameOut) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		ContainerHeader header;
+		ContainerFooter footer;
+		ChunkIndex index = loadIndex(filenameIn, header, footer);
+		const uint64_t plainSize = (footer.count - 1) * header.chunkSize + index.lengths[footer.count - 1];
+
+		const ScopedFd src(filenameIn, O_RDONLY);
+		const ScopedFd dst(filenameOut, O_WRONLY | O_CREAT | O_TRUNC);
+		fs::allocateAll(dst.fd, plainSize);
+
+		fs::pipelineChunks(src.fd, dst.fd, tp, footer.count, header.chunkSize, [&](uint64_t i) {
+			return fs::ChunkRange{index.offsets[i], i * header.chunkSize, index.lengths[i]};
+		}, [&](uint64_t i, unsigned worker, unsigned char* buf, size_t len) {
+			decryptChunk(worker, header.flags & CONTAINER_FLAG_CONVERGENT, i, i == footer.count - 1, buf, len, buf, index.tag(i));
+		});
+	}
+
+	/**
+	 * @brief Returns true if encryptChunked() would compress a file, which it decides from the entropy of the first segment.
+	 */
+	bool willCompress(const char* filenameIn) const {
+		if (codec == Compress::Codec::NONE) {
+			return false;
+		}
+
+		std::ifstream ifs(filenameIn, std::ios_base::in | std::ios_base::binary);
+		std::vector<unsigned char> buf(std::min<uint64_t>(chunkSize, fs::size(filenameIn)));
+		ifs.read(reinterpret_cast<char*>(buf.data()), buf.size());
+		return Compress::worthCompressing(buf.data(), ifs.gcount());
+	}
+
+	/**
+	 * @brief Returns true if a container was compressed.
+	 */
+	static bool isCompressed(const char* filenameIn) {
+		std::ifstream ifs(filenameIn, std::ios_base::in | std::ios_base::binary);
+		if (!ifs) {
+			lnthrow(fs::IOException, std::string("Failed to open input file \"") + filenameIn + "\" (" + std::strerror(errno) + ")");
+		}
+		return readHeader(ifs).codec != Compress::Codec::NONE;
+	}
+
+	/**
+	 * @param digests If not nullptr, each segment's plaintext digest is appended to this in order.
+	 */
+	void encryptFile(const char* filenameIn, const char* filenameOut, std::vector<unsigned char>* digests = nullptr) {
+		if (autoCipher) {
+			adoptCipher(autoChoice.first, autoChoice.second);
+		}
+		IoBackend be = chooseBackend(filenameIn);
+		// compressed segments do not have fixed offsets, which the other backends rely on
+		if (be != IoBackend::STREAM && willCompress(filenameIn)) {
+			be = IoBackend::STREAM;
+		}
+		switch (be) {
+		case IoBackend::MAPPED:
+			encryptMapped(filenameIn, filenameOut, digests);
+			return;
+		case IoBackend::ASYNC:
+			encryptAsync(filenameIn, filenameOut, digests);
+			return;
+		default:
+			withStreams(filenameIn, filenameOut, [this, digests](std::istream& in, std::ostream& out) {
+				encrypt(in, out, digests);
+			});
+		}
+	}
+
+	/**
+	 * @brief Encrypts a file that fits in one segment into a container in a single read and a single write.
+	 * The output is the same as encryptChunked()'s for the same file.
+	 *
+	 * @param headers The serialized header for an uncompressed container, then the one for a compressed container.
+	 * Their key salts, or in envelope mode their wrapped keys, are placeholders that are replaced with fresh ones for every file, so no two files share a key.
+	 * @param keyOffset The offset of that placeholder in either header, as returned by serializeHeader().
+	 *
+	 * @return False, without writing anything, if the file is not a regular file or is longer than one segment.
+	 *
+	 * @exception IOException I/O error.
+	 */
+	bool encryptSmallFile(const char* filenameIn, const char* filenameOut, unsigned worker, SmallFileSlot& slot, const std::string (&headers)[2], size_t keyOffset) {
+		const ScopedFd src(filenameIn, O_RDONLY);
+		struct stat st;
+
+		if (fstat(src.fd, &st) != 0) {
+			lnthrow(fs::IOException, std::string("Failed to stat \"") + filenameIn + "\" (" + std::strerror(errno) + ")");
+		}
+		if (!S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) > chunkSize) {
+			return false;
+		}
+		const size_t len = readUpTo(src.fd, filenameIn, slot.in.data(), chunkSize + 1);
+		if (len > chunkSize) {
+			return false;
+		}
+
+		const Compress::Codec c = codec != Compress::Codec::NONE && Compress::worthCompressing(slot.in.data(), len) ? codec : Compress::Codec::NONE;
+		const std::string& header = headers[c != Compress::Codec::NONE];
+		unsigned char* ptr = slot.out.data();
+
+		std::memcpy(ptr, header.data(), header.size());
+		if (envelope) {
+			const SecBytes dataKey = newDataKey();
+			wrapKey(dataKey, ptr + keyOffset);
+			keyWorker(worker, dataKey);
+		}
+		else {
+			unsigned char* salt = ptr + keyOffset;
+			CryptoPP::OS_GenerateRandomBlock(false, salt, KEY_SALT_LEN);
+			keyWorker(worker, saltedKey(salt, KEY_SALT_LEN));
+		}
+		ptr += header.size();
+		const size_t sealed = sealChunk(worker, c, 0, true, slot.in.data(), len, ptr, slot.index.tag(0));
+		ptr += sealed;
+		slot.index.offsets[0] = header.size();
+		slot.index.lengths[0] = sealed;
+		serializeIndex(slot.index, header.size() + sealed, ptr);
+		ptr += indexSize(1, slot.index.tagLen);
+
+		const ScopedFd dst(filenameOut, O_WRONLY | O_CREAT | O_TRUNC);
+		fs::pwriteAll(dst.fd, slot.out.data(), ptr - slot.out.data(), 0);
+		return true;
+	}
+
+	/**
+	 * @brief Encrypts every file in a list that fits in one segment, several at once across the pool.
+	 * Failures are recorded in errors instead of being thrown, and their output is removed.
+	 *
+	 * @return A flag per file that is set if the file was left for encryptFile(), because it is too large or not a regular file.
+	 */
+	std::vector<char> encryptSmallFiles(const std::vector<std::pair<std::string, std::string>>& files, std::vector<std::exception_ptr>& errors) {
+		std::vector<char> skipped(files.size(), 1);
+		if (chunkSize == 0 || files.empty()) {
+			return skipped;
+		}
+		if (autoCipher) {
+			adoptCipher(autoChoice.first, autoChoice.second);
+		}
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		if (codec != Compress::Codec::NONE) {
+			workerCompressors(codec);
+		}
+
+		// only the codec and the wrapped key or key salt differ between the headers of single-segment containers
+		ContainerHeader header = makeHeader();
+		if (envelope) {
+			header.wrappedKey.resize(wrappedKeySize());
+		}
+		else {
+			header.keySalt.resize(KEY_SALT_LEN);
+		}
+		std::string headers[2];
+		headers[0].resize(header.size());
+		const size_t keyOffset = serializeHeader(header, reinterpret_cast<unsigned char*>(&headers[0][0]));
+		header.codec = codec;
+		headers[1].resize(header.size());
+		serializeHeader(header, reinterpret_cast<unsigned char*>(&headers[1][0]));
+
+		std::vector<SmallFileSlot> slots(tp.size());
+		for (SmallFileSlot& slot : slots) {
+			slot.index.tagLen = header.tagLen;
+			slot.index.offsets.resize(1);
+			slot.index.lengths.resize(1);
+			slot.index.tags.resize(slot.index.tagLen);
+		}
+
+		tp.parallelFor(files.size(), [&](size_t i, unsigned worker) {
+			SmallFileSlot& slot = slots[worker];
+			if (slot.in.empty()) {
+				slot.in.resize(chunkSize + 1);
+				slot.out.resize(std::max(headers[0].size(), headers[1].size()) + chunkSize + 1 + indexSize(1, slot.index.tagLen));
+			}
+			try {
+				skipped[i] = !encryptSmallFile(files[i].first.c_str(), files[i].second.c_str(), worker, slot, headers, keyOffset);
+			}
+			catch (...) {
+				skipped[i] = 0;
+				errors[i] = std::current_exception();
+				try {
+					fs::remove(files[i].second.c_str());
+				}
+				catch (fs::IOException&) {}
+			}
+		});
+		return skipped;
+	}
+
+	/**
+	 * @brief Reads one segment of an open container, authenticates it, and throws the plaintext away.
+	 * The segment's pages are dropped from the page cache once they are read, so verifying an archive does not push everything else out of it.
+	 */
+	void verifySegment(int fd, unsigned worker, VerifySlot& slot, const ContainerHeader& header, ChunkIndex& index, uint64_t i, uint64_t count) const {
+		const size_t len = index.lengths[i];
+
+		if (slot.in.size() < len) {
+			slot.in.resize(len);
+		}
+		if (header.codec != Compress::Codec::NONE) {
+			if (slot.out.size() < header.chunkSize) {
+				slot.out.resize(header.chunkSize);
+			}
+			if (!slot.compressor || slot.compressor->codec() != header.codec) {
+				slot.compressor = std::make_unique<Compress::Compressor>(header.codec);
+			}
+		}
+
+		fs::preadAll(fd, slot.in.data(), len, index.offsets[i]);
+		posix_fadvise(fd, index.offsets[i], len, POSIX_FADV_DONTNEED);
+		unsigned char* out = header.codec == Compress::Codec::NONE ? slot.in.data() : slot.out.data();
+		openChunk(worker, slot.compressor.get(), header, i, i == count - 1, slot.in.data(), len, out, index.tag(i));
+	}
+
+	/**
+	 * @brief Authenticates every segment of a container in parallel without writing any plaintext.
+	 */
+	void verifyChunked(const char* filename) {
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		ContainerHeader header;
+		ContainerFooter footer;
+		ChunkIndex index = loadIndex(filename, header, footer);
+		std::vector<VerifySlot> slots(tp.size());
+
+		const ScopedFd src(filename, O_RDONLY);
+		posix_fadvise(src.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		tp.parallelFor(footer.count, [&](size_t i, unsigned worker) {
+			verifySegment(src.fd, worker, slots[worker], header, index, i, footer.count);
+		});
+	}
+
+	/**
+	 * @brief Authenticates a file encrypted as a single stream, discarding the plaintext.
+	 */
+	void verifyStream(const char* filename) {
+		std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+		if (!ifs) {
+			lnthrow(fs::IOException, std::string("Failed to open input file \"") + filename + "\" (" + std::strerror(errno) + ")");
+		}
+		std::ostream sink(nullptr);
+		decryptStream(ifs, sink);
+		if (ifs.bad()) {
+			lnthrow(fs::IOException, std::string("Input file I/O error: ") + std::strerror(errno));
+		}
+	}
+
+	void verifyFile(const char* filename) {
+		if (chunkSize == 0) {
+			verifyStream(filename);
+		}
+		else {
+			verifyChunked(filename);
+		}
+	}
+
+	/**
+	 * @brief Verifies a container with only one segment on the calling worker.
+	 * This changes nothing but the worker's own engine, so workers can run it side by side.
+	 *
+	 * @return False, without verifying anything, if the container has more than one segment or would need this Symmetric to switch ciphers. verifyFile() handles those.
+	 */
+	bool verifySmallFile(const char* filename, unsigned worker, VerifySlot& slot) {
+		std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+		if (!ifs) {
+			lnthrow(fs::IOException, std::string("Failed to open input file \"") + filename + "\" (" + std::strerror(errno) + ")");
+		}
+		const ContainerHeader header = readHeader(ifs);
+		if (header.bc != bc || header.cm != cm) {
+			return false;
+		}
+		const ContainerFooter footer = readFooter(ifs, header);
+		if (footer.count > 1) {
+			return false;
+		}
+		checkHeader(header);
+		keyWorker(worker, containerKey(header));
+		ChunkIndex index = readCheckedIndex(ifs, fs::size(filename), header, footer);
+		ifs.close();
+
+		const ScopedFd src(filename, O_RDONLY);
+		verifySegment(src.fd, worker, slot, header, index, 0, 1);
+		return true;
+	}
+
+	/**
+	 * @brief Verifies every single-segment container in a list, several at once across the pool.
+	 * Failures are recorded in errors instead of being thrown.
+	 *
+	 * @return A flag per file that is set if it was left for verifyFile().
+	 */
+	std::vector<char> verifySmallFiles(const std::vector<std::string>& files, std::vector<std::exception_ptr>& errors) {
+		std::vector<char> skipped(files.size(), 1);
+		if (chunkSize == 0 || files.empty()) {
+			return skipped;
+		}
+		validateChunked();
+
+		ThreadPool& tp = getPool();
+		workerEngines();
+		std::vector<VerifySlot> slots(tp.size());
+
+		tp.parallelFor(files.size(), [&](size_t i, unsigned worker) {
+			try {
+				skipped[i] = !verifySmallFile(files[i].c_str(), worker, slots[worker]);
+			}
+			catch (...) {
+				skipped[i] = 0;
+				errors[i] = std::current_exception();
+			}
+		});
+		return skipped;
+	}
+
+	/**
+	 * @brief Combines the segment digests collected by encryptFile() into a content digest.
+	 */
+	ContentDigest contentDigest(const std::vector<unsigned char>& digests) const {
+		CryptoPP::SHA256 hash;
+		ContentDigest ret;
+		const unsigned char cs[4] = {
+			static_cast<unsigned char>(chunkSize & 0xFF),
+			static_cast<unsigned char>((chunkSize >> 8) & 0xFF),
+			static_cast<unsigned char>((chunkSize >> 16) & 0xFF),
+			static_cast<unsigned char>((chunkSize >> 24) & 0xFF),
+		};
+
+		hash.Update(cs, sizeof(cs));
+		hash.Update(digests.data(), digests.size());
+		hash.Final(ret.data());
+		return ret;
+	}
+
+	void decryptFile(const char* filenameIn, const char* filenameOut) {
+		IoBackend be = chooseBackend(filenameIn);
+		if (be != IoBackend::STREAM && isCompressed(filenameIn)) {
+			be = IoBackend::STREAM;
+		}
+		switch (be) {
+		case IoBackend::MAPPED:
+			decryptMapped(filenameIn, filenameOut);
+			return;
+		case IoBackend::ASYNC:
+			decryptAsync(filenameIn, filenameOut);
+			return;
+		default:
+			withStreams(filenameIn, filenameOut, [this](std::istream& in, std::ostream& out) {
+				decrypt(in, out);
+			});
+		}
+	}
+};
+
+bool validateKeyLen(int keyLen, BlockCipher bc) {
+	if (bc == BlockCipher::CHACHA20 || bc == BlockCipher::AUTO) {
+		return keyLen == 256;
+	}
+	return keyLen == 128 || keyLen == 192 || keyLen == 256;
+}
+
+Symmetric::Symmetric(const char* password, BlockCipher bc, int keyLen, CipherMode cb): Symmetric(SecSpan(password), KdfParams(), bc, keyLen, cb) {}
+
+Symmetric::Symmetric(SecSpan password, BlockCipher bc, int keyLen, CipherMode cb): Symmetric(password, KdfParams(), bc, keyLen, cb) {}
+
+Symmetric::Symmetric(SecSpan password, const KdfParams& kdf, BlockCipher bc, int keyLen, CipherMode cb): impl(std::make_unique<SymmetricImpl>()) {
+	if (!validateKeyLen(keyLen, bc)) {
+		lnthrow(std::logic_error, "Key length " + std::to_string(keyLen) + " cannot be used with block cipher " + bcToString(bc));
+	}
+	const std::pair<BlockCipher, CipherMode> cipher = resolveCipher(bc, cb);
+	std::pair<SecBytes, SecBytes> keyPair = DeriveKeypair(password, keyLen / 8, getDerivedIvLen(cipher.first), kdf);
+	this->impl->key = std::move(keyPair.first);
+	this->impl->iv = std::move(keyPair.second);
+	this->impl->kdf = kdf;
+	this->impl->autoCipher = bc == BlockCipher::AUTO;
+	this->impl->autoChoice = cipher;
+	this->impl->init(cipher.first, keyLen, cipher.second);
+}
+
+Symmetric::Symmetric(const FileKey& key, BlockCipher bc, CipherMode cb): Symmetric(FileKey(key), bc, cb) {}
+
+Symmetric::Symmetric(FileKey&& key, BlockCipher bc, CipherMode cb): impl(std::make_unique<SymmetricImpl>()) {
+	const int keyLen = key.key.size() * 8;
+	if (!validateKeyLen(keyLen, bc)) {
+		lnthrow(std::logic_error, "Key length " + std::to_string(keyLen) + " cannot be used with block cipher " + bcToString(bc));
+	}
+	const std::pair<BlockCipher, CipherMode> cipher = resolveCipher(bc, cb);
+	if (key.iv.size() < getIvLen(cipher.first, cipher.second)) {
+		lnthrow(std::logic_error, "The IV must be at least " + std::to_string(getIvLen(cipher.first, cipher.second)) + " bytes for " + bcToString(cipher.first) + "/" + cmToString(cipher.second));
+	}
+	this->impl->key = std::move(key.key);
+	this->impl->iv = std::move(key.iv);
+	this->impl->kdf = key.kdf;
+	this->impl->autoCipher = bc == BlockCipher::AUTO;
+	this->impl->autoChoice = cipher;
+	this->impl->init(cipher.first, keyLen, cipher.second);
+}
+
+Symmetric::Symmetric(const MasterKey& key, BlockCipher bc, CipherMode cb): impl(std::make_unique<SymmetricImpl>()) {
+	constexpr int keyLen = MasterKey::LENGTH * 8;
+	if (!validateKeyLen(keyLen, bc)) {
+		lnthrow(std::logic_error, "Key length " + std::to_string(keyLen) + " cannot be used with block cipher " + bcToString(bc));
+	}
+	const std::pair<BlockCipher, CipherMode> cipher = resolveCipher(bc, cb);
+	// every KDF derives its output a block at a time, so the first keyLen bytes of the key and IV are the master key
+	this->impl->key = SecBytes(key.bytes().data(), key.bytes().size());
+	this->impl->iv = SecBytes(getDerivedIvLen(cipher.first));
+	std::memset(this->impl->iv.data(), 0, this->impl->iv.size());
+	this->impl->ivKnown = false;
+	this->impl->kdf = key.params();
+	this->impl->autoCipher = bc == BlockCipher::AUTO;
+	this->impl->autoChoice = cipher;
+	this->impl->init(cipher.first, keyLen, cipher.second);
+}
+
+void Symmetric::encryptData(const unsigned char* in, size_t inLen, unsigned char* out, size_t outLen) const {
+	if (inLen != outLen) {
+		lnthrow(std::logic_error, "inLen (" + std::to_string(inLen) + ") does not equal outLen (" + std::to_string(outLen) + ")");
+	}
+	this->impl->requireExplicitCipher("encryptData()");
+
+	this->impl->engine->encrypt(out, in, inLen);
+}
+
+void Symmetric::decryptData(const unsigned char* in, size_t inLen, unsigned char* out, size_t outLen) const {
+	if (inLen != outLen) {
+		lnthrow(std::logic_error, "inLen (" + std::to_string(inLen) + ") does not equal outLen (" + std::to_string(outLen) + ")");
+	}
+	this->impl->requireExplicitCipher("decryptData()");
+
+	this->impl->engine->decrypt(out, in, inLen);
+}
+
+void Symmetric::encryptv(const struct iovec* in, size_t inCount, const struct iovec* out, size_t outCount) const {
+	this->impl->requireExplicitCipher("encryptv()");
+
+	CipherEngine& engine = *this->impl->engine;
+	transformv(in, inCount, out, outCount, engine.mandatoryBlockSize(), [&engine](unsigned char* o, const unsigned char* i, size_t len) {
+		engine.encrypt(o, i, len);
+	});
+}
+
+void Symmetric::decryptv(const struct iovec* in, size_t inCount, const struct iovec* out, size_t outCount) const {
+	this->impl->requireExplicitCipher("decryptv()");
+
+	CipherEngine& engine = *this->impl->engine;
+	transformv(in, inCount, out, outCount, engine.mandatoryBlockSize(), [&engine](unsigned char* o, const unsigned char* i, size_t len) {
+		engine.decrypt(o, i, len);
+	});
+}
+
+void Symmetric::encryptFile(const char* filenameIn, const char* filenameOut) const {
+	processFile(filenameIn, filenameOut, [this](const char* in, const char* out) {
+		this->impl->encryptFile(in, out);
+	});
+}
+
+void Symmetric::encryptFile(const char* filenameInOut) const {
+	processFile(filenameInOut, [this](const char* in, const char* out) {
+		this->impl->encryptFile(in, out);
+	});
+}
+
+void Symmetric::verifyFile(const char* filename) const {
+	this->impl->verifyFile(filename);
+}
+
+std::vector<std::exception_ptr> Symmetric::verifyFiles(const std::vector<std::string>& filenames) const {
+	std::vector<std::exception_ptr> errors(filenames.size());
+	this->impl->validateBatch();
+	const std::vector<char> skipped = this->impl->verifySmallFiles(filenames, errors);
+
+	for (size_t i = 0; i < filenames.size(); ++i) {
+		if (!skipped[i]) {
+			continue;
+		}
+		try {
+			this->impl->verifyFile(filenames[i].c_str());
+		}
+		catch (...) {
+			errors[i] = std::current_exception();
+		}
+	}
+	return errors;
+}
+
+std::vector<std::exception_ptr> Symmetric::encryptFiles(const std::vector<std::pair<std::string, std::string>>& files) const {
+	std::vector<std::exception_ptr> errors(files.size());
+	this->impl->validateBatch();
+	const std::vector<char> skipped = this->impl->encryptSmallFiles(files, errors);
+
+	for (size_t i = 0; i < files.size(); ++i) {
+		if (!skipped[i]) {
+			continue;
+		}
+		try {
+			encryptFile(files[i].first.c_str(), files[i].second.c_str());
+		}
+		catch (...) {
+			errors[i] = std::current_exception();
+		}
+	}
+	return errors;
+}
+
+ContentDigest Symmetric::encryptFileHashed(const char* filenameIn, const char* filenameOut) const {
+	std::vector<unsigned char> digests;
+	processFile(filenameIn, filenameOut, [this, &digests](const char* in, const char* out) {
+		this->impl->encryptFile(in, out, &digests);
+	});
+	return this->impl->contentDigest(digests);
+}
+
+void Symmetric::decryptFile(const char* filenameIn, const char* filenameOut) const {
+	processFile(filenameIn, filenameOut, [this](const char* in, const char* out) {
+		this->impl->decryptFile(in, out);
+	});
+}
+
+void Symmetric::decryptFile(const char* filenameInOut) const {
+	processFile(filenameInOut, [this](const char* in, const char* out) {
+		this->impl->decryptFile(in, out);
+	});
+}
+
+size_t Symmetric::decryptRange(const char* filename, uint64_t offset, unsigned char* out, size_t len) const {
+	std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+	if (!ifs) {
+		lnthrow(fs::IOException, std::string("Failed to open input file \"") + filename + "\" (" + std::strerror(errno) + ")");
+	}
+	if (this->impl->chunkSize == 0) {
+		lnthrow(std::logic_error, "decryptRange() needs chunked mode, as files encrypted as a single stream cannot be read from the middle");
+	}
+
+	return this->impl->decryptRange(ifs, offset, out, len);
+}
+
+void Symmetric::rewrap(const char* filename, const Symmetric& to) const {
+	std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+	if (!ifs) {
+		lnthrow(fs::IOException, std::string("Failed to open input file \"") + filename + "\" (" + std::strerror(errno) + ")");
+	}
+	ContainerHeader header = readHeader(ifs);
+	ifs.close();
+
+	this->impl->checkHeader(header);
+	if (header.wrappedKey.empty()) {
+		lnthrow(std::runtime_error, std::string("\"") + filename + "\" was not encrypted with envelope encryption, so its key cannot be rewrapped");
+	}
+	if (to.impl->keyLen != header.keyLen) {
+		lnthrow(std::logic_error, "The container has a " + std::to_string(header.keyLen) + "-bit key, but the new key is " + std::to_string(to.impl->keyLen) + "-bit");
+	}
+	if (to.impl->kdf.salt.size() != header.kdf.salt.size()) {
+		lnthrow(std::logic_error, "The container has a " + std::to_string(header.kdf.salt.size()) + "-byte salt, but the new key's is " + std::to_string(to.impl->kdf.salt.size()) + " bytes, so the header cannot be rewritten in place");
+	}
+
+	const SecBytes dataKey = this->impl->unwrapKey(header.wrappedKey);
+	to.impl->wrapKey(dataKey, header.wrappedKey.data());
+	header.kdf = to.impl->kdf;
+
+	// the new header is exactly as long as the old one, so it is a single write to the first sector
+	std::vector<unsigned char> buf(header.size());
+	serializeHeader(header, buf.data());
+	const ScopedFd dst(filename, O_WRONLY);
+	fs::pwriteAll(dst.fd, buf.data(), buf.size(), 0);
+	if (fsync(dst.fd) != 0) {
+		lnthrow(fs::IOException, std::string("Failed to sync \"") + filename + "\" (" + std::strerror(errno) + ")");
+	}
+}
+
+Symmetric& Symmetric::setChunkSize(size_t chunkSize) {
+	if (chunkSize > UINT32_MAX) {
+		lnthrow(std::logic_error, "Chunk size " + std::to_string(chunkSize) + " is too large");
+	}
+	this->impl->chunkSize = chunkSize;
+	return *this;
+}
+
+Symmetric& Symmetric::setThreads(unsigned nThreads) {
+	this->impl->nThreads = nThreads;
+	this->impl->pool.reset();
+	return *this;
+}
+
+Symmetric& Symmetric::setIoBackend(IoBackend backend) {
+	this->impl->backend = backend;
+	return *this;
+}
+
+Symmetric& Symmetric::setEnvelope(bool envelope) {
+	this->impl->envelope = envelope;
+	return *this;
+}
+
+Symmetric& Symmetric::setConvergent(SecSpan secret) {
+	if (secret.size() != 0 && secret.size() < MIN_CONVERGENCE_SECRET_LEN) {
+		lnthrow(std::logic_error, "The convergence secret must be at least " + std::to_string(MIN_CONVERGENCE_SECRET_LEN) + " bytes");
+	}
+	this->impl->convergenceSecret = SecBytes(secret.data(), secret.size());
+	return *this;
+}
+
+Symmetric& Symmetric::setCompression(Compress::Codec codec, int level) {
+	if (codec != Compress::Codec::NONE) {
+		if (!Compress::codecAvailable(codec)) {
+			lnthrow(std::logic_error, std::string("This build does not support ") + Compress::codecToString(codec) + " compression");
+		}
+		if (!Compress::validLevel(codec, level)) {
+			lnthrow(std::logic_error, std::to_string(level) + " is not a valid level for " + Compress::codecToString(codec));
+		}
+	}
+	this->impl->codec = codec;
+	this->impl->level = level;
+	this->impl->compressors.clear();
+	return *this;
+}
+
+KdfParams Symmetric::kdfParams(const char* filename) {
+	std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+	if (!ifs) {
+		lnthrow(fs::IOException, std::string("Failed to open input file \"") + filename + "\" (" + std::strerror(errno) + ")");
+	}
+	return readHeader(ifs).kdf;
+}
+
+std::vector<SegmentName> Symmetric::segmentNames(const char* filename) {
+	std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+	if (!ifs) {
+		lnthrow(fs::IOException, std::string("Failed to open input file \"") + filename + "\" (" + std::strerror(errno) + ")");
+	}
+	const ContainerHeader header = readHeader(ifs);
+	const ContainerFooter footer = readFooter(ifs, header);
+	ChunkIndex index = SymmetricImpl::readCheckedIndex(ifs, fs::size(filename), header, footer);
+	ifs.close();
+
+	// a convergent entry's tag is the segment's tag, the sealed key, and the seal's tag, and both tags are the same length
+	size_t tagLen = index.tagLen;
+	if (header.flags & CONTAINER_FLAG_CONVERGENT) {
+		if (header.tagLen < header.keyLen / 8 || (header.tagLen - header.keyLen / 8) % 2 != 0) {
+			lnthrow(IntegrityException, "The container's tag length does not fit its key length");
+		}
+		tagLen = (header.tagLen - header.keyLen / 8) / 2;
+	}
+
+	const ScopedFd src(filename, O_RDONLY);
+	std::vector<SegmentName> ret(footer.count);
+	std::vector<unsigned char> buf;
+	CryptoPP::SHA256 hash;
+	for (uint64_t i = 0; i < footer.count; ++i) {
+		buf.resize(index.lengths[i]);
+		fs::preadAll(src.fd, buf.data(), buf.size(), index.offsets[i]);
+		hash.Update(buf.data(), buf.size());
+		hash.Update(index.tag(i), tagLen);
+		hash.Final(ret[i].data());
+	}
+	return ret;
+}
+
+Symmetric::~Symmetric() noexcept = default;
+
+}
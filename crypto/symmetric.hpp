@@ -9,8 +9,18 @@
 #ifndef __CS_CRYPTO_SYMMETRIC_HPP
 #define __CS_CRYPTO_SYMMETRIC_HPP
 
+#include "password.hpp"
 #include "secbytes.hpp"
+#include "../compress/codec.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <memory>
+#include <string>
+#include <sys/uio.h>
+#include <utility>
+#include <vector>
 
 namespace CloudSync::Crypto {
 
@@ -19,7 +29,15 @@ enum class BlockCipher {
 	BLOWFISH = 1,
 	CAMELLIA = 2,
 	CAST6 = 3,
+	/**
+	 * @brief ChaCha20. This is a stream cipher, so it can only be used with CipherMode::POLY1305.
+	 */
+	CHACHA20 = 4,
 	RIJNDAEL = 0,
+	/**
+	 * @brief Picks the fastest authenticated cipher for this CPU. See autoSelectCipher().
+	 */
+	AUTO = 0xFF,
 };
 
 enum class CipherMode {
@@ -29,15 +47,422 @@ enum class CipherMode {
 	CTR = 3,
 	EAX = 4,
 	GCM = 5,
+	/**
+	 * @brief Poly1305 authentication as in RFC 8439. This can only be used with BlockCipher::CHACHA20.
+	 */
+	POLY1305 = 6,
+	/**
+	 * @brief GCM for block ciphers and POLY1305 for ChaCha20.
+	 */
+	AUTO = 0xFF,
 };
 
+/**
+ * @brief Returns the name of a block cipher, such as "AES".
+ */
+const char* bcToString(BlockCipher bc);
+
+/**
+ * @brief Returns the name of a cipher mode, such as "GCM".
+ */
+const char* cmToString(CipherMode cm);
+
+/**
+ * @brief Returns true if this CPU has instructions for both AES and the carryless multiplication GCM needs.
+ * These are AES-NI and PCLMULQDQ on x86, and the AES and PMULL crypto extensions on ARMv8.
+ * The CPU is only probed the first time this is called.
+ */
+bool hasAesAcceleration() noexcept;
+
+/**
+ * @brief Returns the fastest authenticated cipher and mode for this CPU.
+ * This is AES-GCM if hasAesAcceleration(), since it then runs at a fraction of a cycle per byte.
+ * Otherwise it is ChaCha20-Poly1305, which is several times faster than table-based AES on CPUs such as older ARM cores and Atoms.
+ */
+std::pair<BlockCipher, CipherMode> autoSelectCipher() noexcept;
+
+/**
+ * @brief How encryptFile() and decryptFile() read and write files in chunked mode.
+ */
+enum class IoBackend {
+	/**
+	 * @brief ASYNC for files of at least 8 MiB if io_uring is available, otherwise MAPPED for files of at least 8 MiB, otherwise STREAM.
+	 */
+	AUTO = 0,
+	/**
+	 * @brief Read and write through streams a batch of segments at a time.
+	 * This is the only backend that works for pipes and other special files.
+	 */
+	STREAM = 1,
+	/**
+	 * @brief Memory-map both files.
+	 */
+	MAPPED = 2,
+	/**
+	 * @brief Read and write each segment at its offset, with I/O overlapped with encryption.
+	 * This uses io_uring when it is available, and blocking pread()/pwrite() on the pool's threads otherwise.
+	 */
+	ASYNC = 3,
+};
+
+/**
+ * @brief The default size of the segments encryptFile() splits a file into.
+ */
+constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+/**
+ * @brief A digest of a file's plaintext, as returned by Symmetric::encryptFileHashed().
+ */
+using ContentDigest = std::array<unsigned char, 32>;
+
+/**
+ * @brief The name of one segment of a container, as returned by Symmetric::segmentNames().
+ */
+using SegmentName = std::array<unsigned char, 32>;
+
+struct FileKey;
+class MasterKey;
+
 class Symmetric {
 public:
+	/**
+	 * @brief Creates a Symmetric from a password.
+	 *
+	 * With BlockCipher::AUTO, the cipher and mode are picked by autoSelectCipher() for encryption, and keySize must be 256.
+	 * The choice is recorded in each container's header, and decryption uses whatever the header says, so a file encrypted on one host can be decrypted on any other.
+	 * Since only containers record it, AUTO cannot be used with a chunk size of 0, encryptData(), or decryptData().
+	 *
+	 * @param password The password.
+	 * @param bc The block cipher.
+	 * @param keySize The key size in bits.
+	 * @param cb The mode.
+	 *
+	 * @exception std::logic_error The key size cannot be used with the cipher, or the cipher cannot be used with the mode.
+	 */
 	Symmetric(const char* password, BlockCipher bc = BlockCipher::AES, int keySize = 256, CipherMode cb = CipherMode::GCM);
+
+	/**
+	 * @brief Creates a Symmetric from a password that is not null-terminated, such as one held in a SecBytes.
+	 * The password is read in place, and the derived key and IV are moved into the Symmetric without being copied.
+	 */
+	Symmetric(SecSpan password, BlockCipher bc = BlockCipher::AES, int keySize = 256, CipherMode cb = CipherMode::GCM);
+
+	/**
+	 * @brief Creates a Symmetric from a password with a chosen KDF, cost, and salt, such as ones picked by CalibrateKdf().
+	 * The parameters, salt included, are recorded in every container this encrypts. To decrypt a container, pass the parameters returned by kdfParams().
+	 *
+	 * @exception std::logic_error The KDF parameters are invalid, the key size cannot be used with the cipher, or the cipher cannot be used with the mode.
+	 */
+	Symmetric(SecSpan password, const KdfParams& kdf, BlockCipher bc = BlockCipher::AES, int keySize = 256, CipherMode cb = CipherMode::GCM);
+
+	/**
+	 * @brief Creates a Symmetric from a per-file key, without running the password KDF.
+	 * The key size is taken from the key, so a FileKey derived with keyLen 32 gives AES-256.
+	 *
+	 * @param key A key from MasterKey::fileKey(). Its IV must be at least as long as the mode's IV, which is at most 16 bytes.
+	 * @param bc The block cipher.
+	 * @param cb The mode.
+	 *
+	 * @exception std::logic_error The key or IV has an invalid length for bc, or the cipher cannot be used with the mode.
+	 */
+	Symmetric(const FileKey& key, BlockCipher bc = BlockCipher::AES, CipherMode cb = CipherMode::GCM);
+
+	/**
+	 * @brief Creates a Symmetric from a per-file key, taking ownership of its key and IV instead of copying them.
+	 * The FileKey is left empty.
+	 */
+	Symmetric(FileKey&& key, BlockCipher bc = BlockCipher::AES, CipherMode cb = CipherMode::GCM);
+
+	/**
+	 * @brief Creates a Symmetric with the same 256-bit key as Symmetric(password, key.params(), bc, 256, cb), from a master key derived from that password, such as one cached by cloudsync-agent.
+	 * A master key is the start of what the KDF derives, which is the key, but not the IV derived after it.
+	 * Containers only use the key, so they work as they would with the password. Anything that needs the IV throws std::logic_error, which is a chunk size of 0 and the raw encryptData() family.
+	 *
+	 * @exception std::logic_error The cipher cannot be used with a 256-bit key or with the mode.
+	 */
+	Symmetric(const MasterKey& key, BlockCipher bc = BlockCipher::AES, CipherMode cb = CipherMode::GCM);
 	Symmetric(const char* key, const SecBytes& iv, BlockCipher bc = BlockCipher::AES, int keySize = 256, CipherMode cb = CipherMode::GCM);
 	void encryptData(const unsigned char* in, size_t inLen, unsigned char* out, size_t outLen) const;
 	void encryptFile(const char* filenameIn, const char* filenameOut) const;
 	void encryptFile(const char* filenameInOut) const;
+
+	/**
+	 * @brief Encrypts a file exactly as encryptFile() does, and hashes its plaintext in the same pass.
+	 * This is for backups that need a digest for change detection, without reading the file a second time.
+	 *
+	 * Each segment is hashed with SHA-256 by the worker that encrypts it, right before it is compressed or encrypted, so it is only pulled into cache once.
+	 * Uncompressed segments are hashed and encrypted in alternating 16 KiB slices that stay in L1.
+	 * The content digest is the SHA-256 of the chunk size as a 32-bit little-endian integer followed by every segment's digest in order.
+	 * It depends only on the plaintext and the chunk size, not on the threads, the I/O backend, the codec, or the key, so digests of files encrypted with the same chunk size can be compared.
+	 * With a chunk size of 0, the whole file is one segment.
+	 *
+	 * @param filenameIn The file to encrypt.
+	 * @param filenameOut Where to write the container.
+	 *
+	 * @return The content digest.
+	 *
+	 * @exception IOException I/O error.
+	 */
+	ContentDigest encryptFileHashed(const char* filenameIn, const char* filenameOut) const;
+
+	/**
+	 * @brief Encrypts many files, each into its own container, exactly as encryptFile() would.
+	 * This is for trees of small files, where opening two streams and running the cipher setup for every file costs more than encrypting it.
+	 *
+	 * Files that fit in one segment are handed out to the pool's workers, so several files are in flight at once.
+	 * Each worker reads a file whole with a single read(), seals it with its own already-keyed engine, and writes the container with a single write(), reusing its buffers from one file to the next.
+	 * Larger files, and anything that is not a regular file, go through encryptFile() one at a time afterwards, which splits them across the workers instead.
+	 * With a chunk size of 0, every file goes through encryptFile().
+	 *
+	 * @param files Pairs of input and output paths.
+	 *
+	 * @return One entry per file: nullptr if it was encrypted, or the exception encryptFile() would have thrown for it.
+	 * A file that fails has its output removed and does not stop the rest, whatever it throws.
+	 *
+	 * @exception std::logic_error This Symmetric cannot encrypt files as it is set up, such as when the cipher or mode cannot be used in chunked mode. This is checked before any file is touched.
+	 */
+	std::vector<std::exception_ptr> encryptFiles(const std::vector<std::pair<std::string, std::string>>& files) const;
+
+	/**
+	 * @brief Decrypts data encrypted by encryptData().
+	 * Like encryptData(), this continues a single stream across calls, so buffers must be passed in the order they were encrypted.
+	 * No tag is checked; use decryptFile() for authenticated decryption.
+	 *
+	 * @param in The ciphertext.
+	 * @param inLen The length of the ciphertext.
+	 * @param out Where to write the plaintext. This can be the same as in.
+	 * @param outLen The length of out. This must equal inLen.
+	 *
+	 * @exception std::logic_error inLen does not equal outLen.
+	 */
+	void decryptData(const unsigned char* in, size_t inLen, unsigned char* out, size_t outLen) const;
+
+	/**
+	 * @brief Encrypts data scattered across several buffers into several other buffers, as if each list were one contiguous buffer.
+	 * This continues the same stream as encryptData(), so the output is the same as one encryptData() call over the concatenated input, however either side is split.
+	 * Nothing is copied into an intermediate buffer, except for a single block when CBC needs one that straddles a boundary.
+	 *
+	 * @param in The input buffers.
+	 * @param inCount The number of input buffers.
+	 * @param out The output buffers. Output byte k may be at the same address as input byte k.
+	 * @param outCount The number of output buffers.
+	 *
+	 * @exception std::logic_error The input and output lengths differ, or the cipher was picked with BlockCipher::AUTO.
+	 */
+	void encryptv(const struct iovec* in, size_t inCount, const struct iovec* out, size_t outCount) const;
+
+	/**
+	 * @brief Decrypts data scattered across several buffers, the counterpart of encryptv().
+	 * Like decryptData(), no tag is checked.
+	 *
+	 * @exception std::logic_error The input and output lengths differ, or the cipher was picked with BlockCipher::AUTO.
+	 */
+	void decryptv(const struct iovec* in, size_t inCount, const struct iovec* out, size_t outCount) const;
+
+	/**
+	 * @brief Decrypts a file encrypted by encryptFile().
+	 * Chunked mode must be on if and only if it was on when the file was encrypted.
+	 * In chunked mode, each segment's tag is checked before its plaintext is written, and segments are decrypted in parallel just like encryptFile().
+	 * If anything fails, the output file is removed.
+	 *
+	 * @param filenameIn The encrypted file.
+	 * @param filenameOut Where to write the plaintext.
+	 *
+	 * @exception IntegrityException The ciphertext was modified, truncated, or encrypted with a different key.
+	 * @exception IOException I/O error.
+	 */
+	void decryptFile(const char* filenameIn, const char* filenameOut) const;
+
+	/**
+	 * @brief Decrypts a file encrypted by encryptFile() in place.
+	 * The plaintext is written to a temporary file that only replaces the original once every tag has been checked.
+	 *
+	 * @param filenameInOut The encrypted file.
+	 *
+	 * @exception IntegrityException The ciphertext was modified, truncated, or encrypted with a different key. The original file is left untouched.
+	 * @exception IOException I/O error.
+	 */
+	void decryptFile(const char* filenameInOut) const;
+
+	/**
+	 * @brief Checks that a file encrypted by encryptFile() still decrypts, without writing any plaintext.
+	 * Every segment is read, authenticated, and decompressed if it is compressed, and the plaintext is thrown away.
+	 * In chunked mode, segments are verified in parallel, and each is read with pread() and dropped from the page cache with posix_fadvise() right after, so auditing a large archive does not evict everything else.
+	 *
+	 * @param filename The encrypted file.
+	 *
+	 * @exception IntegrityException The ciphertext was modified, truncated, or encrypted with a different key.
+	 * @exception IOException I/O error.
+	 */
+	void verifyFile(const char* filename) const;
+
+	/**
+	 * @brief Verifies many files, as verifyFile() would.
+	 * Containers with one segment are verified several at a time across the pool, and larger ones one at a time with their segments in parallel.
+	 *
+	 * @param filenames The encrypted files.
+	 *
+	 * @return One entry per file: nullptr if it verified, or the exception verifyFile() would have thrown for it, whatever that is.
+	 *
+	 * @exception std::logic_error This Symmetric cannot verify files as it is set up, such as when the cipher or mode cannot be used in chunked mode. This is checked before any file is read.
+	 */
+	std::vector<std::exception_ptr> verifyFiles(const std::vector<std::string>& filenames) const;
+
+	/**
+	 * @brief Decrypts part of a file encrypted by encryptFile() in chunked mode.
+	 * Only the segments overlapping the range are read and decrypted, using the container's chunk index to find them, so the cost is proportional to the length of the range rather than the size of the file.
+	 * Every segment read is authenticated.
+	 *
+	 * @param filename The encrypted file.
+	 * @param offset The offset in the plaintext to start from.
+	 * @param out Where to write the plaintext.
+	 * @param len The number of bytes to decrypt.
+	 *
+	 * @return The number of bytes written to out. This is less than len if the range goes past the end of the plaintext.
+	 *
+	 * @exception IntegrityException The file is not a valid container, or a segment failed authentication.
+	 * @exception IOException I/O error.
+	 * @exception std::logic_error Chunked mode is off.
+	 */
+	size_t decryptRange(const char* filename, uint64_t offset, unsigned char* out, size_t len) const;
+
+	/**
+	 * @brief Moves a container encrypted with envelope encryption to another password, without touching its data.
+	 * The container's data key is unwrapped with this Symmetric's key and wrapped again with to's, and the new KDF parameters are recorded.
+	 * Only the header is rewritten, in place. It stays the same length and is well under one sector, so rotating a password costs one small write per file however large the files are.
+	 * The new password should be given a salt of its own with NewSalt(), which keeps the header the same length as long as the old key was salted too.
+	 *
+	 * @param filename The container.
+	 * @param to A Symmetric with the new password. It must have the same key size as the container, and its salt must be as long as the container's.
+	 *
+	 * @exception IntegrityException The container is invalid, or its data key does not unwrap with this Symmetric's key.
+	 * @exception IOException I/O error.
+	 * @exception std::runtime_error The container was not encrypted with envelope encryption, or with this Symmetric's parameters.
+	 * @exception std::logic_error to has a different key size or salt length.
+	 */
+	void rewrap(const char* filename, const Symmetric& to) const;
+
+	/**
+	 * @brief Sets the size of the segments that encryptFile() splits a file into.
+	 * Each segment is encrypted independently under its own nonce, STREAM-style: the nonce is a 7-byte prefix, a 32-bit segment counter, and a flag marking the final segment.
+	 * Every container is encrypted with a key of its own, derived from the password's key and a random salt in its header (or a random data key with setEnvelope()), so the prefix is zeros and no two files share a key and nonce.
+	 * Authenticated modes append their tag to every segment, so truncating, reordering, or dropping segments is detected.
+	 * Because no segment depends on another, they are processed in parallel, and the number of threads does not change the layout of the output.
+	 *
+	 * In chunked mode, encryptFile() writes a container (see crypto/container.hpp) whose header records the cipher, mode, KDF and chunk size, and whose trailing index records each segment's offset and tag.
+	 * decryptFile() and decryptRange() read the chunk size back from the header, so it does not have to match.
+	 *
+	 * Chunked mode is on by default with a chunk size of DEFAULT_CHUNK_SIZE.
+	 * It cannot be used with CBC or with 64-bit block ciphers such as Blowfish.
+	 *
+	 * A raw stream has no header to hold a salt, so with a chunk size of 0 every file is encrypted with the password's key and IV, as files were before chunked mode existed.
+	 * Encrypting two files that way under one password reuses a nonce, so it is only meant for reading and writing files in that old format.
+	 *
+	 * @param chunkSize The size of each segment in bytes, or 0 to encrypt the whole file as one raw stream on one thread. This cannot be more than 4 GiB - 1.
+	 *
+	 * @return this
+	 */
+	Symmetric& setChunkSize(size_t chunkSize);
+
+	/**
+	 * @brief Sets the number of threads used to encrypt segments in chunked mode.
+	 *
+	 * @param nThreads The number of threads, or 0 to use one per hardware thread.
+	 *
+	 * @return this
+	 */
+	Symmetric& setThreads(unsigned nThreads);
+
+	/**
+	 * @brief Sets how files are read and written in chunked mode.
+	 * The output is the same regardless of the backend.
+	 *
+	 * @param backend The backend. IoBackend::AUTO is the default.
+	 *
+	 * @return this
+	 */
+	Symmetric& setIoBackend(IoBackend backend);
+
+	/**
+	 * @brief Turns envelope encryption on or off for the containers encryptFile() writes in chunked mode.
+	 *
+	 * With envelope encryption, every container is encrypted with a random data key of its own instead of the key derived from the password.
+	 * The data key is wrapped with the password's key using AES-GCM and stored in the header, so changing the password with rewrap() only rewrites headers instead of re-encrypting every byte.
+	 * Unwrapping costs one AES-GCM operation over a single key per container.
+	 *
+	 * Decryption reads the wrapped key from the header whatever this is set to, so containers written either way can be decrypted by any Symmetric with the right password.
+	 * It is off by default. It cannot be used with a chunk size of 0, as a single stream has no header, and it does not affect encryptData() or encryptv().
+	 *
+	 * @param envelope True to turn envelope encryption on.
+	 *
+	 * @return this
+	 */
+	Symmetric& setEnvelope(bool envelope);
+
+	/**
+	 * @brief Turns convergent encryption on or off for the containers encryptFile() writes in chunked mode.
+	 *
+	 * In convergent mode, each segment is encrypted with a key derived from its own plaintext: HMAC-SHA256 of the segment under secret.
+	 * Any two segments with the same plaintext, cipher, chunk size and codec therefore encrypt to the same ciphertext, wherever and on whichever host they were encrypted, as long as the same secret is used.
+	 * segmentNames() names segments after their ciphertext, so a store that keeps segments by name can skip uploading any segment it already has.
+	 * Each segment's key is sealed in the container's index under the container's own key, so decrypting only needs the password, not the secret, and truncating or reordering segments is still detected.
+	 *
+	 * This gives up some confidentiality, which is why it is off by default:
+	 * - Anyone who can see the ciphertext, including the store, learns which segments are equal to each other, across files and across hosts.
+	 * - Anyone who knows the secret can confirm a guess of a segment's plaintext by encrypting the guess and comparing. Keep the secret to the hosts that should share storage; without it, nobody can compute a segment's key from a guess.
+	 * - Small segments with little entropy, such as the end of a configuration file, are the easiest to guess.
+	 *
+	 * @param secret The secret shared by the hosts whose segments should deduplicate, which must be at least 16 bytes. It is copied. An empty span turns convergent encryption off.
+	 *
+	 * @return this
+	 *
+	 * @exception std::logic_error The secret is too short.
+	 */
+	Symmetric& setConvergent(SecSpan secret);
+
+	/**
+	 * @brief Compresses each segment before it is encrypted in chunked mode.
+	 *
+	 * Before compressing a file, encryptFile() estimates the entropy of its first segment. If it looks already compressed (JPEG, zip, video), the whole file is stored uncompressed without spending any time trying.
+	 * Otherwise, each segment is compressed on its own, so decryptRange() still only touches the segments it needs, and any segment that does not get smaller is stored as is.
+	 * The codec is recorded in the container's header, and decryptFile() uses whatever codec the header names regardless of this setting.
+	 *
+	 * Compressed segments no longer line up with the plaintext, so compressed containers are always written and read through IoBackend::STREAM.
+	 *
+	 * @param codec The codec, or Compress::Codec::NONE to turn compression off, which is the default.
+	 * @param level The level to compress at, or 0 for the codec's default. See Compress::Codec for each codec's range.
+	 *
+	 * @return this
+	 *
+	 * @exception std::logic_error This build does not support the codec, or the level is invalid for it.
+	 */
+	Symmetric& setCompression(Compress::Codec codec, int level = 0);
+
+	/**
+	 * @brief Returns the KDF parameters recorded in a container's header, without needing the password.
+	 * Pass them to Symmetric(SecSpan, const KdfParams&, ...) to derive the key the container was encrypted with.
+	 *
+	 * @param filename The encrypted file.
+	 *
+	 * @exception IntegrityException The file is not a container.
+	 * @exception IOException I/O error.
+	 */
+	static KdfParams kdfParams(const char* filename);
+
+	/**
+	 * @brief Names every segment of a container after its ciphertext, without needing the password.
+	 * A segment's name is the SHA-256 of its ciphertext followed by its tag, so in convergent containers, equal segments get equal names.
+	 * A store can check a name against the bytes it receives, so nobody can poison a name with other data.
+	 *
+	 * @param filename The encrypted file.
+	 *
+	 * @return One name per segment, in order.
+	 *
+	 * @exception IntegrityException The file is not a valid container.
+	 * @exception IOException I/O error.
+	 */
+	static std::vector<SegmentName> segmentNames(const char* filename);
+
 	~Symmetric() noexcept;
 
 private:
@@ -0,0 +1,281 @@
+/** @file chunkpipeline.cpp
+ * @brief Reads, transforms, and writes fixed chunks of a file with I/O and computation overlapped.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "chunkpipeline.hpp"
+#include "io.hpp"
+#include "ioexception.hpp"
+#include "../lnthrow.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#ifdef CS_HAVE_LIBURING
+#include <liburing.h>
+#include <sys/uio.h>
+#endif
+
+namespace CloudSync::fs {
+
+/**
+ * @brief The number of chunks each io_uring worker keeps in flight.
+ */
+constexpr unsigned PIPELINE_DEPTH = 4;
+
+/**
+ * @brief The state shared by every worker of one pipelineChunks() call.
+ */
+struct Pipeline {
+	int fdIn;
+	int fdOut;
+	uint64_t count;
+	size_t maxLen;
+	const std::function<ChunkRange(uint64_t)>& range;
+	const std::function<void(uint64_t, unsigned, unsigned char*, size_t)>& transform;
+	std::atomic<uint64_t> next = 0;
+
+	/**
+	 * @brief Returns the next chunk to process, or count if there are none left.
+	 */
+	uint64_t take() {
+		uint64_t i = next++;
+		return i < count ? i : count;
+	}
+
+	/**
+	 * @brief Makes every worker stop taking chunks, which is used when one of them fails.
+	 */
+	void cancel() {
+		next = count;
+	}
+
+	void runBlocking(unsigned worker) {
+		std::vector<unsigned char> buf(maxLen);
+		for (uint64_t i = take(); i < count; i = take()) {
+			const ChunkRange r = range(i);
+			preadAll(fdIn, buf.data(), r.len, r.inOffset);
+			transform(i, worker, buf.data(), r.len);
+			pwriteAll(fdOut, buf.data(), r.len, r.outOffset);
+		}
+	}
+
+#ifdef CS_HAVE_LIBURING
+	struct Slot {
+		enum State { FREE, READING, WRITING } state = FREE;
+		uint64_t index;
+		ChunkRange r;
+		/**
+		 * @brief How much of the current read or write has completed, for resubmitting after a short transfer.
+		 */
+		size_t done;
+		/**
+		 * @brief True from when a request is queued until its completion is reaped. A slot that failed can be left READING or WRITING with nothing in flight, so this is what says whether the kernel still owns its buffer.
+		 */
+		bool pending = false;
+		unsigned bufIndex;
+		unsigned char* buf;
+	};
+
+	/**
+	 * @brief Queues the remainder of a slot's current read or write.
+	 */
+	void submitSlot(io_uring& ring, Slot& s, bool fixed) {
+		io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+		if (!sqe) {
+			// the ring has PIPELINE_DEPTH entries and each slot has at most one request in flight
+			lnthrow(std::logic_error, "io_uring submission queue is full");
+		}
+		if (s.state == Slot::READING) {
+			if (fixed) {
+				io_uring_prep_read_fixed(sqe, fdIn, s.buf + s.done, s.r.len - s.done, s.r.inOffset + s.done, s.bufIndex);
+			}
+			else {
+				io_uring_prep_read(sqe, fdIn, s.buf + s.done, s.r.len - s.done, s.r.inOffset + s.done);
+			}
+		}
+		else {
+			if (fixed) {
+				io_uring_prep_write_fixed(sqe, fdOut, s.buf + s.done, s.r.len - s.done, s.r.outOffset + s.done, s.bufIndex);
+			}
+			else {
+				io_uring_prep_write(sqe, fdOut, s.buf + s.done, s.r.len - s.done, s.r.outOffset + s.done);
+			}
+		}
+		io_uring_sqe_set_data(sqe, &s);
+		s.pending = true;
+	}
+
+	/**
+	 * @brief Starts reading the next chunk into a free slot.
+	 *
+	 * @return False if there are no chunks left.
+	 */
+	bool startSlot(io_uring& ring, Slot& s, bool fixed) {
+		uint64_t i = take();
+		if (i >= count) {
+			return false;
+		}
+		s.index = i;
+		s.r = range(i);
+		s.done = 0;
+		s.state = Slot::READING;
+		submitSlot(ring, s, fixed);
+		return true;
+	}
+
+	/**
+	 * @brief Handles one completion.
+	 *
+	 * @return The number of requests that left flight, which is 1 if the slot became free and 0 if it has another request queued.
+	 */
+	unsigned complete(io_uring& ring, Slot& s, int res, unsigned worker, bool fixed) {
+		if (res < 0) {
+			lnthrow(IOException, std::string(s.state == Slot::READING ? "Failed to read input (" : "Failed to write output (") + std::strerror(-res) + ")");
+		}
+		if (res == 0 && s.state == Slot::READING && s.done < s.r.len) {
+			lnthrow(IOException, "The input file ended early. It may have been truncated while being read.");
+		}
+		s.done += res;
+
+		if (s.done < s.r.len) {
+			submitSlot(ring, s, fixed);
+			return 0;
+		}
+		if (s.state == Slot::READING) {
+			transform(s.index, worker, s.buf, s.r.len);
+			s.state = Slot::WRITING;
+			s.done = 0;
+			submitSlot(ring, s, fixed);
+			return 0;
+		}
+		s.state = Slot::FREE;
+		return 1;
+	}
+
+	/**
+	 * @brief Runs a worker on its own ring.
+	 *
+	 * @return False if a ring could not be set up, in which case nothing was processed and the caller should fall back to runBlocking().
+	 */
+	bool runAsync(unsigned worker) {
+		io_uring ring;
+		std::vector<unsigned char> mem(PIPELINE_DEPTH * maxLen);
+		std::vector<iovec> iov(PIPELINE_DEPTH);
+		Slot slots[PIPELINE_DEPTH];
+		unsigned inFlight = 0;
+		bool fixed;
+
+		if (io_uring_queue_init(PIPELINE_DEPTH, &ring, 0) < 0) {
+			return false;
+		}
+		for (unsigned i = 0; i < PIPELINE_DEPTH; ++i) {
+			slots[i].bufIndex = i;
+			slots[i].buf = mem.data() + i * maxLen;
+			iov[i].iov_base = slots[i].buf;
+			iov[i].iov_len = maxLen;
+		}
+		// registered buffers count against RLIMIT_MEMLOCK on older kernels, so plain reads and writes are the fallback
+		fixed = maxLen > 0 && io_uring_register_buffers(&ring, iov.data(), PIPELINE_DEPTH) == 0;
+
+		try {
+			for (;;) {
+				for (Slot& s : slots) {
+					if (s.state == Slot::FREE && startSlot(ring, s, fixed)) {
+						++inFlight;
+					}
+				}
+				if (inFlight == 0) {
+					break;
+				}
+
+				io_uring_cqe* cqe;
+				int res = io_uring_submit_and_wait(&ring, 1);
+				if (res < 0 && res != -EINTR) {
+					lnthrow(IOException, std::string("io_uring_submit_and_wait failed (") + std::strerror(-res) + ")");
+				}
+				while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+					Slot& s = *static_cast<Slot*>(io_uring_cqe_get_data(cqe));
+					res = cqe->res;
+					io_uring_cqe_seen(&ring, cqe);
+					s.pending = false;
+					inFlight -= complete(ring, s, res, worker, fixed);
+				}
+			}
+		}
+		catch (...) {
+			// the kernel may still be writing into our buffers, so wait for everything in flight before they are freed
+			// a slot whose completion threw has already been reaped, so only the slots still pending are waited for
+			cancel();
+			io_uring_submit(&ring);
+			while (std::any_of(std::begin(slots), std::end(slots), [](const Slot& s) { return s.pending; })) {
+				io_uring_cqe* cqe;
+				const int res = io_uring_wait_cqe(&ring, &cqe);
+				if (res == -EINTR) {
+					continue;
+				}
+				if (res < 0) {
+					break;
+				}
+				static_cast<Slot*>(io_uring_cqe_get_data(cqe))->pending = false;
+				io_uring_cqe_seen(&ring, cqe);
+			}
+			io_uring_queue_exit(&ring);
+			throw;
+		}
+
+		io_uring_queue_exit(&ring);
+		return true;
+	}
+#endif
+
+	void run(unsigned worker, bool useAsync) {
+		try {
+#ifdef CS_HAVE_LIBURING
+			if (useAsync && runAsync(worker)) {
+				return;
+			}
+#else
+			(void)useAsync;
+#endif
+			runBlocking(worker);
+		}
+		catch (...) {
+			cancel();
+			throw;
+		}
+	}
+};
+
+bool asyncIoAvailable() noexcept {
+#ifdef CS_HAVE_LIBURING
+	static const bool available = []() {
+		io_uring ring;
+		if (io_uring_queue_init(1, &ring, 0) < 0) {
+			return false;
+		}
+		io_uring_queue_exit(&ring);
+		return true;
+	}();
+	return available;
+#else
+	return false;
+#endif
+}
+
+void pipelineChunks(int fdIn, int fdOut, ThreadPool& pool, uint64_t count, size_t maxLen, const std::function<ChunkRange(uint64_t index)>& range, const std::function<void(uint64_t index, unsigned worker, unsigned char* buf, size_t len)>& transform, bool useAsync) {
+	Pipeline p{fdIn, fdOut, count, maxLen, range, transform};
+
+	pool.parallelFor(pool.size(), [&p, useAsync](size_t, unsigned worker) {
+		p.run(worker, useAsync);
+	});
+}
+
+}
@@ -0,0 +1,65 @@
+/** @file chunkpipeline.hpp
+ * @brief Reads, transforms, and writes fixed chunks of a file with I/O and computation overlapped.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_CHUNKPIPELINE_HPP
+#define __CS_CHUNKPIPELINE_HPP
+
+#include "../threadpool.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief Where a chunk comes from and where it goes.
+ */
+struct ChunkRange {
+	/**
+	 * @brief The offset of the chunk in the input file.
+	 */
+	uint64_t inOffset;
+	/**
+	 * @brief The offset the transformed chunk is written to in the output file.
+	 */
+	uint64_t outOffset;
+	/**
+	 * @brief The length of the chunk, which is the same before and after the transform.
+	 */
+	size_t len;
+};
+
+/**
+ * @brief Returns true if this build has io_uring support and the running kernel allows it.
+ */
+bool asyncIoAvailable() noexcept;
+
+/**
+ * @brief Reads every chunk of one file, transforms it in place, and writes it to another file.
+ *
+ * Every worker of the pool takes chunks from a shared counter.
+ * With io_uring, each worker owns a ring and a few registered buffers, and keeps reads and writes of several chunks in flight while it transforms the one that just arrived.
+ * Without it, each worker uses blocking pread()/pwrite(), so I/O only overlaps across workers.
+ *
+ * @param fdIn The input file. It must support pread().
+ * @param fdOut The output file. It must support pwrite().
+ * @param pool The pool to run on.
+ * @param count The number of chunks.
+ * @param maxLen The largest length of any chunk.
+ * @param range Returns the ChunkRange for a chunk index. It is called from the worker threads.
+ * @param transform Transforms a chunk in place. Its arguments are the chunk index, the worker index, the buffer, and its length.
+ * @param useAsync Set this to false to use pread()/pwrite() even if io_uring is available.
+ *
+ * @exception IOException I/O error, or the input ended before a chunk did.
+ * @exception std::exception Anything thrown by transform is rethrown once all I/O in flight has finished.
+ */
+void pipelineChunks(int fdIn, int fdOut, ThreadPool& pool, uint64_t count, size_t maxLen, const std::function<ChunkRange(uint64_t index)>& range, const std::function<void(uint64_t index, unsigned worker, unsigned char* buf, size_t len)>& transform, bool useAsync = true);
+
+}
+
+#endif
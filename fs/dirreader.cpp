@@ -0,0 +1,166 @@
+/** @file dirreader.cpp
+ * @brief Reads directory entries in bulk with getdents64().
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "dirreader.hpp"
+#include "ioexception.hpp"
+#include "../lnthrow.hpp"
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief The layout of the records getdents64() returns, which glibc does not declare before 2.30.
+ */
+struct LinuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	/**
+	 * @brief The start of the null-terminated name, which runs past the end of the struct.
+	 */
+	char d_name[1];
+};
+
+static Type typeFromMode(unsigned mode) noexcept {
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return Type::File;
+	case S_IFDIR:
+		return Type::Directory;
+	case S_IFLNK:
+		return Type::Symlink;
+	default:
+		return Type::Other;
+	}
+}
+
+static Type typeFromDirent(unsigned char type) noexcept {
+	switch (type) {
+	case DT_REG:
+		return Type::File;
+	case DT_DIR:
+		return Type::Directory;
+	case DT_LNK:
+		return Type::Symlink;
+	default:
+		return Type::Other;
+	}
+}
+
+bool fillEntry(int dirFd, const DirEntry& d, unsigned fields, Entry& out) {
+	out.inode = d.inode;
+	out.fields = 0;
+
+	unsigned mask = 0;
+	if (d.type == DT_UNKNOWN) {
+		mask |= STATX_TYPE;
+	}
+	else {
+		out.type = typeFromDirent(d.type);
+	}
+	if (fields & ENTRY_SIZE) {
+		mask |= STATX_SIZE;
+	}
+	if (fields & ENTRY_MTIME) {
+		mask |= STATX_MTIME;
+	}
+	if (fields & ENTRY_MODE) {
+		mask |= STATX_TYPE | STATX_MODE;
+	}
+	if (fields & ENTRY_CTIME) {
+		mask |= STATX_CTIME;
+	}
+	if (mask == 0) {
+		return true;
+	}
+
+	struct statx st;
+	if (statx(dirFd, d.name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_SYNC_AS_STAT, mask, &st) != 0) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		lnthrow(IOException, std::string("Failed to stat \"") + d.name + "\" (" + std::strerror(errno) + ")");
+	}
+
+	if (d.type == DT_UNKNOWN) {
+		out.type = typeFromMode(st.stx_mode);
+	}
+	if (fields & ENTRY_SIZE) {
+		out.size = st.stx_size;
+		out.fields |= ENTRY_SIZE;
+	}
+	if (fields & ENTRY_MTIME) {
+		out.mtime = st.stx_mtime.tv_sec * INT64_C(1000000000) + st.stx_mtime.tv_nsec;
+		out.fields |= ENTRY_MTIME;
+	}
+	if (fields & ENTRY_MODE) {
+		out.mode = st.stx_mode;
+		out.fields |= ENTRY_MODE;
+	}
+	if (fields & ENTRY_CTIME) {
+		out.ctime = st.stx_ctime.tv_sec * INT64_C(1000000000) + st.stx_ctime.tv_nsec;
+		out.fields |= ENTRY_CTIME;
+	}
+	return true;
+}
+
+int openDirectoryAt(int dirFd, const char* name, bool follow) noexcept {
+	int fd;
+	do {
+		fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+	} while (fd < 0 && errno == EINTR);
+	return fd;
+}
+
+DirReader::DirReader(size_t bufferSize): buf(bufferSize) {}
+
+void DirReader::reset(int fd) noexcept {
+	this->fd = fd;
+	this->pos = 0;
+	this->len = 0;
+}
+
+bool DirReader::next(DirEntry& entry) {
+	for (;;) {
+		if (this->pos >= this->len) {
+			long n;
+			do {
+				n = syscall(SYS_getdents64, this->fd, this->buf.data(), this->buf.size());
+			} while (n < 0 && errno == EINTR);
+			if (n < 0) {
+				lnthrow(IOException, std::string("Failed to read directory entries (") + std::strerror(errno) + ")");
+			}
+			if (n == 0) {
+				return false;
+			}
+			this->pos = 0;
+			this->len = n;
+		}
+
+		const LinuxDirent64* d = reinterpret_cast<const LinuxDirent64*>(this->buf.data() + this->pos);
+		this->pos += d->d_reclen;
+		const char* name = d->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+			continue;
+		}
+		entry.name = name;
+		entry.inode = d->d_ino;
+		entry.type = d->d_type;
+		return true;
+	}
+}
+
+}
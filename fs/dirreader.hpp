@@ -0,0 +1,149 @@
+/** @file dirreader.hpp
+ * @brief Reads directory entries in bulk with getdents64().
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_DIRREADER_HPP
+#define __CS_DIRREADER_HPP
+
+#include "file.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief The size of the buffer a DirReader reads entries into, which holds several hundred entries per getdents64() call.
+ */
+constexpr size_t DIRENT_BUFFER_SIZE = 32 << 10;
+
+/**
+ * @brief One entry of a directory, as returned by DirReader::next().
+ */
+struct DirEntry {
+	/**
+	 * @brief The entry's name, without its directory. This is only valid until the next call to DirReader::next().
+	 */
+	const char* name;
+	uint64_t inode;
+	/**
+	 * @brief The entry's type as a DT_ constant from <dirent.h>. Some filesystems always report DT_UNKNOWN.
+	 */
+	unsigned char type;
+};
+
+/**
+ * @brief The stat data an Entry can carry. These can be or'd together to ask a walker for several.
+ * An entry's type and inode come from the directory listing itself and are always filled, so asking for none of these costs no system calls per file.
+ * Asking for any of them costs one statx() per file, which only retrieves the requested fields.
+ */
+enum EntryField {
+	ENTRY_SIZE = 1 << 0,
+	ENTRY_MTIME = 1 << 1,
+	ENTRY_MODE = 1 << 2,
+	ENTRY_CTIME = 1 << 3,
+};
+
+/**
+ * @brief A file found by a walker, along with whatever stat data it was asked for.
+ */
+struct Entry {
+	/**
+	 * @brief The entry's path, which starts with the walker's base directory.
+	 */
+	const char* path;
+	Type type;
+	uint64_t inode;
+	/**
+	 * @brief The size in bytes. Only filled if ENTRY_SIZE is in fields.
+	 */
+	uint64_t size;
+	/**
+	 * @brief The modification time in nanoseconds since the epoch. Only filled if ENTRY_MTIME is in fields.
+	 */
+	int64_t mtime;
+	/**
+	 * @brief The status change time in nanoseconds since the epoch. Only filled if ENTRY_CTIME is in fields.
+	 */
+	int64_t ctime;
+	/**
+	 * @brief The st_mode, including the file type bits. Only filled if ENTRY_MODE is in fields.
+	 */
+	uint32_t mode;
+	/**
+	 * @brief The EntryField values that were filled.
+	 */
+	unsigned fields;
+};
+
+/**
+ * @brief Fills an Entry's type, inode, and requested stat data from a directory listing, calling statx() only if the listing does not have everything that was asked for.
+ * Symbolic links are not followed.
+ *
+ * @param dirFd The directory containing the entry.
+ * @param d The entry as listed by DirReader::next().
+ * @param fields The EntryField values to fill.
+ * @param out The entry to fill. Its path is left alone.
+ *
+ * @return True if the entry was filled, or false if it was removed after being listed.
+ *
+ * @exception IOException I/O error.
+ */
+bool fillEntry(int dirFd, const DirEntry& d, unsigned fields, Entry& out);
+
+/**
+ * @brief Opens a directory relative to another one's file descriptor, by default without following a symlink in its place.
+ *
+ * @param dirFd The parent directory, or AT_FDCWD for a path relative to the working directory.
+ * @param name The directory's name or path relative to dirFd.
+ * @param follow True to follow a symlink in name's place. Walkers do this for their base directory only, so a base directory that is a symlink still works while symlinks inside the tree are never followed.
+ *
+ * @return The file descriptor, or -1 with errno set.
+ */
+int openDirectoryAt(int dirFd, const char* name, bool follow = false) noexcept;
+
+/**
+ * @brief Reads a directory's entries with getdents64(), so one system call returns as many entries as fit in its buffer instead of going through readdir()'s DIR stream.
+ * A DirReader does not own the directory's file descriptor, and can be reused for one directory after another without reallocating its buffer.
+ */
+class DirReader {
+public:
+	/**
+	 * @brief Constructs a DirReader that is not reading any directory yet.
+	 *
+	 * @param bufferSize The size of the buffer that entries are read into.
+	 */
+	DirReader(size_t bufferSize = DIRENT_BUFFER_SIZE);
+
+	/**
+	 * @brief Starts reading another directory from its beginning.
+	 *
+	 * @param fd The directory's file descriptor, which must stay open until the last call to next().
+	 */
+	void reset(int fd) noexcept;
+
+	/**
+	 * @brief Reads the next entry, skipping "." and "..".
+	 *
+	 * @param entry Where to store the entry.
+	 *
+	 * @return True if an entry was read, or false if the directory has no more.
+	 *
+	 * @exception IOException I/O error.
+	 */
+	bool next(DirEntry& entry);
+
+private:
+	int fd = -1;
+	std::vector<unsigned char> buf;
+	size_t pos = 0;
+	size_t len = 0;
+};
+
+}
+
+#endif
@@ -194,7 +194,7 @@ std::pair<std::string, std::ofstream> makeTemp(const char* baseDir) {
 		char tmpname[11];
 
 		for (char& c : tmpname) {
-			c = alphabet[std::rand() % sizeof(alphabet) - 1];
+			c = alphabet[std::rand() % (sizeof(alphabet) - 1)];
 		}
 		tmpname[sizeof(tmpname) - 1] = '\0';
 
@@ -0,0 +1,359 @@
+/** @file fileindex.cpp
+ * @brief Remembers the state of every file from the previous run so unchanged files can be skipped.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "fileindex.hpp"
+#include "file.hpp"
+#include "io.hpp"
+#include "ioexception.hpp"
+#include "mappedfile.hpp"
+#include "notfoundexception.hpp"
+#include "../logger.hpp"
+#include "../lnthrow.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace CloudSync::fs {
+
+constexpr char INDEX_MAGIC[8] = {'C', 'S', 'F', 'I', 'N', 'D', 'E', 'X'};
+constexpr uint32_t INDEX_VERSION = 1;
+/**
+ * @brief Reads back differently on a machine with another byte order.
+ */
+constexpr uint32_t INDEX_BYTE_ORDER = 0x01020304;
+/**
+ * @brief FileRecord::flags bit for a file that was modified within RACY_WINDOW_NS of being recorded, which skip() never trusts.
+ */
+constexpr uint32_t RECORD_RACY = 1;
+constexpr int64_t RACY_WINDOW_NS = 1000000000;
+/**
+ * @brief The number of records commit() buffers before writing them.
+ */
+constexpr size_t WRITE_BATCH = 4096;
+
+/**
+ * @brief The layout of an index file is:
+ * IndexHeader
+ * DiskRecord[count], sorted by path
+ * char[stringsSize], the paths, which are not null-terminated
+ */
+struct IndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t recordSize;
+	uint32_t reserved;
+	uint64_t count;
+	uint64_t stringsSize;
+};
+
+struct DiskRecord {
+	/**
+	 * @brief Where the path starts in the path table.
+	 */
+	uint64_t pathOffset;
+	uint32_t pathLen;
+	uint32_t reserved;
+	FileRecord record;
+};
+
+static_assert(sizeof(IndexHeader) == 40, "IndexHeader must not have padding");
+static_assert(sizeof(DiskRecord) == 88, "DiskRecord must not have padding");
+static_assert(sizeof(IndexHeader) % alignof(DiskRecord) == 0, "The records must be aligned in the mapping");
+
+/**
+ * @brief A temporary file that is removed unless it was renamed into place.
+ */
+struct TempFile {
+	std::string path;
+	int fd = -1;
+	bool renamed = false;
+
+	~TempFile() {
+		if (this->fd >= 0) {
+			close(this->fd);
+		}
+		if (!this->renamed) {
+			unlink(this->path.c_str());
+		}
+	}
+};
+
+struct FileIndex::FileIndexImpl {
+	std::string path;
+	/**
+	 * @brief When this FileIndex was loaded, in nanoseconds since the epoch. Files modified after RACY_WINDOW_NS before this are marked racy when recorded.
+	 */
+	int64_t runStart;
+
+	/**
+	 * @brief Held shared while the loaded index is searched, and exclusively while commit() replaces it.
+	 */
+	mutable std::shared_mutex mapLock;
+	std::optional<MappedFile> map;
+	const DiskRecord* records = nullptr;
+	size_t count = 0;
+	const char* strings = nullptr;
+	uint64_t stringsSize = 0;
+
+	/**
+	 * @brief Guards kept and puts. When both are needed, mapLock is taken first.
+	 */
+	std::mutex m;
+	/**
+	 * @brief The indices of records carried over to the next commit().
+	 */
+	std::vector<size_t> kept;
+	/**
+	 * @brief The records put since the last commit(). This is a deque so views of its paths stay valid as it grows.
+	 */
+	std::deque<std::pair<std::string, FileRecord>> puts;
+
+	void load() {
+		this->records = nullptr;
+		this->count = 0;
+		this->strings = nullptr;
+		this->stringsSize = 0;
+		try {
+			this->map.emplace(this->path.c_str());
+		}
+		catch (NotFoundException&) {
+			return;
+		}
+
+		const unsigned char* data = this->map->data();
+		const uint64_t size = this->map->size();
+		IndexHeader h;
+		if (size < sizeof(h)) {
+			return this->reject("it is truncated");
+		}
+		std::memcpy(&h, data, sizeof(h));
+		if (std::memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) != 0 || h.version != INDEX_VERSION) {
+			return this->reject("it is not a version " + std::to_string(INDEX_VERSION) + " file index");
+		}
+		if (h.byteOrder != INDEX_BYTE_ORDER || h.recordSize != sizeof(DiskRecord)) {
+			return this->reject("it was written on a different architecture");
+		}
+		if (h.count > (size - sizeof(h)) / sizeof(DiskRecord) || size - sizeof(h) - h.count * sizeof(DiskRecord) != h.stringsSize) {
+			return this->reject("its size does not match its header");
+		}
+
+		madvise(const_cast<unsigned char*>(data), size, MADV_RANDOM);
+		this->records = reinterpret_cast<const DiskRecord*>(data + sizeof(h));
+		this->count = h.count;
+		this->strings = reinterpret_cast<const char*>(data + sizeof(h) + h.count * sizeof(DiskRecord));
+		this->stringsSize = h.stringsSize;
+	}
+
+	void reject(const std::string& reason) {
+		LOG(LEVEL_WARNING) << "Ignoring the file index \"" << this->path << "\" because " << reason << ". Every file will be hashed again.";
+		this->map.reset();
+	}
+
+	/**
+	 * @brief Returns a record's path, or an empty string if it points outside of the path table.
+	 */
+	std::string_view pathAt(size_t i) const noexcept {
+		const DiskRecord& r = this->records[i];
+		if (r.pathOffset > this->stringsSize || r.pathLen > this->stringsSize - r.pathOffset) {
+			return std::string_view();
+		}
+		return std::string_view(this->strings + r.pathOffset, r.pathLen);
+	}
+
+	/**
+	 * @brief Binary searches the loaded index for a path.
+	 *
+	 * @return The record's index, or count if it is not there.
+	 */
+	size_t lookup(std::string_view path) const noexcept {
+		size_t lo = 0;
+		size_t hi = this->count;
+		while (lo < hi) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (this->pathAt(mid) < path) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		return lo < this->count && this->pathAt(lo) == path ? lo : this->count;
+	}
+
+	void write(const std::vector<std::pair<std::string_view, const FileRecord*>>& all) {
+		TempFile tmp;
+		tmp.path = this->path + ".XXXXXX";
+		tmp.fd = mkostemp(tmp.path.data(), O_CLOEXEC);
+		if (tmp.fd < 0) {
+			tmp.renamed = true;
+			lnthrow(IOException, "Failed to create a temporary file for \"" + this->path + "\" (" + std::strerror(errno) + ")");
+		}
+
+		IndexHeader h = {};
+		std::memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+		h.version = INDEX_VERSION;
+		h.byteOrder = INDEX_BYTE_ORDER;
+		h.recordSize = sizeof(DiskRecord);
+		h.count = all.size();
+		for (const auto& p : all) {
+			h.stringsSize += p.first.size();
+		}
+		pwriteAll(tmp.fd, &h, sizeof(h), 0);
+
+		const uint64_t stringsStart = sizeof(h) + all.size() * sizeof(DiskRecord);
+		std::vector<DiskRecord> recordBuf;
+		std::string stringBuf;
+		uint64_t recordPos = sizeof(h);
+		uint64_t stringPos = 0;
+		recordBuf.reserve(WRITE_BATCH);
+		for (size_t i = 0; i < all.size(); ++i) {
+			DiskRecord r = {};
+			r.pathOffset = stringPos + stringBuf.size();
+			r.pathLen = all[i].first.size();
+			r.record = *all[i].second;
+			recordBuf.push_back(r);
+			stringBuf.append(all[i].first);
+
+			if (recordBuf.size() == WRITE_BATCH || i + 1 == all.size()) {
+				pwriteAll(tmp.fd, recordBuf.data(), recordBuf.size() * sizeof(DiskRecord), recordPos);
+				pwriteAll(tmp.fd, stringBuf.data(), stringBuf.size(), stringsStart + stringPos);
+				recordPos += recordBuf.size() * sizeof(DiskRecord);
+				stringPos += stringBuf.size();
+				recordBuf.clear();
+				stringBuf.clear();
+			}
+		}
+
+		if (fsync(tmp.fd) != 0) {
+			lnthrow(IOException, "Failed to sync \"" + tmp.path + "\" (" + std::strerror(errno) + ")");
+		}
+		if (rename(tmp.path.c_str(), this->path.c_str()) != 0) {
+			lnthrow(IOException, "Failed to rename \"" + tmp.path + "\" to \"" + this->path + "\" (" + std::strerror(errno) + ")");
+		}
+		tmp.renamed = true;
+
+		// the rename itself is only durable once the directory is synced
+		std::string dir = parentDir(this->path.c_str());
+		const int dirFd = openDirectoryAt(AT_FDCWD, dir.empty() ? "." : dir.c_str());
+		if (dirFd >= 0) {
+			fsync(dirFd);
+			close(dirFd);
+		}
+	}
+};
+
+FileIndex::FileIndex(const char* path): impl(std::make_unique<FileIndexImpl>()) {
+	this->impl->path = path;
+	this->impl->runStart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	this->impl->load();
+}
+
+FileIndex::~FileIndex() = default;
+
+size_t FileIndex::size() const {
+	std::shared_lock<std::shared_mutex> mapLock(this->impl->mapLock);
+	return this->impl->count;
+}
+
+const FileRecord* FileIndex::find(std::string_view path) const {
+	std::shared_lock<std::shared_mutex> mapLock(this->impl->mapLock);
+	const size_t i = this->impl->lookup(path);
+	return i < this->impl->count ? &this->impl->records[i].record : nullptr;
+}
+
+bool FileIndex::skip(const Entry& entry) {
+	std::shared_lock<std::shared_mutex> mapLock(this->impl->mapLock);
+	const size_t i = this->impl->lookup(entry.path);
+	if (i == this->impl->count) {
+		return false;
+	}
+
+	const FileRecord& r = this->impl->records[i].record;
+	if ((entry.fields & FIELDS) != FIELDS || (r.flags & RECORD_RACY) || r.size != entry.size || r.mtime != entry.mtime || r.ctime != entry.ctime || r.inode != entry.inode || r.mode != entry.mode) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	this->impl->kept.push_back(i);
+	return true;
+}
+
+bool FileIndex::keep(std::string_view path) {
+	std::shared_lock<std::shared_mutex> mapLock(this->impl->mapLock);
+	const size_t i = this->impl->lookup(path);
+	if (i == this->impl->count) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	this->impl->kept.push_back(i);
+	return true;
+}
+
+void FileIndex::put(std::string_view path, const FileRecord& record) {
+	FileRecord r = record;
+	r.flags = r.mtime >= this->impl->runStart - RACY_WINDOW_NS ? RECORD_RACY : 0;
+
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	this->impl->puts.emplace_back(std::string(path), r);
+}
+
+void FileIndex::put(const Entry& entry, const FileDigest& digest) {
+	if ((entry.fields & FIELDS) != FIELDS) {
+		lnthrow(std::logic_error, "The entry for \"" + std::string(entry.path) + "\" is missing stat data that FileIndex needs");
+	}
+	this->put(entry.path, FileRecord{entry.size, entry.mtime, entry.ctime, entry.inode, entry.mode, 0, digest});
+}
+
+void FileIndex::commit() {
+	std::unique_lock<std::shared_mutex> mapLock(this->impl->mapLock);
+	std::lock_guard<std::mutex> lock(this->impl->m);
+
+	// carried over records come first so a put() for the same path wins
+	std::vector<std::pair<std::string_view, const FileRecord*>> all;
+	all.reserve(this->impl->kept.size() + this->impl->puts.size());
+	for (size_t i : this->impl->kept) {
+		all.emplace_back(this->impl->pathAt(i), &this->impl->records[i].record);
+	}
+	for (const std::pair<std::string, FileRecord>& p : this->impl->puts) {
+		all.emplace_back(p.first, &p.second);
+	}
+	std::stable_sort(all.begin(), all.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	size_t out = 0;
+	for (size_t i = 0; i < all.size(); ++i) {
+		if (out > 0 && all[out - 1].first == all[i].first) {
+			all[out - 1] = all[i];
+		}
+		else {
+			all[out++] = all[i];
+		}
+	}
+	all.resize(out);
+
+	this->impl->write(all);
+	this->impl->kept.clear();
+	this->impl->puts.clear();
+	this->impl->map.reset();
+	this->impl->load();
+}
+
+}
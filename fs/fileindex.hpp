@@ -0,0 +1,134 @@
+/** @file fileindex.hpp
+ * @brief Remembers the state of every file from the previous run so unchanged files can be skipped.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_FILEINDEX_HPP
+#define __CS_FILEINDEX_HPP
+
+#include "dirreader.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief A digest of a file's contents, such as its SHA-256.
+ */
+using FileDigest = std::array<unsigned char, 32>;
+
+/**
+ * @brief What a FileIndex remembers about one file.
+ */
+struct FileRecord {
+	uint64_t size;
+	/**
+	 * @brief The modification time in nanoseconds since the epoch.
+	 */
+	int64_t mtime;
+	/**
+	 * @brief The status change time in nanoseconds since the epoch.
+	 */
+	int64_t ctime;
+	uint64_t inode;
+	uint32_t mode;
+	/**
+	 * @brief Set by FileIndex. Callers should leave this 0.
+	 */
+	uint32_t flags;
+	FileDigest digest;
+};
+
+/**
+ * @brief A persistent index of files keyed by path, which lets an incremental run only hash and encrypt the files that changed.
+ *
+ * The index file is a header, an array of fixed-size records sorted by path, and a table of the paths. It is mapped read-only and searched in place, so loading it costs nothing no matter how many files it has.
+ * It is in the machine's native byte order, since it is a local cache. An index that is missing, was written by another architecture, or is malformed is treated as empty, which only means that every file is hashed again.
+ *
+ * Each run starts from the index written by the previous one. Files found unchanged are carried over with keep() or skip(), and files that were hashed are recorded with put().
+ * commit() then atomically replaces the index with the carried over and recorded files, so files that were deleted are dropped.
+ *
+ * A file is unchanged if its size, mtime, ctime, inode, and mode all match. A file whose mtime is within a second of the run that recorded it is treated as changed on the next run, since a write in the same timestamp tick as the hashing could otherwise go unnoticed.
+ * This class is thread-safe. Lookups share the loaded index, and commit() waits for them to finish before it replaces it.
+ */
+class FileIndex {
+public:
+	/**
+	 * @brief The EntryField values that skip() needs. A walker that consults the index asks for these.
+	 */
+	static constexpr unsigned FIELDS = ENTRY_SIZE | ENTRY_MTIME | ENTRY_CTIME | ENTRY_MODE;
+
+	/**
+	 * @brief Loads the index at a path.
+	 *
+	 * @param path The index file. It does not have to exist.
+	 *
+	 * @exception IOException I/O error.
+	 */
+	FileIndex(const char* path);
+
+	~FileIndex();
+
+	/**
+	 * @brief Returns the number of files in the loaded index.
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Looks up a file in the loaded index.
+	 *
+	 * @return The file's record, or nullptr if it is not in the index. The record is valid until the next commit().
+	 */
+	const FileRecord* find(std::string_view path) const;
+
+	/**
+	 * @brief Checks whether a file is unchanged since the loaded index was written, and carries its record over to the next commit() if so.
+	 *
+	 * @param entry The file, with at least the fields in FIELDS.
+	 *
+	 * @return True if the file is unchanged and does not need to be hashed again.
+	 */
+	bool skip(const Entry& entry);
+
+	/**
+	 * @brief Carries a file's record in the loaded index over to the next commit() without checking it.
+	 *
+	 * @return False if the file is not in the loaded index.
+	 */
+	bool keep(std::string_view path);
+
+	/**
+	 * @brief Records a file for the next commit(), replacing anything carried over for the same path.
+	 */
+	void put(std::string_view path, const FileRecord& record);
+
+	/**
+	 * @brief Records a file found by a walker for the next commit().
+	 *
+	 * @param entry The file, with at least the fields in FIELDS.
+	 * @param digest The digest of its contents.
+	 */
+	void put(const Entry& entry, const FileDigest& digest);
+
+	/**
+	 * @brief Atomically replaces the index file with every record that was carried over or recorded since it was loaded, then loads the new one.
+	 * The new index is written to a temporary file, synced, and renamed over the old one, so a crash leaves either the old index or the new one.
+	 *
+	 * @exception IOException I/O error. The old index is left in place.
+	 */
+	void commit();
+
+private:
+	struct FileIndexImpl;
+	std::unique_ptr<FileIndexImpl> impl;
+};
+
+}
+
+#endif
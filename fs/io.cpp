@@ -0,0 +1,71 @@
+/** @file io.cpp
+ * @brief Positioned reads and writes that retry until the whole buffer is done, and preallocation of the files they write.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "io.hpp"
+#include "ioexception.hpp"
+#include "../lnthrow.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+namespace CloudSync::fs {
+
+void preadAll(int fd, void* data, size_t len, uint64_t offset) {
+	unsigned char* buf = static_cast<unsigned char*>(data);
+	while (len > 0) {
+		ssize_t res = pread(fd, buf, len, offset);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			lnthrow(IOException, std::string("Failed to read input (") + std::strerror(errno) + ")");
+		}
+		if (res == 0) {
+			lnthrow(IOException, "The input file ended early. It may have been truncated while being read.");
+		}
+		buf += res;
+		len -= res;
+		offset += res;
+	}
+}
+
+void pwriteAll(int fd, const void* data, size_t len, uint64_t offset) {
+	const unsigned char* buf = static_cast<const unsigned char*>(data);
+	while (len > 0) {
+		ssize_t res = pwrite(fd, buf, len, offset);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			lnthrow(IOException, std::string("Failed to write output (") + std::strerror(errno) + ")");
+		}
+		buf += res;
+		len -= res;
+		offset += res;
+	}
+}
+
+void allocateAll(int fd, uint64_t size) {
+	// ftruncate() first so an existing file that is too long is cut down
+	if (ftruncate(fd, size) != 0) {
+		lnthrow(IOException, "Failed to resize output to " + std::to_string(size) + " bytes (" + std::strerror(errno) + ")");
+	}
+	if (size == 0) {
+		return;
+	}
+
+	int err;
+	while ((err = posix_fallocate(fd, 0, size)) == EINTR);
+	if (err != 0) {
+		lnthrow(IOException, "Failed to allocate " + std::to_string(size) + " bytes for output (" + std::strerror(err) + ")");
+	}
+}
+
+}
@@ -0,0 +1,41 @@
+/** @file io.hpp
+ * @brief Positioned reads and writes that retry until the whole buffer is done, and preallocation of the files they write.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_IO_HPP
+#define __CS_IO_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief Fills a whole buffer from an offset, retrying short reads.
+ *
+ * @exception IOException I/O error, or the file ended before the buffer was filled.
+ */
+void preadAll(int fd, void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Writes a whole buffer at an offset, retrying short writes.
+ *
+ * @exception IOException I/O error.
+ */
+void pwriteAll(int fd, const void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Resizes a file and reserves disk space for all of it, so the file is not sparse and later writes to it cannot fail for lack of space.
+ * This matters most for memory-mapped output, where running out of space raises SIGBUS instead of returning an error.
+ *
+ * @exception IOException I/O error, or there is not enough space for the whole file.
+ */
+void allocateAll(int fd, uint64_t size);
+
+}
+
+#endif
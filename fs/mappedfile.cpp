@@ -0,0 +1,96 @@
+/** @file mappedfile.cpp
+ * @brief Memory-maps a file.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "mappedfile.hpp"
+#include "io.hpp"
+#include "ioexception.hpp"
+#include "notfoundexception.hpp"
+#include "../lnthrow.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace CloudSync::fs {
+
+struct MappedFile::MappedFileImpl {
+	int fd = -1;
+	unsigned char* data = nullptr;
+	uint64_t size = 0;
+
+	void map(const char* path, int prot) {
+		if (size == 0) {
+			return;
+		}
+		void* ptr = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			lnthrow(IOException, std::string("Failed to map \"") + path + "\" (" + std::strerror(errno) + ")");
+		}
+		data = static_cast<unsigned char*>(ptr);
+	}
+
+	~MappedFileImpl() {
+		if (data) {
+			munmap(data, size);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+MappedFile::MappedFile(const char* path): impl(std::make_unique<MappedFileImpl>()) {
+	struct stat st;
+
+	this->impl->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (this->impl->fd < 0) {
+		if (errno == ENOENT) {
+			lnthrow(NotFoundException, std::string("\"") + path + "\" does not exist");
+		}
+		lnthrow(IOException, std::string("Failed to open \"") + path + "\" (" + std::strerror(errno) + ")");
+	}
+	if (fstat(this->impl->fd, &st) != 0) {
+		lnthrow(IOException, std::string("Failed to stat \"") + path + "\" (" + std::strerror(errno) + ")");
+	}
+	this->impl->size = st.st_size;
+
+	this->impl->map(path, PROT_READ);
+	if (this->impl->data) {
+		madvise(this->impl->data, this->impl->size, MADV_SEQUENTIAL);
+	}
+}
+
+MappedFile::MappedFile(const char* path, uint64_t size): impl(std::make_unique<MappedFileImpl>()) {
+	this->impl->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (this->impl->fd < 0) {
+		lnthrow(IOException, std::string("Failed to open \"") + path + "\" (" + std::strerror(errno) + ")");
+	}
+	// the blocks are allocated up front, since running out of space while writing to the mapping would raise SIGBUS
+	allocateAll(this->impl->fd, size);
+	this->impl->size = size;
+
+	this->impl->map(path, PROT_READ | PROT_WRITE);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept = default;
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept = default;
+
+MappedFile::~MappedFile() = default;
+
+unsigned char* MappedFile::data() const noexcept {
+	return this->impl->data;
+}
+
+uint64_t MappedFile::size() const noexcept {
+	return this->impl->size;
+}
+
+}
@@ -0,0 +1,89 @@
+/** @file mappedfile.hpp
+ * @brief Memory-maps a file.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_MAPPEDFILE_HPP
+#define __CS_MAPPEDFILE_HPP
+
+#include <cstdint>
+#include <memory>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief A file mapped into memory.
+ * The mapping is removed and the file is closed on destruction.
+ *
+ * If another process truncates the file while it is mapped, touching the missing pages raises SIGBUS.
+ */
+class MappedFile {
+public:
+	/**
+	 * @brief Maps an existing file read-only.
+	 *
+	 * @param path The file to map.
+	 *
+	 * @exception NotFoundException There is no file at this path.
+	 * @exception IOException I/O error.
+	 */
+	MappedFile(const char* path);
+
+	/**
+	 * @brief Creates a file of the given size, or resizes it if it exists, and maps it read-write.
+	 * Disk space for the whole file is allocated before it is mapped, so a full disk is reported here instead of as SIGBUS while writing.
+	 *
+	 * @param path The file to map.
+	 * @param size The size the file should have.
+	 *
+	 * @exception IOException I/O error, or there is not enough space for the file.
+	 */
+	MappedFile(const char* path, uint64_t size);
+
+	/**
+	 * @brief Move constructor.
+	 */
+	MappedFile(MappedFile&& other) noexcept;
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	MappedFile(const MappedFile& other) = delete;
+
+	/**
+	 * @brief Move assignment operator.
+	 */
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	MappedFile& operator=(const MappedFile& other) = delete;
+
+	/**
+	 * @brief Unmaps and closes the file.
+	 */
+	~MappedFile();
+
+	/**
+	 * @brief Returns a pointer to the start of the mapping, or nullptr if the file is empty.
+	 * The mapping is only writable if the file was mapped with MappedFile(const char*, uint64_t).
+	 */
+	unsigned char* data() const noexcept;
+
+	/**
+	 * @brief Returns the size of the mapping in bytes.
+	 */
+	uint64_t size() const noexcept;
+
+private:
+	struct MappedFileImpl;
+	std::unique_ptr<MappedFileImpl> impl;
+};
+
+}
+
+#endif
@@ -0,0 +1,284 @@
+/** @file parallelwalker.cpp
+ * @brief Recursively visits the files in a directory using several threads.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "parallelwalker.hpp"
+#include "dirreader.hpp"
+#include "fileindex.hpp"
+#include "file.hpp"
+#include "ioexception.hpp"
+#include "notfoundexception.hpp"
+#include "../lnthrow.hpp"
+#include "../threadpool.hpp"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief Closes a directory once the last of its subdirectories has been opened.
+ */
+struct DirFd {
+	DirFd(int fd): fd(fd) {}
+	DirFd(const DirFd&) = delete;
+	DirFd& operator=(const DirFd&) = delete;
+	~DirFd() {
+		close(this->fd);
+	}
+	int fd;
+};
+
+/**
+ * @brief A directory waiting to be read.
+ */
+struct PendingDir {
+	/**
+	 * @brief The directory containing this one, or nullptr for the base directory.
+	 */
+	std::shared_ptr<DirFd> parent;
+	std::string path;
+	/**
+	 * @brief Where the directory's own name starts in path.
+	 */
+	size_t nameOffset;
+};
+
+/**
+ * @brief One worker's directories. Each is on its own cache line so workers pushing to their own deques do not contend.
+ */
+struct alignas(64) WorkerQueue {
+	std::mutex m;
+	std::deque<PendingDir> dirs;
+};
+
+struct ParallelTreeWalker::ParallelTreeWalkerImpl {
+	ParallelTreeWalkerImpl(unsigned nThreads, unsigned fields): fields(fields), statFields(fields), tp(nThreads), queues(new WorkerQueue[tp.size()]), readers(tp.size()), paths(tp.size()) {}
+
+	std::string baseDir;
+	unsigned fields;
+	RuleSet rules;
+	FileIndex* index = nullptr;
+	/**
+	 * @brief The fields to ask statx() for, which are the caller's fields plus the ones the rules and index need.
+	 */
+	unsigned statFields;
+	/**
+	 * @brief The length of the base directory's path plus its separator, which is where paths relative to it start.
+	 */
+	size_t rootPrefixLen;
+	ThreadPool tp;
+	std::unique_ptr<WorkerQueue[]> queues;
+	std::vector<DirReader> readers;
+	/**
+	 * @brief Per-worker buffers that the paths of files are built in.
+	 */
+	std::vector<std::string> paths;
+
+	/**
+	 * @brief The number of directories that are queued or being read. The walk is over when this reaches 0.
+	 */
+	std::atomic<size_t> pending;
+	/**
+	 * @brief The number of directories that are queued.
+	 */
+	std::atomic<size_t> queued;
+	std::atomic<bool> stop;
+
+	std::mutex idleMutex;
+	std::condition_variable cvIdle;
+	/**
+	 * @brief The number of workers waiting on cvIdle, so a push only takes idleMutex when someone can be woken.
+	 */
+	std::atomic<unsigned> idle;
+
+	void updateFields() noexcept {
+		this->statFields = this->fields | this->rules.fields() | (this->index ? FileIndex::FIELDS : 0);
+	}
+
+	void push(unsigned worker, PendingDir&& dir) {
+		this->pending++;
+		{
+			std::lock_guard<std::mutex> lock(this->queues[worker].m);
+			this->queues[worker].dirs.push_back(std::move(dir));
+			this->queued++;
+		}
+		if (this->idle.load() > 0) {
+			std::lock_guard<std::mutex> lock(this->idleMutex);
+			this->cvIdle.notify_one();
+		}
+	}
+
+	bool pop(unsigned worker, PendingDir& dir) {
+		WorkerQueue& own = this->queues[worker];
+		{
+			std::lock_guard<std::mutex> lock(own.m);
+			if (!own.dirs.empty()) {
+				dir = std::move(own.dirs.back());
+				own.dirs.pop_back();
+				this->queued--;
+				return true;
+			}
+		}
+
+		const unsigned n = this->tp.size();
+		for (unsigned i = 1; i < n; ++i) {
+			WorkerQueue& victim = this->queues[(worker + i) % n];
+			std::lock_guard<std::mutex> lock(victim.m);
+			if (!victim.dirs.empty()) {
+				dir = std::move(victim.dirs.front());
+				victim.dirs.pop_front();
+				this->queued--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void wakeAll() {
+		std::lock_guard<std::mutex> lock(this->idleMutex);
+		this->cvIdle.notify_all();
+	}
+
+	void readDirectory(unsigned worker, PendingDir& dir, const std::function<void(const Entry&, unsigned)>& func) {
+		// the base directory may be a symlink, but nothing below it is followed
+		const int fd = dir.parent ? openDirectoryAt(dir.parent->fd, dir.path.c_str() + dir.nameOffset) : openDirectoryAt(AT_FDCWD, dir.path.c_str(), true);
+		if (fd < 0) {
+			// a subdirectory can vanish or be locked mid-walk, but a base directory that cannot be opened would silently be an empty walk
+			if (dir.parent && (errno == EACCES || errno == ENOENT || errno == ENOTDIR || errno == ELOOP)) {
+				return;
+			}
+			lnthrow(IOException, "Failed to open directory \"" + dir.path + "\" (" + std::strerror(errno) + ")");
+		}
+		std::shared_ptr<DirFd> self = std::make_shared<DirFd>(fd);
+		dir.parent.reset();
+
+		const size_t prefixLen = dir.path.back() == '/' ? dir.path.size() : dir.path.size() + 1;
+		std::string& path = this->paths[worker];
+		path.assign(dir.path);
+		path.resize(prefixLen, '/');
+
+		DirReader& reader = this->readers[worker];
+		DirEntry d;
+		Entry entry;
+		reader.reset(fd);
+		while (reader.next(d)) {
+			if (this->stop.load(std::memory_order_relaxed)) {
+				return;
+			}
+			if (!fillEntry(fd, d, d.type == DT_DIR ? 0 : this->statFields, entry)) {
+				continue;
+			}
+
+			path.resize(prefixLen);
+			path += d.name;
+			if (!this->rules.empty() && this->rules.excluded(std::string_view(path.data() + this->rootPrefixLen, prefixLen - this->rootPrefixLen), d.name, entry)) {
+				continue;
+			}
+			if (entry.type == Type::Directory) {
+				this->push(worker, PendingDir{self, path, prefixLen});
+			}
+			else {
+				entry.path = path.c_str();
+				if (!this->index || !this->index->skip(entry)) {
+					func(entry, worker);
+				}
+			}
+		}
+	}
+
+	void run(unsigned worker, const std::function<void(const Entry&, unsigned)>& func) {
+		try {
+			for (;;) {
+				PendingDir dir;
+				if (!this->pop(worker, dir)) {
+					std::unique_lock<std::mutex> lock(this->idleMutex);
+					this->idle++;
+					this->cvIdle.wait(lock, [this]() { return this->queued.load() > 0 || this->pending.load() == 0 || this->stop.load(); });
+					this->idle--;
+					if (this->pending.load() == 0 || this->stop.load()) {
+						return;
+					}
+					continue;
+				}
+
+				this->readDirectory(worker, dir, func);
+				if (--this->pending == 0) {
+					this->wakeAll();
+				}
+			}
+		}
+		catch (...) {
+			this->stop = true;
+			this->wakeAll();
+			throw;
+		}
+	}
+};
+
+ParallelTreeWalker::ParallelTreeWalker(const char* baseDir, unsigned nThreads, unsigned fields): impl(std::make_unique<ParallelTreeWalkerImpl>(nThreads, fields)) {
+	if (!isDirectory(baseDir)) {
+		lnthrow(NotFoundException, "\"" + std::string(baseDir) + "\" does not point to a directory");
+	}
+
+	this->impl->baseDir = baseDir;
+	while (this->impl->baseDir.size() > 1 && this->impl->baseDir.back() == '/') {
+		this->impl->baseDir.pop_back();
+	}
+	this->impl->rootPrefixLen = this->impl->baseDir == "/" ? 1 : this->impl->baseDir.size() + 1;
+}
+
+ParallelTreeWalker::~ParallelTreeWalker() = default;
+
+ParallelTreeWalker& ParallelTreeWalker::setRules(RuleSet&& rules) {
+	this->impl->rules = std::move(rules);
+	this->impl->updateFields();
+	return *this;
+}
+
+ParallelTreeWalker& ParallelTreeWalker::setIndex(FileIndex* index) {
+	this->impl->index = index;
+	this->impl->updateFields();
+	return *this;
+}
+
+void ParallelTreeWalker::walk(const std::function<void(const char* path, unsigned worker)>& func) {
+	this->walkEntries([&func](const Entry& entry, unsigned worker) {
+		func(entry.path, worker);
+	});
+}
+
+void ParallelTreeWalker::walkEntries(const std::function<void(const Entry& entry, unsigned worker)>& func) {
+	const unsigned n = this->impl->tp.size();
+	for (unsigned i = 0; i < n; ++i) {
+		this->impl->queues[i].dirs.clear();
+	}
+	this->impl->pending = 0;
+	this->impl->queued = 0;
+	this->impl->idle = 0;
+	this->impl->stop = false;
+	this->impl->push(0, PendingDir{nullptr, this->impl->baseDir, 0});
+
+	this->impl->tp.parallelFor(n, [this, &func](size_t, unsigned worker) {
+		this->impl->run(worker, func);
+	});
+}
+
+unsigned ParallelTreeWalker::threads() const noexcept {
+	return this->impl->tp.size();
+}
+
+}
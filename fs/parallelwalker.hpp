@@ -0,0 +1,101 @@
+/** @file parallelwalker.hpp
+ * @brief Recursively visits the files in a directory using several threads.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_PARALLELWALKER_HPP
+#define __CS_PARALLELWALKER_HPP
+
+#include "dirreader.hpp"
+#include "fileindex.hpp"
+#include "rules.hpp"
+#include <functional>
+#include <memory>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief Recursively visits the files in a directory using a pool of worker threads.
+ *
+ * Every worker has its own deque of directories still to be read. A worker takes its newest directory from the back of its own deque, so it descends depth-first and keeps few directories open.
+ * A worker whose deque is empty steals the oldest directory from the front of another worker's deque, which is usually the top of a large subtree.
+ * Directories are read with getdents64() and opened relative to their parent's file descriptor with openat(), so no path is resolved from the root more than once.
+ *
+ * Files are visited in no particular order. Use TreeWalker when the order matters or when directories need to be skipped while iterating.
+ */
+class ParallelTreeWalker {
+public:
+	/**
+	 * @brief Constructs a ParallelTreeWalker starting at the specified directory.
+	 *
+	 * @param baseDir The base directory to start iterating through.
+	 * @param nThreads The number of worker threads. If this is 0, one thread per hardware thread is used.
+	 * @param fields The EntryField values that walkEntries() should fill, as with TreeWalker.
+	 *
+	 * @exception NotFoundException A directory does not exist at this path.
+	 */
+	ParallelTreeWalker(const char* baseDir, unsigned nThreads = 0, unsigned fields = 0);
+
+	/**
+	 * @brief Stops the worker threads.
+	 */
+	~ParallelTreeWalker();
+
+	/**
+	 * @brief Sets the rules deciding which entries are skipped. Directories that are excluded are never opened or queued.
+	 * This must not be called during a walk.
+	 *
+	 * @param rules The rules. Any stat data they need is asked for along with the constructor's fields.
+	 *
+	 * @return This ParallelTreeWalker.
+	 */
+	ParallelTreeWalker& setRules(RuleSet&& rules);
+
+	/**
+	 * @brief Consults a FileIndex for every file, skipping the ones it says are unchanged and carrying their records over to its next commit().
+	 * This must not be called during a walk.
+	 *
+	 * @param index The index, which must outlive the walk, or nullptr to stop consulting one. The stat data it needs is asked for along with the constructor's fields.
+	 *
+	 * @return This ParallelTreeWalker.
+	 */
+	ParallelTreeWalker& setIndex(FileIndex* index);
+
+	/**
+	 * @brief Calls a function for every entry under the base directory that is not a directory.
+	 * Symbolic links are passed to func and are not followed, except for the base directory itself. Subdirectories that cannot be opened because of their permissions or because they were removed during the walk are skipped.
+	 * This function blocks until every entry has been visited.
+	 *
+	 * @param func The function to call, which is called from several threads at once.
+	 * Its first argument is the entry's path, which starts with the base directory and is only valid for the duration of the call.
+	 * Its second argument is the index of the worker thread calling it, which is always less than threads(), so per-worker state can be indexed by it without locking.
+	 *
+	 * @exception IOException I/O error, including the base directory not being openable. The walk stops at the first one.
+	 * @exception std::exception Any exception thrown by func stops the walk and is rethrown here.
+	 */
+	void walk(const std::function<void(const char* path, unsigned worker)>& func);
+
+	/**
+	 * @brief Like walk(), but passes each entry's type, inode, and the stat data asked for in the constructor along with its path.
+	 *
+	 * @exception IOException I/O error. The walk stops at the first one.
+	 * @exception std::exception Any exception thrown by func stops the walk and is rethrown here.
+	 */
+	void walkEntries(const std::function<void(const Entry& entry, unsigned worker)>& func);
+
+	/**
+	 * @brief Returns the number of worker threads.
+	 */
+	unsigned threads() const noexcept;
+
+private:
+	struct ParallelTreeWalkerImpl;
+	std::unique_ptr<ParallelTreeWalkerImpl> impl;
+};
+
+}
+
+#endif
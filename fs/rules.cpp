@@ -0,0 +1,467 @@
+/** @file rules.cpp
+ * @brief gitignore-style include/exclude rules for the tree walkers.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "rules.hpp"
+#include "../lnthrow.hpp"
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <deque>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CloudSync::fs {
+
+enum class TokenType {
+	LITERAL,
+	/**
+	 * @brief '?'
+	 */
+	ANY,
+	/**
+	 * @brief '*', which matches any run of characters other than '/'.
+	 */
+	STAR,
+	CLASS,
+	/**
+	 * @brief A "**" segment followed by a '/', which matches nothing or any run of characters ending with a '/'.
+	 */
+	DIRS,
+	/**
+	 * @brief A trailing "**" segment, which matches everything that is left.
+	 */
+	ALL,
+};
+
+struct Token {
+	TokenType type;
+	char c;
+	/**
+	 * @brief The characters a CLASS matches, with any negation already applied.
+	 */
+	std::bitset<256> set;
+};
+
+struct Rule {
+	std::vector<Token> tokens;
+	/**
+	 * @brief The pattern without its glob syntax if it is indexed by literal or suffix.
+	 */
+	std::string literal;
+	bool negate = false;
+	bool dirOnly = false;
+	bool anchored = false;
+	bool hasPredicates = false;
+	uint64_t minSize = 0;
+	uint64_t maxSize = UINT64_MAX;
+	int64_t minMtime = INT64_MIN;
+	int64_t maxMtime = INT64_MAX;
+};
+
+static bool globMatch(const Token* t, const Token* end, const char* s, const char* send) {
+	for (; t != end; ++t) {
+		switch (t->type) {
+		case TokenType::LITERAL:
+			if (s == send || *s != t->c) {
+				return false;
+			}
+			++s;
+			break;
+		case TokenType::ANY:
+			if (s == send || *s == '/') {
+				return false;
+			}
+			++s;
+			break;
+		case TokenType::CLASS:
+			if (s == send || *s == '/' || !t->set[static_cast<unsigned char>(*s)]) {
+				return false;
+			}
+			++s;
+			break;
+		case TokenType::STAR:
+			for (const char* p = s;; ++p) {
+				if (globMatch(t + 1, end, p, send)) {
+					return true;
+				}
+				if (p == send || *p == '/') {
+					return false;
+				}
+			}
+		case TokenType::DIRS:
+			if (globMatch(t + 1, end, s, send)) {
+				return true;
+			}
+			for (const char* p = s; p != send; ++p) {
+				if (*p == '/' && globMatch(t + 1, end, p + 1, send)) {
+					return true;
+				}
+			}
+			return false;
+		case TokenType::ALL:
+			return true;
+		}
+	}
+	return s == send;
+}
+
+/**
+ * @brief Parses a number with a unit suffix, such as "10M" or "30d".
+ */
+static uint64_t parseQuantity(std::string_view str, std::string_view units, const uint64_t* multipliers, std::string_view rule) {
+	size_t i = 0;
+	uint64_t n = 0;
+	for (; i < str.size() && str[i] >= '0' && str[i] <= '9'; ++i) {
+		if (n > (UINT64_MAX - 9) / 10) {
+			lnthrow(std::invalid_argument, "Number out of range in rule \"" + std::string(rule) + "\"");
+		}
+		n = n * 10 + (str[i] - '0');
+	}
+	if (i == 0 || str.size() - i > 1) {
+		lnthrow(std::invalid_argument, "Malformed number in rule \"" + std::string(rule) + "\"");
+	}
+	if (i == str.size()) {
+		return n;
+	}
+
+	const size_t unit = units.find(str[i]);
+	if (unit == std::string_view::npos) {
+		lnthrow(std::invalid_argument, "Unknown unit '" + std::string(1, str[i]) + "' in rule \"" + std::string(rule) + "\"");
+	}
+	if (n > UINT64_MAX / multipliers[unit]) {
+		lnthrow(std::invalid_argument, "Number out of range in rule \"" + std::string(rule) + "\"");
+	}
+	return n * multipliers[unit];
+}
+
+struct RuleSet::RuleSetImpl {
+	std::chrono::system_clock::time_point now;
+	/**
+	 * @brief The rules in the order they were added. This is a deque so the string_views in the indexes stay valid as it grows.
+	 */
+	std::deque<Rule> rules;
+	std::unordered_map<std::string_view, std::vector<size_t>> names;
+	std::unordered_map<std::string_view, std::vector<size_t>> suffixes;
+	std::set<size_t> suffixLengths;
+	std::unordered_map<std::string_view, std::vector<size_t>> paths;
+	std::vector<size_t> globs;
+	unsigned fields = 0;
+
+	void parsePredicate(Rule& r, std::string_view word, std::string_view rule) {
+		static constexpr uint64_t sizeMultipliers[] = {UINT64_C(1) << 10, UINT64_C(1) << 20, UINT64_C(1) << 30, UINT64_C(1) << 40};
+		static constexpr uint64_t ageMultipliers[] = {1, 60, 3600, 86400, 604800};
+
+		const bool isSize = word.substr(0, 4) == "size";
+		const size_t op = isSize ? 4 : 3;
+		const bool greater = word[op] == '>';
+		r.hasPredicates = true;
+
+		if (isSize) {
+			const uint64_t n = parseQuantity(word.substr(op + 1), "KMGT", sizeMultipliers, rule);
+			if (greater) {
+				r.minSize = std::max(r.minSize, n == UINT64_MAX ? n : n + 1);
+			}
+			else {
+				r.maxSize = n == 0 ? 0 : std::min(r.maxSize, n - 1);
+				if (n == 0) {
+					r.minSize = UINT64_MAX;
+				}
+			}
+			this->fields |= ENTRY_SIZE;
+			return;
+		}
+
+		const uint64_t seconds = parseQuantity(word.substr(op + 1), "smhdw", ageMultipliers, rule);
+		if (seconds > static_cast<uint64_t>(INT64_MAX / 1000000000)) {
+			lnthrow(std::invalid_argument, "Age out of range in rule \"" + std::string(rule) + "\"");
+		}
+		const int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(this->now.time_since_epoch()).count();
+		const int64_t cutoff = nowNs - static_cast<int64_t>(seconds) * 1000000000;
+		// older than N means modified before now - N
+		if (greater) {
+			r.maxMtime = std::min(r.maxMtime, cutoff - 1);
+		}
+		else {
+			r.minMtime = std::max(r.minMtime, cutoff + 1);
+		}
+		this->fields |= ENTRY_MTIME;
+	}
+
+	void parsePattern(Rule& r, std::string_view pattern, std::string_view rule) {
+		if (!pattern.empty() && pattern.front() == '!') {
+			r.negate = true;
+			pattern.remove_prefix(1);
+		}
+		if (!pattern.empty() && pattern.back() == '/') {
+			r.dirOnly = true;
+			pattern.remove_suffix(1);
+		}
+		if (!pattern.empty() && pattern.front() == '/') {
+			r.anchored = true;
+			pattern.remove_prefix(1);
+		}
+		if (pattern.empty()) {
+			lnthrow(std::invalid_argument, "Empty pattern in rule \"" + std::string(rule) + "\"");
+		}
+		if (pattern.find('/') != std::string_view::npos) {
+			r.anchored = true;
+		}
+
+		for (size_t i = 0; i < pattern.size(); ++i) {
+			Token t{TokenType::LITERAL, pattern[i], {}};
+			switch (pattern[i]) {
+			case '\\':
+				if (++i == pattern.size()) {
+					lnthrow(std::invalid_argument, "Trailing backslash in rule \"" + std::string(rule) + "\"");
+				}
+				t.c = pattern[i];
+				break;
+			case '?':
+				t.type = TokenType::ANY;
+				break;
+			case '*': {
+				const bool segmentStart = i == 0 || pattern[i - 1] == '/';
+				if (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+					while (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+						++i;
+					}
+					if (segmentStart && i + 1 == pattern.size()) {
+						t.type = TokenType::ALL;
+						break;
+					}
+					if (segmentStart && pattern[i + 1] == '/') {
+						t.type = TokenType::DIRS;
+						++i;
+						break;
+					}
+				}
+				t.type = TokenType::STAR;
+				if (!r.tokens.empty() && r.tokens.back().type == TokenType::STAR) {
+					continue;
+				}
+				break;
+			}
+			case '[': {
+				size_t j = i + 1;
+				const bool negated = j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^');
+				if (negated) {
+					++j;
+				}
+				const size_t first = j;
+				for (; j < pattern.size() && (pattern[j] != ']' || j == first); ++j) {
+					unsigned char lo = pattern[j];
+					if (lo == '\\' && j + 1 < pattern.size()) {
+						lo = pattern[++j];
+					}
+					unsigned char hi = lo;
+					if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+						hi = pattern[j + 2];
+						j += 2;
+					}
+					for (unsigned c = lo; c <= hi; ++c) {
+						t.set.set(c);
+					}
+				}
+				if (j >= pattern.size()) {
+					lnthrow(std::invalid_argument, "Unterminated character class in rule \"" + std::string(rule) + "\"");
+				}
+				if (negated) {
+					t.set.flip();
+				}
+				t.type = TokenType::CLASS;
+				i = j;
+				break;
+			}
+			default:
+				break;
+			}
+			r.tokens.push_back(t);
+		}
+	}
+
+	void index(size_t idx) {
+		Rule& r = this->rules[idx];
+		const bool literalTail = std::all_of(r.tokens.begin() + (r.tokens.front().type == TokenType::STAR ? 1 : 0), r.tokens.end(), [](const Token& t) { return t.type == TokenType::LITERAL; });
+		if (!literalTail) {
+			this->globs.push_back(idx);
+			return;
+		}
+
+		for (const Token& t : r.tokens) {
+			if (t.type == TokenType::LITERAL) {
+				r.literal += t.c;
+			}
+		}
+		if (r.tokens.front().type != TokenType::STAR) {
+			(r.anchored ? this->paths : this->names)[r.literal].push_back(idx);
+		}
+		else if (!r.anchored && !r.literal.empty()) {
+			this->suffixes[r.literal].push_back(idx);
+			this->suffixLengths.insert(r.literal.size());
+		}
+		else {
+			r.literal.clear();
+			this->globs.push_back(idx);
+		}
+	}
+
+	bool accepts(const Rule& r, const Entry& entry) const noexcept {
+		const bool dir = entry.type == Type::Directory;
+		if (r.dirOnly && !dir) {
+			return false;
+		}
+		if (!r.hasPredicates) {
+			return true;
+		}
+		if (dir) {
+			return false;
+		}
+		if ((r.minSize != 0 || r.maxSize != UINT64_MAX) && (!(entry.fields & ENTRY_SIZE) || entry.size < r.minSize || entry.size > r.maxSize)) {
+			return false;
+		}
+		if ((r.minMtime != INT64_MIN || r.maxMtime != INT64_MAX) && (!(entry.fields & ENTRY_MTIME) || entry.mtime < r.minMtime || entry.mtime > r.maxMtime)) {
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Raises best to the newest rule in candidates that accepts the entry.
+	 * Candidates are in the order they were added, so the search stops at the first one that is not newer than best.
+	 */
+	void consider(const std::vector<size_t>& candidates, const Entry& entry, long& best) const noexcept {
+		for (auto it = candidates.rbegin(); it != candidates.rend() && static_cast<long>(*it) > best; ++it) {
+			if (this->accepts(this->rules[*it], entry)) {
+				best = *it;
+				return;
+			}
+		}
+	}
+};
+
+RuleSet::RuleSet(std::chrono::system_clock::time_point now): impl(std::make_unique<RuleSetImpl>()) {
+	this->impl->now = now;
+}
+
+RuleSet::RuleSet(RuleSet&& other) = default;
+RuleSet& RuleSet::operator=(RuleSet&& other) = default;
+RuleSet::~RuleSet() = default;
+
+RuleSet& RuleSet::add(std::string_view rule) {
+	while (!rule.empty() && (rule.back() == ' ' || rule.back() == '\t' || rule.back() == '\r')) {
+		rule.remove_suffix(1);
+	}
+	if (rule.empty() || rule.front() == '#') {
+		return *this;
+	}
+
+	// split on unescaped whitespace
+	std::vector<std::string_view> words;
+	for (size_t i = 0; i < rule.size();) {
+		while (i < rule.size() && (rule[i] == ' ' || rule[i] == '\t')) {
+			++i;
+		}
+		const size_t start = i;
+		while (i < rule.size() && rule[i] != ' ' && rule[i] != '\t') {
+			i += rule[i] == '\\' && i + 1 < rule.size() ? 2 : 1;
+		}
+		if (i > start) {
+			words.push_back(rule.substr(start, i - start));
+		}
+	}
+
+	auto isPredicate = [](std::string_view w) {
+		return (w.substr(0, 4) == "size" && w.size() > 5 && (w[4] == '<' || w[4] == '>')) || (w.substr(0, 3) == "age" && w.size() > 4 && (w[3] == '<' || w[3] == '>'));
+	};
+
+	Rule r;
+	size_t first = 0;
+	if (!isPredicate(words[0])) {
+		this->impl->parsePattern(r, words[0], rule);
+		first = 1;
+	}
+	else {
+		r.tokens.push_back(Token{TokenType::STAR, '*', {}});
+	}
+	for (size_t i = first; i < words.size(); ++i) {
+		if (!isPredicate(words[i])) {
+			lnthrow(std::invalid_argument, "Unknown predicate \"" + std::string(words[i]) + "\" in rule \"" + std::string(rule) + "\"");
+		}
+		this->impl->parsePredicate(r, words[i], rule);
+	}
+
+	this->impl->rules.push_back(std::move(r));
+	this->impl->index(this->impl->rules.size() - 1);
+	return *this;
+}
+
+RuleSet& RuleSet::addLines(std::string_view lines) {
+	while (!lines.empty()) {
+		const size_t nl = lines.find('\n');
+		this->add(lines.substr(0, nl));
+		lines.remove_prefix(nl == std::string_view::npos ? lines.size() : nl + 1);
+	}
+	return *this;
+}
+
+unsigned RuleSet::fields() const noexcept {
+	return this->impl->fields;
+}
+
+bool RuleSet::empty() const noexcept {
+	return this->impl->rules.empty();
+}
+
+bool RuleSet::excluded(std::string_view dir, std::string_view name, const Entry& entry) const {
+	const RuleSetImpl& rs = *this->impl;
+	long best = -1;
+
+	auto it = rs.names.find(name);
+	if (it != rs.names.end()) {
+		rs.consider(it->second, entry, best);
+	}
+	for (size_t len : rs.suffixLengths) {
+		if (len > name.size()) {
+			break;
+		}
+		it = rs.suffixes.find(name.substr(name.size() - len));
+		if (it != rs.suffixes.end()) {
+			rs.consider(it->second, entry, best);
+		}
+	}
+
+	std::string path;
+	if (!rs.paths.empty() || !rs.globs.empty()) {
+		path.reserve(dir.size() + name.size());
+		path.append(dir);
+		path.append(name);
+	}
+	if (!rs.paths.empty()) {
+		it = rs.paths.find(path);
+		if (it != rs.paths.end()) {
+			rs.consider(it->second, entry, best);
+		}
+	}
+
+	for (auto g = rs.globs.rbegin(); g != rs.globs.rend() && static_cast<long>(*g) > best; ++g) {
+		const Rule& r = rs.rules[*g];
+		const char* s = r.anchored ? path.data() : name.data();
+		const size_t len = r.anchored ? path.size() : name.size();
+		if (globMatch(r.tokens.data(), r.tokens.data() + r.tokens.size(), s, s + len) && rs.accepts(r, entry)) {
+			best = *g;
+			break;
+		}
+	}
+
+	return best >= 0 && !rs.rules[best].negate;
+}
+
+}
@@ -0,0 +1,93 @@
+/** @file rules.hpp
+ * @brief gitignore-style include/exclude rules for the tree walkers.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_RULES_HPP
+#define __CS_RULES_HPP
+
+#include "dirreader.hpp"
+#include <chrono>
+#include <memory>
+#include <string_view>
+
+namespace CloudSync::fs {
+
+/**
+ * @brief A set of gitignore-style rules deciding which entries a walker skips.
+ *
+ * Each rule is one line:
+ * <ul>
+ * <li>Blank lines and lines starting with '#' are ignored.</li>
+ * <li>A pattern without a '/' (other than a trailing one) matches an entry's name at any depth, such as "node_modules" or "*.log".</li>
+ * <li>A pattern with a '/' in it is anchored to the base directory, such as "/build" or "docs&#47;*.pdf".</li>
+ * <li>A trailing '/' only matches directories.</li>
+ * <li>'*' matches anything but '/', '?' matches one character other than '/', and [a-z] or [!a-z] matches a character class.</li>
+ * <li>"**&#47;" matches any number of directories, and a trailing "&#47;**" matches everything inside a directory.</li>
+ * <li>A leading '!' re-includes entries that an earlier rule excluded. As with git, an entry inside an excluded directory cannot be re-included, because that directory is never opened.</li>
+ * <li>A pattern can be followed by predicates separated by spaces, "size>N", "size<N", "age>N", or "age<N". Sizes take a K, M, G, or T suffix (powers of 1024), and ages take s, m, h, d, or w. A rule with predicates only matches files, and a line with only predicates applies to every file.</li>
+ * </ul>
+ * The last rule that matches an entry decides whether it is excluded.
+ *
+ * The rules are compiled as they are added: literal names, "*.ext"-style suffixes, and literal anchored paths are indexed in hash tables, so only the remaining glob rules are matched one by one.
+ */
+class RuleSet {
+public:
+	/**
+	 * @brief Constructs an empty RuleSet, which excludes nothing.
+	 *
+	 * @param now The time that ages are measured from.
+	 */
+	RuleSet(std::chrono::system_clock::time_point now = std::chrono::system_clock::now());
+
+	RuleSet(RuleSet&& other);
+	RuleSet& operator=(RuleSet&& other);
+	~RuleSet();
+
+	/**
+	 * @brief Adds one rule. Later rules take precedence over earlier ones.
+	 *
+	 * @exception std::invalid_argument The rule is malformed, such as an unterminated character class or an unknown predicate.
+	 */
+	RuleSet& add(std::string_view rule);
+
+	/**
+	 * @brief Adds every line of a string as a rule, as in a .gitignore file.
+	 *
+	 * @exception std::invalid_argument A rule is malformed.
+	 */
+	RuleSet& addLines(std::string_view lines);
+
+	/**
+	 * @brief Returns the EntryField values that matching needs, which a walker adds to the fields it asks statx() for.
+	 * This is 0 unless a rule has a predicate.
+	 */
+	unsigned fields() const noexcept;
+
+	/**
+	 * @brief Returns true if there are no rules.
+	 */
+	bool empty() const noexcept;
+
+	/**
+	 * @brief Checks whether an entry is excluded.
+	 *
+	 * @param dir The entry's directory relative to the base directory, which is empty or ends with a '/'.
+	 * @param name The entry's name.
+	 * @param entry The entry's type, along with the fields returned by fields() if the entry is not a directory.
+	 *
+	 * @return True if the entry should be skipped.
+	 */
+	bool excluded(std::string_view dir, std::string_view name, const Entry& entry) const;
+
+private:
+	struct RuleSetImpl;
+	std::unique_ptr<RuleSetImpl> impl;
+};
+
+}
+
+#endif
@@ -8,62 +8,296 @@
 
 #include "treewalker.hpp"
 #include "file.hpp"
+#include "fileindex.hpp"
 #include "ioexception.hpp"
 #include "notfoundexception.hpp"
-#include "../logger.hpp"
 #include "../lnthrow.hpp"
-#include <filesystem>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
 namespace CloudSync::fs {
 
+/**
+ * @brief The size of the blocks that batch paths are allocated from.
+ */
+constexpr size_t ARENA_BLOCK_SIZE = 256 << 10;
+
+/**
+ * @brief A bump allocator for the paths of one batch.
+ * Blocks are kept when the arena is reset, so a walk allocates only as many blocks as its largest batch needs.
+ */
+class PathArena {
+public:
+	/**
+	 * @brief Copies dir followed by name into the arena.
+	 *
+	 * @return The null-terminated copy, which is valid until the next reset().
+	 */
+	const char* append(const std::string& dir, const char* name) {
+		const size_t nameLen = std::strlen(name);
+		const size_t len = dir.size() + nameLen + 1;
+		if (this->blocks.empty() || this->used + len > this->blocks[this->current].second) {
+			this->nextBlock(len);
+		}
+
+		char* ret = this->blocks[this->current].first.get() + this->used;
+		std::memcpy(ret, dir.data(), dir.size());
+		std::memcpy(ret + dir.size(), name, nameLen + 1);
+		this->used += len;
+		return ret;
+	}
+
+	/**
+	 * @brief Makes every block available again, invalidating every path handed out so far.
+	 */
+	void reset() noexcept {
+		this->current = 0;
+		this->used = 0;
+	}
+
+private:
+	void nextBlock(size_t len) {
+		if (!this->blocks.empty()) {
+			this->current++;
+		}
+		while (this->current < this->blocks.size() && this->blocks[this->current].second < len) {
+			this->current++;
+		}
+		if (this->current >= this->blocks.size()) {
+			const size_t size = std::max(len, ARENA_BLOCK_SIZE);
+			this->blocks.emplace_back(std::make_unique<char[]>(size), size);
+			this->current = this->blocks.size() - 1;
+		}
+		this->used = 0;
+	}
+
+	std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks;
+	size_t current = 0;
+	size_t used = 0;
+};
+
+struct EntryBatch::EntryBatchImpl {
+	PathArena arena;
+	std::vector<Entry> entries;
+};
+
+EntryBatch::EntryBatch(): impl(std::make_unique<EntryBatchImpl>()) {}
+
+EntryBatch::EntryBatch(EntryBatch&& other) noexcept = default;
+
+EntryBatch& EntryBatch::operator=(EntryBatch&& other) noexcept = default;
+
+EntryBatch::~EntryBatch() = default;
+
+const std::vector<Entry>& EntryBatch::entries() const noexcept {
+	return this->impl->entries;
+}
+
+/**
+ * @brief A directory that is currently being read.
+ */
+struct Frame {
+	int fd;
+	/**
+	 * @brief The directory's path, with a trailing '/' unless it is the base directory.
+	 */
+	std::string path;
+};
+
 struct TreeWalker::TreeWalkerImpl {
-	std::filesystem::path baseDir;
-	std::filesystem::recursive_directory_iterator iter;
+	std::string baseDir;
+	unsigned fields;
+	RuleSet rules;
+	FileIndex* index = nullptr;
+	/**
+	 * @brief The fields to ask statx() for, which are the caller's fields plus the ones the rules and index need.
+	 */
+	unsigned statFields;
+	std::vector<Frame> stack;
+	/**
+	 * @brief One reader per level of the stack. These are not freed when the walker leaves a directory so their buffers are reused.
+	 */
+	std::vector<DirReader> readers;
 	std::mutex m;
-	std::filesystem::path currentPath;
-	const std::filesystem::recursive_directory_iterator end;
+	std::string currentPath;
+	std::string currentDir;
+	/**
+	 * @brief Holds the path of a file while it is checked against the index.
+	 */
+	std::string scratch;
+
+	~TreeWalkerImpl() {
+		while (!this->stack.empty()) {
+			this->pop();
+		}
+	}
+
+	void push(int fd, std::string&& path) {
+		if (this->readers.size() <= this->stack.size()) {
+			this->readers.emplace_back();
+		}
+		this->readers[this->stack.size()].reset(fd);
+		this->stack.push_back(Frame{fd, std::move(path)});
+	}
+
+	void pop() noexcept {
+		close(this->stack.back().fd);
+		this->stack.pop_back();
+	}
+
+	/**
+	 * @brief Finds the next file. On success, its directory is stack.back().path and its name is d.name.
+	 */
+	bool next(Entry& entry, DirEntry& d) {
+		while (!this->stack.empty()) {
+			Frame& top = this->stack.back();
+			if (!this->readers[this->stack.size() - 1].next(d)) {
+				this->pop();
+				continue;
+			}
+
+			const unsigned fields = d.type == DT_DIR ? 0 : this->statFields;
+			if (!fillEntry(top.fd, d, fields, entry)) {
+				continue;
+			}
+			if (!this->rules.empty() && this->rules.excluded(std::string_view(top.path).substr(this->stack.front().path.size()), d.name, entry)) {
+				continue;
+			}
+
+			if (entry.type == Type::Directory) {
+				const int fd = openDirectoryAt(top.fd, d.name);
+				if (fd < 0) {
+					if (errno == EACCES || errno == ENOENT || errno == ENOTDIR || errno == ELOOP) {
+						continue;
+					}
+					lnthrow(IOException, "Failed to open directory \"" + top.path + d.name + "\" (" + std::strerror(errno) + ")");
+				}
+				this->push(fd, top.path + d.name + "/");
+				continue;
+			}
+			if (this->index) {
+				this->scratch.assign(top.path);
+				this->scratch += d.name;
+				entry.path = this->scratch.c_str();
+				if (this->index->skip(entry)) {
+					continue;
+				}
+			}
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Recomputes statFields from the caller's fields and the ones the rules and index need.
+	 */
+	void updateFields() noexcept {
+		this->statFields = this->fields | this->rules.fields() | (this->index ? FileIndex::FIELDS : 0);
+	}
+
+	/**
+	 * @brief Sets currentDir to the directory part of a path returned by the walker, which always contains a '/'.
+	 */
+	void setCurrentDirectory(const char* path) {
+		const char* slash = std::strrchr(path, '/');
+		this->currentDir.assign(path, slash == path ? 1 : slash - path);
+	}
 };
 
-TreeWalker::TreeWalker(const char* baseDir): impl(std::make_unique<TreeWalkerImpl>()) {
+TreeWalker::TreeWalker(const char* baseDir, unsigned fields): impl(std::make_unique<TreeWalkerImpl>()) {
 	if (!isDirectory(baseDir)) {
 		lnthrow(NotFoundException, "\"" + std::string(baseDir) + "\" does not point to a directory");
 	}
 
+	this->impl->fields = fields;
+	this->impl->statFields = fields;
 	this->impl->baseDir = baseDir;
-	try {
-		this->impl->iter = std::filesystem::recursive_directory_iterator(this->impl->baseDir, std::filesystem::directory_options::skip_permission_denied);
+	while (this->impl->baseDir.size() > 1 && this->impl->baseDir.back() == '/') {
+		this->impl->baseDir.pop_back();
 	}
-	catch (std::filesystem::filesystem_error& e) {
-		lnthrow(IOException, "Failed to create recursive_directory_iterator.", e);
+
+	// the base directory may be a symlink, but nothing below it is followed
+	const int fd = openDirectoryAt(AT_FDCWD, this->impl->baseDir.c_str(), true);
+	if (fd < 0) {
+		lnthrow(IOException, "Failed to open directory \"" + this->impl->baseDir + "\" (" + std::strerror(errno) + ")");
 	}
+	this->impl->push(fd, this->impl->baseDir == "/" ? std::string("/") : this->impl->baseDir + "/");
 }
 
 TreeWalker::~TreeWalker() = default;
 
-const char* TreeWalker::nextEntry() {
-	std::unique_lock<std::mutex> lock(this->impl->m);
-	if (this->impl->iter == this->impl->end) {
-		return nullptr;
+TreeWalker& TreeWalker::setRules(RuleSet&& rules) {
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	this->impl->rules = std::move(rules);
+	this->impl->updateFields();
+	return *this;
+}
+
+TreeWalker& TreeWalker::setIndex(FileIndex* index) {
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	this->impl->index = index;
+	this->impl->updateFields();
+	return *this;
+}
+
+bool TreeWalker::nextEntry(Entry& entry) {
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	DirEntry d;
+	if (!this->impl->next(entry, d)) {
+		return false;
 	}
-	this->impl->currentPath = this->impl->iter->path();
-	if (std::filesystem::is_directory(this->impl->currentPath.generic_string())) {
-		++this->impl->iter;
-		lock.unlock();
-		return nextEntry();
+	this->impl->currentPath = this->impl->stack.back().path;
+	this->impl->currentPath += d.name;
+	entry.path = this->impl->currentPath.c_str();
+	this->impl->setCurrentDirectory(entry.path);
+	return true;
+}
+
+size_t TreeWalker::nextBatch(EntryBatch& batch, size_t n) {
+	std::vector<Entry>& entries = batch.impl->entries;
+	// the batch belongs to the caller, so only the walk itself needs the lock
+	batch.impl->arena.reset();
+	entries.resize(n);
+
+	DirEntry d;
+	size_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock(this->impl->m);
+		while (count < n && this->impl->next(entries[count], d)) {
+			entries[count].path = batch.impl->arena.append(this->impl->stack.back().path, d.name);
+			count++;
+		}
+		if (count > 0) {
+			this->impl->setCurrentDirectory(entries[count - 1].path);
+		}
 	}
-	const char* s = this->impl->currentPath.c_str();
-	++this->impl->iter;
-	return s;
+	entries.resize(count);
+	return count;
+}
+
+const char* TreeWalker::nextEntry() {
+	Entry entry;
+	return this->nextEntry(entry) ? entry.path : nullptr;
 }
 
 const char* TreeWalker::currentDirectory() const noexcept {
-	return this->impl->iter->path().parent_path().c_str();
+	return this->impl->currentDir.empty() ? nullptr : this->impl->currentDir.c_str();
 }
 
 void TreeWalker::skipDirectory() noexcept {
-	std::unique_lock<std::mutex>(this->impl->m);
-	this->impl->iter.pop();
+	std::lock_guard<std::mutex> lock(this->impl->m);
+	if (!this->impl->stack.empty()) {
+		this->impl->pop();
+	}
 }
 
 }
@@ -9,12 +9,41 @@
 #ifndef __CS_TREEWALKER_HPP
 #define __CS_TREEWALKER_HPP
 
+#include "dirreader.hpp"
+#include "fileindex.hpp"
+#include "rules.hpp"
+#include <cstddef>
 #include <memory>
+#include <vector>
 
 namespace CloudSync::fs {
 
+/**
+ * @brief A batch of entries filled by TreeWalker::nextBatch(), along with the memory their paths are stored in.
+ * Each consumer of a walk keeps its own batch, so several threads can take batches from one TreeWalker at once without sharing anything but the walker's lock.
+ * Refilling a batch reuses its memory, so it allocates nothing once the batch has grown to fit the largest one.
+ */
+class EntryBatch {
+public:
+	EntryBatch();
+	EntryBatch(EntryBatch&& other) noexcept;
+	EntryBatch& operator=(EntryBatch&& other) noexcept;
+	~EntryBatch();
+
+	/**
+	 * @brief Returns the entries of the last fill, which is empty once the walk is over. Their paths are valid until the batch is refilled or destroyed.
+	 */
+	const std::vector<Entry>& entries() const noexcept;
+
+private:
+	friend class TreeWalker;
+	struct EntryBatchImpl;
+	std::unique_ptr<EntryBatchImpl> impl;
+};
+
 /**
  * @brief A class that recursively iterates though files in a directory.
+ * Directories are read depth-first in the order the filesystem lists them, using getdents64() and openat() relative to their parent, so the walk itself costs no system calls per file.
  */
 class TreeWalker {
 public:
@@ -22,11 +51,12 @@ public:
 	 * @brief Constructs a TreeWalker class starting at the specified directory.
 	 *
 	 * @param baseDir The base directory to start iterating through.
+	 * @param fields The EntryField values that nextEntry(Entry&) should fill. Every field costs nothing unless one is asked for, in which case each file costs one statx().
 	 *
 	 * @exception NotFoundException A directory does not exist at this path.
 	 * @exception IOException I/O error.
 	 */
-	TreeWalker(const char* baseDir);
+	TreeWalker(const char* baseDir, unsigned fields = 0);
 
 	/**
 	 * @brief We have to explicitly define the destructor, otherwise the pImpl unique_ptr has errors determining how to delete the TreeWalkerImpl.
@@ -34,6 +64,26 @@ public:
 	 */
 	~TreeWalker();
 
+	/**
+	 * @brief Sets the rules deciding which entries are skipped. Directories that are excluded are never opened, so nothing under them costs anything.
+	 * This should be called before the first entry is read, since directories that were already entered are not left.
+	 *
+	 * @param rules The rules. Any stat data they need is asked for along with the constructor's fields.
+	 *
+	 * @return This TreeWalker.
+	 */
+	TreeWalker& setRules(RuleSet&& rules);
+
+	/**
+	 * @brief Consults a FileIndex for every file, skipping the ones it says are unchanged and carrying their records over to its next commit().
+	 * This should be called before the first entry is read.
+	 *
+	 * @param index The index, which must outlive the walk, or nullptr to stop consulting one. The stat data it needs is asked for along with the constructor's fields.
+	 *
+	 * @return This TreeWalker.
+	 */
+	TreeWalker& setIndex(FileIndex* index);
+
 	/**
 	 * @brief Returns the next entry in the directory, or nullptr if there are no more entries.
 	 *
@@ -43,13 +93,38 @@ public:
 	 */
 	const char* nextEntry();
 
+	/**
+	 * @brief Returns the next entry in the directory along with its type, inode, and the stat data asked for in the constructor.
+	 * Directories are descended into and are not returned. Symbolic links are returned and are not followed.
+	 *
+	 * @param entry Filled with the next entry. Its path is only valid until the next call.
+	 *
+	 * @return True if an entry was returned, or false if there are no more.
+	 *
+	 * @exception IOException I/O error.
+	 */
+	bool nextEntry(Entry& entry);
+
+	/**
+	 * @brief Refills a batch with the next entries as nextEntry(Entry&) would, taking the lock once for the whole batch.
+	 * The entries and their paths are stored in the batch, which belongs to the caller, so threads that each pass their own batch can call this at once.
+	 *
+	 * @param batch The batch to refill. Its previous entries are invalidated.
+	 * @param n The most entries to return.
+	 *
+	 * @return The number of entries returned, which is only less than n once the walk is over.
+	 *
+	 * @exception IOException I/O error.
+	 */
+	size_t nextBatch(EntryBatch& batch, size_t n);
+
 	/**
 	 * @brief Returns the current directory name, or nullptr if there isn't one.
 	 */
 	const char* currentDirectory() const noexcept;
 
 	/**
-	 * @brief Skips the current directory.
+	 * @brief Skips the rest of the directory containing the last entry returned.
 	 */
 	void skipDirectory() noexcept;
 
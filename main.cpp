@@ -6,6 +6,354 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 
-int main() {
+#include "agent/keyagent.hpp"
+#include "crypto/masterkey.hpp"
+#include "crypto/password.hpp"
+#include "crypto/symmetric.hpp"
+#include "fs/file.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace CloudSync::Crypto;
+
+static void usage(const char* argv0) {
+	std::cerr << "Usage: " << argv0 << " <command> [options]" << std::endl;
+	std::cerr << "Commands:" << std::endl;
+	std::cerr << "  calibrate [--kdf scrypt|pbkdf2] [--time MS] [--memory MIB] [--lanes P]" << std::endl;
+	std::cerr << "      Picks KDF parameters that take about MS milliseconds (default 250) and at most MIB MiB on this machine." << std::endl;
+	std::cerr << "      scrypt runs P lanes (default " << SCRYPT_DEFAULT_LANES << ", at most " << SCRYPT_MAX_LANES << "), which every host that derives the key needs cores for." << std::endl;
+	std::cerr << "  verify [--threads N] FILE..." << std::endl;
+	std::cerr << "      Checks that every segment of each encrypted file still authenticates, without writing any plaintext." << std::endl;
+	std::cerr << "  rewrap FILE..." << std::endl;
+	std::cerr << "      Moves files encrypted with envelope encryption to a new password by rewriting only their headers." << std::endl;
+	std::cerr << "  forget FILE..." << std::endl;
+	std::cerr << "      Makes cloudsync-agent wipe the keys for these files before their TTL runs out." << std::endl;
+	std::cerr << "verify and rewrap take keys from cloudsync-agent when it is running, and ask for the password otherwise." << std::endl;
+	std::cerr << "A key derived from a password is only handed to the agent once it has opened a file." << std::endl;
+}
+
+/**
+ * @brief Returns the name cloudsync-agent caches a key under. A salted key is named after its salt, so every key gets an entry of its own.
+ */
+static std::string agentKeyId(const KdfParams& kdf) {
+	static constexpr char hex[] = "0123456789abcdef";
+	if (kdf.salt.empty()) {
+		return "unsalted";
+	}
+	std::string ret = "salt:";
+	for (unsigned char c : kdf.salt) {
+		ret += hex[c >> 4];
+		ret += hex[c & 0xF];
+	}
+	return ret;
+}
+
+/**
+ * @brief Returns true if at least one file in a batch succeeded.
+ */
+static bool anySucceeded(const std::vector<std::exception_ptr>& errors) {
+	return std::any_of(errors.begin(), errors.end(), [](const std::exception_ptr& e) { return !e; });
+}
+
+/**
+ * @brief Parses a positive integer argument, or returns 0 if it is not one.
+ */
+static unsigned long long parsePositive(const char* str) {
+	char* end;
+	const unsigned long long n = std::strtoull(str, &end, 10);
+	return *str != '\0' && *end == '\0' ? n : 0;
+}
+
+static int calibrate(const char* argv0, int argc, char** argv) {
+	KDFType kt = SCRYPT;
+	std::chrono::milliseconds targetTime(250);
+	size_t maxMemory = 0;
+	unsigned long long lanes = SCRYPT_DEFAULT_LANES;
+
+	for (int i = 0; i < argc; ++i) {
+		if (i + 1 >= argc) {
+			usage(argv0);
+			return 1;
+		}
+		if (!std::strcmp(argv[i], "--kdf")) {
+			const char* name = argv[++i];
+			if (!std::strcmp(name, "scrypt")) {
+				kt = SCRYPT;
+			}
+			else if (!std::strcmp(name, "pbkdf2")) {
+				kt = PBKDF2;
+			}
+			else {
+				usage(argv0);
+				return 1;
+			}
+		}
+		else if (!std::strcmp(argv[i], "--time")) {
+			targetTime = std::chrono::milliseconds(parsePositive(argv[++i]));
+			if (targetTime.count() == 0) {
+				usage(argv0);
+				return 1;
+			}
+		}
+		else if (!std::strcmp(argv[i], "--memory")) {
+			maxMemory = parsePositive(argv[++i]) << 20;
+			if (maxMemory == 0) {
+				usage(argv0);
+				return 1;
+			}
+		}
+		else if (!std::strcmp(argv[i], "--lanes")) {
+			lanes = parsePositive(argv[++i]);
+			if (lanes == 0 || lanes > SCRYPT_MAX_LANES) {
+				usage(argv0);
+				return 1;
+			}
+		}
+		else {
+			usage(argv0);
+			return 1;
+		}
+	}
+
+	const KdfParams params = CalibrateKdf(kt, targetTime, maxMemory, SHA256, lanes);
+
+	unsigned char out[32];
+	const auto start = std::chrono::steady_clock::now();
+	DeriveKey("CloudSync calibration", out, sizeof(out), params);
+	const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+	if (kt == SCRYPT) {
+		std::cout << "scrypt: N=" << params.cost << " r=" << params.blockSize << " p=" << params.parallelism << std::endl;
+		std::cout << "Memory: " << (params.memory() >> 20) << " MiB" << std::endl;
+	}
+	else {
+		std::cout << "PBKDF2-SHA256: " << params.cost << " iterations" << std::endl;
+	}
+	std::cout << "Time: " << elapsed.count() << " ms" << std::endl;
+	std::cout << "These parameters are recorded in every container encrypted with them, so any host can derive the key." << std::endl;
 	return 0;
 }
+
+static int verify(const char* argv0, int argc, char** argv) {
+	unsigned threads = 0;
+	std::vector<std::string> files;
+
+	for (int i = 0; i < argc; ++i) {
+		if (!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = parsePositive(argv[++i]);
+			if (threads == 0) {
+				usage(argv0);
+				return 1;
+			}
+		}
+		else {
+			files.emplace_back(argv[i]);
+		}
+	}
+	if (files.empty()) {
+		usage(argv0);
+		return 1;
+	}
+
+	// every distinct set of KDF parameters needs its own key, so files are grouped by them
+	std::vector<std::pair<KdfParams, std::vector<std::string>>> groups;
+	size_t failed = 0;
+	uint64_t bytes = 0;
+	for (const std::string& f : files) {
+		try {
+			const KdfParams kdf = Symmetric::kdfParams(f.c_str());
+			auto it = std::find_if(groups.begin(), groups.end(), [&kdf](const auto& g) { return g.first == kdf; });
+			if (it == groups.end()) {
+				groups.emplace_back(kdf, std::vector<std::string>());
+				it = groups.end() - 1;
+			}
+			it->second.push_back(f);
+		}
+		catch (std::exception& e) {
+			std::cerr << "FAILED " << f << ": " << e.what() << std::endl;
+			failed++;
+		}
+	}
+
+	// the password is only asked for if the agent does not have a key
+	const CloudSync::Agent::AgentClient agent;
+	const auto start = std::chrono::steady_clock::now();
+	for (const std::pair<KdfParams, std::vector<std::string>>& g : groups) {
+		bool derived;
+		const MasterKey key = CloudSync::Agent::unlockMasterKey(agentKeyId(g.first), "Password:", g.first, &derived);
+		Symmetric sym(key, BlockCipher::AUTO, CipherMode::AUTO);
+		sym.setThreads(threads);
+		const std::vector<std::exception_ptr> errors = sym.verifyFiles(g.second);
+		if (derived && anySucceeded(errors)) {
+			agent.put(agentKeyId(g.first), key, CloudSync::Agent::DEFAULT_TTL);
+		}
+
+		for (size_t i = 0; i < errors.size(); ++i) {
+			if (!errors[i]) {
+				bytes += CloudSync::fs::size(g.second[i].c_str());
+				continue;
+			}
+			failed++;
+			try {
+				std::rethrow_exception(errors[i]);
+			}
+			catch (std::exception& e) {
+				std::cerr << "FAILED " << g.second[i] << ": " << e.what() << std::endl;
+			}
+		}
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Verified " << files.size() - failed << " of " << files.size() << " files, " << (bytes >> 20) << " MiB in " << std::fixed << std::setprecision(2) << seconds << " s";
+	if (seconds > 0) {
+		std::cout << " (" << bytes / seconds / (1 << 20) << " MiB/s)";
+	}
+	std::cout << std::endl;
+	return failed == 0 ? 0 : 1;
+}
+
+static int rewrap(const char* argv0, int argc, char** argv) {
+	if (argc == 0) {
+		usage(argv0);
+		return 1;
+	}
+
+	// each file keeps its KDF parameters, so files are grouped by them and each group gets its own pair of keys
+	std::vector<std::pair<KdfParams, std::vector<const char*>>> groups;
+	size_t failed = 0;
+	for (int i = 0; i < argc; ++i) {
+		try {
+			const KdfParams kdf = Symmetric::kdfParams(argv[i]);
+			auto it = std::find_if(groups.begin(), groups.end(), [&kdf](const auto& g) { return g.first == kdf; });
+			if (it == groups.end()) {
+				groups.emplace_back(kdf, std::vector<const char*>());
+				it = groups.end() - 1;
+			}
+			it->second.push_back(argv[i]);
+		}
+		catch (std::exception& e) {
+			std::cerr << "FAILED " << argv[i] << ": " << e.what() << std::endl;
+			failed++;
+		}
+	}
+
+	// rewrapping only touches the keys wrapped in the headers, so the old keys can come from the agent
+	const CloudSync::Agent::AgentClient agent;
+	std::optional<SecBytes> newPassword;
+	for (const std::pair<KdfParams, std::vector<const char*>>& g : groups) {
+		bool derived;
+		const MasterKey oldKey = CloudSync::Agent::unlockMasterKey(agentKeyId(g.first), "Current password:", g.first, &derived);
+		if (!newPassword) {
+			newPassword = StdinPassword("New password:", "Verify new password:");
+			if (!newPassword) {
+				std::cerr << "The passwords do not match" << std::endl;
+				return 1;
+			}
+			if (newPassword->size() == 0) {
+				std::cerr << "The password cannot be empty" << std::endl;
+				return 1;
+			}
+		}
+
+		// the new key gets a salt of its own, unless the old one had none and the header has no room for it
+		KdfParams newKdf = g.first;
+		if (!newKdf.salt.empty()) {
+			newKdf.salt = NewSalt();
+		}
+		const MasterKey newKey(*newPassword, newKdf);
+
+		const Symmetric from(oldKey, BlockCipher::AUTO, CipherMode::AUTO);
+		const Symmetric to(newKey, BlockCipher::AUTO, CipherMode::AUTO);
+		bool rewrapped = false;
+		for (const char* f : g.second) {
+			try {
+				from.rewrap(f, to);
+				rewrapped = true;
+			}
+			catch (std::exception& e) {
+				std::cerr << "FAILED " << f << ": " << e.what() << std::endl;
+				failed++;
+			}
+		}
+
+		// neither key is cached unless the old one unwrapped a file's key and the new one now wraps it
+		if (rewrapped) {
+			if (derived) {
+				agent.put(agentKeyId(g.first), oldKey, CloudSync::Agent::DEFAULT_TTL);
+			}
+			agent.put(agentKeyId(newKdf), newKey, CloudSync::Agent::DEFAULT_TTL);
+		}
+	}
+
+	std::cout << "Rewrapped " << argc - failed << " of " << argc << " files" << std::endl;
+	return failed == 0 ? 0 : 1;
+}
+
+static int forget(const char* argv0, int argc, char** argv) {
+	if (argc == 0) {
+		usage(argv0);
+		return 1;
+	}
+
+	// files that share KDF parameters share a key, so each key is only forgotten once
+	const CloudSync::Agent::AgentClient agent;
+	std::vector<std::string> ids;
+	size_t failed = 0;
+	size_t forgotten = 0;
+	for (int i = 0; i < argc; ++i) {
+		try {
+			const std::string id = agentKeyId(Symmetric::kdfParams(argv[i]));
+			if (std::find(ids.begin(), ids.end(), id) != ids.end()) {
+				continue;
+			}
+			ids.push_back(id);
+			if (agent.forget(id)) {
+				forgotten++;
+			}
+		}
+		catch (std::exception& e) {
+			std::cerr << "FAILED " << argv[i] << ": " << e.what() << std::endl;
+			failed++;
+		}
+	}
+
+	std::cout << "Forgot " << forgotten << " of " << ids.size() << " keys" << std::endl;
+	return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		if (!std::strcmp(argv[1], "calibrate")) {
+			return calibrate(argv[0], argc - 2, argv + 2);
+		}
+		if (!std::strcmp(argv[1], "verify")) {
+			return verify(argv[0], argc - 2, argv + 2);
+		}
+		if (!std::strcmp(argv[1], "rewrap")) {
+			return rewrap(argv[0], argc - 2, argv + 2);
+		}
+		if (!std::strcmp(argv[1], "forget")) {
+			return forget(argv[0], argc - 2, argv + 2);
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,147 @@
+/** @file tests/agent/keyagent_test.cpp
+ * @brief tests keyagent
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../agent/keyagent.hpp"
+#include "../../fs/ioexception.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace CloudSync::Agent;
+using namespace CloudSync::Crypto;
+
+/**
+ * @brief Runs an agent on a background thread for the length of a test.
+ */
+class KeyAgentTest : public ::testing::Test {
+protected:
+	void SetUp() override {
+		char tmpl[] = "/tmp/cs_agent_test_XXXXXX";
+		ASSERT_NE(mkdtemp(tmpl), nullptr);
+		dir = tmpl;
+		socketPath = dir + "/agent.sock";
+		agent = std::make_unique<KeyAgent>(socketPath.c_str(), std::chrono::seconds(60));
+		thread = std::thread([this]() { agent->run(); });
+	}
+
+	void TearDown() override {
+		agent->stop();
+		thread.join();
+		agent.reset();
+		rmdir(dir.c_str());
+	}
+
+	std::string dir;
+	std::string socketPath;
+	std::unique_ptr<KeyAgent> agent;
+	std::thread thread;
+};
+
+TEST_F(KeyAgentTest, PutGetForget) {
+	AgentClient client(socketPath.c_str());
+	MasterKey mk("hunter2", KdfParams{SCRYPT, SHA256, 16, 1, 2, NewSalt()});
+
+	EXPECT_FALSE(client.get("backup").has_value());
+	EXPECT_TRUE(client.put("backup", mk));
+
+	std::optional<MasterKey> cached = client.get("backup");
+	ASSERT_TRUE(cached.has_value());
+	EXPECT_EQ(cached->params(), mk.params());
+	EXPECT_EQ(cached->fileKey("a.txt").key, mk.fileKey("a.txt").key);
+	EXPECT_EQ(agent->size(), 1u);
+
+	EXPECT_TRUE(client.forget("backup"));
+	EXPECT_FALSE(client.forget("backup"));
+	EXPECT_FALSE(client.get("backup").has_value());
+}
+
+TEST_F(KeyAgentTest, KeysExpire) {
+	AgentClient client(socketPath.c_str());
+	MasterKey mk("hunter2");
+
+	ASSERT_TRUE(client.put("short", mk, std::chrono::seconds(1)));
+	ASSERT_TRUE(client.put("long", mk));
+	EXPECT_TRUE(client.get("short").has_value());
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	EXPECT_FALSE(client.get("short").has_value());
+	EXPECT_TRUE(client.get("long").has_value());
+	EXPECT_EQ(agent->size(), 1u);
+}
+
+TEST_F(KeyAgentTest, InsecureSocketIsRejected) {
+	AgentClient client(socketPath.c_str());
+
+	ASSERT_EQ(chmod(socketPath.c_str(), 0666), 0);
+	EXPECT_THROW(client.get("backup"), CloudSync::fs::IOException);
+	ASSERT_EQ(chmod(socketPath.c_str(), 0600), 0);
+
+	ASSERT_EQ(chmod(dir.c_str(), 0755), 0);
+	EXPECT_THROW(client.get("backup"), CloudSync::fs::IOException);
+	ASSERT_EQ(chmod(dir.c_str(), 0700), 0);
+}
+
+TEST(KeyAgentNoServerTest, MissingAgentIsNotAnError) {
+	AgentClient client("/tmp/cs_agent_test_missing/agent.sock");
+	MasterKey mk("hunter2");
+
+	EXPECT_FALSE(client.get("backup").has_value());
+	EXPECT_FALSE(client.put("backup", mk));
+}
+
+static size_t openFds() {
+	size_t ret = 0;
+	DIR* d = opendir("/proc/self/fd");
+	while (readdir(d) != nullptr) {
+		ret++;
+	}
+	closedir(d);
+	return ret;
+}
+
+TEST(KeyAgentNoServerTest, SecondAgentIsRejected) {
+	char tmpl[] = "/tmp/cs_agent_test_XXXXXX";
+	ASSERT_NE(mkdtemp(tmpl), nullptr);
+	const std::string path = std::string(tmpl) + "/agent.sock";
+
+	{
+		KeyAgent first(path.c_str());
+		// the failed agent closes the socket it opened and leaves the first one's socket alone
+		const size_t fds = openFds();
+		EXPECT_THROW(KeyAgent second(path.c_str()), CloudSync::fs::IOException);
+		EXPECT_EQ(openFds(), fds);
+		EXPECT_EQ(access(path.c_str(), F_OK), 0);
+	}
+
+	// a socket left behind by a killed agent is replaced
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	std::strcpy(addr.sun_path, path.c_str());
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	ASSERT_EQ(bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)), 0);
+	close(fd);
+	EXPECT_NO_THROW(KeyAgent(path.c_str()));
+	rmdir(tmpl);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,105 @@
+/** @file tests/compress/codec_test.cpp
+ * @brief tests codec
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../compress/codec.hpp"
+#include "../test_ext.hpp"
+#include <gtest/gtest.h>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+using namespace CloudSync::Compress;
+
+static std::vector<unsigned char> randomData(size_t len) {
+	std::mt19937 rng(42);
+	std::vector<unsigned char> ret(len);
+	for (unsigned char& c : ret) {
+		c = rng();
+	}
+	return ret;
+}
+
+TEST(CodecTest, EntropyEstimate) {
+	std::vector<unsigned char> text(1 << 20);
+	TestExt::fillData(text.data(), text.size());
+	const std::vector<unsigned char> noise = randomData(1 << 20);
+	const std::vector<unsigned char> zeros(4096);
+
+	EXPECT_EQ(estimateEntropy(zeros.data(), zeros.size()), 0);
+	EXPECT_NEAR(estimateEntropy(text.data(), text.size()), 3.32, 0.01);
+	EXPECT_GT(estimateEntropy(noise.data(), noise.size()), 7.9);
+	EXPECT_TRUE(worthCompressing(text.data(), text.size()));
+	EXPECT_FALSE(worthCompressing(noise.data(), noise.size()));
+	EXPECT_EQ(estimateEntropy(nullptr, 0), 0);
+}
+
+TEST(CodecTest, RoundTrip) {
+	std::vector<unsigned char> data(100000, 'a');
+	TestExt::fillData(data.data(), 1000);
+
+	for (Codec codec : {Codec::ZSTD, Codec::LZ4}) {
+		if (!codecAvailable(codec)) {
+			continue;
+		}
+		for (int level : {-1, 0, 3}) {
+			Compressor comp(codec, level);
+			std::vector<unsigned char> compressed(data.size());
+			std::vector<unsigned char> out(data.size());
+
+			const size_t n = comp.compress(data.data(), data.size(), compressed.data(), compressed.size());
+			ASSERT_GT(n, 0u);
+			EXPECT_LT(n, data.size());
+			EXPECT_EQ(comp.decompress(compressed.data(), n, out.data(), out.size()), data.size());
+			EXPECT_EQ(out, data);
+		}
+	}
+}
+
+TEST(CodecTest, IncompressibleDataDoesNotFit) {
+	const std::vector<unsigned char> noise = randomData(4096);
+	std::vector<unsigned char> out(noise.size() - 1);
+
+	for (Codec codec : {Codec::ZSTD, Codec::LZ4}) {
+		if (codecAvailable(codec)) {
+			Compressor comp(codec);
+			EXPECT_EQ(comp.compress(noise.data(), noise.size(), out.data(), out.size()), 0u);
+		}
+	}
+}
+
+TEST(CodecTest, OverlongOutputThrows) {
+	std::vector<unsigned char> data(4096);
+	TestExt::fillData(data.data(), data.size());
+	std::vector<unsigned char> compressed(data.size());
+	std::vector<unsigned char> out(data.size() / 2);
+
+	for (Codec codec : {Codec::ZSTD, Codec::LZ4}) {
+		if (codecAvailable(codec)) {
+			Compressor comp(codec);
+			const size_t n = comp.compress(data.data(), data.size(), compressed.data(), compressed.size());
+			ASSERT_GT(n, 0u);
+			EXPECT_THROW(comp.decompress(compressed.data(), n, out.data(), out.size()), std::runtime_error);
+		}
+	}
+}
+
+TEST(CodecTest, InvalidArgumentsAreRejected) {
+	EXPECT_THROW(Compressor(Codec::NONE), std::logic_error);
+	EXPECT_THROW(Compressor(Codec::ZSTD, 1000), std::logic_error);
+	EXPECT_THROW(Compressor(Codec::LZ4, 13), std::logic_error);
+	EXPECT_TRUE(codecAvailable(Codec::NONE));
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
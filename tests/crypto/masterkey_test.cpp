@@ -0,0 +1,90 @@
+/** @file tests/crypto/masterkey_test.cpp
+ * @brief tests masterkey
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../crypto/masterkey.hpp"
+#include "../../crypto/symmetric.hpp"
+#include "../../crypto/integrityexception.hpp"
+#include "../test_ext.hpp"
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <vector>
+
+using namespace CloudSync::Crypto;
+
+constexpr const char* plainFname = "mk_plain.txt";
+constexpr const char* encFname = "mk_enc.bin";
+constexpr const char* decFname = "mk_dec.txt";
+
+TEST(MasterKeyTest, SameIdSameKey) {
+	MasterKey mk("hunter2");
+	FileKey a = mk.fileKey("docs/a.txt");
+	FileKey b = mk.fileKey("docs/a.txt");
+
+	EXPECT_EQ(a.key.size(), 32u);
+	EXPECT_EQ(a.iv.size(), 16u);
+	EXPECT_EQ(a.key, b.key);
+	EXPECT_EQ(a.iv, b.iv);
+}
+
+TEST(MasterKeyTest, DifferentIdsDifferentKeys) {
+	MasterKey mk("hunter2");
+	FileKey a = mk.fileKey("docs/a.txt");
+	FileKey b = mk.fileKey("docs/b.txt");
+
+	EXPECT_NE(a.key, b.key);
+	EXPECT_NE(a.iv, b.iv);
+}
+
+TEST(MasterKeyTest, DifferentPasswordsDifferentKeys) {
+	MasterKey mk1("hunter2");
+	MasterKey mk2("hunter3");
+
+	EXPECT_NE(mk1.fileKey("docs/a.txt").key, mk2.fileKey("docs/a.txt").key);
+}
+
+TEST(MasterKeyTest, LongOutput) {
+	MasterKey mk("hunter2");
+	FileKey a = mk.fileKey("docs/a.txt", 100, 20);
+	FileKey b = mk.fileKey("docs/a.txt", 32, 16);
+
+	// HKDF output is a prefix stream, so the first 32 bytes agree regardless of the total length
+	EXPECT_EQ(SecBytes(a.key.data(), 32), b.key);
+	EXPECT_THROW(mk.fileKey("docs/a.txt", 8000, 1000), std::logic_error);
+}
+
+TEST(MasterKeyTest, SymmetricRoundTrip) {
+	std::vector<unsigned char> data(10000);
+	MasterKey mk("hunter2");
+	TestExt::fillData(&data[0], data.size());
+	TestExt::createFile(plainFname, &data[0], data.size());
+
+	Symmetric(mk.fileKey("a")).setChunkSize(4096).encryptFile(plainFname, encFname);
+	Symmetric(mk.fileKey("a")).setChunkSize(4096).decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+
+	EXPECT_THROW(Symmetric(mk.fileKey("b")).decryptFile(encFname, decFname), IntegrityException);
+
+	std::remove(plainFname);
+	std::remove(encFname);
+	std::remove(decFname);
+}
+
+TEST(MasterKeyTest, SymmetricRejectsBadKeyLength) {
+	MasterKey mk("hunter2");
+	EXPECT_THROW(Symmetric(mk.fileKey("a", 20, 16)), std::logic_error);
+	EXPECT_THROW(Symmetric(mk.fileKey("a", 32, 8)), std::logic_error);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,207 @@
+/** @file tests/crypto/password_test.cpp
+ * @brief tests password
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../crypto/password.hpp"
+#include "../../crypto/masterkey.hpp"
+#include <cryptopp/hmac.h>
+#include <cryptopp/sha.h>
+#include <cstdlib>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+using namespace CloudSync::Crypto;
+
+/**
+ * @brief The number of heap allocations made while allocCounting is set.
+ */
+static thread_local size_t allocCount = 0;
+static thread_local bool allocCounting = false;
+
+void* operator new(size_t len) {
+	if (allocCounting) {
+		allocCount++;
+	}
+	void* ptr = std::malloc(len ? len : 1);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+/**
+ * @brief Returns the number of heap allocations f makes.
+ */
+template <class F>
+static size_t countAllocs(F f) {
+	allocCount = 0;
+	allocCounting = true;
+	f();
+	allocCounting = false;
+	return allocCount;
+}
+
+TEST(PasswordTest, KeypairSplitsDerivedKey) {
+	unsigned char expected[48];
+	DeriveKey("hunter2", expected, sizeof(expected));
+
+	std::pair<SecBytes, SecBytes> kp = DeriveKeypair("hunter2", 32, 16);
+	ASSERT_EQ(kp.first.size(), 32u);
+	ASSERT_EQ(kp.second.size(), 16u);
+	EXPECT_EQ(std::memcmp(kp.first.data(), expected, 32), 0);
+	EXPECT_EQ(std::memcmp(kp.second.data(), expected + 32, 16), 0);
+
+	SecBytes pw("hunter2");
+	EXPECT_EQ(DeriveKeypair(pw, 32, 16).first, kp.first);
+}
+
+TEST(PasswordTest, KeyPathDoesNotAllocate) {
+	unsigned char buf[48];
+	const size_t kdfAllocs = countAllocs([&]() {
+		DeriveKey("hunter2", buf, sizeof(buf));
+	});
+
+	// any allocation past the KDF's own would be a copy of the key
+	std::pair<SecBytes, SecBytes> kp;
+	EXPECT_EQ(countAllocs([&]() {
+		kp = DeriveKeypair("hunter2", 32, 16);
+	}), kdfAllocs);
+
+	std::pair<SecBytes, SecBytes> moved;
+	EXPECT_EQ(countAllocs([&]() {
+		moved = std::move(kp);
+	}), 0u);
+	EXPECT_EQ(moved.first.size(), 32u);
+}
+
+TEST(PasswordTest, FileKeyDoesNotAllocate) {
+	MasterKey mk("hunter2");
+	const unsigned char prk[32] = {};
+	const size_t hmacAllocs = countAllocs([&]() {
+		CryptoPP::HMAC<CryptoPP::SHA256> hmac(prk, sizeof(prk));
+	});
+
+	FileKey fk;
+	EXPECT_EQ(countAllocs([&]() {
+		fk = mk.fileKey("docs/a.txt");
+	}), hmacAllocs);
+
+	FileKey moved;
+	EXPECT_EQ(countAllocs([&]() {
+		moved = std::move(fk);
+	}), 0u);
+	EXPECT_EQ(moved.key.size(), 32u);
+	EXPECT_EQ(moved.iv.size(), 16u);
+}
+
+TEST(PasswordTest, SecSpanSubspan) {
+	SecBytes s("0123456789");
+	SecSpan span(s);
+
+	EXPECT_EQ(span.data(), s.data());
+	EXPECT_EQ(span.size(), 10u);
+	EXPECT_EQ(std::memcmp(span.subspan(3, 4).data(), "3456", 4), 0);
+	EXPECT_EQ(span.subspan(10, 0).size(), 0u);
+	EXPECT_THROW(span.subspan(8, 3), std::out_of_range);
+}
+
+TEST(PasswordTest, ScryptMatchesRfc7914) {
+	// RFC 7914 section 12, first vector: empty password and salt, N=16, r=1, p=1
+	const unsigned char expected[] = {
+		0x77, 0xd6, 0x57, 0x62, 0x38, 0x65, 0x7b, 0x20, 0x3b, 0x19, 0xca, 0x42, 0xc1, 0x8a, 0x04, 0x97,
+		0xf1, 0x6b, 0x48, 0x44, 0xe3, 0x07, 0x4a, 0xe8, 0xdf, 0xdf, 0xfa, 0x3f, 0xed, 0xe2, 0x14, 0x42,
+		0xfc, 0xd0, 0x06, 0x9d, 0xed, 0x09, 0x48, 0xf8, 0x32, 0x6a, 0x75, 0x3a, 0x0f, 0xc8, 0x1f, 0x17,
+		0xe8, 0xd3, 0xe0, 0xfb, 0x2e, 0x0d, 0x36, 0x28, 0xcf, 0x35, 0xe2, 0x0c, 0x38, 0xd1, 0x89, 0x06,
+	};
+	unsigned char out[64];
+	DeriveKey(SecSpan(), out, sizeof(out), KdfParams{SCRYPT, SHA256, 16, 1, 1});
+	EXPECT_EQ(std::memcmp(out, expected, sizeof(out)), 0);
+}
+
+TEST(PasswordTest, ScryptUsesTheSalt) {
+	// RFC 7914 section 12, second vector: "password" salted with "NaCl", N=1024, r=8, p=16
+	const unsigned char expected[] = {
+		0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+		0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+		0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+		0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40,
+	};
+	unsigned char out[64];
+	DeriveKey("password", out, sizeof(out), KdfParams{SCRYPT, SHA256, 1024, 8, 16, {'N', 'a', 'C', 'l'}});
+	EXPECT_EQ(std::memcmp(out, expected, sizeof(out)), 0);
+}
+
+TEST(PasswordTest, SaltsChangeTheKey) {
+	KdfParams a{PBKDF2, SHA256, 1024};
+	a.salt = NewSalt();
+	KdfParams b = a;
+	b.salt = NewSalt();
+	unsigned char outA[32];
+	unsigned char outB[32];
+
+	EXPECT_EQ(a.salt.size(), KDF_SALT_LEN);
+	EXPECT_NE(a, b);
+	DeriveKey("hunter2", outA, sizeof(outA), a);
+	DeriveKey("hunter2", outB, sizeof(outB), b);
+	EXPECT_NE(std::memcmp(outA, outB, sizeof(outA)), 0);
+
+	// a salt without a cost would silently be ignored by Crypto++'s defaults
+	EXPECT_THROW(DeriveKey("hunter2", outA, sizeof(outA), KdfParams{PBKDF2, SHA256, 0, 0, 0, a.salt}), std::logic_error);
+}
+
+TEST(PasswordTest, ScryptLanesRunInParallel) {
+	// lanes are mixed on separate threads, so p > 1 must still match the reference implementation
+	const unsigned char expected[] = {
+		0x92, 0xc3, 0x3e, 0x3d, 0x57, 0x75, 0x5a, 0x12, 0x2d, 0xc3, 0xfe, 0x8e, 0xee, 0xf4, 0x37, 0x6e,
+		0x73, 0xa0, 0x6c, 0x1b, 0xad, 0x85, 0xe1, 0x93, 0x52, 0xc8, 0xb1, 0x45, 0xb5, 0x5a, 0xd8, 0xca,
+	};
+	unsigned char out[32];
+	DeriveKey("hunter2", out, sizeof(out), KdfParams{SCRYPT, SHA256, 1024, 8, 4});
+	EXPECT_EQ(std::memcmp(out, expected, sizeof(out)), 0);
+}
+
+TEST(PasswordTest, InvalidScryptCostIsRejected) {
+	unsigned char out[32];
+	EXPECT_THROW(DeriveKey("hunter2", out, sizeof(out), KdfParams{SCRYPT, SHA256, 1000, 8, 1}), std::logic_error);
+}
+
+TEST(PasswordTest, CalibrationRespectsMemoryLimit) {
+	const size_t limit = 16 << 20;
+	const KdfParams params = CalibrateKdf(SCRYPT, std::chrono::milliseconds(0), limit);
+	EXPECT_EQ(params.kt, SCRYPT);
+	EXPECT_GT(params.cost, 0u);
+	EXPECT_LE(params.memory(), limit);
+	EXPECT_GT(params.memory() * 2, limit);
+	EXPECT_EQ(params.salt.size(), KDF_SALT_LEN);
+	// p must not depend on the machine, or a key calibrated on a big server would take far longer everywhere else
+	EXPECT_EQ(params.parallelism, SCRYPT_DEFAULT_LANES);
+	EXPECT_EQ(CalibrateKdf(SCRYPT, std::chrono::milliseconds(0), limit, SHA256, 1).parallelism, 1u);
+	EXPECT_THROW(CalibrateKdf(SCRYPT, std::chrono::milliseconds(0), limit, SHA256, 0), std::logic_error);
+
+	EXPECT_GE(CalibrateKdf(PBKDF2, std::chrono::milliseconds(10)).cost, 1024u);
+	EXPECT_THROW(CalibrateKdf(HKDF, std::chrono::milliseconds(10)), std::logic_error);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,99 @@
+/** @file tests/crypto/secbytes_test.cpp
+ * @brief tests secbytes
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../crypto/secbytes.hpp"
+#include <algorithm>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <utility>
+
+TEST(SecBytesTest, KeysArePooled) {
+	unsigned char* first;
+	{
+		// a key must not live inside the object, where it could not be locked
+		SecBytes key(32);
+		first = key.data();
+		std::memset(key.data(), 0xAA, key.size());
+		EXPECT_EQ(key.capacity(), 32u);
+		EXPECT_TRUE(first < reinterpret_cast<unsigned char*>(&key) || first >= reinterpret_cast<unsigned char*>(&key + 1));
+	}
+
+	SecBytes reused(32);
+	EXPECT_EQ(reused.data(), first);
+	EXPECT_TRUE(std::all_of(reused.data(), reused.data() + reused.size(), [](unsigned char c) { return c == 0; }));
+
+	SecBytes empty;
+	EXPECT_NE(empty.data(), nullptr);
+	EXPECT_EQ(empty.capacity(), 0u);
+}
+
+TEST(SecBytesTest, LargeSecretsArePooledAndWiped) {
+	unsigned char* first;
+	{
+		SecBytes big(1000);
+		first = big.data();
+		std::memset(big.data(), 0xAA, big.size());
+		EXPECT_GE(big.capacity(), 1000u);
+	}
+
+	SecBytes reused(1000);
+	EXPECT_EQ(reused.data(), first);
+	EXPECT_TRUE(std::all_of(reused.data(), reused.data() + reused.size(), [](unsigned char c) { return c == 0; }));
+}
+
+TEST(SecBytesTest, MoveStealsPooledBlock) {
+	SecBytes a(1000);
+	unsigned char* ptr = a.data();
+	a[999] = 7;
+
+	SecBytes b(std::move(a));
+	EXPECT_EQ(b.data(), ptr);
+	EXPECT_EQ(b[999], 7);
+	EXPECT_EQ(a.size(), 0u);
+
+	SecBytes c("hunter2");
+	SecBytes d(std::move(c));
+	EXPECT_EQ(d, SecBytes("hunter2"));
+	EXPECT_EQ(c.size(), 0u);
+}
+
+TEST(SecBytesTest, ResizeKeepsContents) {
+	SecBytes s("0123456789");
+	s.resize(100);
+	EXPECT_EQ(std::memcmp(s.data(), "0123456789", 10), 0);
+	s.resize(5);
+	EXPECT_EQ(s, SecBytes("01234"));
+	EXPECT_THROW(s[5], std::out_of_range);
+}
+
+TEST(SecBytesTest, ConcatenateAndCompare) {
+	SecBytes a("correct horse ");
+	SecBytes b("battery staple");
+
+	EXPECT_EQ(a + b, SecBytes("correct horse battery staple"));
+	a += a;
+	EXPECT_EQ(a, SecBytes("correct horse correct horse "));
+	EXPECT_NE(a, b);
+
+	SecBytes big(200);
+	std::memset(big.data(), 'x', big.size());
+	SecBytes copy;
+	copy = big;
+	EXPECT_EQ(copy, big);
+	EXPECT_NE(copy.data(), big.data());
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
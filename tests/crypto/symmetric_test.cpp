@@ -0,0 +1,743 @@
+/** @file tests/crypto/symmetric_test.cpp
+ * @brief tests symmetric
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../crypto/symmetric.hpp"
+#include "../../crypto/integrityexception.hpp"
+#include "../../crypto/masterkey.hpp"
+#include "../test_ext.hpp"
+#include <cryptopp/sha.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <initializer_list>
+#include <iterator>
+#include <random>
+#include <vector>
+
+using namespace CloudSync::Crypto;
+namespace Compress = CloudSync::Compress;
+
+constexpr const char* plainFname = "sym_plain.txt";
+constexpr const char* encFname = "sym_enc.bin";
+constexpr const char* decFname = "sym_dec.txt";
+constexpr const char* encFname2 = "sym_enc2.bin";
+
+class SymmetricTest : public testing::Test {
+protected:
+	virtual void SetUp() override {
+		data.resize(3 * 4096 + 123);
+		TestExt::fillData(&data[0], data.size());
+		TestExt::createFile(plainFname, &data[0], data.size());
+	}
+
+	virtual void TearDown() override {
+		std::remove(plainFname);
+		std::remove(encFname);
+		std::remove(decFname);
+		std::remove(encFname2);
+	}
+
+	std::vector<unsigned char> data;
+};
+
+TEST_F(SymmetricTest, ChunkedRoundTrip) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+}
+
+TEST_F(SymmetricTest, StreamRoundTrip) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(0);
+	sym.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+}
+
+TEST_F(SymmetricTest, ThreadCountDoesNotChangeOutput) {
+	Symmetric sym1("hunter2");
+	Symmetric sym8("hunter2");
+	sym1.setChunkSize(4096).setThreads(1);
+	sym8.setChunkSize(4096).setThreads(8);
+	sym1.encryptFile(plainFname, encFname);
+	sym8.encryptFile(plainFname, encFname2);
+	EXPECT_EQ(std::filesystem::file_size(encFname), std::filesystem::file_size(encFname2));
+
+	// every container has a key of its own, so the outputs can only be compared through each other's decryption
+	sym8.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	sym1.decryptFile(encFname2, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+}
+
+TEST_F(SymmetricTest, TamperingIsDetected) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekg(5000);
+	char c = fs.get();
+	fs.seekp(5000);
+	fs.put(c ^ 1);
+	fs.close();
+
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+	EXPECT_FALSE(TestExt::fileExists(decFname));
+}
+
+TEST_F(SymmetricTest, TruncationIsDetected) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	std::filesystem::resize_file(encFname, std::filesystem::file_size(encFname) - 1);
+
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+}
+
+TEST_F(SymmetricTest, CorruptFooterIsDetected) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+
+	// a chunk count far too large for the file must not be used to size the index
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekp(-12, std::ios_base::end);
+	fs.write("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x0F", 8);
+	fs.close();
+
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+	const std::vector<std::exception_ptr> errors = sym.verifyFiles({encFname});
+	ASSERT_EQ(errors.size(), 1u);
+	EXPECT_THROW(std::rethrow_exception(errors[0]), IntegrityException);
+}
+
+TEST_F(SymmetricTest, OtherVersionsAreRejected) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+
+	// the version follows the 4-byte magic
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekp(4);
+	fs.put(2);
+	fs.close();
+
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+	EXPECT_THROW(Symmetric::kdfParams(encFname), IntegrityException);
+}
+
+TEST_F(SymmetricTest, DecryptRange) {
+	Symmetric sym("hunter2");
+	std::vector<unsigned char> buf(5000);
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+
+	ASSERT_EQ(sym.decryptRange(encFname, 1000, buf.data(), buf.size()), buf.size());
+	EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + 1000));
+
+	ASSERT_EQ(sym.decryptRange(encFname, data.size() - 10, buf.data(), buf.size()), 10u);
+	EXPECT_TRUE(std::equal(buf.begin(), buf.begin() + 10, data.end() - 10));
+
+	EXPECT_EQ(sym.decryptRange(encFname, data.size(), buf.data(), buf.size()), 0u);
+}
+
+TEST_F(SymmetricTest, MappedRoundTrip) {
+	// large enough to take the mmap path
+	std::vector<unsigned char> big(9 * 1024 * 1024 + 17);
+	std::vector<unsigned char> buf(100);
+	Symmetric sym("hunter2");
+	TestExt::fillData(&big[0], big.size());
+	TestExt::createFile(plainFname, &big[0], big.size());
+
+	sym.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, big), 0);
+
+	ASSERT_EQ(sym.decryptRange(encFname, big.size() - 50, buf.data(), buf.size()), 50u);
+	EXPECT_TRUE(std::equal(buf.begin(), buf.begin() + 50, big.end() - 50));
+}
+
+TEST_F(SymmetricTest, BackendDoesNotChangeOutput) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096).setThreads(3);
+
+	sym.setIoBackend(IoBackend::STREAM).encryptFile(plainFname, encFname);
+	for (IoBackend backend : {IoBackend::MAPPED, IoBackend::ASYNC}) {
+		sym.setIoBackend(backend).encryptFile(plainFname, encFname2);
+		EXPECT_EQ(std::filesystem::file_size(encFname), std::filesystem::file_size(encFname2));
+		sym.decryptFile(encFname, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+		sym.setIoBackend(IoBackend::STREAM).decryptFile(encFname2, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	}
+}
+
+TEST_F(SymmetricTest, AsyncTamperingIsDetected) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096).setIoBackend(IoBackend::ASYNC);
+	sym.encryptFile(plainFname, encFname);
+
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekg(9000);
+	char c = fs.get();
+	fs.seekp(9000);
+	fs.put(c ^ 1);
+	fs.close();
+
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+	EXPECT_FALSE(TestExt::fileExists(decFname));
+}
+
+TEST_F(SymmetricTest, InPlaceRoundTrip) {
+	Symmetric sym("hunter2");
+	sym.encryptFile(plainFname);
+	EXPECT_NE(TestExt::compare(plainFname, data), 0);
+	sym.decryptFile(plainFname);
+	EXPECT_EQ(TestExt::compare(plainFname, data), 0);
+}
+
+TEST_F(SymmetricTest, ChaCha20Poly1305RoundTrip) {
+	Symmetric sym("hunter2", BlockCipher::CHACHA20, 256, CipherMode::POLY1305);
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+}
+
+TEST_F(SymmetricTest, AutoDecryptsWhateverTheHeaderNames) {
+	// stands in for a host without AES acceleration
+	Symmetric chacha("hunter2", BlockCipher::CHACHA20, 256, CipherMode::POLY1305);
+	Symmetric aes("hunter2", BlockCipher::AES, 256, CipherMode::GCM);
+	Symmetric sym("hunter2", BlockCipher::AUTO, 256, CipherMode::AUTO);
+	chacha.setChunkSize(4096);
+	aes.setChunkSize(4096);
+	sym.setChunkSize(4096);
+
+	chacha.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+
+	aes.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+
+	sym.encryptFile(plainFname, encFname);
+	Symmetric& chosen = autoSelectCipher().first == BlockCipher::AES ? aes : chacha;
+	chosen.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+}
+
+TEST_F(SymmetricTest, InvalidPairingsAreRejected) {
+	EXPECT_THROW(Symmetric("hunter2", BlockCipher::CHACHA20, 256, CipherMode::GCM), std::logic_error);
+	EXPECT_THROW(Symmetric("hunter2", BlockCipher::AES, 256, CipherMode::POLY1305), std::logic_error);
+	EXPECT_THROW(Symmetric("hunter2", BlockCipher::CHACHA20, 128, CipherMode::POLY1305), std::logic_error);
+
+	Symmetric sym("hunter2", BlockCipher::AUTO);
+	sym.setChunkSize(0);
+	EXPECT_THROW(sym.encryptFile(plainFname, encFname), std::logic_error);
+}
+
+TEST_F(SymmetricTest, CompressedRoundTrip) {
+	for (Compress::Codec codec : {Compress::Codec::ZSTD, Compress::Codec::LZ4}) {
+		if (!Compress::codecAvailable(codec)) {
+			continue;
+		}
+		Symmetric sym("hunter2");
+		std::vector<unsigned char> buf(5000);
+		sym.setChunkSize(4096).setCompression(codec).setIoBackend(IoBackend::MAPPED);
+		sym.encryptFile(plainFname, encFname);
+		EXPECT_LT(std::filesystem::file_size(encFname), data.size());
+
+		sym.setCompression(Compress::Codec::NONE);
+		sym.decryptFile(encFname, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+
+		ASSERT_EQ(sym.decryptRange(encFname, 3000, buf.data(), buf.size()), buf.size());
+		EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + 3000));
+	}
+}
+
+TEST_F(SymmetricTest, IncompressibleDataIsStoredAsIs) {
+	std::mt19937 rng(42);
+	std::generate(data.begin(), data.end(), [&rng]() { return static_cast<unsigned char>(rng()); });
+	TestExt::createFile(plainFname, &data[0], data.size());
+
+	for (Compress::Codec codec : {Compress::Codec::ZSTD, Compress::Codec::LZ4}) {
+		if (!Compress::codecAvailable(codec)) {
+			continue;
+		}
+		Symmetric plain("hunter2");
+		Symmetric compressed("hunter2");
+		plain.setChunkSize(4096);
+		compressed.setChunkSize(4096).setCompression(codec);
+		plain.encryptFile(plainFname, encFname);
+		compressed.encryptFile(plainFname, encFname2);
+		EXPECT_EQ(std::filesystem::file_size(encFname), std::filesystem::file_size(encFname2));
+		plain.decryptFile(encFname2, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	}
+}
+
+TEST_F(SymmetricTest, CompressedTamperingIsDetected) {
+	if (!Compress::codecAvailable(Compress::Codec::ZSTD)) {
+		GTEST_SKIP();
+	}
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096).setCompression(Compress::Codec::ZSTD);
+	sym.encryptFile(plainFname, encFname);
+
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekg(40);
+	char c = fs.get();
+	fs.seekp(40);
+	fs.put(c ^ 1);
+	fs.close();
+
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+}
+
+TEST_F(SymmetricTest, KdfParamsAreRecorded) {
+	const KdfParams params{SCRYPT, SHA256, 16, 1, 2, NewSalt()};
+	Symmetric sym("hunter2", params);
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	EXPECT_EQ(Symmetric::kdfParams(encFname), params);
+	EXPECT_EQ(Symmetric::kdfParams(encFname).salt, params.salt);
+
+	Symmetric legacy("hunter2");
+	EXPECT_THROW(legacy.decryptFile(encFname, decFname), std::runtime_error);
+	Symmetric resalted("hunter2", KdfParams{SCRYPT, SHA256, 16, 1, 2, NewSalt()});
+	EXPECT_THROW(resalted.decryptFile(encFname, decFname), std::runtime_error);
+
+	Symmetric reader("hunter2", Symmetric::kdfParams(encFname));
+	reader.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+}
+
+TEST_F(SymmetricTest, MasterKeyMatchesThePassword) {
+	const KdfParams params{PBKDF2, SHA256, 1024, 0, 0, NewSalt()};
+	Symmetric sym("hunter2", params, BlockCipher::AUTO, 256, CipherMode::AUTO);
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	sym.setEnvelope(true).encryptFile(plainFname, encFname2);
+
+	const MasterKey mk("hunter2", params);
+	Symmetric cached(mk, BlockCipher::AUTO, CipherMode::AUTO);
+	cached.setChunkSize(4096);
+	for (const char* f : {encFname, encFname2}) {
+		cached.decryptFile(f, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+		EXPECT_NO_THROW(cached.verifyFile(f));
+	}
+	cached.encryptFile(plainFname, encFname);
+	sym.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+
+	// a master key does not carry the IV, which single-stream mode needs
+	Symmetric stream(mk, BlockCipher::AES, CipherMode::GCM);
+	stream.setChunkSize(0);
+	EXPECT_THROW(stream.encryptFile(plainFname, encFname), std::logic_error);
+}
+
+TEST_F(SymmetricTest, BatchMatchesEncryptFile) {
+	const size_t sizes[] = {0, 1, 100, 4095, 4096, 4097, 3 * 4096 + 123};
+	std::vector<std::pair<std::string, std::string>> files;
+	Symmetric batch("hunter2");
+	Symmetric single("hunter2");
+	batch.setChunkSize(4096).setThreads(4);
+	single.setChunkSize(4096);
+
+	for (size_t len : sizes) {
+		const std::string name = "sym_batch_" + std::to_string(len);
+		TestExt::createFile(name.c_str(), &data[0], len);
+		files.emplace_back(name, name + ".enc");
+	}
+	files.emplace_back("sym_batch_missing", "sym_batch_missing.enc");
+
+	std::vector<std::exception_ptr> errors = batch.encryptFiles(files);
+	ASSERT_EQ(errors.size(), files.size());
+	EXPECT_NE(errors.back(), nullptr);
+	EXPECT_FALSE(std::filesystem::exists("sym_batch_missing.enc"));
+
+	for (size_t i = 0; i < std::size(sizes); ++i) {
+		EXPECT_EQ(errors[i], nullptr);
+		single.encryptFile(files[i].first.c_str(), encFname);
+		EXPECT_EQ(std::filesystem::file_size(files[i].second), std::filesystem::file_size(encFname)) << sizes[i] << " bytes";
+		single.decryptFile(files[i].second.c_str(), decFname);
+		EXPECT_EQ(TestExt::compare(decFname, &data[0], sizes[i]), 0);
+
+		std::remove(files[i].first.c_str());
+		std::remove(files[i].second.c_str());
+	}
+}
+
+/**
+ * @brief Splits a buffer into iovecs of the given lengths, with whatever is left over in one last iovec.
+ */
+static std::vector<iovec> split(unsigned char* buf, size_t len, std::initializer_list<size_t> lens) {
+	std::vector<iovec> ret;
+	size_t pos = 0;
+	for (size_t l : lens) {
+		ret.push_back(iovec{buf + pos, l});
+		pos += l;
+	}
+	ret.push_back(iovec{buf + pos, len - pos});
+	return ret;
+}
+
+TEST_F(SymmetricTest, VectoredMatchesContiguous) {
+	for (CipherMode cm : {CipherMode::CTR, CipherMode::GCM, CipherMode::CBC}) {
+		// CBC only takes whole blocks overall, but not within each buffer
+		const size_t len = 3 * 4096;
+		std::vector<unsigned char> expected(len);
+		std::vector<unsigned char> in(data.begin(), data.begin() + len);
+		std::vector<unsigned char> out(len);
+
+		Symmetric("hunter2", BlockCipher::AES, 256, cm).encryptData(in.data(), len, expected.data(), len);
+
+		Symmetric sym("hunter2", BlockCipher::AES, 256, cm);
+		std::vector<iovec> inv = split(in.data(), len, {1, 7, 0, 100, 15, 3000});
+		std::vector<iovec> outv = split(out.data(), len, {33, 5, 16, 2000});
+		sym.encryptv(inv.data(), inv.size(), outv.data(), outv.size());
+		EXPECT_EQ(out, expected) << cmToString(cm);
+
+		// in place, split differently again
+		Symmetric dec("hunter2", BlockCipher::AES, 256, cm);
+		std::vector<iovec> inPlace = split(out.data(), len, {17, 17, 4000});
+		dec.decryptv(inPlace.data(), inPlace.size(), inPlace.data(), inPlace.size());
+		EXPECT_EQ(out, in) << cmToString(cm);
+	}
+
+	Symmetric sym("hunter2");
+	unsigned char a[10], b[11];
+	iovec av{a, sizeof(a)}, bv{b, sizeof(b)};
+	EXPECT_THROW(sym.encryptv(&av, 1, &bv, 1), std::logic_error);
+}
+
+TEST_F(SymmetricTest, HashedEncryptionMatchesSeparatePasses) {
+	CryptoPP::SHA256 hash;
+	ContentDigest expected;
+	const unsigned char cs[4] = {0x00, 0x10, 0x00, 0x00};
+	hash.Update(cs, sizeof(cs));
+	for (size_t pos = 0; pos < data.size(); pos += 4096) {
+		unsigned char seg[CryptoPP::SHA256::DIGESTSIZE];
+		CryptoPP::SHA256().CalculateDigest(seg, &data[pos], std::min<size_t>(4096, data.size() - pos));
+		hash.Update(seg, sizeof(seg));
+	}
+	hash.Final(expected.data());
+
+	Symmetric other("correct horse");
+	other.setChunkSize(4096);
+	for (IoBackend backend : {IoBackend::STREAM, IoBackend::MAPPED, IoBackend::ASYNC}) {
+		Symmetric sym("hunter2");
+		sym.setChunkSize(4096).setIoBackend(backend);
+		EXPECT_EQ(sym.encryptFileHashed(plainFname, encFname), expected);
+		sym.encryptFile(plainFname, encFname2);
+		EXPECT_EQ(std::filesystem::file_size(encFname), std::filesystem::file_size(encFname2));
+		sym.decryptFile(encFname, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	}
+	EXPECT_EQ(other.encryptFileHashed(plainFname, encFname), expected);
+
+	data[5000] ^= 1;
+	TestExt::createFile(plainFname, &data[0], data.size());
+	EXPECT_NE(other.encryptFileHashed(plainFname, encFname), expected);
+}
+
+TEST_F(SymmetricTest, VerifyChecksEverySegment) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096).setThreads(4);
+	sym.encryptFile(plainFname, encFname);
+	EXPECT_NO_THROW(sym.verifyFile(encFname));
+
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekg(3 * 4096);
+	char c = fs.get();
+	fs.seekp(3 * 4096);
+	fs.put(c ^ 1);
+	fs.close();
+	EXPECT_THROW(sym.verifyFile(encFname), IntegrityException);
+}
+
+TEST_F(SymmetricTest, VerifyFilesReportsEachFile) {
+	Symmetric sym("hunter2");
+	Symmetric chacha("hunter2", BlockCipher::CHACHA20, 256, CipherMode::POLY1305);
+	Symmetric any("hunter2", BlockCipher::AUTO, 256, CipherMode::AUTO);
+	sym.setChunkSize(4096);
+	chacha.setChunkSize(4096);
+	any.setChunkSize(4096);
+
+	TestExt::createFile(decFname, &data[0], 100);
+	sym.encryptFile(plainFname, encFname);
+	sym.encryptFile(decFname, encFname2);
+	chacha.encryptFile(decFname, "sym_chacha.bin");
+
+	std::vector<std::exception_ptr> errors = any.verifyFiles({encFname, encFname2, "sym_chacha.bin", plainFname, "sym_missing.bin"});
+	ASSERT_EQ(errors.size(), 5u);
+	EXPECT_EQ(errors[0], nullptr);
+	EXPECT_EQ(errors[1], nullptr);
+	EXPECT_EQ(errors[2], nullptr);
+	EXPECT_THROW(std::rethrow_exception(errors[3]), IntegrityException);
+	EXPECT_NE(errors[4], nullptr);
+
+	Symmetric wrong("hunter3");
+	wrong.setChunkSize(4096);
+	errors = wrong.verifyFiles({encFname, encFname2});
+	EXPECT_THROW(std::rethrow_exception(errors[0]), IntegrityException);
+	EXPECT_THROW(std::rethrow_exception(errors[1]), IntegrityException);
+	std::remove("sym_chacha.bin");
+}
+
+TEST_F(SymmetricTest, BatchesOnlyThrowConfigurationErrors) {
+	Symmetric cbc("hunter2", BlockCipher::AES, 256, CipherMode::CBC);
+	cbc.setChunkSize(4096);
+	EXPECT_THROW(cbc.encryptFiles({{plainFname, encFname}}), std::logic_error);
+	EXPECT_FALSE(TestExt::fileExists(encFname));
+
+	// a header naming a mode chunked mode cannot use only fails that file
+	Symmetric sym("hunter2");
+	Symmetric any("hunter2", BlockCipher::AUTO, 256, CipherMode::AUTO);
+	sym.setChunkSize(4096);
+	any.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	sym.encryptFile(plainFname, encFname2);
+	std::fstream fs(encFname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+	fs.seekp(6);
+	fs.put(static_cast<char>(CipherMode::CBC));
+	fs.close();
+
+	for (int i = 0; i < 2; ++i) {
+		std::vector<std::exception_ptr> errors;
+		ASSERT_NO_THROW(errors = any.verifyFiles({encFname, encFname2}));
+		ASSERT_EQ(errors.size(), 2u);
+		EXPECT_NE(errors[0], nullptr);
+		EXPECT_EQ(errors[1], nullptr);
+	}
+}
+
+/**
+ * @brief Reads a whole file into memory.
+ */
+static std::vector<char> readAll(const char* filename) {
+	std::ifstream ifs(filename, std::ios_base::in | std::ios_base::binary);
+	return std::vector<char>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+TEST_F(SymmetricTest, ContainersDoNotShareKeys) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096);
+	sym.encryptFile(plainFname, encFname);
+	sym.encryptFile(plainFname, encFname2);
+
+	// the same plaintext under the same password must not give the same ciphertext, or the key and nonces were reused
+	// the header is well under 128 bytes, so everything after that in the first segment is ciphertext
+	const std::vector<char> a = readAll(encFname);
+	const std::vector<char> b = readAll(encFname2);
+	ASSERT_EQ(a.size(), b.size());
+	EXPECT_FALSE(std::equal(a.begin() + 128, a.begin() + 4096, b.begin() + 128));
+}
+
+TEST_F(SymmetricTest, BatchedFilesDoNotShareKeys) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(8192).setThreads(1);
+	TestExt::createFile("sym_batch_a", &data[0], 4096);
+	TestExt::createFile("sym_batch_b", &data[0], 4096);
+
+	// two small files with the same contents go through the same worker, and must still get different keys
+	const std::vector<std::exception_ptr> errors = sym.encryptFiles({{"sym_batch_a", encFname}, {"sym_batch_b", encFname2}});
+	EXPECT_EQ(errors[0], nullptr);
+	EXPECT_EQ(errors[1], nullptr);
+	const std::vector<char> a = readAll(encFname);
+	const std::vector<char> b = readAll(encFname2);
+	ASSERT_EQ(a.size(), b.size());
+	EXPECT_FALSE(std::equal(a.begin() + 128, a.begin() + 4096, b.begin() + 128));
+
+	sym.decryptFile(encFname2, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, &data[0], 4096), 0);
+	std::remove("sym_batch_a");
+	std::remove("sym_batch_b");
+}
+
+TEST_F(SymmetricTest, EnvelopeRoundTrip) {
+	Symmetric sym("hunter2");
+	Symmetric plain("hunter2");
+	sym.setChunkSize(4096).setThreads(4).setEnvelope(true);
+	plain.setChunkSize(4096).setThreads(4);
+
+	sym.encryptFile(plainFname, encFname);
+	sym.encryptFile(plainFname, encFname2);
+	// every container gets its own data key
+	EXPECT_NE(TestExt::compare(encFname, encFname2), 0);
+
+	for (IoBackend be : {IoBackend::STREAM, IoBackend::MAPPED, IoBackend::ASYNC}) {
+		plain.setIoBackend(be);
+		plain.decryptFile(encFname, decFname);
+		EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	}
+	EXPECT_NO_THROW(plain.verifyFile(encFname));
+
+	std::vector<unsigned char> buf(5000);
+	ASSERT_EQ(plain.decryptRange(encFname2, 4000, buf.data(), buf.size()), buf.size());
+	EXPECT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + 4000));
+
+	// the workers go back to keys derived from the password's afterwards
+	plain.setIoBackend(IoBackend::STREAM);
+	plain.encryptFile(plainFname, encFname2);
+	EXPECT_THROW(plain.rewrap(encFname2, Symmetric("hunter3")), std::runtime_error);
+	Symmetric("hunter2").setChunkSize(4096).decryptFile(encFname2, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+
+	Symmetric wrong("hunter3");
+	wrong.setChunkSize(4096);
+	EXPECT_THROW(wrong.decryptFile(encFname, decFname), IntegrityException);
+
+	sym.setChunkSize(0);
+	EXPECT_THROW(sym.encryptFile(plainFname, encFname), std::logic_error);
+}
+
+TEST_F(SymmetricTest, RewrapOnlyChangesTheHeader) {
+	Symmetric oldKey("hunter2");
+	Symmetric newKey("correct horse battery staple");
+	oldKey.setChunkSize(4096).setEnvelope(true);
+	newKey.setChunkSize(4096);
+
+	oldKey.encryptFile(plainFname, encFname);
+	const std::vector<char> before = readAll(encFname);
+	oldKey.rewrap(encFname, newKey);
+	const std::vector<char> after = readAll(encFname);
+
+	ASSERT_EQ(before.size(), after.size());
+	const auto firstSame = std::mismatch(before.rbegin(), before.rend(), after.rbegin()).first;
+	EXPECT_LT(before.rend() - firstSame, 128);
+
+	EXPECT_THROW(oldKey.decryptFile(encFname, decFname), IntegrityException);
+	newKey.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	EXPECT_THROW(oldKey.rewrap(encFname, newKey), IntegrityException);
+
+	Symmetric("hunter2").setChunkSize(4096).encryptFile(plainFname, encFname2);
+	EXPECT_THROW(oldKey.rewrap(encFname2, newKey), std::runtime_error);
+
+	// the header has no room for a salt that an unsalted key did not leave
+	const Symmetric salted("correct horse battery staple", KdfParams{PBKDF2, SHA256, 1024, 0, 0, NewSalt()});
+	EXPECT_THROW(newKey.rewrap(encFname, salted), std::logic_error);
+}
+
+TEST_F(SymmetricTest, EnvelopeBatches) {
+	const size_t sizes[] = {0, 100, 4096, 3 * 4096 + 123};
+	std::vector<std::pair<std::string, std::string>> files;
+	std::vector<std::string> containers;
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096).setThreads(4).setEnvelope(true);
+
+	for (size_t len : sizes) {
+		const std::string name = "sym_envelope_" + std::to_string(len);
+		TestExt::createFile(name.c_str(), &data[0], len);
+		files.emplace_back(name, name + ".enc");
+		containers.push_back(name + ".enc");
+	}
+	// a container without a data key in the same batch
+	Symmetric("hunter2").setChunkSize(4096).encryptFile(plainFname, encFname);
+	containers.push_back(encFname);
+
+	for (const std::exception_ptr& e : sym.encryptFiles(files)) {
+		EXPECT_EQ(e, nullptr);
+	}
+	for (const std::exception_ptr& e : sym.verifyFiles(containers)) {
+		EXPECT_EQ(e, nullptr);
+	}
+
+	Symmetric wrong("hunter3");
+	wrong.setChunkSize(4096).setThreads(4);
+	for (const std::exception_ptr& e : wrong.verifyFiles(containers)) {
+		EXPECT_THROW(std::rethrow_exception(e), IntegrityException);
+	}
+
+	for (size_t i = 0; i < std::size(sizes); ++i) {
+		sym.decryptFile(files[i].second.c_str(), decFname);
+		EXPECT_EQ(TestExt::compare(decFname, &data[0], sizes[i]), 0) << sizes[i] << " bytes";
+		std::remove(files[i].first.c_str());
+		std::remove(files[i].second.c_str());
+	}
+}
+
+TEST_F(SymmetricTest, ConvergentSegmentsDeduplicate) {
+	const SecBytes secret("tenant secret of 32 bytes here!!");
+	Symmetric a("hunter2");
+	Symmetric b("correct horse battery staple");
+	a.setChunkSize(4096).setThreads(4).setConvergent(secret);
+	b.setChunkSize(4096).setConvergent(secret).setEnvelope(true);
+
+	std::vector<unsigned char> changed(data);
+	changed[4096 + 7] ^= 1;
+	TestExt::createFile(decFname, &changed[0], changed.size());
+	a.encryptFile(plainFname, encFname);
+	b.encryptFile(decFname, encFname2);
+
+	// only the segment that changed gets a new name, even under another password
+	const std::vector<SegmentName> namesA = Symmetric::segmentNames(encFname);
+	const std::vector<SegmentName> namesB = Symmetric::segmentNames(encFname2);
+	ASSERT_EQ(namesA.size(), 4u);
+	ASSERT_EQ(namesB.size(), 4u);
+	EXPECT_EQ(namesA[0], namesB[0]);
+	EXPECT_NE(namesA[1], namesB[1]);
+	EXPECT_EQ(namesA[2], namesB[2]);
+	EXPECT_EQ(namesA[3], namesB[3]);
+
+	a.decryptFile(encFname, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, data), 0);
+	b.decryptFile(encFname2, decFname);
+	EXPECT_EQ(TestExt::compare(decFname, &changed[0], changed.size()), 0);
+	EXPECT_THROW(b.decryptFile(encFname, decFname), IntegrityException);
+	EXPECT_NO_THROW(Symmetric("hunter2").setChunkSize(4096).verifyFile(encFname));
+
+	// another secret, or none at all, shares nothing
+	Symmetric c("hunter2");
+	c.setChunkSize(4096).setConvergent(SecBytes("another tenant's secret"));
+	c.encryptFile(plainFname, encFname2);
+	EXPECT_NE(Symmetric::segmentNames(encFname2)[0], namesA[0]);
+	c.setConvergent(SecSpan());
+	c.encryptFile(plainFname, encFname2);
+	EXPECT_NE(Symmetric::segmentNames(encFname2)[0], namesA[0]);
+
+	EXPECT_THROW(c.setConvergent(SecBytes("short")), std::logic_error);
+}
+
+TEST_F(SymmetricTest, ConvergentReorderingIsDetected) {
+	Symmetric sym("hunter2");
+	sym.setChunkSize(4096).setConvergent(SecBytes("tenant secret of 32 bytes here!!"));
+
+	// four equal segments encrypt to four equal ciphertexts, so only the index can tell them apart
+	std::vector<unsigned char> same(4 * 4096, 'x');
+	TestExt::createFile(decFname, &same[0], same.size());
+	sym.encryptFile(decFname, encFname);
+	const std::vector<SegmentName> names = Symmetric::segmentNames(encFname);
+	EXPECT_EQ(names[0], names[1]);
+	EXPECT_EQ(names[0], names[3]);
+
+	std::vector<char> container = readAll(encFname);
+	const size_t entryLen = 8 + 4 + 2 * 16 + 32;
+	const size_t first = container.size() - 20 - 4 * entryLen;
+	std::swap_ranges(container.begin() + first + 12, container.begin() + first + entryLen, container.begin() + first + entryLen + 12);
+	std::ofstream(encFname, std::ios_base::binary).write(container.data(), container.size());
+	EXPECT_THROW(sym.decryptFile(encFname, decFname), IntegrityException);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,102 @@
+/** @file tests/fs/chunkpipeline_test.cpp
+ * @brief tests chunkpipeline
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../fs/chunkpipeline.hpp"
+#include "../../fs/ioexception.hpp"
+#include "../test_ext.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+using namespace CloudSync::fs;
+
+constexpr const char* inFname = "pipe_in.bin";
+constexpr const char* outFname = "pipe_out.bin";
+constexpr size_t CHUNK = 4096;
+
+class ChunkPipelineTest : public testing::TestWithParam<bool> {
+protected:
+	virtual void SetUp() override {
+		data.resize(37 * CHUNK + 123);
+		TestExt::fillData(&data[0], data.size());
+		TestExt::createFile(inFname, &data[0], data.size());
+		fdIn = open(inFname, O_RDONLY | O_CLOEXEC);
+		fdOut = open(outFname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		ASSERT_GE(fdIn, 0);
+		ASSERT_GE(fdOut, 0);
+	}
+
+	virtual void TearDown() override {
+		close(fdIn);
+		close(fdOut);
+		std::remove(inFname);
+		std::remove(outFname);
+	}
+
+	uint64_t count() const {
+		return (data.size() + CHUNK - 1) / CHUNK;
+	}
+
+	ChunkRange range(uint64_t i) const {
+		const uint64_t off = i * CHUNK;
+		return ChunkRange{off, off, static_cast<size_t>(std::min<uint64_t>(CHUNK, data.size() - off))};
+	}
+
+	std::vector<unsigned char> data;
+	int fdIn = -1;
+	int fdOut = -1;
+};
+
+TEST_P(ChunkPipelineTest, TransformsEveryChunk) {
+	CloudSync::ThreadPool pool(4);
+	pipelineChunks(fdIn, fdOut, pool, count(), CHUNK, [this](uint64_t i) { return range(i); }, [](uint64_t, unsigned, unsigned char* buf, size_t len) {
+		for (size_t j = 0; j < len; ++j) {
+			buf[j] ^= 0x5A;
+		}
+	}, GetParam());
+
+	std::vector<unsigned char> expected = data;
+	for (unsigned char& c : expected) {
+		c ^= 0x5A;
+	}
+	EXPECT_EQ(TestExt::compare(outFname, expected), 0);
+}
+
+TEST_P(ChunkPipelineTest, FailingTransformIsRethrown) {
+	CloudSync::ThreadPool pool(4);
+	// a chunk failing while the others are still being read or written must come back as an exception, not a hang
+	for (uint64_t bad : {uint64_t(0), uint64_t(5), count() - 1}) {
+		EXPECT_THROW(pipelineChunks(fdIn, fdOut, pool, count(), CHUNK, [this](uint64_t i) { return range(i); }, [bad](uint64_t i, unsigned, unsigned char*, size_t) {
+			if (i == bad) {
+				throw std::runtime_error("bad chunk");
+			}
+		}, GetParam()), std::runtime_error);
+	}
+
+	// the input ending early is reported the same way
+	ASSERT_EQ(ftruncate(fdOut, 0), 0);
+	const int empty = open(outFname, O_RDONLY | O_CLOEXEC);
+	ASSERT_GE(empty, 0);
+	EXPECT_THROW(pipelineChunks(empty, fdOut, pool, count(), CHUNK, [this](uint64_t i) { return range(i); }, [](uint64_t, unsigned, unsigned char*, size_t) {}, GetParam()), IOException);
+	close(empty);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, ChunkPipelineTest, testing::Values(false, true));
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,196 @@
+/** @file tests/fs/fileindex_test.cpp
+ * @brief tests fileindex
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../fs/fileindex.hpp"
+#include "../../fs/parallelwalker.hpp"
+#include "../../fs/treewalker.hpp"
+#include "../test_ext.hpp"
+#include <atomic>
+#include <fcntl.h>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace CloudSync::fs;
+
+constexpr const char* indexPath = "tmpIndex";
+
+static FileDigest digestOf(const std::string& path) {
+	FileDigest d = {};
+	for (size_t i = 0; i < path.size(); ++i) {
+		d[i % d.size()] ^= path[i];
+	}
+	return d;
+}
+
+/**
+ * @brief Moves a file's mtime an hour into the past, so it is not racy when it is recorded.
+ */
+static void backdate(const char* path) {
+	struct timespec times[2];
+	clock_gettime(CLOCK_REALTIME, &times[0]);
+	times[0].tv_sec -= 3600;
+	times[1] = times[0];
+	ASSERT_EQ(utimensat(AT_FDCWD, path, times, 0), 0);
+}
+
+/**
+ * @brief Runs one incremental pass: walks the tree with the index, records every file that is returned, and commits.
+ *
+ * @return The files that were returned.
+ */
+static std::vector<std::string> incrementalRun(const char* dir) {
+	FileIndex index(indexPath);
+	TreeWalker tw(dir);
+	tw.setIndex(&index);
+
+	std::vector<std::string> changed;
+	Entry entry;
+	while (tw.nextEntry(entry)) {
+		changed.push_back(entry.path);
+		index.put(entry, digestOf(entry.path));
+	}
+	index.commit();
+	return changed;
+}
+
+TEST(FileIndexTest, PutFindCommit) {
+	unlink(indexPath);
+	{
+		FileIndex index(indexPath);
+		EXPECT_EQ(index.size(), 0u);
+		EXPECT_EQ(index.find("a"), nullptr);
+
+		index.put("b/c", FileRecord{10, 1000, 2000, 7, 0100644, 0, digestOf("b/c")});
+		index.put("a", FileRecord{20, 3000, 4000, 8, 0100600, 0, digestOf("a")});
+		index.put("a", FileRecord{21, 3001, 4001, 9, 0100600, 0, digestOf("a2")});
+		index.commit();
+		EXPECT_EQ(index.size(), 2u);
+	}
+
+	FileIndex index(indexPath);
+	ASSERT_EQ(index.size(), 2u);
+	const FileRecord* a = index.find("a");
+	ASSERT_NE(a, nullptr);
+	EXPECT_EQ(a->size, 21u);
+	EXPECT_EQ(a->mtime, 3001);
+	EXPECT_EQ(a->ctime, 4001);
+	EXPECT_EQ(a->inode, 9u);
+	EXPECT_EQ(a->mode, 0100600u);
+	EXPECT_EQ(a->digest, digestOf("a2"));
+	ASSERT_NE(index.find("b/c"), nullptr);
+	EXPECT_EQ(index.find("b/c")->size, 10u);
+	EXPECT_EQ(index.find("b"), nullptr);
+
+	// anything that is not carried over or put is dropped
+	EXPECT_TRUE(index.keep("b/c"));
+	EXPECT_FALSE(index.keep("missing"));
+	index.commit();
+	EXPECT_EQ(index.size(), 1u);
+	EXPECT_EQ(index.find("a"), nullptr);
+	ASSERT_NE(index.find("b/c"), nullptr);
+	EXPECT_EQ(index.find("b/c")->digest, digestOf("b/c"));
+	unlink(indexPath);
+}
+
+TEST(FileIndexTest, WalkerSkipsUnchangedFiles) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Basic(tmpPath);
+	const std::vector<std::string> files(te.getFiles().begin(), te.getFiles().end());
+	for (const std::string& f : files) {
+		backdate(f.c_str());
+	}
+	unlink(indexPath);
+
+	EXPECT_EQ(incrementalRun(tmpPath).size(), files.size());
+	EXPECT_TRUE(incrementalRun(tmpPath).empty());
+	EXPECT_EQ(FileIndex(indexPath).size(), files.size());
+
+	// a modified file is returned, and a deleted one is dropped from the index
+	std::ofstream(files[0], std::ios::app) << "more";
+	ASSERT_EQ(unlink(files[1].c_str()), 0);
+	EXPECT_EQ(incrementalRun(tmpPath), std::vector<std::string>{files[0]});
+	EXPECT_EQ(FileIndex(indexPath).find(files[1]), nullptr);
+
+	// files[0] was modified moments before it was recorded, so it is not trusted until it is recorded again
+	backdate(files[0].c_str());
+	EXPECT_EQ(incrementalRun(tmpPath), std::vector<std::string>{files[0]});
+	EXPECT_TRUE(incrementalRun(tmpPath).empty());
+
+	// a metadata change shows up in the ctime
+	ASSERT_EQ(chmod(files[2].c_str(), 0600), 0);
+	EXPECT_EQ(incrementalRun(tmpPath), std::vector<std::string>{files[2]});
+
+	FileIndex index(indexPath);
+	ParallelTreeWalker ptw(tmpPath, 4);
+	ptw.setIndex(&index);
+	std::atomic<size_t> count(0);
+	ptw.walk([&](const char*, unsigned) { count++; });
+	EXPECT_EQ(count.load(), 0u);
+	index.commit();
+	EXPECT_EQ(index.size(), files.size() - 1);
+	unlink(indexPath);
+}
+
+TEST(FileIndexTest, LookupsDuringCommit) {
+	unlink(indexPath);
+	FileIndex index(indexPath);
+	for (int i = 0; i < 1000; ++i) {
+		const std::string path = "f" + std::to_string(i);
+		index.put(path, FileRecord{static_cast<uint64_t>(i), 1000, 2000, 7, 0100644, 0, digestOf(path)});
+	}
+	index.commit();
+
+	// every commit remaps the index while the other threads are searching it
+	std::atomic<bool> done(false);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 4; ++t) {
+		readers.emplace_back([&, t]() {
+			for (int i = t; !done; i = (i + 7) % 1000) {
+				EXPECT_TRUE(index.keep("f" + std::to_string(i)));
+			}
+		});
+	}
+	for (int c = 0; c < 20; ++c) {
+		for (int i = 0; i < 1000; ++i) {
+			index.keep("f" + std::to_string(i));
+		}
+		index.commit();
+	}
+	done = true;
+	for (std::thread& t : readers) {
+		t.join();
+	}
+	EXPECT_EQ(index.size(), 1000u);
+	unlink(indexPath);
+}
+
+TEST(FileIndexTest, MalformedIndexIsIgnored) {
+	std::ofstream(indexPath, std::ios::trunc) << "this is not an index";
+	FileIndex index(indexPath);
+	EXPECT_EQ(index.size(), 0u);
+	EXPECT_EQ(index.find("this"), nullptr);
+
+	index.put("x", FileRecord{1, 2, 3, 4, 5, 0, {}});
+	index.commit();
+	EXPECT_EQ(FileIndex(indexPath).size(), 1u);
+	unlink(indexPath);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,202 @@
+/** @file tests/fs/parallelwalker_test.cpp
+ * @brief tests parallelwalker
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../fs/parallelwalker.hpp"
+#include "../../fs/treewalker.hpp"
+#include "../../fs/ioexception.hpp"
+#include "../../fs/notfoundexception.hpp"
+#include "../test_ext.hpp"
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+using namespace CloudSync::fs;
+
+static std::unordered_set<std::string> parallelFiles(const char* dir, unsigned threads) {
+	ParallelTreeWalker ptw(dir, threads);
+	std::mutex m;
+	std::unordered_set<std::string> ret;
+	ptw.walk([&](const char* path, unsigned worker) {
+		EXPECT_LT(worker, ptw.threads());
+		std::lock_guard<std::mutex> lock(m);
+		EXPECT_TRUE(ret.insert(path).second) << path << " was visited twice";
+	});
+	return ret;
+}
+
+static std::unordered_set<std::string> orderedFiles(const char* dir) {
+	TreeWalker tw(dir);
+	std::unordered_set<std::string> ret;
+	const char* current;
+	while ((current = tw.nextEntry()) != nullptr) {
+		ret.insert(current);
+	}
+	return ret;
+}
+
+TEST(ParallelTreeWalkerTest, MatchesTreeWalker) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+
+	const std::unordered_set<std::string> expected = orderedFiles(tmpPath);
+	EXPECT_FALSE(expected.empty());
+	EXPECT_EQ(parallelFiles(tmpPath, 1), expected);
+	EXPECT_EQ(parallelFiles(tmpPath, 4), expected);
+	EXPECT_EQ(parallelFiles("tmpPath///", 4), expected);
+}
+
+TEST(ParallelTreeWalkerTest, BaseDirectory) {
+	constexpr const char* tmpPath = "tmpPath";
+	constexpr const char* linkPath = "tmpPathLink";
+	constexpr const char* lockedPath = "tmpPathLocked";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+
+	// the base directory may be a symlink, even though symlinks inside the tree are not followed
+	unlink(linkPath);
+	ASSERT_EQ(symlink(tmpPath, linkPath), 0);
+	const std::unordered_set<std::string> direct = parallelFiles(tmpPath, 4);
+	const std::unordered_set<std::string> linked = parallelFiles(linkPath, 4);
+	unlink(linkPath);
+	EXPECT_FALSE(direct.empty());
+	EXPECT_EQ(linked.size(), direct.size());
+	for (const std::string& f : linked) {
+		EXPECT_EQ(f.compare(0, std::strlen(linkPath) + 1, std::string(linkPath) + "/"), 0) << f;
+	}
+
+	// a base directory that cannot be read is an error rather than an empty walk
+	rmdir(lockedPath);
+	ASSERT_EQ(mkdir(lockedPath, 0), 0);
+	if (geteuid() != 0) {
+		ParallelTreeWalker ptw(lockedPath, 4);
+		EXPECT_THROW(ptw.walk([](const char*, unsigned) {}), IOException);
+	}
+	rmdir(lockedPath);
+}
+
+TEST(ParallelTreeWalkerTest, DeepAndWideTree) {
+	constexpr const char* tmpPath = "tmpPath_deep";
+	std::unordered_set<std::string> expected;
+	std::vector<std::string> dirs;
+
+	ASSERT_EQ(mkdir(tmpPath, 0755), 0);
+	dirs.push_back(tmpPath);
+	std::string deep = tmpPath;
+	for (int i = 0; i < 64; ++i) {
+		deep += "/d" + std::to_string(i);
+		ASSERT_EQ(mkdir(deep.c_str(), 0755), 0);
+		dirs.push_back(deep);
+		const std::string file = deep + "/f";
+		std::ofstream(file).put('x');
+		expected.insert(file);
+	}
+	for (int i = 0; i < 200; ++i) {
+		const std::string wide = std::string(tmpPath) + "/w" + std::to_string(i);
+		ASSERT_EQ(mkdir(wide.c_str(), 0755), 0);
+		dirs.push_back(wide);
+		for (int j = 0; j < 5; ++j) {
+			const std::string file = wide + "/f" + std::to_string(j);
+			std::ofstream(file).put('x');
+			expected.insert(file);
+		}
+	}
+	const std::string link = std::string(tmpPath) + "/link";
+	ASSERT_EQ(symlink("d0", link.c_str()), 0);
+	expected.insert(link);
+
+	EXPECT_EQ(parallelFiles(tmpPath, 8), expected);
+
+	for (const std::string& f : expected) {
+		unlink(f.c_str());
+	}
+	for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+		rmdir(it->c_str());
+	}
+}
+
+TEST(ParallelTreeWalkerTest, ExceptionStopsTheWalk) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+	ParallelTreeWalker ptw(tmpPath, 4);
+	std::atomic<int> calls(0);
+
+	EXPECT_THROW(ptw.walk([&](const char*, unsigned) {
+		if (++calls == 10) {
+			throw std::runtime_error("stop");
+		}
+	}), std::runtime_error);
+
+	// the walker can be reused after a failed walk
+	std::atomic<size_t> count(0);
+	ptw.walk([&](const char*, unsigned) { count++; });
+	EXPECT_EQ(count.load(), orderedFiles(tmpPath).size());
+}
+
+TEST(ParallelTreeWalkerTest, EntriesCarrySizes) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+	ParallelTreeWalker ptw(tmpPath, 4, ENTRY_SIZE);
+	std::atomic<size_t> count(0);
+
+	ptw.walkEntries([&](const Entry& entry, unsigned) {
+		struct stat st;
+		ASSERT_EQ(lstat(entry.path, &st), 0);
+		EXPECT_EQ(entry.type, Type::File);
+		EXPECT_EQ(entry.fields, unsigned(ENTRY_SIZE));
+		EXPECT_EQ(entry.size, static_cast<uint64_t>(st.st_size));
+		count++;
+	});
+	EXPECT_EQ(count.load(), orderedFiles(tmpPath).size());
+}
+
+TEST(ParallelTreeWalkerTest, RulesMatchTreeWalker) {
+	constexpr const char* tmpPath = "tmpPath";
+	constexpr const char* rules = "dir1/\n*_1*.txt\n!*_12.txt\n/test?.txt\n";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+
+	TreeWalker tw(tmpPath);
+	tw.setRules(std::move(RuleSet().addLines(rules)));
+	std::unordered_set<std::string> expected;
+	const char* current;
+	while ((current = tw.nextEntry()) != nullptr) {
+		expected.insert(current);
+	}
+
+	ParallelTreeWalker ptw(tmpPath, 4);
+	ptw.setRules(std::move(RuleSet().addLines(rules)));
+	std::mutex m;
+	std::unordered_set<std::string> found;
+	ptw.walk([&](const char* path, unsigned) {
+		std::lock_guard<std::mutex> lock(m);
+		found.insert(path);
+	});
+
+	EXPECT_FALSE(expected.empty());
+	EXPECT_LT(expected.size(), orderedFiles(tmpPath).size());
+	EXPECT_EQ(found, expected);
+}
+
+TEST(ParallelTreeWalkerTest, MissingDirectory) {
+	EXPECT_THROW(ParallelTreeWalker("tmpPath_does_not_exist"), NotFoundException);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -0,0 +1,151 @@
+/** @file tests/fs/rules_test.cpp
+ * @brief tests rules
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "../../fs/rules.hpp"
+#include "../../fs/treewalker.hpp"
+#include "../test_ext.hpp"
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+
+using namespace CloudSync::fs;
+
+static Entry file(uint64_t size = 0, int64_t mtime = 0) {
+	Entry e = {};
+	e.type = Type::File;
+	e.size = size;
+	e.mtime = mtime;
+	e.fields = ENTRY_SIZE | ENTRY_MTIME;
+	return e;
+}
+
+static Entry dir() {
+	Entry e = {};
+	e.type = Type::Directory;
+	return e;
+}
+
+TEST(RuleSetTest, NamesAndSuffixes) {
+	RuleSet rs;
+	rs.addLines("# caches\nnode_modules/\n.cache\n\n*.log\n*~\n");
+
+	EXPECT_TRUE(rs.excluded("", "node_modules", dir()));
+	EXPECT_TRUE(rs.excluded("a/b/", "node_modules", dir()));
+	EXPECT_FALSE(rs.excluded("a/", "node_modules", file()));
+	EXPECT_TRUE(rs.excluded("a/", ".cache", dir()));
+	EXPECT_TRUE(rs.excluded("a/", ".cache", file()));
+	EXPECT_TRUE(rs.excluded("a/", "build.log", file()));
+	EXPECT_TRUE(rs.excluded("", ".log", file()));
+	EXPECT_TRUE(rs.excluded("", "notes.txt~", file()));
+	EXPECT_FALSE(rs.excluded("", "log", file()));
+	EXPECT_FALSE(rs.excluded("", "build.log.txt", file()));
+	EXPECT_EQ(rs.fields(), 0u);
+}
+
+TEST(RuleSetTest, AnchoredPaths) {
+	RuleSet rs;
+	rs.add("/build").add("docs/*.pdf").add("src/**/gen/").add("out/**").add("**/tmp");
+
+	EXPECT_TRUE(rs.excluded("", "build", dir()));
+	EXPECT_FALSE(rs.excluded("a/", "build", dir()));
+	EXPECT_TRUE(rs.excluded("docs/", "manual.pdf", file()));
+	EXPECT_FALSE(rs.excluded("docs/old/", "manual.pdf", file()));
+	EXPECT_FALSE(rs.excluded("x/docs/", "manual.pdf", file()));
+	EXPECT_TRUE(rs.excluded("src/", "gen", dir()));
+	EXPECT_TRUE(rs.excluded("src/a/b/", "gen", dir()));
+	EXPECT_FALSE(rs.excluded("src/a/", "gen", file()));
+	EXPECT_TRUE(rs.excluded("out/a/", "x.o", file()));
+	EXPECT_FALSE(rs.excluded("", "out", dir()));
+	EXPECT_TRUE(rs.excluded("", "tmp", dir()));
+	EXPECT_TRUE(rs.excluded("a/b/", "tmp", file()));
+}
+
+TEST(RuleSetTest, GlobsAndClasses) {
+	RuleSet rs;
+	rs.add("file?.[ch]").add("[!a-m]*.bak").add("a\\*b").add("*cache*");
+
+	EXPECT_TRUE(rs.excluded("", "file1.c", file()));
+	EXPECT_TRUE(rs.excluded("x/", "fileX.h", file()));
+	EXPECT_FALSE(rs.excluded("", "file12.c", file()));
+	EXPECT_FALSE(rs.excluded("", "file1.o", file()));
+	EXPECT_TRUE(rs.excluded("", "zoo.bak", file()));
+	EXPECT_FALSE(rs.excluded("", "foo.bak", file()));
+	EXPECT_TRUE(rs.excluded("", "a*b", file()));
+	EXPECT_FALSE(rs.excluded("", "axb", file()));
+	EXPECT_TRUE(rs.excluded("", "webcache", dir()));
+
+	EXPECT_THROW(rs.add("[abc"), std::invalid_argument);
+	EXPECT_THROW(rs.add("*.iso bigger>1G"), std::invalid_argument);
+	EXPECT_THROW(rs.add("*.iso size>1X"), std::invalid_argument);
+	EXPECT_THROW(rs.add("!"), std::invalid_argument);
+}
+
+TEST(RuleSetTest, NegationLastMatchWins) {
+	RuleSet rs;
+	rs.addLines("*.log\n!important.log\nimportant.log size>1M\n");
+
+	EXPECT_TRUE(rs.excluded("", "debug.log", file()));
+	EXPECT_FALSE(rs.excluded("", "important.log", file(100)));
+	EXPECT_TRUE(rs.excluded("", "important.log", file(2 << 20)));
+}
+
+TEST(RuleSetTest, Predicates) {
+	const auto now = std::chrono::system_clock::now();
+	const int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+	const int64_t day = INT64_C(86400) * 1000000000;
+	RuleSet rs(now);
+	rs.add("*.iso size>100M").add("age>30d").add("!*.keep");
+
+	EXPECT_EQ(rs.fields(), unsigned(ENTRY_SIZE | ENTRY_MTIME));
+	EXPECT_TRUE(rs.excluded("", "a.iso", file(200 << 20, nowNs)));
+	EXPECT_FALSE(rs.excluded("", "a.iso", file(100 << 20, nowNs)));
+	EXPECT_TRUE(rs.excluded("", "old.txt", file(1, nowNs - 31 * day)));
+	EXPECT_FALSE(rs.excluded("", "new.txt", file(1, nowNs - 29 * day)));
+	EXPECT_FALSE(rs.excluded("", "old.keep", file(1, nowNs - 31 * day)));
+	// predicates never match directories, so old directories are still walked
+	EXPECT_FALSE(rs.excluded("", "olddir", dir()));
+
+	// an entry without the stat data a predicate needs does not match it
+	Entry bare = file(200 << 20);
+	bare.fields = 0;
+	EXPECT_FALSE(rs.excluded("", "a.iso", bare));
+}
+
+TEST(RuleSetTest, WalkerPrunesExcludedDirectories) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+	RuleSet rs;
+	rs.addLines("dir2/\n/excl\nnoaccess/\ntest1*\n!test10.txt\n");
+
+	std::unordered_set<std::string> found;
+	TreeWalker tw(tmpPath);
+	tw.setRules(std::move(rs));
+	Entry entry;
+	while (tw.nextEntry(entry)) {
+		found.insert(entry.path);
+	}
+
+	EXPECT_FALSE(found.empty());
+	for (const std::string& f : found) {
+		EXPECT_EQ(f.find("/dir2/"), std::string::npos) << f;
+		EXPECT_EQ(f.find("/excl/"), std::string::npos) << f;
+		EXPECT_EQ(f.find("/noaccess/"), std::string::npos) << f;
+		EXPECT_EQ(f.find("/test1"), f.find("/test10.txt")) << f;
+	}
+	EXPECT_TRUE(found.count(std::string(tmpPath) + "/dir1/d1_0.txt") > 0);
+}
+
+#ifndef __MAIN_TEST__
+
+int main(int argc, char** argv) {
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
+
+#endif
@@ -10,7 +10,12 @@
 #include "../../fs/ioexception.hpp"
 #include "../test_ext.hpp"
 #include <gtest/gtest.h>
+#include <cstring>
+#include <mutex>
 #include <regex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 TEST(TreeWalkerTest, MainTest) {
 	constexpr const char* tmpPath = "tmpPath";
@@ -76,6 +81,112 @@ TEST(SkipDirectoryTest, MainTest) {
 	}
 }
 
+TEST(TreeWalkerEntryTest, MainTest) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+	CloudSync::fs::Entry entry;
+	size_t count = 0;
+
+	CloudSync::fs::TreeWalker typesOnly(tmpPath);
+	while (typesOnly.nextEntry(entry)) {
+		struct stat st;
+		ASSERT_EQ(lstat(entry.path, &st), 0);
+		EXPECT_EQ(entry.type, CloudSync::fs::Type::File);
+		EXPECT_EQ(entry.inode, st.st_ino);
+		EXPECT_EQ(entry.fields, 0u);
+		count++;
+	}
+
+	CloudSync::fs::TreeWalker tw(tmpPath, CloudSync::fs::ENTRY_SIZE | CloudSync::fs::ENTRY_MTIME | CloudSync::fs::ENTRY_MODE);
+	while (tw.nextEntry(entry)) {
+		struct stat st;
+		ASSERT_EQ(lstat(entry.path, &st), 0);
+		EXPECT_EQ(entry.fields, unsigned(CloudSync::fs::ENTRY_SIZE | CloudSync::fs::ENTRY_MTIME | CloudSync::fs::ENTRY_MODE));
+		EXPECT_EQ(entry.size, static_cast<uint64_t>(st.st_size));
+		EXPECT_EQ(entry.mtime, st.st_mtim.tv_sec * INT64_C(1000000000) + st.st_mtim.tv_nsec);
+		EXPECT_EQ(entry.mode, st.st_mode);
+		count--;
+	}
+	EXPECT_EQ(count, 0u);
+}
+
+TEST(TreeWalkerSymlinkBaseTest, MainTest) {
+	constexpr const char* tmpPath = "tmpPath";
+	constexpr const char* linkPath = "tmpPathLink";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+	CloudSync::fs::Entry entry;
+	size_t direct = 0;
+	size_t linked = 0;
+
+	unlink(linkPath);
+	ASSERT_EQ(symlink(tmpPath, linkPath), 0);
+
+	CloudSync::fs::TreeWalker tw(tmpPath);
+	while (tw.nextEntry(entry)) {
+		direct++;
+	}
+	// the base directory may be a symlink, even though symlinks inside the tree are not followed
+	CloudSync::fs::TreeWalker viaLink(linkPath);
+	while (viaLink.nextEntry(entry)) {
+		EXPECT_EQ(std::string(entry.path).compare(0, std::strlen(linkPath) + 1, std::string(linkPath) + "/"), 0);
+		linked++;
+	}
+	unlink(linkPath);
+
+	EXPECT_GT(direct, 0u);
+	EXPECT_EQ(linked, direct);
+}
+
+TEST(TreeWalkerBatchTest, MainTest) {
+	constexpr const char* tmpPath = "tmpPath";
+	TestExt::TestEnvironment te = TestExt::TestEnvironment::Full(tmpPath);
+	std::unordered_set<std::string> expected;
+	CloudSync::fs::Entry entry;
+
+	CloudSync::fs::TreeWalker single(tmpPath);
+	while (single.nextEntry(entry)) {
+		expected.insert(entry.path);
+	}
+
+	CloudSync::fs::TreeWalker batched(tmpPath, CloudSync::fs::ENTRY_SIZE);
+	CloudSync::fs::EntryBatch batch;
+	std::unordered_set<std::string> found;
+	while (batched.nextBatch(batch, 7) > 0) {
+		ASSERT_LE(batch.entries().size(), 7u);
+		// every path in the batch is still intact after the rest of the batch was filled
+		for (const CloudSync::fs::Entry& e : batch.entries()) {
+			struct stat st;
+			ASSERT_EQ(lstat(e.path, &st), 0) << e.path;
+			EXPECT_EQ(e.size, static_cast<uint64_t>(st.st_size));
+			EXPECT_TRUE(found.insert(e.path).second);
+		}
+	}
+	EXPECT_EQ(found, expected);
+
+	EXPECT_TRUE(batch.entries().empty());
+
+	// consumers on several threads each refill their own batch from one walker
+	CloudSync::fs::TreeWalker shared(tmpPath);
+	std::mutex m;
+	std::unordered_set<std::string> sharedFound;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		threads.emplace_back([&]() {
+			CloudSync::fs::EntryBatch own;
+			while (shared.nextBatch(own, 3) > 0) {
+				std::lock_guard<std::mutex> lock(m);
+				for (const CloudSync::fs::Entry& e : own.entries()) {
+					EXPECT_TRUE(sharedFound.insert(e.path).second) << e.path;
+				}
+			}
+		});
+	}
+	for (std::thread& t : threads) {
+		t.join();
+	}
+	EXPECT_EQ(sharedFound, expected);
+}
+
 #ifndef __MAIN_TEST__
 
 int main(int argc, char** argv) {
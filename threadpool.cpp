@@ -0,0 +1,135 @@
+/** @file threadpool.cpp
+ * @brief A fixed-size pool of worker threads.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "threadpool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CloudSync {
+
+struct ThreadPool::ThreadPoolImpl {
+	std::vector<std::thread> threads;
+	/**
+	 * @brief Held for the duration of a parallelFor() so that jobs from different callers do not overlap.
+	 */
+	std::mutex jobMutex;
+	std::mutex m;
+	/**
+	 * @brief Signalled when a new job is posted or the pool is shutting down.
+	 */
+	std::condition_variable cvJob;
+	/**
+	 * @brief Signalled when a worker finishes its share of the current job.
+	 */
+	std::condition_variable cvDone;
+
+	/**
+	 * @brief Incremented for every job so sleeping workers can tell a new job from a spurious wakeup.
+	 */
+	uint64_t generation = 0;
+	bool stop = false;
+
+	const std::function<void(size_t, unsigned)>* func = nullptr;
+	size_t n = 0;
+	std::atomic<size_t> next = 0;
+	unsigned running = 0;
+	std::exception_ptr error = nullptr;
+
+	void work(unsigned worker) {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(m);
+
+		for (;;) {
+			cvJob.wait(lock, [&]() { return stop || generation != seen; });
+			if (stop) {
+				return;
+			}
+			seen = generation;
+			lock.unlock();
+
+			for (size_t i = next++; i < n; i = next++) {
+				try {
+					(*func)(i, worker);
+				}
+				catch (...) {
+					std::unique_lock<std::mutex> errLock(m);
+					if (!error) {
+						error = std::current_exception();
+					}
+					// make the other workers run out of indices
+					next = n;
+				}
+			}
+
+			lock.lock();
+			if (--running == 0) {
+				cvDone.notify_all();
+			}
+		}
+	}
+};
+
+ThreadPool::ThreadPool(unsigned nThreads): impl(std::make_unique<ThreadPoolImpl>()) {
+	if (nThreads == 0) {
+		nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	for (unsigned i = 0; i < nThreads; ++i) {
+		this->impl->threads.emplace_back(&ThreadPoolImpl::work, this->impl.get(), i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> lock(this->impl->m);
+		this->impl->stop = true;
+	}
+	this->impl->cvJob.notify_all();
+	for (std::thread& t : this->impl->threads) {
+		t.join();
+	}
+}
+
+void ThreadPool::parallelFor(size_t n, const std::function<void(size_t index, unsigned worker)>& func) {
+	std::unique_lock<std::mutex> jobLock(this->impl->jobMutex);
+	std::unique_lock<std::mutex> lock(this->impl->m);
+	std::exception_ptr error;
+
+	if (n == 0) {
+		return;
+	}
+
+	this->impl->func = &func;
+	this->impl->n = n;
+	this->impl->next = 0;
+	this->impl->error = nullptr;
+	this->impl->running = this->impl->threads.size();
+	++this->impl->generation;
+	this->impl->cvJob.notify_all();
+
+	this->impl->cvDone.wait(lock, [this]() { return this->impl->running == 0; });
+	this->impl->func = nullptr;
+	error = this->impl->error;
+	this->impl->error = nullptr;
+	lock.unlock();
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+unsigned ThreadPool::size() const noexcept {
+	return this->impl->threads.size();
+}
+
+}
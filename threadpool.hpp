@@ -0,0 +1,75 @@
+/** @file threadpool.hpp
+ * @brief A fixed-size pool of worker threads.
+ * @copyright Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CS_THREADPOOL_HPP
+#define __CS_THREADPOOL_HPP
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+namespace CloudSync {
+
+/**
+ * @brief A fixed-size pool of worker threads.
+ * The threads are started once on construction and reused for every job, so submitting work does not pay for thread creation.
+ */
+class ThreadPool {
+public:
+	/**
+	 * @brief Constructs a ThreadPool.
+	 *
+	 * @param nThreads The number of worker threads to start.
+	 * If this is 0, one thread per hardware thread is started.
+	 */
+	ThreadPool(unsigned nThreads = 0);
+
+	/**
+	 * @brief Deleted copy constructor.
+	 */
+	ThreadPool(const ThreadPool& other) = delete;
+
+	/**
+	 * @brief Deleted copy assignment operator.
+	 */
+	ThreadPool& operator=(const ThreadPool& other) = delete;
+
+	/**
+	 * @brief Stops and joins all of the worker threads.
+	 */
+	~ThreadPool();
+
+	/**
+	 * @brief Calls a function once for every index in [0, n) using the worker threads.
+	 * This function blocks until every call has returned.
+	 *
+	 * @param n The number of indices to process.
+	 * @param func The function to call.
+	 * Its first argument is the index being processed.
+	 * Its second argument is the index of the worker thread calling it, which is always less than size().
+	 * A worker thread only ever processes one index at a time, so per-worker state can be indexed by the second argument without locking.
+	 * func must not call parallelFor() on the same pool.
+	 *
+	 * @exception std::exception Any exception thrown by func is rethrown here once all of the workers have stopped.
+	 * If more than one call throws, only the first exception is rethrown.
+	 */
+	void parallelFor(size_t n, const std::function<void(size_t index, unsigned worker)>& func);
+
+	/**
+	 * @brief Returns the number of worker threads in this pool.
+	 */
+	unsigned size() const noexcept;
+
+private:
+	struct ThreadPoolImpl;
+	std::unique_ptr<ThreadPoolImpl> impl;
+};
+
+}
+
+#endif